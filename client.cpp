@@ -8,11 +8,26 @@
 #include <functional>
 #include <thread>
 #include <chrono>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
 
 #include "./third_party/cxxopts/include/cxxopts.hpp"
 
 #include "file.h"
 #include "protocol.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "udp.h"
+#include "sockopt.h"
+#include "resume.h"
 
 INITIALIZE_EASYLOGGINGPP
 
@@ -22,9 +37,10 @@ INITIALIZE_EASYLOGGINGPP
 /** Workflow
  * Client: Server Hello
  * Server: Client Hello
- * Client: File Negotiation
+ * Client: File Negotiation (once for each file)
  * Server: File Negotiation
  * Client: Start Transfering file
+ *         (Server: Start Transfering file, for files fetched)
  * Cilent: Finish Transfering file
  * Server: Close file and clean
  */
@@ -32,10 +48,531 @@ INITIALIZE_EASYLOGGINGPP
 using boost::asio::ip::tcp;
 using boost::asio::buffer;
 
+// latency of each stage of sending a piece
+metrics::Histogram h_read;
+metrics::Histogram h_encrypt;
+metrics::Histogram h_send;
+// latency of writing a piece of a file fetched
+metrics::Histogram h_write;
+
+/// \brief what a transfer connection did
+struct ConnectionStats {
+  int number;
+  uint64_t pieces = 0;
+  uint64_t bytes = 0;
+  // pieces of files fetched
+  uint64_t received = 0;
+  uint64_t received_bytes = 0;
+  // from connected to closed
+  double seconds = 0;
+  // blocked reading acks
+  double ack_wait = 0;
+  bool ok = true;
+
+  std::string str() const {
+    std::ostringstream s;
+    s << "Connection " << number << ": " << pieces << " pieces, " << bytes
+      << " bytes in " << seconds << "seconds, " << ack_wait
+      << "seconds waiting for acks";
+    if (received > 0) {
+      s << ", " << received << " pieces, " << received_bytes
+        << " bytes fetched";
+    }
+    s << (ok ? "." : ", broken.");
+    return s.str();
+  }
+
+  std::string json() const {
+    std::ostringstream s;
+    s << "{\"number\":" << number << ",\"pieces\":" << pieces
+      << ",\"bytes\":" << bytes << ",\"seconds\":" << seconds
+      << ",\"ack_wait\":" << ack_wait << ",\"received\":" << received
+      << ",\"received_bytes\":" << received_bytes
+      << ",\"ok\":" << (ok ? "true" : "false") << "}";
+    return s.str();
+  }
+};
+
+/// \brief pieces sent through a connection but not acknowledged yet,
+///        as (stream, order) pairs
+typedef std::deque<std::pair<uint64_t, uint32_t>> in_flight_t;
+
+/// \class Upload
+/// \brief Class to hold one file being uploaded
+/// \detail every file negotiated in the session is an Upload with its own
+///         stream id. pieces of all Uploads share the transfer connections
+///         of the session.
+/// \datamember uint64_t stream
+///             stream id of the file
+/// \datamember std::string file_name
+///             file name (and path)
+/// \datamember int piece_size
+///             transfer file piece size
+/// \datamember std::unique_ptr<file::reader> f
+///             source of the data, a file reader or generated data
+/// \datamember bool streaming
+///             the size of the source is unknown until its end, like a
+///             pipe. pieces are counted as they're read, and the end is
+///             told by one more piece of size 0 carrying the file length.
+/// \datamember std::uintmax_t file_size
+///             size of the file. of a streaming Upload, 0 until the end
+///             is read.
+/// \datamember uint32_t pieces
+///             count of pieces of the file. of a streaming Upload, pieces
+///             read so far, and the end piece once it's read.
+/// \datamember std::chrono::steady_clock::time_point start
+///             time the file is negotiated
+/// \datamember std::atomic_bool exhausted
+///             every piece has been read once
+/// \datamember bool ended
+///             the end of a streaming Upload is read
+/// \datamember std::vector<bool> acked
+///             whether each piece is acknowledged by the server
+/// \datamember std::deque<uint32_t> resend_queue
+///             pieces to be sent again by any connection
+/// \datamember std::unordered_map<uint32_t, int> retries
+///             how many times each piece has been sent again
+/// \datamember std::vector<uint8_t> copies
+///             how many copies of each piece have been sent
+/// \datamember uint32_t first_unacked
+///             every piece with lower order is acknowledged
+/// \datamember std::chrono::steady_clock::time_point deferred_until
+///             nothing is sent until then, as the server had no room for
+///             pieces
+/// \datamember std::mutex _lock
+///             lock of the ack related data members above
+class Upload {
+ public:
+  uint64_t stream;
+  std::string file_name;
+  int piece_size;
+ private:
+  std::unique_ptr<file::reader> f;
+ public:
+  const bool streaming;
+  std::uintmax_t file_size;
+  uint32_t pieces;
+  std::chrono::steady_clock::time_point start;
+ private:
+  std::atomic_bool exhausted = false;
+  bool ended = false;
+  std::vector<bool> acked;
+  std::deque<uint32_t> resend_queue;
+  std::unordered_map<uint32_t, int> retries;
+  std::vector<uint8_t> copies;
+  uint32_t first_unacked = 0;
+  std::chrono::steady_clock::time_point deferred_until;
+  std::mutex _lock;
+ public:
+  /// \brief constructor
+  /// \note this constructor simply initialize its members. for detailed
+  ///       infomation, see class's datamenber explanation.
+  Upload(
+      const uint64_t &_stream,
+      const std::string &_file_name,
+      const int &_piece_size,
+      std::unique_ptr<file::reader> _f) :
+      stream(_stream),
+      file_name(_file_name),
+      piece_size(_piece_size),
+      f(std::move(_f)),
+      streaming(!f->sized()),
+      file_size(streaming ? 0 : f->get_size()),
+      start(std::chrono::steady_clock::now()) {
+    pieces = (file_size + piece_size - 1) / piece_size;
+    acked.assign(pieces, false);
+    copies.assign(pieces, 0);
+  }
+
+  /// \brief mark pieces as acknowledged
+  /// \param cumulative every piece with lower order is acknowledged
+  /// \param orders other acknowledged pieces
+  void ack(uint32_t cumulative, const std::vector<uint32_t> &orders) {
+    std::lock_guard<std::mutex> lock(_lock);
+    for (uint32_t i = first_unacked; i < cumulative && i < pieces; ++i) {
+      _acked(i);
+    }
+    for (auto order : orders) {
+      if (order < pieces) {
+        _acked(order);
+      }
+    }
+    while (first_unacked < pieces && acked[first_unacked]) {
+      ++first_unacked;
+    }
+  }
+
+  /// \brief check if the piece is acknowledged
+  bool is_acked(uint32_t order) {
+    std::lock_guard<std::mutex> lock(_lock);
+    return order >= pieces || acked[order];
+  }
+
+  /// \brief check if every piece of the file is acknowledged
+  bool all_acked() {
+    std::lock_guard<std::mutex> lock(_lock);
+    return (!streaming || ended) && first_unacked >= pieces;
+  }
+
+  /// \brief schedule the piece to be sent again
+  /// \throw std::runtime_error if the piece has been sent again too
+  ///        many times
+  void resend(uint32_t order) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (order >= pieces || acked[order]) {
+      return;
+    }
+    if (++retries[order] > 3) {
+      throw std::runtime_error("Piece " + std::to_string(order) + " of "
+                                   + file_name + " failed too many times.");
+    }
+    resend_queue.push_back(order);
+  }
+
+  /// \brief schedule a piece lost on the way to be sent again
+  /// \detail unlike resend it's not counted as a failure, as datagrams of
+  ///         UDP transfer threads are lost now and then.
+  void retransmit(uint32_t order) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (order >= pieces || acked[order]) {
+      return;
+    }
+    resend_queue.push_back(order);
+  }
+
+  /// \brief schedule a piece the server had no room for to be sent again
+  /// \detail not counted as a failure. the whole Upload waits a moment,
+  ///         so the consumer the server delivers the file to catches up.
+  void defer(uint32_t order) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (order >= pieces || acked[order]) {
+      return;
+    }
+    resend_queue.push_back(order);
+    deferred_until = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(20);
+  }
+
+  /// \brief time pieces can be sent again after the server had no room
+  std::chrono::steady_clock::time_point deferred() {
+    std::lock_guard<std::mutex> lock(_lock);
+    return deferred_until;
+  }
+
+  /// \brief note that a copy of the piece is sent
+  /// \return copies of the piece sent so far
+  int sent(uint32_t order) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (order >= pieces) {
+      return 0;
+    }
+    if (copies[order] < 255) {
+      ++copies[order];
+    }
+    return copies[order];
+  }
+
+  /// \brief get the next piece to send
+  /// \detail pieces to be sent again go first, then pieces never sent. once
+  ///         all pieces are read, connections having nothing to send help
+  ///         the slower ones by sending one more copy of pieces not
+  ///         acknowledged yet (end-game). the server keeps whichever copy
+  ///         comes first.
+  /// \param buffer space to save the read data in.
+  ///         should have a size of at least @piece_size.
+  /// \param order order of the piece
+  /// \param own pieces in flight on the calling connection. they are not
+  ///        duplicated as this connection is the one waiting for them.
+  /// \return length of the piece, or -1 if there's nothing to send
+  int next_piece(char *buffer, uint32_t &order, const in_flight_t &own) {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      if (std::chrono::steady_clock::now() < deferred_until) {
+        return -1;
+      }
+    }
+    if (next_resend(order)) {
+      return read_at(buffer, order);
+    }
+    if (!exhausted && f->ready()) {
+      std::uintmax_t _offset;
+      auto start = std::chrono::steady_clock::now();
+      int size = f->read(buffer, _offset);
+      h_read.record(start);
+      if (size > 0) {
+        order = _offset / piece_size;
+        if (streaming) {
+          _grow(order + 1);
+        }
+        return size;
+      }
+      exhausted = true;
+      if (streaming && _end(order)) {
+        return read_at(buffer, order);
+      }
+    }
+    if (next_duplicate(order, own)) {
+      return read_at(buffer, order);
+    }
+    return -1;
+  }
+
+ private:
+  /// \brief mark a piece acknowledged
+  /// \note call with @_lock held
+  void _acked(uint32_t order) {
+    if (acked[order]) {
+      return;
+    }
+    acked[order] = true;
+    if (streaming) {
+      f->release(((std::uintmax_t) order) * piece_size);
+    }
+  }
+
+  /// \brief count pieces of a streaming Upload read so far
+  void _grow(uint32_t count) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (count > pieces) {
+      pieces = count;
+      acked.resize(pieces, false);
+      copies.resize(pieces, 0);
+    }
+  }
+
+  /// \brief add the end piece of a streaming Upload, once
+  /// \param order set to the order of the end piece
+  /// \return false if it's added already
+  bool _end(uint32_t &order) {
+    std::uintmax_t size = f->get_size();
+    std::lock_guard<std::mutex> lock(_lock);
+    if (ended) {
+      return false;
+    }
+    ended = true;
+    file_size = size;
+    // pieces read by others meanwhile are counted here
+    order = (file_size + piece_size - 1) / piece_size;
+    pieces = order + 1;
+    acked.resize(pieces, false);
+    copies.resize(pieces, 0);
+    return true;
+  }
+
+  /// \brief read a piece again
+  int read_at(char *buffer, uint32_t order) {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      if (ended && order + 1 == pieces) {
+        // the end piece
+        std::string length = protocol::fixedLength(file_size, 16);
+        memcpy(buffer, length.data(), length.size());
+        return 0;
+      }
+    }
+    auto start = std::chrono::steady_clock::now();
+    int size = f->read_at(buffer, ((std::uintmax_t) order) * piece_size);
+    h_read.record(start);
+    return size;
+  }
+
+  /// \brief get the next piece to be sent again
+  /// \return false if there's no piece to be sent again
+  bool next_resend(uint32_t &order) {
+    std::lock_guard<std::mutex> lock(_lock);
+    while (!resend_queue.empty()) {
+      order = resend_queue.front();
+      resend_queue.pop_front();
+      if (!acked[order]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// \brief get an outstanding piece to duplicate in end-game
+  /// \return false if there's no piece to duplicate
+  bool next_duplicate(uint32_t &order, const in_flight_t &own) {
+    std::lock_guard<std::mutex> lock(_lock);
+    for (uint32_t i = first_unacked; i < pieces; ++i) {
+      if (!acked[i] && copies[i] == 1
+          && std::find(own.begin(), own.end(), std::make_pair(stream, i))
+              == own.end()) {
+        ++copies[i];
+        order = i;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+/// \class Fetch
+/// \brief Class to hold one file being fetched from the server
+/// \detail the server sends its pieces through the transfer connections,
+///         in any order, and each is written at its place in the file by
+///         the connection receiving it.
+/// \datamember uint64_t stream
+///             stream id of the file
+/// \datamember std::string file_name
+///             file name (and path) on the server
+/// \datamember std::string local_name
+///             file name (and path) the file is saved as
+/// \datamember int piece_size
+///             transfer file piece size
+/// \datamember std::uintmax_t file_size
+///             size of the file, told by the server
+/// \datamember uint32_t pieces
+///             count of pieces of the file
+/// \datamember std::chrono::steady_clock::time_point start
+///             time the file is negotiated
+/// \datamember f_code state
+///             NEGOTIATING: the server hasn't told the size yet, pieces
+///             coming wait until it does.
+///             RECEIVING: pieces are written into the file.
+///             FAILED: the file is given up.
+/// \datamember std::shared_ptr<file::writer> f
+///             the file written
+/// \datamember std::vector<bool> received
+///             whether each piece has been written into file
+/// \datamember uint32_t cumulative
+///             every piece with lower order has been written into file
+/// \datamember std::mutex _lock
+///             lock of the data members above
+/// \datamember std::condition_variable _cv
+///             notified when the state changes from NEGOTIATING
+class Fetch {
+ public:
+  enum f_code { NEGOTIATING, RECEIVING, FAILED };
+  uint64_t stream;
+  std::string file_name;
+  std::string local_name;
+  int piece_size;
+  std::uintmax_t file_size = 0;
+  uint32_t pieces = 0;
+  std::chrono::steady_clock::time_point start;
+ private:
+  f_code state = NEGOTIATING;
+  std::shared_ptr<file::writer> f;
+  std::vector<bool> received;
+  uint32_t cumulative = 0;
+  std::mutex _lock;
+  std::condition_variable _cv;
+ public:
+  /// \brief constructor
+  /// \note this constructor simply initialize its members. for detailed
+  ///       infomation, see class's datamenber explanation.
+  Fetch(
+      const uint64_t &_stream,
+      const std::string &_file_name,
+      const std::string &_local_name,
+      const int &_piece_size) :
+      stream(_stream),
+      file_name(_file_name),
+      local_name(_local_name),
+      piece_size(_piece_size),
+      start(std::chrono::steady_clock::now()) {}
+
+  /// \brief open the file to write, once the server told its size
+  /// \return false if it can't be written
+  bool open(std::uintmax_t _file_size) {
+    std::shared_ptr<file::writer> _f;
+    try {
+      _f = file::open_writer(local_name, _file_size, file::write_options());
+    }
+    catch (const file::NoEnoughSpace &e) {}
+    std::lock_guard<std::mutex> lock(_lock);
+    if (!_f || !_f->ok) {
+      state = FAILED;
+    } else {
+      f = std::move(_f);
+      file_size = _file_size;
+      pieces = (file_size + piece_size - 1) / piece_size;
+      received.assign(pieces, false);
+      state = RECEIVING;
+    }
+    _cv.notify_all();
+    return state == RECEIVING;
+  }
+
+  /// \brief give the file up
+  void fail() {
+    std::lock_guard<std::mutex> lock(_lock);
+    state = FAILED;
+    _cv.notify_all();
+  }
+
+  /// \brief write a piece received
+  /// \detail blocks until the server told the size of the file.
+  /// \return status to acknowledge the piece with, see
+  ///         protocol::file_transfer_receive
+  int write(uint32_t order, const std::string &piece, uint32_t size) {
+    std::shared_ptr<file::writer> _f;
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _cv.wait(lock, [this]() { return state != NEGOTIATING; });
+      if (state == FAILED) {
+        return 2;
+      }
+      if (order >= pieces || received[order]) {
+        return 0;
+      }
+      _f = f;
+    }
+    // pieces received by other connections are written meanwhile
+    auto start = std::chrono::steady_clock::now();
+    bool ok = _f->write(piece, size, ((std::uintmax_t) order) * piece_size)
+        == (int) size;
+    h_write.record(start);
+    if (!ok) {
+      LOG(WARNING) << "Failed writing piece " << order << " of "
+                   << local_name << ".";
+      return 1;
+    }
+    std::lock_guard<std::mutex> lock(_lock);
+    received[order] = true;
+    while (cumulative < pieces && received[cumulative]) {
+      ++cumulative;
+    }
+    return 0;
+  }
+
+  /// \brief get cumulative ack of the file
+  uint32_t get_cumulative() {
+    std::lock_guard<std::mutex> lock(_lock);
+    return cumulative;
+  }
+
+  /// \brief check if every piece is written, or the file is given up
+  bool done() {
+    std::lock_guard<std::mutex> lock(_lock);
+    return state == FAILED || (state == RECEIVING && cumulative == pieces);
+  }
+
+  /// \brief check if every piece is written
+  bool complete() {
+    std::lock_guard<std::mutex> lock(_lock);
+    return state == RECEIVING && cumulative == pieces;
+  }
+
+  /// \brief close the file
+  void close() {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (f) {
+      f->close();
+    }
+  }
+};
+
 /// \class Uploader
 /// \brief Class to perform upload work
 /// \detail after created Uploader will handle all negotiation work
-///         and start required threads to upload data to the server
+///         and start required threads to upload data to the server.
+///         any number of files can be uploaded in one session: they are
+///         negotiated one after another through the same connection and
+///         their pieces are scheduled in turn on the same transfer
+///         connections, so a new file starts on connections already warmed
+///         up without another handshake.
 /// \datamember std::string ip
 ///             ip of the server
 /// \datamember int port
@@ -46,16 +583,69 @@ using boost::asio::buffer;
 ///             encrypter object
 /// \datamember protocol::AESDecrypter dec
 ///             decrypter object
+/// \datamember std::string key_id
+///             id of the key on the server, empty for its default key
 /// \datamember std::string session
-///             session id of this connection
+///             session id of this connection, proposed by the client
+/// \datamember bool greeted
+///             the server accepted the handshake. its reply is read along
+///             with the first File Negotiation reply, so the handshake
+///             doesn't cost a round trip of its own.
+/// \datamember bool resumed
+///             the handshake carries a resumption ticket, so the server
+///             sends no reply to it. cleared if the server refuses the
+///             ticket and the handshake is done again.
+/// \datamember bool answered
+///             the server answered the handshake or a File Negotiation
+/// \datamember std::string ticket
+///             resumption ticket sent, or the one issued by the server
+/// \datamember uint64_t ticket_lifetime
+///             seconds the ticket issued is valid for
 /// \datamember int piece_size
 ///             transfer file piece size
-/// \datamember std::string file_name
-///             file name (and path)
-/// \datamember file::file_reader f
-///             file reader object
 /// \datamember int ths
 ///             threads count
+/// \datamember size_t window
+///             max count of pieces sent but not acknowledged per connection
+/// \datamember std::vector<std::shared_ptr<Upload>> uploads
+///             files being uploaded
+/// \datamember std::vector<std::shared_ptr<Fetch>> fetches
+///             files being fetched
+/// \datamember std::set<uint64_t> fetched
+///             stream ids of every file fetched, finished or not. messages
+///             of them from the server are pieces rather than acks.
+/// \datamember size_t cursor
+///             the Upload to take the next piece from. Uploads take turns
+///             so every file gets a fair share of the connections.
+/// \datamember uint64_t last_stream
+///             stream id of the last negotiated file
+/// \datamember bool closing
+///             no more file will be negotiated
+/// \datamember int alive
+///             count of transfer threads still running
+/// \datamember std::vector<std::thread> workers
+///             transfer threads
+/// \datamember std::mutex _lock
+///             lock of the Upload related data members above
+/// \datamember std::condition_variable _cv
+///             notified when an Upload finished or a thread exited
+/// \datamember uint64_t changes
+///             counts changes that may give idle transfer threads something
+///             to send
+/// \datamember std::set<tcp::socket *> sleepers
+///             sockets of transfer threads blocked in idle
+/// \datamember std::atomic_bool failed
+///             set when some file can not be uploaded
+/// \datamember ratelimit::TokenBucket limiter
+///             rate limit shared by all transfer threads
+/// \datamember std::vector<ConnectionStats> connections
+///             stats of transfer threads exited
+/// \datamember sockopt::options tuning
+///             settings of transfer sockets
+/// \datamember bool over_udp
+///             transfer threads send UDP datagrams instead of connecting
+/// \datamember udp::Conditions conditions
+///             simulated path of datagrams sent, for testing
 class Uploader : public std::enable_shared_from_this<Uploader> {
  private:
   std::string ip;
@@ -63,15 +653,55 @@ class Uploader : public std::enable_shared_from_this<Uploader> {
   tcp::socket socket_;
   protocol::AESEncrypter enc;
   protocol::AESDecrypter dec;
+  std::string key_id;
   std::string session;
+  bool greeted = false;
+  bool resumed = false;
   int piece_size;
-  std::string file_name;
-  file::file_reader f;
   int ths;
+  size_t window;
+  std::vector<std::shared_ptr<Upload>> uploads;
+  std::vector<std::shared_ptr<Fetch>> fetches;
+  std::set<uint64_t> fetched;
+  size_t cursor = 0;
+  uint64_t last_stream = 0;
+  bool closing = false;
+  int alive = 0;
+  std::vector<std::thread> workers;
+  std::mutex _lock;
+  std::condition_variable _cv;
+  uint64_t changes = 0;
+  std::set<tcp::socket *> sleepers;
+  ratelimit::TokenBucket limiter;
+  sockopt::options tuning;
+  bool over_udp;
+  udp::Conditions conditions;
+
+  // longest an idle transfer thread blocks without looking for a piece
+  static constexpr std::chrono::milliseconds idle_timeout{100};
+
+  /// \brief count a change and wake the threads blocked in idle
+  /// \note call with @_lock held. the sockets stay open until the threads
+  ///       have left idle, which takes @_lock too.
+  void _wake() {
+    ++changes;
+    for (auto sock : sleepers) {
+      boost::asio::post(sock->get_executor(), [sock]() {
+        boost::system::error_code ec;
+        sock->cancel(ec);
+      });
+    }
+  }
  public:
+  std::atomic_bool failed = false;
+  std::vector<ConnectionStats> connections;
+  bool answered = false;
+  std::string ticket;
+  uint64_t ticket_lifetime = 0;
   // transfer thread function.
   // for access convenience, make it friend function
-  friend void transfer(Uploader *ul);
+  friend void transfer(Uploader *ul, int number);
+  friend void transfer_udp(Uploader *ul, int number);
   /// \brief constructor
   /// \note this constructor simply initialize its members. for detailed
   ///       infomation, see class's datamenber explanation.
@@ -81,21 +711,40 @@ class Uploader : public std::enable_shared_from_this<Uploader> {
       tcp::socket &sock,
       protocol::AESEncrypter &_enc,
       protocol::AESDecrypter &_dec,
-      std::string &_file_name,
+      std::string &_key_id,
       int &_piece_size,
-      int &thread_number) :
+      int &thread_number,
+      int &_window,
+      uint64_t &rate,
+      uint64_t &burst,
+      sockopt::options &_tuning,
+      bool &_over_udp,
+      udp::Conditions &_conditions) :
       ip(_ip),
       port(_port),
-      // socket is the established connection between the client and server
-      // therefore can not be copied. use std::move to move the socket
+      // socket is connected to the server later by connect(), and can not
+      // be copied. use std::move to move the socket
       socket_(std::move(sock)),
       // copy the encrypter and decrypter
       enc(_enc),
       dec(_dec),
-      file_name(_file_name),
+      key_id(_key_id),
       piece_size(_piece_size),
-      f(file_name, piece_size),
-      ths(thread_number) {
+      ths(thread_number),
+      window(_window),
+      limiter(rate, burst),
+      tuning(_tuning),
+      over_udp(_over_udp),
+      conditions(_conditions) {
+    // proposed to the server, so transfer connections can be opened
+    // before the handshake is answered
+    session = protocol::Randomsession().session(32);
+  }
+  /// \brief connect to the server for handshake and negotiation
+  void connect() {
+    boost::asio::ip::tcp::endpoint
+        ep(boost::asio::ip::address::from_string(ip), port);
+    socket_.connect(ep);
     // force send small tcp packet to make protocol negotiation
     // works properly
     boost::asio::ip::tcp::no_delay option(true);
@@ -117,12 +766,28 @@ class Uploader : public std::enable_shared_from_this<Uploader> {
     read(socket_, buffer(_tmp), boost::asio::transfer_exactly(length));
     return _tmp;
   };
+  /// \brief resume with a ticket cached, skipping the Client hello
+  void resume(const std::string &_ticket) {
+    ticket = _ticket;
+    resumed = true;
+    greeted = true;
+  }
+  /// \brief tell if the server accepted the ticket resumed with
+  bool is_resumed() const { return resumed; }
   /// \brief handshake period logic.
+  /// \detail only the Server hello is sent here. files are negotiated right
+  ///         after it, and the reply is checked by _greeting.
   void handshake() {
     //Client: Server hello
-    socket_.write_some(buffer(protocol::build_msg(protocol::server_hello_build(
-        enc))));
-
+    boost::asio::write(socket_, buffer(protocol::build_msg(
+        protocol::server_hello_build(enc, session, resumed ? ticket : "",
+                                     key_id))));
+  }
+  /// \brief verify the Client hello, once
+  void _greeting() {
+    if (greeted) {
+      return;
+    }
     //Client: Verify client hello
 
     //wrap the scope for function to call for data
@@ -131,9 +796,11 @@ class Uploader : public std::enable_shared_from_this<Uploader> {
       // to external function to call
       std::function<std::string(int)>
           _t = std::bind(&Uploader::_read, this, std::placeholders::_1);
-      int status =
-          protocol::client_hello_verify(dec, protocol::read_msg(_t), session);
-      if (status != 0) {
+      std::string _sess;
+      int status = protocol::client_hello_verify(
+          dec, protocol::read_msg(_t), _sess, ticket_lifetime, ticket);
+      if (status != 0 || _sess != session) {
+        LOG(ERROR) << "Server refused the handshake.";
         exit(1);
       }
     }
@@ -141,90 +808,405 @@ class Uploader : public std::enable_shared_from_this<Uploader> {
       e.what();
       exit(1);
     }
+    greeted = true;
+    answered = true;
+  }
+  /// \brief send a File Negotiation and read its reply
+  /// \detail the server closes the connection on a resumption ticket it
+  ///         doesn't accept. then the handshake is done again in full, with
+  ///         the same session so transfer connections waiting for it are
+  ///         attached, and the negotiation is sent again.
+  /// \param msg File Negotiation built
+  /// \return the reply
+  std::string _negotiate(const std::string &msg) {
+    for (;;) {
+      try {
+        boost::asio::write(socket_, buffer(protocol::build_msg(msg)));
+        _greeting();
+        std::function<std::string(int)>
+            _t = std::bind(&Uploader::_read, this, std::placeholders::_1);
+        return protocol::read_msg(_t);
+      }
+      catch (const std::exception &e) {
+        if (!resumed || answered) {
+          throw;
+        }
+      }
+      LOG(WARNING) << "Server refused the resumption ticket, handshake "
+                      "again.";
+      boost::system::error_code ec;
+      socket_.close(ec);
+      resumed = false;
+      greeted = false;
+      ticket.clear();
+      connect();
+      handshake();
+    }
   }
   /// \brief negotiation period logic.
-  void file_negotiation() {
-    //Client: Send negotiate message
-    socket_.write_some(buffer(protocol::build_msg(
-        protocol::file_negotiation_build(enc,
-                                         session,
-                                         piece_size,
-                                         f.get_size(),
-                                         file_name)
-    )));
-
-    //Client: Check negotiate response
+  /// \detail negotiate the file and let transfer threads start sending it.
+  ///         pieces are sent while the server is answering, it holds them
+  ///         until the file is opened.
+  /// \param file_name file name (and path) told to the server
+  /// \param source where the data is read from
+  /// \param flags FLAG_* bits asking how the server stores the file
+  /// \return false if the server can't receive the file
+  bool file_negotiation(const std::string &file_name,
+                        std::unique_ptr<file::reader> source,
+                        uint32_t flags = 0) {
+    auto up = std::make_shared<Upload>(++last_stream, file_name, piece_size,
+                                       std::move(source));
+
+    if (up->pieces > 0 || up->streaming) {
+      std::lock_guard<std::mutex> lock(_lock);
+      uploads.push_back(up);
+      _wake();
+    }
+
+    //Client: Send negotiate message, and check negotiate response
     try {
-      std::function<std::string(int)>
-          _t = std::bind(&Uploader::_read, this, std::placeholders::_1);
-      int status = protocol::file_negotiation_finish(dec,
-                                                     protocol::read_msg(_t),
-                                                     session);
+      int status = protocol::file_negotiation_finish(
+          dec,
+          _negotiate(protocol::file_negotiation_build(
+              enc,
+              session,
+              up->stream,
+              piece_size,
+              up->file_size,
+              up->streaming ? flags | FLAG_STREAMING : flags,
+              file_name)),
+          session,
+          up->stream);
+      answered = true;
       if (status != 0) {
-        exit(1);
+        LOG(ERROR) << "Server can't receive " << file_name << ".";
+        failed = true;
+        finish(up->stream, false);
+        return false;
+      }
+    }
+    catch (const std::exception &e) {
+      e.what();
+      exit(1);
+    }
+
+    if (up->pieces == 0 && !up->streaming) {
+      // nothing to send, server closed the file already
+      LOG(INFO) << "Upload of " << file_name << " finished.";
+    }
+    return true;
+  }
+
+  /// \brief negotiation of a file fetched from the server
+  /// \detail the server starts sending pieces once it has opened the
+  ///         file. connections receiving them wait until its size is read
+  ///         here.
+  /// \param file_name file name (and path) on the server
+  /// \param local_name file name (and path) to save it as
+  /// \return false if the server can't send the file, or it can't be
+  ///         saved
+  bool file_fetch(const std::string &file_name,
+                  const std::string &local_name) {
+    auto ft = std::make_shared<Fetch>(++last_stream, file_name, local_name,
+                                      piece_size);
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      fetches.push_back(ft);
+      fetched.insert(ft->stream);
+    }
+
+    //Client: Send negotiate message, and check negotiate response
+    std::uintmax_t file_size;
+    try {
+      uint64_t length;
+      int status = protocol::file_negotiation_finish(
+          dec,
+          _negotiate(protocol::file_negotiation_build(enc,
+                                                      session,
+                                                      ft->stream,
+                                                      piece_size,
+                                                      0,
+                                                      FLAG_FETCH,
+                                                      file_name)),
+          session,
+          ft->stream,
+          length);
+      answered = true;
+      file_size = length;
+      if (status != 0) {
+        LOG(ERROR) << "Server can't send " << file_name << ".";
+        ft->fail();
+        finish_fetch(ft->stream);
+        return false;
       }
     }
     catch (const std::exception &e) {
       e.what();
       exit(1);
     }
+
+    if (!ft->open(file_size)) {
+      // pieces coming are acknowledged as given up, so the server stops
+      LOG(ERROR) << "Can't save " << file_name << " as " << local_name
+                 << ".";
+      finish_fetch(ft->stream);
+      return false;
+    }
+    if (ft->done()) {
+      // empty file
+      finish_fetch(ft->stream);
+    }
+    return true;
+  }
+
+  /// \brief tell if the stream is of a file fetched
+  bool is_fetched(uint64_t stream) {
+    std::lock_guard<std::mutex> lock(_lock);
+    return fetched.find(stream) != fetched.end();
+  }
+
+  /// \brief find the Fetch of the stream
+  /// \return nullptr if the Fetch has finished
+  std::shared_ptr<Fetch> find_fetch(uint64_t stream) {
+    std::lock_guard<std::mutex> lock(_lock);
+    for (auto &ft : fetches) {
+      if (ft->stream == stream) {
+        return ft;
+      }
+    }
+    return nullptr;
+  }
+
+  /// \brief remove the Fetch once every piece is written or it's given up
+  void finish_fetch(uint64_t stream) {
+    std::lock_guard<std::mutex> lock(_lock);
+    auto it = std::find_if(fetches.begin(), fetches.end(),
+                           [stream](const std::shared_ptr<Fetch> &ft) {
+                             return ft->stream == stream;
+                           });
+    if (it == fetches.end()) {
+      return;
+    }
+    (*it)->close();
+    std::chrono::duration<double> time_span =
+        std::chrono::duration_cast<std::chrono::duration<double>>(
+            std::chrono::steady_clock::now() - (*it)->start);
+    if ((*it)->complete()) {
+      LOG(INFO) << "Fetch of " << (*it)->file_name << " finished using "
+                << time_span.count() << "seconds.";
+    } else {
+      LOG(ERROR) << "Fetch of " << (*it)->file_name << " failed.";
+      failed = true;
+    }
+    fetches.erase(it);
+    _cv.notify_all();
+    _wake();
+  }
+
+  /// \brief find the Upload of the stream
+  /// \return nullptr if the Upload has finished
+  std::shared_ptr<Upload> find(uint64_t stream) {
+    std::lock_guard<std::mutex> lock(_lock);
+    for (auto &up : uploads) {
+      if (up->stream == stream) {
+        return up;
+      }
+    }
+    return nullptr;
+  }
+
+  /// \brief get the next piece to send, taking Uploads in turn
+  /// \param buffer space to save the read data in.
+  ///         should have a size of at least @piece_size.
+  /// \param order order of the piece
+  /// \param size length of the piece
+  /// \param own pieces in flight on the calling connection
+  /// \return the Upload the piece belongs to, nullptr if nothing to send
+  std::shared_ptr<Upload> next_piece(char *buffer,
+                                     uint32_t &order,
+                                     int &size,
+                                     const in_flight_t &own) {
+    std::vector<std::shared_ptr<Upload>> _ups;
+    size_t _cursor;
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      _ups = uploads;
+      _cursor = cursor;
+    }
+    for (size_t i = 0; i < _ups.size(); ++i) {
+      auto &up = _ups[(_cursor + i) % _ups.size()];
+      size = up->next_piece(buffer, order, own);
+      if (size >= 0) {
+        std::lock_guard<std::mutex> lock(_lock);
+        cursor = _cursor + i + 1;
+        return up;
+      }
+    }
+    return nullptr;
+  }
+
+  /// \brief remove the Upload once all its pieces are acknowledged
+  /// \param ok false if the Upload is given up
+  void finish(uint64_t stream, bool ok = true) {
+    std::lock_guard<std::mutex> lock(_lock);
+    auto it = std::find_if(uploads.begin(), uploads.end(),
+                           [stream](const std::shared_ptr<Upload> &up) {
+                             return up->stream == stream;
+                           });
+    if (it == uploads.end()) {
+      return;
+    }
+    std::chrono::duration<double> time_span =
+        std::chrono::duration_cast<std::chrono::duration<double>>(
+            std::chrono::steady_clock::now() - (*it)->start);
+    if (ok) {
+      LOG(INFO) << "Upload of " << (*it)->file_name << " finished using "
+                << time_span.count() << "seconds.";
+    } else {
+      LOG(ERROR) << "Upload of " << (*it)->file_name << " failed.";
+      failed = true;
+    }
+    uploads.erase(it);
+    _cv.notify_all();
+    _wake();
+  }
+
+  /// \brief check if transfer threads can exit
+  bool finished() {
+    std::lock_guard<std::mutex> lock(_lock);
+    return closing && uploads.empty() && fetches.empty();
+  }
+
+  /// \brief get @changes, to be given to idle
+  uint64_t changed() {
+    std::lock_guard<std::mutex> lock(_lock);
+    return changes;
+  }
+
+  /// \brief tell idle transfer threads there may be something to send
+  void wake() {
+    std::lock_guard<std::mutex> lock(_lock);
+    _wake();
+  }
+
+  /// \brief block a transfer thread having nothing to send
+  /// \detail returns once the server sends something (a cancel, or a piece
+  ///         fetched), there may be something new to send, or pieces
+  ///         deferred can be sent. a pipe read having room again isn't
+  ///         told, it's looked at every @idle_timeout.
+  /// \param io_context io_context of the socket, run only here
+  /// \param seen @changes before the thread looked for a piece
+  void idle(boost::asio::io_context &io_context,
+            tcp::socket &sock,
+            uint64_t seen) {
+    auto deadline = std::chrono::steady_clock::now() + idle_timeout;
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      if (changes != seen) {
+        return;
+      }
+      for (auto &up : uploads) {
+        auto deferred = up->deferred();
+        if (deferred > std::chrono::steady_clock::now()) {
+          deadline = std::min(deadline, deferred);
+        }
+      }
+      sleepers.insert(&sock);
+    }
+    bool woken = false;
+    sock.async_wait(tcp::socket::wait_read,
+                    [&woken](const boost::system::error_code &) {
+                      woken = true;
+                    });
+    io_context.restart();
+    io_context.run_until(deadline);
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      sleepers.erase(&sock);
+    }
+    if (!woken) {
+      boost::system::error_code ec;
+      sock.cancel(ec);
+      io_context.restart();
+      io_context.run();
+    }
+  }
+
+  /// \brief block until less than the given count of files are uploading
+  ///        or being fetched
+  void wait_slot(size_t concurrent) {
+    std::unique_lock<std::mutex> lock(_lock);
+    _cv.wait(lock, [this, concurrent]() {
+      return uploads.size() + fetches.size() < concurrent || alive == 0;
+    });
   }
+
   /// \brief transfer period logic.
+  /// \detail start the transfer threads. they keep sending pieces of
+  ///         every negotiated file until close is called.
   /// \note Versus server, even using asio to do asynchorous programming,
   ///         we decided to make client send data to server synchorous,
   ///         because it's difficult to control concurrent number in
   ///         asynchorous code.
-#ifndef _MSC_VER
-  // This code can not compile on MSVC but compile and works fine on G++
   void file_transfer() {
-    // thread pointers array
-    std::thread *threads[ths];
-    // set all to nullptr
-    for (int i = 0; i < ths; ++i) {
-      threads[i] = nullptr;
-    }
+    alive = ths;
     for (int i = 0; i < ths; ++i) {
       // start new threads
       // use lambda function to encapsulate transfer task
-      threads[i] = new std::thread([this]() { transfer(this); });
+      workers.emplace_back([this, i]() {
+        if (over_udp) {
+          transfer_udp(this, i);
+        } else {
+          transfer(this, i);
+        }
+        std::lock_guard<std::mutex> lock(_lock);
+        --alive;
+        _cv.notify_all();
+      });
+    }
+  }
+
+  /// \brief wait for all negotiated files to finish and stop the threads
+  void close() {
+    _greeting();
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      closing = true;
+      _wake();
     }
     // join the threads (after task finished, thread can be joined)
-    for (auto t : threads) {
-      if (t && t->joinable()) {
-        t->join();
-        // then the pointer is useless
-        delete t;
+    for (auto &t : workers) {
+      if (t.joinable()) {
+        t.join();
       }
     }
-    // here threads is a stack object so can be deleted automaticly
-  }
-#else
-  void file_transfer() {
-    // MSVC see ths as variable so we must make it heap object
-//    auto threads = new std::thread * [ths];
-    // update: use smart pointer to hold heap object to make sure it
-    // can be deleted
-    std::unique_ptr<std::thread *[]> threads(new std::thread * [ths]);
-    for (int i = 0; i < ths; ++i) {
-      threads[i] = new std::thread([this]() {transfer(this); });
+    for (auto &up : uploads) {
+      LOG(ERROR) << "Upload of " << up->file_name << " not finished.";
+      failed = true;
     }
-    for (int i = 0; i < ths; ++i) {
-      if (threads[i]->joinable()) {
-        threads[i]->join();
-        delete threads[i];
-      }
+    for (auto &ft : fetches) {
+      LOG(ERROR) << "Fetch of " << ft->file_name << " not finished.";
+      failed = true;
     }
-//    // and delete it
-//    delete[] threads;
-  // since we used smart pointer, the object will automaticly be deleted
-  // after left the scope due to RAII even when exception throwed
   }
-#endif
 };
 
 /// \brief file transfer worker.
 /// \param ul pointer to negotiated Uploader object
-void transfer(Uploader *ul) {
+/// \param number thread number
+void transfer(Uploader *ul, int number) {
+
+  ConnectionStats stats;
+  stats.number = number;
+  auto connected = std::chrono::steady_clock::now();
+  // keep stats however the thread exits
+  auto report = [&]() {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - connected;
+    stats.seconds = elapsed.count();
+    std::lock_guard<std::mutex> lock(ul->_lock);
+    ul->connections.push_back(stats);
+  };
 
   // transfer threads use different io_context
   boost::asio::io_context io_context;
@@ -241,6 +1223,18 @@ void transfer(Uploader *ul) {
 
   sock.connect(ep);
 
+  auto applied = sockopt::apply(sock.native_handle(), ul->tuning);
+  LOG(INFO) << "Connection " << number << ": " << applied.str() << ".";
+  // large pieces are sent without copying if asked
+  std::unique_ptr<sockopt::zerocopy_sender> zerocopy;
+  if (applied.zerocopy) {
+    zerocopy = std::make_unique<sockopt::zerocopy_sender>(
+        sock.native_handle());
+  }
+  // bytes sent and time since buffers are last sized
+  uint64_t tuned_bytes = 0;
+  auto tuned_at = connected;
+
   boost::system::error_code error;
 
   std::string _sess = ul->session;
@@ -251,18 +1245,112 @@ void transfer(Uploader *ul) {
                      buffer(protocol::build_msg_transfer(
                          protocol::file_transfer_init(
                          enc,
-                         ul->session))),
+                         ul->session,
+                         ul->key_id), 0)),
                      error);
 
-//  std::function<std::string(int)>
-//      _t = std::bind(&Uploader::_read, ul, std::placeholders::_1);
-//
-//  if (protocol::file_transfer_init_confirm(
-//      dec, protocol::read_msg_transfer(_t)) != 0) {
-//    LOG(WARNING) << "Server encountered error.";
-//  }
-
-  int size;
+  // receive one ack message and update the pieces not acknowledged yet,
+  // or a piece of a file fetched and write it
+  std::function<std::string(int)> _t = [&sock](int length) {
+    std::string _tmp;
+    _tmp.resize(length);
+    read(sock, buffer(_tmp), boost::asio::transfer_exactly(length));
+    return _tmp;
+  };
+  // pieces sent through this connection but not acknowledged
+  in_flight_t in_flight;
+  auto receive_piece = [&](uint64_t stream, const std::string &msg) {
+    uint32_t order;
+    uint32_t size;
+    std::string piece;
+    protocol::file_transfer_read(dec, msg, _sess, stream, order, size,
+                                 piece);
+    auto ft = ul->find_fetch(stream);
+    // finished or given up already
+    int status = 2;
+    if (ft && size == 0) {
+      LOG(ERROR) << "Server can't read " << ft->file_name << " anymore.";
+      ft->fail();
+    } else if (ft) {
+      status = ft->write(order, piece, size);
+    }
+    if (status == 0) {
+      ++stats.received;
+      stats.received_bytes += size;
+    }
+    std::vector<uint32_t> orders = {order};
+    uint32_t base;
+    std::string bitmap = protocol::sack_bitmap_build(orders, base);
+    boost::asio::write(sock, buffer(protocol::build_msg_transfer(
+        protocol::file_transfer_receive(enc, _sess, status,
+                                        ft ? ft->get_cumulative() : 0,
+                                        base, bitmap), stream)));
+    if (ft && ft->done()) {
+      ul->finish_fetch(stream);
+    }
+  };
+  auto wait_ack = [&]() {
+    uint64_t stream;
+    uint32_t cumulative;
+    uint32_t base;
+    std::string bitmap;
+    auto start = std::chrono::steady_clock::now();
+    std::string msg = protocol::read_msg_transfer(_t, stream);
+    std::chrono::duration<double> waited =
+        std::chrono::steady_clock::now() - start;
+    stats.ack_wait += waited.count();
+    if (ul->is_fetched(stream)) {
+      receive_piece(stream, msg);
+      return;
+    }
+    auto up = ul->find(stream);
+    if (up) {
+      int status = protocol::file_transfer_confirm(
+          dec, msg, _sess, cumulative, base, bitmap);
+      auto orders = protocol::sack_bitmap_read(base, bitmap);
+      if (status == 0) {
+        up->ack(cumulative, orders);
+      } else if (status == 2) {
+        // the server got the whole file, stop sending it
+        up->ack(cumulative, {});
+      } else if (status == 3) {
+        up->ack(cumulative, {});
+        for (auto order : orders) {
+          up->defer(order);
+          in_flight.erase(std::remove(in_flight.begin(), in_flight.end(),
+                                      std::make_pair(stream, order)),
+                          in_flight.end());
+        }
+      } else {
+        up->ack(cumulative, {});
+        try {
+          for (auto order : orders) {
+            LOG(WARNING) << "Server failed writing piece " << order << " of "
+                         << up->file_name << ".";
+            up->resend(order);
+            // it is sent again through resend queue
+            in_flight.erase(std::remove(in_flight.begin(), in_flight.end(),
+                                        std::make_pair(stream, order)),
+                            in_flight.end());
+          }
+        }
+        catch (const std::exception &e) {
+          LOG(ERROR) << e.what();
+          ul->finish(stream, false);
+        }
+      }
+      if (up->all_acked()) {
+        ul->finish(stream);
+      }
+    }
+    in_flight.erase(std::remove_if(in_flight.begin(), in_flight.end(),
+                                   [ul](const std::pair<uint64_t,
+                                                        uint32_t> &p) {
+                                     auto up = ul->find(p.first);
+                                     return !up || up->is_acked(p.second);
+                                   }),
+                    in_flight.end());
+  };
 
   // we have to use heap memory and char pointer now.
   // TODO: Update file module to support smart pointer
@@ -270,53 +1358,501 @@ void transfer(Uploader *ul) {
 
   // make memory release even if error occured.
   try {
-    do {
-      std::uintmax_t _offset;
+    while (true) {
+      // take acks (and pieces fetched) already arrived, and wait for acks
+      // if window is full
+      while ((!in_flight.empty() && in_flight.size() >= ul->window)
+          || sock.available() > 0) {
+        wait_ack();
+      }
+
+      uint32_t order;
+      int size;
+      uint64_t seen = ul->changed();
+      auto up = ul->next_piece(_read_buf, order, size, in_flight);
+      if (!up) {
+        if (!in_flight.empty()) {
+          // nothing to send, wait until all pieces of us are acknowledged
+          wait_ack();
+        } else if (!ul->finished()) {
+          // others are still sending or more files are coming. block until
+          // the server sends something or there may be a piece to send
+          ul->idle(io_context, sock, seen);
+          if (sock.available() > 0) {
+            wait_ack();
+          }
+        } else {
+          break;
+        }
+        continue;
+      }
 
-      size = ul->f.read(_read_buf, _offset);
+      if (up->is_acked(order)) {
+        // acknowledged through another connection meanwhile
+        continue;
+      }
 
       // give length info to string constructor
       // to prevent construct stop at first 0x00 byte
       std::string _read_str(_read_buf, ul->piece_size);
 
-      boost::asio::write(sock,
-                         buffer(protocol::build_msg_transfer(
-                             protocol::file_transfer_build(
-                                 enc,
-                                 _sess,
-                                 _offset / ul->piece_size,
-                                 size,
-                                 _read_str))),
-                         error);
-
-//    try {
-//      std::function<std::string(int)>
-//          _t = std::bind(&Uploader::_read, ul, std::placeholders::_1);
-//      int status = protocol::file_transfer_confirm(
-//          dec, protocol::read_msg_transfer(_t), ul->session);
-//      if (status != 0) {
-//        exit(1);
-//      }
-//    }
-//    catch (const std::exception &e) {
-//      e.what();
-//      exit(1);
-//    }
+      auto start = std::chrono::steady_clock::now();
+      std::string _msg = protocol::build_msg_transfer(
+          protocol::file_transfer_build(enc, _sess, up->stream, order,
+                                        size, _read_str),
+          up->stream);
+      h_encrypt.record(start);
+
+      // one limit for all threads, so idle threads leave their share
+      // to others
+      auto wait = ul->limiter.consume(_msg.size());
+      if (wait.count() > 0) {
+        std::this_thread::sleep_for(wait);
+      }
+
+      start = std::chrono::steady_clock::now();
+      uint32_t bytes = _msg.size();
+      if (zerocopy && bytes >= ul->tuning.zerocopy) {
+        zerocopy->send(std::make_shared<std::string>(std::move(_msg)));
+        // pieces are kept until the kernel is done with them, a window of
+        // them at most
+        zerocopy->reap((uint64_t) ul->window * bytes);
+      } else {
+        boost::asio::write(sock, buffer(_msg));
+      }
+      h_send.record(start);
+      ++stats.pieces;
+      stats.bytes += bytes;
+      up->sent(order);
+      in_flight.emplace_back(up->stream, order);
+
+      // size buffers by the bandwidth-delay product measured lately
+      tuned_bytes += bytes;
+      std::chrono::duration<double> tuned = start - tuned_at;
+      if (tuned.count() >= 1) {
+        if (sockopt::autosize(sock.native_handle(),
+                              tuned_bytes / tuned.count(), applied)) {
+          LOG(INFO) << "Connection " << number << " buffers resized: "
+                    << applied.str() << ".";
+        }
+        tuned_bytes = 0;
+        tuned_at = start;
+      }
+
       // reset memory in case error happened
       memset(_read_buf, 0, ul->piece_size);
-    } while (size != 0);
+    }
 
     // send finish packet
     boost::asio::write(sock, buffer(protocol::build_msg_transfer(
-        protocol::file_transfer_build(enc, _sess, 0, 0, " "))), error);
+        protocol::file_transfer_build(enc, _sess, 0, 0, 0, " "), 0)), error);
+    if (zerocopy) {
+      zerocopy->reap(0);
+      LOG(INFO) << "Connection " << number << ": " << zerocopy->completed
+                << " zerocopy sends, " << zerocopy->copied
+                << " copied by the kernel anyway.";
+    }
   }
   catch (std::exception &e) {
     LOG(ERROR) << e.what();
+    // let other connections send what we didn't get acknowledged
+    for (auto &p : in_flight) {
+      auto up = ul->find(p.first);
+      if (!up) {
+        continue;
+      }
+      try {
+        up->resend(p.second);
+      }
+      catch (std::exception &e) {
+        LOG(ERROR) << e.what();
+        ul->finish(p.first, false);
+      }
+    }
+    ul->wake();
     // remember to delete _read_buf
     delete[] _read_buf;
+    stats.ok = false;
+    report();
+    return;
+  }
+  delete[] _read_buf;
+  report();
+}
+
+/// \brief file transfer worker sending UDP datagrams.
+/// \detail one piece goes in a datagram. pieces are paced at the rate
+///         RateControl estimates the path can carry, and at most a window
+///         of them is in flight. a piece is lost if one sent well after it
+///         is acknowledged first, or if nothing acknowledges it for a
+///         timeout. lost pieces are sent again by any thread.
+/// \param ul pointer to negotiated Uploader object
+/// \param number thread number
+void transfer_udp(Uploader *ul, int number) {
+
+  ConnectionStats stats;
+  stats.number = number;
+  auto connected = std::chrono::steady_clock::now();
+  // keep stats however the thread exits
+  auto report = [&]() {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - connected;
+    stats.seconds = elapsed.count();
+    std::lock_guard<std::mutex> lock(ul->_lock);
+    ul->connections.push_back(stats);
+  };
+
+  // transfer threads use different io_context. it's polled to run sending
+  // and the simulated path.
+  boost::asio::io_context io_context;
+  udp::socket sock(io_context);
+  udp::Link link(sock, ul->conditions);
+
+  // Encrypter / Decrypter object is not thread safe so we need to
+  // copy it for each thread
+  protocol::AESEncrypter enc(ul->enc);
+  protocol::AESDecrypter dec(ul->dec);
+
+  udp::endpoint ep(boost::asio::ip::address::from_string(ul->ip), ul->port);
+
+  std::string _sess = ul->session;
+
+  // receive the datagrams arrived, as (stream, body) of their messages
+  std::string _datagram;
+  auto receive = [&]() {
+    std::vector<std::pair<uint64_t, std::string>> msgs;
+    io_context.restart();
+    io_context.poll();
+    for (;;) {
+      boost::system::error_code ec;
+      _datagram.resize(udp::MAX_DATAGRAM);
+      size_t length = sock.receive(buffer(_datagram), 0, ec);
+      if (ec == boost::asio::error::would_block) {
+        return msgs;
+      }
+      if (ec) {
+        // error of an earlier datagram, like the port not listening
+        throw boost::system::system_error(ec);
+      }
+      _datagram.resize(length);
+      for (auto &frame : udp::unpack(_datagram)) {
+        uint64_t stream;
+        std::function<std::string(int)> _t = [&frame](int length) {
+          std::string _data = frame.substr(0, length);
+          frame.erase(0, length);
+          return _data;
+        };
+        std::string msg = protocol::read_msg_transfer(_t, stream);
+        msgs.emplace_back(stream, std::move(msg));
+      }
+    }
+  };
+
+  // a datagram sent and not acknowledged yet
+  struct sent_t {
+    uint64_t stream;
+    uint32_t order;
+    uint32_t bytes;
+    udp::RateControl::Sample sample;
+    // it's the only copy of the piece, so its ack tells when it arrived
+    bool only;
+  };
+  // datagrams in flight, in the order they are sent
+  std::map<uint64_t, sent_t> outstanding;
+  // datagram in flight of each piece
+  std::map<std::pair<uint64_t, uint32_t>, uint64_t> sequence_of;
+  uint64_t next_sequence = 0;
+  // pieces sent through this connection but not acknowledged
+  in_flight_t in_flight;
+  // latest sending time of a datagram acknowledged
+  udp::time_point newest_acked;
+
+  // forget a datagram in flight, delivered or lost
+  auto forget = [&](std::map<uint64_t, sent_t>::iterator it) {
+    auto piece = std::make_pair(it->second.stream, it->second.order);
+    sequence_of.erase(piece);
+    auto p = std::find(in_flight.begin(), in_flight.end(), piece);
+    if (p != in_flight.end()) {
+      in_flight.erase(p);
+    }
+    outstanding.erase(it);
+  };
+
+  char *_read_buf = new char[ul->piece_size];
+
+  try {
+    sock.open(ep.protocol());
+    boost::system::error_code error;
+    sock.set_option(boost::asio::socket_base::receive_buffer_size(1 << 20),
+                    error);
+    sock.set_option(boost::asio::socket_base::send_buffer_size(8 << 20),
+                    error);
+    sock.connect(ep);
+    sock.non_blocking(true);
+
+    // file transfer init, sent again until answered
+    auto init = std::make_shared<std::string>(protocol::build_msg_transfer(
+        protocol::file_transfer_init(enc, ul->session, ul->key_id), 0));
+    std::chrono::nanoseconds rtt{0};
+    auto tried_at = std::chrono::steady_clock::now();
+    link.send(init, ep);
+    for (int tries = 1; rtt.count() == 0;) {
+      for (auto &m : receive()) {
+        if (m.first != 0) {
+          continue;
+        }
+        if (protocol::file_transfer_init_confirm(dec, m.second) != 0) {
+          throw std::runtime_error("Server refused UDP transfer thread.");
+        }
+        rtt = std::chrono::steady_clock::now() - tried_at;
+      }
+      auto now = std::chrono::steady_clock::now();
+      if (rtt.count() == 0 && now - tried_at > std::chrono::milliseconds(200)) {
+        if (++tries > 25) {
+          throw std::runtime_error("Server didn't answer UDP transfer thread.");
+        }
+        link.send(init, ep);
+        tried_at = now;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    udp::RateControl control(ul->piece_size, rtt);
+    auto next_send = std::chrono::steady_clock::now();
+
+    while (true) {
+      bool busy = false;
+
+      // take acks arrived
+      for (auto &m : receive()) {
+        busy = true;
+        uint64_t stream = m.first;
+        if (stream == 0) {
+          // answer of a init sent again
+          continue;
+        }
+        auto now = std::chrono::steady_clock::now();
+        // measure: the ack is for the datagram rather than for the stream
+        auto acked = [&](uint32_t order, bool measure) {
+          auto p = sequence_of.find(std::make_pair(stream, order));
+          if (p == sequence_of.end()) {
+            return;
+          }
+          auto it = outstanding.find(p->second);
+          measure = measure && it->second.only;
+          control.on_ack(it->second.sample, it->second.bytes, now, measure);
+          if (measure) {
+            newest_acked = std::max(newest_acked, it->second.sample.sent_at);
+          }
+          forget(it);
+        };
+        // pieces of the stream in flight with order lower than given
+        auto below = [&](uint32_t cumulative) {
+          std::vector<uint32_t> orders;
+          for (auto p = sequence_of.lower_bound(std::make_pair(stream, 0u));
+               p != sequence_of.end() && p->first.first == stream
+                   && p->first.second < cumulative; ++p) {
+            orders.push_back(p->first.second);
+          }
+          return orders;
+        };
+
+        auto up = ul->find(stream);
+        if (!up) {
+          // finished through other connections
+          for (auto order : below(UINT32_MAX)) {
+            acked(order, false);
+          }
+          continue;
+        }
+        uint32_t cumulative;
+        uint32_t base;
+        std::string bitmap;
+        int status = protocol::file_transfer_confirm(
+            dec, m.second, _sess, cumulative, base, bitmap);
+        auto orders = protocol::sack_bitmap_read(base, bitmap);
+        if (status == 0) {
+          up->ack(cumulative, orders);
+        } else if (status == 2) {
+          // the server got the whole file, stop sending it
+          up->ack(cumulative, {});
+          for (auto order : below(UINT32_MAX)) {
+            acked(order, false);
+          }
+        } else if (status == 3) {
+          up->ack(cumulative, {});
+          for (auto order : orders) {
+            up->defer(order);
+          }
+        } else {
+          up->ack(cumulative, {});
+          try {
+            for (auto order : orders) {
+              LOG(WARNING) << "Server failed writing piece " << order << " of "
+                           << up->file_name << ".";
+              up->resend(order);
+            }
+          }
+          catch (const std::exception &e) {
+            LOG(ERROR) << e.what();
+            ul->finish(stream, false);
+          }
+        }
+        for (auto order : below(cumulative)) {
+          acked(order, true);
+        }
+        for (auto order : orders) {
+          acked(order, status == 0);
+        }
+        if (up->all_acked()) {
+          ul->finish(stream);
+        }
+      }
+
+      // find lost datagrams, which are sent a reorder window before one
+      // acknowledged, or not acknowledged for a timeout
+      auto now = std::chrono::steady_clock::now();
+      auto reordered = newest_acked - control.reorder_window();
+      auto expired = now - control.timeout();
+      while (!outstanding.empty()) {
+        auto it = outstanding.begin();
+        auto sent_at = it->second.sample.sent_at;
+        if (sent_at >= reordered && sent_at >= expired) {
+          break;
+        }
+        control.on_loss(it->second.bytes);
+        auto up = ul->find(it->second.stream);
+        if (up) {
+          up->retransmit(it->second.order);
+        }
+        forget(it);
+      }
+
+      // send pieces as the window and the pacing rate allow
+      bool idle = false;
+      while (control.get_in_flight() < control.window() && now >= next_send) {
+        uint32_t order;
+        int size;
+        auto up = ul->next_piece(_read_buf, order, size, in_flight);
+        if (!up) {
+          idle = true;
+          break;
+        }
+        if (up->is_acked(order)) {
+          // acknowledged through another connection meanwhile
+          continue;
+        }
+
+        // give length info to string constructor
+        // to prevent construct stop at first 0x00 byte
+        std::string _read_str(_read_buf, ul->piece_size);
+
+        auto start = std::chrono::steady_clock::now();
+        auto _msg = std::make_shared<std::string>(protocol::build_msg_transfer(
+            protocol::file_transfer_build(enc, _sess, up->stream, order,
+                                          size, _read_str),
+            up->stream));
+        h_encrypt.record(start);
+        if (_msg->size() > udp::MAX_DATAGRAM) {
+          throw std::runtime_error("Piece can't fit in a datagram, "
+                                   "use a smaller piece size.");
+        }
+
+        // one limit for all threads, so idle threads leave their share
+        // to others
+        auto wait = ul->limiter.consume(_msg->size());
+        if (wait.count() > 0) {
+          std::this_thread::sleep_for(wait);
+        }
+
+        auto piece = std::make_pair(up->stream, order);
+        auto p = sequence_of.find(piece);
+        if (p != sequence_of.end()) {
+          // the copy sent before won't be waited for
+          auto it = outstanding.find(p->second);
+          control.on_loss(it->second.bytes);
+          forget(it);
+        }
+
+        now = std::chrono::steady_clock::now();
+        uint32_t bytes = _msg->size();
+        outstanding[next_sequence] = {up->stream, order, bytes,
+                                      control.on_send(bytes, now),
+                                      up->sent(order) == 1};
+        sequence_of[piece] = next_sequence++;
+        in_flight.push_back(piece);
+        link.send(_msg, ep);
+        h_send.record(now);
+        ++stats.pieces;
+        stats.bytes += bytes;
+        busy = true;
+
+        // a little burst is allowed after falling behind, as sleeping
+        // is not precise
+        next_send = std::max(next_send, now - std::chrono::milliseconds(1))
+            + std::chrono::nanoseconds(
+                (int64_t) (bytes * 1e9 / control.pacing_rate()));
+
+        // reset memory in case error happened
+        memset(_read_buf, 0, ul->piece_size);
+      }
+
+      if (idle && outstanding.empty()) {
+        if (ul->finished()) {
+          break;
+        }
+        // others are still sending or more files are coming
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      } else if (!busy) {
+        now = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(
+            std::max<std::chrono::nanoseconds>(
+                next_send - now, std::chrono::microseconds(50)),
+            std::chrono::milliseconds(1)));
+      }
+    }
+
+    // send finish packet. the server ignores the copies after the first.
+    auto finish = std::make_shared<std::string>(protocol::build_msg_transfer(
+        protocol::file_transfer_build(enc, _sess, 0, 0, 0, " "), 0));
+    for (int i = 0; i < 3; ++i) {
+      link.send(finish, ep);
+    }
+    // let them through the simulated path
+    io_context.restart();
+    io_context.run_for(ul->conditions.delay + ul->conditions.jitter
+                           + std::chrono::milliseconds(10));
+
+    LOG(INFO) << "UDP connection " << number << ": bandwidth "
+              << control.get_bandwidth() << "byte/s, min RTT "
+              << std::chrono::duration<double>(
+                  control.get_min_rtt()).count() << "seconds, "
+              << control.get_lost() << " bytes lost, " << link.dropped
+              << " datagrams dropped by simulator.";
+  }
+  catch (std::exception &e) {
+    LOG(ERROR) << e.what();
+    // let other connections send what we didn't get acknowledged
+    for (auto &p : in_flight) {
+      auto up = ul->find(p.first);
+      if (!up) {
+        continue;
+      }
+      try {
+        up->resend(p.second);
+      }
+      catch (std::exception &e) {
+        LOG(ERROR) << e.what();
+        ul->finish(p.first, false);
+      }
+    }
+    delete[] _read_buf;
+    stats.ok = false;
+    report();
     return;
   }
   delete[] _read_buf;
+  report();
 }
 
 int main(int argc, char *argv[]) {
@@ -331,16 +1867,89 @@ int main(int argc, char *argv[]) {
       ("h,host", "IP Address to connect", cxxopts::value<std::string>())
       ("p,port", "Port number to connect", cxxopts::value<int>())
       ("k,key", "Encrypt key to communicate", cxxopts::value<std::string>())
-      ("f,file", "File name", cxxopts::value<std::string>())
+      ("f,file", "File names, comma separated or repeated. - for stdin, "
+                 "and pipes are read as data arrives",
+       cxxopts::value<std::vector<std::string>>())
       ("t,thread", "Threads to connect", cxxopts::value<int>())
-      ("s,size", "Piece size(byte) to split file in", cxxopts::value<int>());
+      ("s,size", "Piece size(byte) to split file in", cxxopts::value<int>())
+      ("w,window", "Pieces in flight per connection", cxxopts::value<int>())
+      ("c,concurrent", "Files uploaded at the same time",
+       cxxopts::value<int>())
+      ("r,rate", "Upload rate limit(byte/s), like 100M. 0 for unlimited",
+       cxxopts::value<std::string>())
+      ("burst", "Bytes can be sent at once after idle",
+       cxxopts::value<std::string>())
+      ("stats-json", "File to write latency and connection stats to",
+       cxxopts::value<std::string>())
+      ("synthetic", "Send generated data as the files instead of reading "
+                    "them, as pattern:size. pattern is zero, random or "
+                    "compressible, like random:1G",
+       cxxopts::value<std::string>())
+      ("direct", "Ask the server to write the files with direct I/O")
+      ("sndbuf", "Send buffer of connections, like 4M. sized by the "
+                 "measured bandwidth-delay product if not given",
+       cxxopts::value<std::string>())
+      ("pacing", "Rate(byte/s) the kernel paces each connection at, "
+                 "like 50M",
+       cxxopts::value<std::string>())
+      ("notsent-lowat", "Unsent bytes each connection buffers at most, "
+                        "like 128K",
+       cxxopts::value<std::string>())
+      ("zerocopy", "Send pieces of at least this size, like 64K, without "
+                   "copying them into the kernel",
+       cxxopts::value<std::string>())
+      ("udp", "Send pieces in UDP datagrams with rate based congestion "
+              "control, for long fat links. use a piece size fitting the "
+              "path MTU, like 1200, unless on loopback")
+      ("udp-sim", "Simulate a path for datagrams sent, for testing, like "
+                  "loss=0.01,delay=50ms,jitter=5ms",
+       cxxopts::value<std::string>())
+      ("crypto-threads", "Threads encrypting segments of large pieces "
+                         "at the same time, default the count of cores",
+       cxxopts::value<int>())
+      ("stdin-name", "Name of the file uploaded from stdin, default stdin",
+       cxxopts::value<std::string>())
+      ("pipe-buffer", "Bytes read from stdin or a pipe kept until "
+                      "acknowledged, like 256M, default 64M",
+       cxxopts::value<std::string>())
+      ("key-id", "Id of the key on the server, if it takes more than one",
+       cxxopts::value<std::string>())
+      ("resume", "File to cache resumption tickets and the derived key in. "
+                 "a later upload to the same server skips deriving the key",
+       cxxopts::value<std::string>())
+      ("fetch", "Files on the server to download, comma separated or "
+                "repeated. fetched over all the threads, along with files "
+                "uploaded",
+       cxxopts::value<std::vector<std::string>>())
+      ("o,output", "Directory to save files fetched in, default the "
+                   "current one",
+       cxxopts::value<std::string>());
 
   std::string host;
   int port;
   std::string key;
-  std::string file_name;
+  std::vector<std::string> file_names;
+  std::vector<std::string> fetch_names;
+  std::string output = ".";
   int thread_num;
   int piece_size;
+  int window;
+  int concurrent;
+  uint64_t rate;
+  uint64_t burst;
+  std::string stats_json;
+  bool synthetic = false;
+  auto pattern = file::synthetic_reader::ZERO;
+  std::uintmax_t synthetic_size = 0;
+  uint32_t flags = 0;
+  sockopt::options tuning;
+  bool over_udp;
+  udp::Conditions conditions;
+  std::string stdin_name = "stdin";
+  std::uintmax_t pipe_buffer = 64 * 1024 * 1024;
+  std::string key_id;
+  std::string resume_file;
+  int crypto_threads;
 
   auto result = options.parse(argc, argv);
 
@@ -349,7 +1958,13 @@ int main(int argc, char *argv[]) {
     host = result["h"].as<std::string>();
     port = result["p"].as<int>();
     key = result["k"].as<std::string>();
-    file_name = result["f"].as<std::string>();
+    if (result.count("fetch")) {
+      fetch_names = result["fetch"].as<std::vector<std::string>>();
+    }
+    // only files to fetch are fine too
+    if (result.count("f") || fetch_names.empty()) {
+      file_names = result["f"].as<std::vector<std::string>>();
+    }
   }
   catch (const cxxopts::OptionException &e) {
     std::cerr << "Incorrect parameters" << std::endl;
@@ -367,11 +1982,187 @@ int main(int argc, char *argv[]) {
     thread_num = 1;
   }
 
+  try {
+    crypto_threads = result["crypto-threads"].as<int>();
+  }
+  catch (const std::domain_error &e) {
+    crypto_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  if (crypto_threads < 1) {
+    std::cerr << "Crypto threads should be positive" << std::endl;
+    exit(1);
+  }
+
   try {
     piece_size = result["s"].as<int>();
   }
   catch (const std::domain_error &e) {
-    piece_size = 65536;
+    // a UDP piece and its head should fit in one datagram
+    piece_size = result.count("udp") ? 61440 : 65536;
+  }
+
+  try {
+    window = result["w"].as<int>();
+  }
+  catch (const std::domain_error &e) {
+    window = 16;
+  }
+
+  try {
+    concurrent = result["c"].as<int>();
+  }
+  catch (const std::domain_error &e) {
+    concurrent = 4;
+  }
+
+  try {
+    rate = ratelimit::parse_rate(result["r"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {
+    rate = 0;
+  }
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    burst = ratelimit::parse_rate(result["burst"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {
+    burst = 0;
+  }
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    stats_json = result["stats-json"].as<std::string>();
+  }
+  catch (const std::domain_error &e) {}
+
+  try {
+    auto spec = result["synthetic"].as<std::string>();
+    auto pos = spec.find(':');
+    if (pos == std::string::npos) {
+      std::cerr << "Incorrect synthetic data " << spec << std::endl;
+      exit(1);
+    }
+    pattern = file::synthetic_reader::parse_pattern(spec.substr(0, pos));
+    synthetic_size = file::parse_size(spec.substr(pos + 1));
+    synthetic = true;
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  if (result.count("direct")) {
+    flags |= FLAG_DIRECT_IO;
+  }
+
+  try {
+    tuning.send_buffer = file::parse_size(result["sndbuf"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    tuning.pacing_rate = ratelimit::parse_rate(
+        result["pacing"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    tuning.notsent_lowat = file::parse_size(
+        result["notsent-lowat"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    tuning.zerocopy = file::parse_size(result["zerocopy"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  over_udp = result.count("udp") > 0;
+
+  try {
+    conditions = udp::Conditions::parse(result["udp-sim"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    stdin_name = result["stdin-name"].as<std::string>();
+  }
+  catch (const std::domain_error &e) {}
+
+  try {
+    pipe_buffer = file::parse_size(result["pipe-buffer"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  if (window <= 0) {
+    std::cerr << "Window should be positive" << std::endl;
+    exit(1);
+  }
+
+  if (pipe_buffer < (std::uintmax_t) piece_size) {
+    std::cerr << "Pipe buffer should hold a piece" << std::endl;
+    exit(1);
+  }
+
+  try {
+    key_id = result["key-id"].as<std::string>();
+    if (key_id.size() > KEY_ID_LENGTH) {
+      throw std::invalid_argument("Key id longer than "
+                                      + std::to_string(KEY_ID_LENGTH));
+    }
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    resume_file = result["resume"].as<std::string>();
+  }
+  catch (const std::domain_error &e) {}
+
+  try {
+    output = result["output"].as<std::string>();
+  }
+  catch (const std::domain_error &e) {}
+
+  if (!fetch_names.empty() && over_udp) {
+    std::cerr << "Files can't be fetched over UDP" << std::endl;
+    exit(1);
   }
 
   el::Configurations defaultConf;
@@ -385,25 +2176,86 @@ int main(int argc, char *argv[]) {
   protocol::init_environment();
   #endif
 
-  protocol::AESEncrypter enc(key);
-  protocol::AESDecrypter dec(key);
+  std::string server = host + ":" + std::to_string(port);
+  if (!key_id.empty()) {
+    server += "#" + key_id;
+  }
+  if (key.length() < 7) {
+    LOG(WARNING) << "You are using a short key which is weak to attack.";
+  }
+  resume::Entry cached;
+  bool resumed = !resume_file.empty()
+      && resume::load(resume_file, server, key, cached);
+  if (resumed) {
+    // used once, and saved again after the server accepted it
+    resume::forget(resume_file, server, key);
+    LOG(INFO) << "Resuming with the ticket cached.";
+  }
+  // derived once for both, unless cached
+  std::string derived = cached.derived;
+  if (derived.empty()) {
+    derived = encrypt::_cryptopp_Scrypt(key);
+  }
+  protocol::AESEncrypter enc(encrypt::derived, derived);
+  protocol::AESDecrypter dec(encrypt::derived, derived);
+  // the caller encrypting a piece takes a segment too
+  auto crypto_pool = std::make_shared<parallel::Pool>(crypto_threads - 1);
+  enc.parallelize(crypto_pool);
+  dec.parallelize(crypto_pool);
 
   // main thread io_context
   boost::asio::io_context io_context;
   tcp::socket sock(io_context);
 
-  boost::asio::ip::tcp::endpoint
-      ep(boost::asio::ip::address::from_string(host), port);
-
-  sock.connect(ep);
+  Uploader ul(host, port, sock, enc, dec, key_id, piece_size, thread_num, window,
+              rate, burst, tuning, over_udp, conditions);
 
-  Uploader ul(host, port, sock, enc, dec, file_name, piece_size, thread_num);
+  // transfer connections are opened along with the negotiation connection,
+  // and the server attaches them once the handshake is done
+  ul.file_transfer();
 
+  ul.connect();
+  if (resumed) {
+    ul.resume(cached.ticket);
+  }
   ul.handshake();
 
-  ul.file_negotiation();
+  for (auto &file_name : file_names) {
+    ul.wait_slot(concurrent);
+    std::unique_ptr<file::reader> source;
+    std::string remote_name = file_name;
+    if (synthetic) {
+      source = std::make_unique<file::synthetic_reader>(
+          pattern, synthetic_size, piece_size);
+    } else if (file::is_stream(file_name)) {
+      source = std::make_unique<file::stream_reader>(
+          file_name, piece_size, pipe_buffer);
+      if (file_name == "-") {
+        remote_name = stdin_name;
+      }
+    } else {
+      source = std::make_unique<file::file_reader>(file_name, piece_size);
+    }
+    ul.file_negotiation(remote_name, std::move(source), flags);
+  }
+
+  for (auto &fetch_name : fetch_names) {
+    ul.wait_slot(concurrent);
+    auto local_name = std::filesystem::path(output)
+        / std::filesystem::path(fetch_name).filename();
+    ul.file_fetch(fetch_name, local_name.string());
+  }
 
-  ul.file_transfer();
+  ul.close();
+
+  if (!resume_file.empty() && ul.answered && !ul.ticket.empty()) {
+    if (!ul.is_resumed()) {
+      cached.ticket = ul.ticket;
+      cached.expiry = resume::now() + ul.ticket_lifetime;
+    }
+    cached.derived = derived;
+    resume::save(resume_file, server, key, cached);
+  }
 
   io_context.run();
 
@@ -416,6 +2268,42 @@ int main(int argc, char *argv[]) {
   std::chrono::duration<double> time_span =
       std::chrono::duration_cast<std::chrono::duration<double>>(t2 - now);
 
+  // tell where the time went
+  auto s_read = h_read.summary();
+  auto s_encrypt = h_encrypt.summary();
+  auto s_send = h_send.summary();
+  LOG(INFO) << "Piece read: " << s_read.str();
+  LOG(INFO) << "Piece encrypt: " << s_encrypt.str();
+  LOG(INFO) << "Piece send: " << s_send.str();
+  auto s_write = h_write.summary();
+  if (s_write.count > 0) {
+    LOG(INFO) << "Piece write: " << s_write.str();
+  }
+  for (auto &c : ul.connections) {
+    LOG(INFO) << c.str();
+  }
+  if (!stats_json.empty()) {
+    std::ofstream out(stats_json);
+    out << "{\"seconds\":" << time_span.count()
+        << ",\"ok\":" << (ul.failed ? "false" : "true")
+        << ",\"read\":" << s_read.json()
+        << ",\"encrypt\":" << s_encrypt.json()
+        << ",\"send\":" << s_send.json()
+        << ",\"write\":" << s_write.json() << ",\"connections\":[";
+    for (size_t i = 0; i < ul.connections.size(); ++i) {
+      out << (i ? "," : "") << ul.connections[i].json();
+    }
+    out << "]}\n";
+    if (!out) {
+      LOG(WARNING) << "Failed writing " << stats_json << ".";
+    }
+  }
+
+  if (ul.failed) {
+    LOG(ERROR) << "Upload failed after " << time_span.count() << "seconds.";
+    return 1;
+  }
+
   LOG(INFO) << "Upload finished using "<< time_span.count() << "seconds.";
 
   return 0;
@@ -0,0 +1,371 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <regex>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <filesystem>
+#include <cstring>
+
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/// \file bench_e2e.cpp
+/// \brief Loopback end-to-end benchmark of server and client
+/// \note
+/** Usage
+ * bench_e2e [--server ./server] [--client ./client] [-S 256M]
+ *           [-t 1,2,4,8] [-s 16384,65536,262144] [-r 1] [-d dir]
+ *           [-p 23333] [--csv result.csv] [--json result.json]
+ *           [--server-args "..."] [--client-args "..."]
+ *
+ * for each thread count and piece size, a fresh server is started on
+ * localhost and the client uploads a synthetic file of the given size.
+ * throughput, CPU seconds per GB and peak RSS of both sides are taken from
+ * wait4, and the per connection breakdown from the client's --stats-json.
+ * POSIX only.
+ */
+
+namespace fs = std::filesystem;
+
+/// \brief result of one run
+struct Run {
+  int threads;
+  int piece_size;
+  int repeat;
+  uint64_t bytes;
+  double seconds;
+  double client_cpu;
+  double server_cpu;
+  long client_rss;
+  long server_rss;
+  double conn_min = 0;
+  double conn_max = 0;
+  std::string connections = "[]";
+  bool ok;
+
+  double mb_per_s() const { return bytes / seconds / 1e6; }
+
+  static std::string csv_head() {
+    return "threads,piece_size,repeat,bytes,seconds,mb_per_s,"
+           "client_cpu_s_per_gb,server_cpu_s_per_gb,client_peak_rss_kb,"
+           "server_peak_rss_kb,conn_min_mb_per_s,conn_max_mb_per_s,ok";
+  }
+
+  std::string csv() const {
+    std::ostringstream s;
+    s << std::setprecision(6) << threads << "," << piece_size << ","
+      << repeat << "," << bytes << "," << seconds << "," << mb_per_s() << ","
+      << client_cpu / (bytes / 1e9) << "," << server_cpu / (bytes / 1e9)
+      << "," << client_rss << "," << server_rss << "," << conn_min << ","
+      << conn_max << "," << (ok ? "true" : "false");
+    return s.str();
+  }
+
+  std::string json() const {
+    std::ostringstream s;
+    s << std::setprecision(6)
+      << "{\"threads\":" << threads << ",\"piece_size\":" << piece_size
+      << ",\"repeat\":" << repeat << ",\"bytes\":" << bytes
+      << ",\"seconds\":" << seconds << ",\"mb_per_s\":" << mb_per_s()
+      << ",\"client_cpu_s_per_gb\":" << client_cpu / (bytes / 1e9)
+      << ",\"server_cpu_s_per_gb\":" << server_cpu / (bytes / 1e9)
+      << ",\"client_peak_rss_kb\":" << client_rss
+      << ",\"server_peak_rss_kb\":" << server_rss
+      << ",\"ok\":" << (ok ? "true" : "false")
+      << ",\"connections\":" << connections << "}";
+    return s.str();
+  }
+};
+
+/// \brief parse size like 256M or 1G, powers of 1024
+uint64_t parse_size(const std::string &size) {
+  size_t pos;
+  double value = std::stod(size, &pos);
+  std::string suffix = size.substr(pos);
+  const std::string units = "KMGT";
+  if (!suffix.empty()) {
+    auto unit = units.find((char) toupper(suffix[0]));
+    if (unit == std::string::npos) {
+      throw std::invalid_argument("Not a size: " + size);
+    }
+    for (size_t i = 0; i <= unit; ++i) {
+      value *= 1024;
+    }
+  }
+  return (uint64_t) value;
+}
+
+/// \brief split by a separator
+std::vector<std::string> split(const std::string &s, char sep) {
+  std::vector<std::string> parts;
+  std::stringstream ss(s);
+  std::string part;
+  while (std::getline(ss, part, sep)) {
+    if (!part.empty()) {
+      parts.push_back(part);
+    }
+  }
+  return parts;
+}
+
+/// \brief start a program with output to a log file
+pid_t spawn(const std::vector<std::string> &args,
+            const std::string &dir,
+            const std::string &log) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  if (chdir(dir.c_str()) != 0) {
+    _exit(127);
+  }
+  int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+  }
+  std::vector<char *> argv;
+  for (auto &a : args) {
+    argv.push_back(const_cast<char *>(a.c_str()));
+  }
+  argv.push_back(nullptr);
+  execv(argv[0], argv.data());
+  _exit(127);
+}
+
+/// \brief wait for a program to exit
+/// \param cpu user and system CPU seconds used
+/// \param rss peak RSS in KB
+/// \return exit status, or -1 if killed by a signal
+int reap(pid_t pid, double &cpu, long &rss) {
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+      + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  rss = usage.ru_maxrss;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/// \brief wait until something listens on the port
+/// \detail binding the port fails once the server has it. connecting
+///         instead would be taken as a client by the server.
+bool wait_listen(int port) {
+  for (int i = 0; i < 500; ++i) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    bool used = bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0
+        && errno == EADDRINUSE;
+    close(fd);
+    if (used) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+/// \brief make a file of random data
+void make_file(const std::string &path, uint64_t size) {
+  if (fs::exists(path) && fs::file_size(path) == size) {
+    return;
+  }
+  std::ofstream out(path, std::ios::binary);
+  std::mt19937_64 rng(size);
+  std::vector<uint64_t> chunk(131072);
+  while (size > 0) {
+    for (auto &v : chunk) {
+      v = rng();
+    }
+    uint64_t n = std::min<uint64_t>(size, chunk.size() * 8);
+    out.write((const char *) chunk.data(), n);
+    size -= n;
+  }
+}
+
+/// \brief read a whole file
+std::string slurp(const std::string &path) {
+  std::ifstream in(path);
+  std::stringstream s;
+  s << in.rdbuf();
+  return s.str();
+}
+
+/// \brief compare two files
+bool same(const std::string &a, const std::string &b) {
+  std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+  std::vector<char> ba(1 << 20), bb(1 << 20);
+  while (fa && fb) {
+    fa.read(ba.data(), ba.size());
+    fb.read(bb.data(), bb.size());
+    if (fa.gcount() != fb.gcount()
+        || memcmp(ba.data(), bb.data(), fa.gcount()) != 0) {
+      return false;
+    }
+  }
+  return fa.eof() && fb.eof();
+}
+
+int main(int argc, char *argv[]) {
+  std::string server = "./server";
+  std::string client = "./client";
+  std::string size_str = "256M";
+  std::string threads_str = "1,2,4,8";
+  std::string pieces_str = "16384,65536,262144";
+  int repeat = 1;
+  std::string dir = "bench_e2e";
+  int port = 23333;
+  std::string csv, json, server_args, client_args;
+  const std::string usage =
+      "Usage: bench_e2e [--server ./server] [--client ./client] [-S 256M] "
+      "[-t 1,2,4,8] [-s 16384,65536,262144] [-r 1] [-d dir] [-p 23333] "
+      "[--csv file] [--json file] [--server-args \"...\"] "
+      "[--client-args \"...\"]";
+  for (int i = 1; i < argc; i += 2) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      std::cerr << usage << std::endl;
+      return 1;
+    }
+    std::string value = argv[i + 1];
+    if (arg == "--server") {
+      server = value;
+    } else if (arg == "--client") {
+      client = value;
+    } else if (arg == "-S") {
+      size_str = value;
+    } else if (arg == "-t") {
+      threads_str = value;
+    } else if (arg == "-s") {
+      pieces_str = value;
+    } else if (arg == "-r") {
+      repeat = std::stoi(value);
+    } else if (arg == "-d") {
+      dir = value;
+    } else if (arg == "-p") {
+      port = std::stoi(value);
+    } else if (arg == "--csv") {
+      csv = value;
+    } else if (arg == "--json") {
+      json = value;
+    } else if (arg == "--server-args") {
+      server_args = value;
+    } else if (arg == "--client-args") {
+      client_args = value;
+    } else {
+      std::cerr << usage << std::endl;
+      return 1;
+    }
+  }
+
+  uint64_t size = parse_size(size_str);
+  server = fs::absolute(server).string();
+  client = fs::absolute(client).string();
+  fs::create_directories(dir);
+  dir = fs::absolute(dir).string();
+  std::string src = dir + "/src.bin";
+  std::string srv_dir = dir + "/srv";
+  std::cerr << "Preparing " << size << " bytes source file." << std::endl;
+  make_file(src, size);
+
+  std::vector<Run> runs;
+  std::cout << Run::csv_head() << std::endl;
+  for (auto &t : split(threads_str, ',')) {
+    for (auto &s : split(pieces_str, ',')) {
+      for (int r = 0; r < repeat; ++r) {
+        fs::remove_all(srv_dir);
+        fs::create_directories(srv_dir);
+
+        std::vector<std::string> s_args =
+            {server, "-p", std::to_string(port), "-k", "bench"};
+        for (auto &a : split(server_args, ' ')) {
+          s_args.push_back(a);
+        }
+        pid_t s_pid = spawn(s_args, srv_dir, dir + "/server.log");
+        if (!wait_listen(port)) {
+          std::cerr << "Server didn't start, see " << dir << "/server.log"
+                    << std::endl;
+          kill(s_pid, SIGKILL);
+          return 1;
+        }
+
+        std::vector<std::string> c_args =
+            {client, "-h", "127.0.0.1", "-p", std::to_string(port),
+             "-k", "bench", "-f", "src.bin", "-t", t, "-s", s,
+             "--stats-json", dir + "/client.json"};
+        for (auto &a : split(client_args, ' ')) {
+          c_args.push_back(a);
+        }
+        fs::remove(dir + "/client.json");
+        auto start = std::chrono::steady_clock::now();
+        pid_t c_pid = spawn(c_args, dir, dir + "/client.log");
+        Run run{std::stoi(t), std::stoi(s), r, size};
+        int status = reap(c_pid, run.client_cpu, run.client_rss);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        run.seconds = elapsed.count();
+
+        kill(s_pid, SIGTERM);
+        reap(s_pid, run.server_cpu, run.server_rss);
+
+        run.ok = status == 0 && same(src, srv_dir + "/src.bin");
+
+        // breakdown by connection from client stats
+        std::string stats = slurp(dir + "/client.json");
+        auto pos = stats.find("\"connections\":");
+        if (pos != std::string::npos) {
+          run.connections = stats.substr(pos + 14);
+          run.connections.erase(run.connections.find_last_of(']') + 1);
+        }
+        std::regex conn("\"bytes\":([0-9]+),\"seconds\":([0-9.e+-]+)");
+        bool first = true;
+        for (std::sregex_iterator it(run.connections.begin(),
+                                     run.connections.end(), conn), end;
+             it != end; ++it) {
+          double rate = std::stod((*it)[1]) / std::stod((*it)[2]) / 1e6;
+          run.conn_min = first ? rate : std::min(run.conn_min, rate);
+          run.conn_max = first ? rate : std::max(run.conn_max, rate);
+          first = false;
+        }
+
+        std::cout << run.csv() << std::endl;
+        runs.push_back(run);
+      }
+    }
+  }
+
+  if (!csv.empty()) {
+    std::ofstream out(csv);
+    out << Run::csv_head() << "\n";
+    for (auto &run : runs) {
+      out << run.csv() << "\n";
+    }
+  }
+  if (!json.empty()) {
+    std::ofstream out(json);
+    out << "{\"size\":" << size << ",\"runs\":[";
+    for (size_t i = 0; i < runs.size(); ++i) {
+      out << (i ? ",\n" : "\n") << runs[i].json();
+    }
+    out << "\n]}\n";
+  }
+
+  bool ok = std::all_of(runs.begin(), runs.end(),
+                        [](const Run &run) { return run.ok; });
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,256 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <cstdio>
+
+#include "../third_party/easyloggingpp/src/easylogging++.h"
+
+#include "../encrypt.h"
+#include "../protocol.h"
+#include "../file.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+/// \file bench_micro.cpp
+/// \brief Microbenchmarks of crypto, framing and file I/O
+/// \note
+/** Usage
+ * bench_micro [-o result.json] [-t seconds] [-w max_writers] [-d dir]
+ *
+ * every case runs for at least the given seconds (default 0.5) and reports
+ * ns per operation and MB/s processed. results are printed to stdout as
+ * JSON, or written to the -o file.
+ */
+
+/// \brief result of one benchmark case
+struct Result {
+  std::string name;
+  uint64_t size;
+  int threads;
+  uint64_t ops;
+  double seconds;
+
+  std::string json() const {
+    std::ostringstream s;
+    s << std::setprecision(6) << std::fixed
+      << "{\"name\":\"" << name << "\",\"size\":" << size
+      << ",\"threads\":" << threads << ",\"ops\":" << ops
+      << ",\"ns_per_op\":" << seconds * 1e9 / ops
+      << ",\"mb_per_s\":" << size * ops / seconds / 1e6 << "}";
+    return s.str();
+  }
+};
+
+double min_seconds = 0.5;
+
+/// \brief run a case repeatedly for at least min_seconds
+/// \param size bytes processed by each call, for MB/s
+Result run(const std::string &name,
+           uint64_t size,
+           const std::function<void()> &fn) {
+  // warm up
+  fn();
+  uint64_t ops = 0;
+  uint64_t batch = 1;
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed(0);
+  while (elapsed.count() < min_seconds) {
+    for (uint64_t i = 0; i < batch; ++i) {
+      fn();
+    }
+    ops += batch;
+    // read the clock less often for fast cases
+    if (batch < 4096) {
+      batch *= 2;
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+  }
+  Result r{name, size, 1, ops, elapsed.count()};
+  std::cerr << r.json() << std::endl;
+  return r;
+}
+
+int main(int argc, char *argv[]) {
+  std::string output;
+  std::string dir = ".";
+  int max_writers = 4;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "-o") {
+      output = argv[i + 1];
+    } else if (arg == "-t") {
+      min_seconds = std::stod(argv[i + 1]);
+    } else if (arg == "-w") {
+      max_writers = std::stoi(argv[i + 1]);
+    } else if (arg == "-d") {
+      dir = argv[i + 1];
+    } else {
+      std::cerr << "Usage: bench_micro [-o result.json] [-t seconds] "
+                   "[-w max_writers] [-d dir]" << std::endl;
+      return 1;
+    }
+  }
+
+  // keep file module quiet
+  el::Configurations conf;
+  conf.setToDefault();
+  conf.setGlobally(el::ConfigurationType::Enabled, "false");
+  el::Loggers::reconfigureAllLoggers(conf);
+
+  std::vector<Result> results;
+  const int sizes[] = {1024, 4096, 16384, 65536, 262144, 1048576};
+
+  encrypt::AESEncrypter enc("benchmark");
+  encrypt::AESDecrypter dec("benchmark");
+
+  // crypto
+  for (int size : sizes) {
+    std::string plain(size, 'x');
+    std::string cipher = enc.encrypt(plain);
+    results.push_back(run("aes_encrypt", size, [&]() {
+      cipher = enc.encrypt(plain);
+    }));
+    results.push_back(run("aes_decrypt", size, [&]() {
+      plain = dec.decrypt(cipher);
+    }));
+  }
+
+  // framing
+  for (int size : sizes) {
+    std::string raw(size, 'x');
+    std::string msg = protocol::build_msg_transfer(raw, 1);
+    results.push_back(run("build_msg_transfer", size, [&]() {
+      msg = protocol::build_msg_transfer(raw, 1);
+    }));
+    results.push_back(run("read_msg_transfer", size, [&]() {
+      size_t pos = 0;
+      std::function<std::string(int)> _t = [&](int length) {
+        std::string _data = msg.substr(pos, length);
+        pos += length;
+        return _data;
+      };
+      uint64_t stream;
+      raw = protocol::read_msg_transfer(_t, stream);
+    }));
+  }
+  {
+    std::string raw(256, 'x');
+    std::string msg = protocol::build_msg(raw);
+    results.push_back(run("build_msg", raw.size(), [&]() {
+      msg = protocol::build_msg(raw);
+    }));
+    results.push_back(run("read_msg", raw.size(), [&]() {
+      size_t pos = 0;
+      std::function<std::string(int)> _t = [&](int length) {
+        std::string _data = msg.substr(pos, length);
+        pos += length;
+        return _data;
+      };
+      raw = protocol::read_msg(_t);
+    }));
+  }
+
+  // whole piece, as the client sends and the server reads it
+  {
+    std::string session(32, 's');
+    for (int size : sizes) {
+      std::string piece(size, 'x');
+      std::string msg = protocol::file_transfer_build(
+          enc, session, 1, 1, size, piece);
+      results.push_back(run("file_transfer_build", size, [&]() {
+        msg = protocol::file_transfer_build(enc, session, 1, 1, size, piece);
+      }));
+      results.push_back(run("file_transfer_read", size, [&]() {
+        uint32_t order, _size;
+        protocol::file_transfer_read(dec, msg, session, 1, order, _size,
+                                     piece);
+      }));
+    }
+  }
+
+  // number fields
+  {
+    uint32_t v32 = 0x1234abcd;
+    uint64_t v64 = 0x1234abcd5678ef90;
+    std::string s;
+    results.push_back(run("fixedLength_8", 8, [&]() {
+      s = protocol::fixedLength(v32++, 8);
+    }));
+    results.push_back(run("fixedLength_16", 16, [&]() {
+      s = protocol::fixedLength(v64++, 16);
+    }));
+    std::string h8 = protocol::fixedLength(v32, 8);
+    std::string h16 = protocol::fixedLength(v64, 16);
+    results.push_back(run("hex_parse_8", 8, [&]() {
+      v32 += std::stoul(h8, nullptr, 16);
+    }));
+    results.push_back(run("hex_parse_16", 16, [&]() {
+      v64 += std::stoull(h16, nullptr, 16);
+    }));
+  }
+
+  // file write with concurrent writers
+  {
+    const int piece = 65536;
+    const uint64_t file_size = 64ull * 1024 * 1024;
+    const uint64_t pieces = file_size / piece;
+    std::string path = dir + "/bench_micro.tmp";
+    std::string data(piece, 'x');
+    for (int writers = 1; writers <= max_writers; writers *= 2) {
+      std::remove(path.c_str());
+      uint64_t ops = 0;
+      auto start = std::chrono::steady_clock::now();
+      std::chrono::duration<double> elapsed(0);
+      while (elapsed.count() < min_seconds) {
+        file::file_writer w(path, file_size);
+        if (!w.ok) {
+          std::cerr << "Can't open " << path << std::endl;
+          return 1;
+        }
+        std::vector<std::thread> threads;
+        for (int t = 0; t < writers; ++t) {
+          threads.emplace_back([&, t]() {
+            for (uint64_t i = t; i < pieces; i += writers) {
+              w.write(data, piece, i * piece);
+            }
+          });
+        }
+        for (auto &t : threads) {
+          t.join();
+        }
+        w.close();
+        std::remove(path.c_str());
+        ops += pieces;
+        elapsed = std::chrono::steady_clock::now() - start;
+      }
+      Result r{"file_write", piece, writers, ops, elapsed.count()};
+      std::cerr << r.json() << std::endl;
+      results.push_back(r);
+    }
+  }
+
+  std::ostringstream s;
+  s << "{\"benchmarks\":[";
+  for (size_t i = 0; i < results.size(); ++i) {
+    s << (i ? ",\n" : "\n") << results[i].json();
+  }
+  s << "\n]}\n";
+
+  if (output.empty()) {
+    std::cout << s.str();
+  } else {
+    std::ofstream out(output);
+    out << s.str();
+    if (!out) {
+      std::cerr << "Failed writing " << output << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
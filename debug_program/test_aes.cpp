@@ -5,9 +5,9 @@
 #include <iostream>
 #include <iomanip>
 
-#include "..\third_party\easyloggingpp\src\easylogging++.h"
+#include "../third_party/easyloggingpp/src/easylogging++.h"
 
-#include "..\encrypt.h"
+#include "../encrypt.h"
 
 INITIALIZE_EASYLOGGINGPP
 
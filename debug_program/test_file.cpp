@@ -2,9 +2,11 @@
 // Created by TYTY on 2019-05-07 007.
 //
 
-#include "..\third_party\easyloggingpp\src\easylogging++.h"
+#include <cstring>
 
-#include "..\file.h"
+#include "../third_party/easyloggingpp/src/easylogging++.h"
+
+#include "../file.h"
 
 INITIALIZE_EASYLOGGINGPP
 
@@ -0,0 +1,257 @@
+#include "deliver.h"
+
+#include <cstring>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "./third_party/easyloggingpp/src/easylogging++.h"
+
+extern char **environ;
+
+using namespace deliver;
+
+Output::Output(const std::string &spec) {
+  if (spec == "-") {
+    kind = STDOUT;
+  } else if (!spec.empty() && spec[0] == '|') {
+    kind = COMMAND;
+    where = spec.substr(1);
+    if (where.empty()) {
+      throw std::invalid_argument("No command to deliver files to.");
+    }
+  } else {
+    kind = PATH;
+    where = spec;
+  }
+  // a consumer gone makes writes fail with EPIPE, rather than killing us
+  signal(SIGPIPE, SIG_IGN);
+}
+
+Output::~Output() {
+  if (kind == PATH && fd >= 0) {
+    close(fd);
+  }
+}
+
+uint64_t Output::ticket() {
+  std::lock_guard<std::mutex> lock(_lock);
+  return tickets++;
+}
+
+int Output::wait(uint64_t turn) {
+  std::unique_lock<std::mutex> lock(_lock);
+  _cv.wait(lock, [this, turn]() { return serving == turn; });
+  if (fd >= 0) {
+    return fd;
+  }
+  if (kind == STDOUT) {
+    fd = STDOUT_FILENO;
+    return fd;
+  }
+  // opening a named pipe blocks till its reader comes. others wait for
+  // their turn anyway, only don't keep them from taking one meanwhile.
+  lock.unlock();
+  int _fd = open(where.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                 0644);
+  lock.lock();
+  if (_fd < 0) {
+    throw std::runtime_error("Can't open " + where + ": " + strerror(errno));
+  }
+  fd = _fd;
+  return fd;
+}
+
+void Output::done(uint64_t turn) {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    serving = turn + 1;
+  }
+  _cv.notify_all();
+}
+
+int Output::spawn(const std::string &name, int &pid) {
+  // built before fork, the child only calls what's safe after it
+  std::vector<std::string> env;
+  for (char **e = environ; *e; ++e) {
+    if (strncmp(*e, "UPLOAD_NAME=", 12) != 0) {
+      env.emplace_back(*e);
+    }
+  }
+  env.push_back("UPLOAD_NAME=" + name);
+  std::vector<char *> envp;
+  for (auto &e : env) {
+    envp.push_back(&e[0]);
+  }
+  envp.push_back(nullptr);
+  const char *argv[] = {"sh", "-c", where.c_str(), nullptr};
+
+  int fds[2];
+  // close-on-exec, so other commands started don't keep this one's stdin
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    throw std::runtime_error(std::string("Can't make a pipe: ")
+                                 + strerror(errno));
+  }
+  pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    throw std::runtime_error(std::string("Can't start command: ")
+                                 + strerror(errno));
+  }
+  if (pid == 0) {
+    dup2(fds[0], STDIN_FILENO);
+    execve("/bin/sh", (char *const *) argv, envp.data());
+    _exit(127);
+  }
+  close(fds[0]);
+  return fds[1];
+}
+
+Reorder::Reorder(std::shared_ptr<Output> _out,
+                 const std::string &_name,
+                 uint32_t _piece_size,
+                 uint64_t _limit)
+    : out(std::move(_out)),
+      name(_name),
+      piece_size(_piece_size),
+      // the piece the prefix continues with always fits
+      limit(std::max<uint64_t>(_limit, _piece_size)) {}
+
+void Reorder::start() {
+  if (out->get_kind() != Output::COMMAND) {
+    turn = out->ticket();
+  }
+  auto self(shared_from_this());
+  std::thread([this, self]() { _run(); }).detach();
+}
+
+bool Reorder::_write_all(int fd, const std::string &data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    auto n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+void Reorder::_run() {
+  int fd = -1;
+  int pid = -1;
+  bool broken = false;
+  try {
+    if (out->get_kind() == Output::COMMAND) {
+      fd = out->spawn(name, pid);
+    } else {
+      fd = out->wait(turn);
+    }
+    LOG(INFO) << "Delivering " << name << ".";
+  }
+  catch (const std::runtime_error &e) {
+    LOG(ERROR) << "Can't deliver " << name << ": " << e.what();
+    broken = true;
+  }
+
+  for (;;) {
+    std::string data;
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _cv.wait(lock, [this]() { return aborted || ended || !ready.empty(); });
+      if (aborted || ready.empty()) {
+        break;
+      }
+      data = std::move(ready.front());
+      ready.pop_front();
+    }
+    if (!broken && !_write_all(fd, data)) {
+      LOG(ERROR) << "Delivery of " << name << " broke: " << strerror(errno);
+      // the rest is dropped, so the upload isn't held up
+      broken = true;
+    }
+    std::lock_guard<std::mutex> lock(_lock);
+    delivered += data.size();
+  }
+
+  bool ok;
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    ok = !aborted;
+  }
+  if (out->get_kind() == Output::COMMAND) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (pid > 0) {
+      if (!ok) {
+        // what it got is not the whole file
+        kill(pid, SIGTERM);
+      }
+      int status = 0;
+      waitpid(pid, &status, 0);
+      if (ok && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        LOG(WARNING) << "Command consuming " << name << " failed.";
+      }
+    }
+  } else {
+    out->done(turn);
+  }
+  if (!ok) {
+    LOG(WARNING) << "Delivery of " << name << " aborted.";
+  } else if (!broken) {
+    LOG(INFO) << "Delivery of " << name << " finished, " << delivered
+              << " bytes.";
+  }
+}
+
+bool Reorder::accept(uint32_t order, const std::string &piece, uint32_t size) {
+  std::lock_guard<std::mutex> lock(_lock);
+  if (ended || aborted || order < next
+      || pending.find(order) != pending.end()) {
+    return true;
+  }
+  if ((uint64_t) order * piece_size + size > delivered + limit) {
+    return false;
+  }
+  std::string data = piece.substr(0, size);
+  if (order != next) {
+    pending.emplace(order, std::move(data));
+    return true;
+  }
+  ready.push_back(std::move(data));
+  ++next;
+  for (auto it = pending.find(next); it != pending.end();
+       it = pending.find(next)) {
+    ready.push_back(std::move(it->second));
+    pending.erase(it);
+    ++next;
+  }
+  _cv.notify_one();
+  return true;
+}
+
+void Reorder::end() {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    ended = true;
+  }
+  _cv.notify_one();
+}
+
+void Reorder::abort() {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    aborted = true;
+  }
+  _cv.notify_one();
+}
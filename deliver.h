@@ -0,0 +1,169 @@
+#ifndef FILE_TRANSFER_DELIVER_H_
+#define FILE_TRANSFER_DELIVER_H_
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+/// \file deliver.h
+/// \brief Header for passing received files on in order while uploading
+/// \note All things are in `deliver` namespace
+/** DELIVERY
+ * Pieces arrive in any order. A Reorder keeps those ahead of the
+ * contiguous prefix, and a thread of its own writes the prefix to the
+ * Output as it grows, so a consumer reads the file from its beginning
+ * long before the upload finishes. Pieces are kept for at most @limit
+ * bytes past what's delivered; one further ahead is refused, and the
+ * client sends it again later. A slow consumer so slows down the upload
+ * rather than filling the memory.
+ * Outputs:
+ * -         stdout. files are delivered one after another.
+ * |COMMAND  COMMAND is run by /bin/sh for each file, with the file on its
+ *           stdin and its name in the environment variable UPLOAD_NAME.
+ *           it's killed if the upload of the file doesn't finish.
+ * PATH      a named pipe (or any file), opened once the first file is
+ *           delivered. files are delivered one after another.
+ */
+
+namespace deliver {
+
+/// \class Output
+/// \brief Class to hold where files are delivered
+/// \detail files delivered to stdout or a path take turns by the order
+///         their Reorder is opened.
+/// \datamember kind_t kind
+///             STDOUT, PATH or COMMAND
+/// \datamember std::string where
+///             the path or the command
+/// \datamember int fd
+///             descriptor of stdout or the path, -1 if not opened yet
+/// \datamember uint64_t tickets
+///             turns handed out
+/// \datamember uint64_t serving
+///             turn delivering now
+/// \datamember std::mutex _lock
+///             lock of @fd and the turns
+class Output {
+ public:
+  enum kind_t { STDOUT, PATH, COMMAND };
+ private:
+  kind_t kind;
+  std::string where;
+  int fd = -1;
+  uint64_t tickets = 0;
+  uint64_t serving = 0;
+  std::mutex _lock;
+  std::condition_variable _cv;
+ public:
+  /// \brief constructor
+  /// \param spec -, |COMMAND or PATH, see DELIVERY
+  /// \throw std::invalid_argument if the command is empty
+  explicit Output(const std::string &spec);
+
+  Output(const Output &) = delete;
+
+  ~Output();
+
+  kind_t get_kind() const { return kind; }
+
+  /// \brief take a turn, for files delivered one after another
+  uint64_t ticket();
+
+  /// \brief block until it's the turn
+  /// \return descriptor to write to
+  /// \throw std::runtime_error if the path can't be opened
+  int wait(uint64_t turn);
+
+  /// \brief end the turn
+  void done(uint64_t turn);
+
+  /// \brief start the command for a file
+  /// \param pid set to the process started
+  /// \return descriptor of its stdin
+  /// \throw std::runtime_error if it can't be started
+  int spawn(const std::string &name, int &pid);
+};
+
+/// \class Reorder
+/// \brief Class to deliver a file in order while its pieces arrive
+/// \detail see DELIVERY. accept, end and abort are called on the io
+///         thread, writing to the Output is on a thread of its own.
+/// \datamember std::shared_ptr<Output> out
+///             where the file is delivered
+/// \datamember std::string name
+///             file name told to the Output
+/// \datamember uint32_t piece_size
+///             transfer file piece size
+/// \datamember uint64_t limit
+///             bytes past what's delivered pieces are kept within
+/// \datamember uint64_t turn
+///             turn taken of @out
+/// \datamember std::map<uint32_t, std::string> pending
+///             pieces ahead of the prefix, by order
+/// \datamember std::deque<std::string> ready
+///             pieces of the prefix not delivered yet
+/// \datamember uint32_t next
+///             order of the piece the prefix continues with
+/// \datamember uint64_t delivered
+///             bytes written to @out
+/// \datamember bool ended
+///             every piece is accepted
+/// \datamember bool aborted
+///             the upload of the file didn't finish
+/// \datamember std::mutex _lock
+///             lock of the data members above
+class Reorder : public std::enable_shared_from_this<Reorder> {
+ private:
+  std::shared_ptr<Output> out;
+  std::string name;
+  uint32_t piece_size;
+  uint64_t limit;
+  uint64_t turn = 0;
+  std::map<uint32_t, std::string> pending;
+  std::deque<std::string> ready;
+  uint32_t next = 0;
+  uint64_t delivered = 0;
+  bool ended = false;
+  bool aborted = false;
+  std::mutex _lock;
+  std::condition_variable _cv;
+
+  /// \brief write the prefix as it grows, till the end
+  void _run();
+
+  /// \brief write all the data, unless @fd is broken
+  /// \return false if it can't be written
+  static bool _write_all(int fd, const std::string &data);
+ public:
+  /// \brief constructor
+  /// \note call start() to begin delivering
+  Reorder(std::shared_ptr<Output> _out,
+          const std::string &_name,
+          uint32_t _piece_size,
+          uint64_t _limit);
+
+  Reorder(const Reorder &) = delete;
+
+  /// \brief start the thread delivering the file
+  void start();
+
+  /// \brief take a piece received
+  /// \return false if it's too far ahead of what's delivered. pieces
+  ///         taken already are taken again.
+  bool accept(uint32_t order, const std::string &piece, uint32_t size);
+
+  /// \brief every piece is accepted, deliver the rest and close
+  void end();
+
+  /// \brief the upload of the file failed, stop delivering it
+  void abort();
+};
+
+}
+
+#endif //FILE_TRANSFER_DELIVER_H_
@@ -4,8 +4,36 @@
 
 #include "encrypt.h"
 
+#include <algorithm>
+
 using namespace encrypt;
 
+/// \brief run counter mode over data, in segments on the pool if large
+/// \detail every segment runs on a copy of the key schedule, as a cipher
+///         object may keep scratch space of its own.
+static void _ctr(const CryptoPP::AES::Encryption &aes,
+                 const byte *iv,
+                 const byte *in,
+                 byte *out,
+                 size_t length,
+                 parallel::Pool *pool) {
+  size_t segments = (length + CTR_SEGMENT - 1) / CTR_SEGMENT;
+  if (!pool || segments <= 2) {
+    CryptoPP::AES::Encryption _aes(aes);
+    CryptoPP::CTR_Mode_ExternalCipher::Encryption ctr(_aes, iv);
+    ctr.ProcessData(out, in, length);
+    return;
+  }
+  pool->run(segments, [&](size_t i) {
+    size_t offset = i * CTR_SEGMENT;
+    CryptoPP::AES::Encryption _aes(aes);
+    CryptoPP::CTR_Mode_ExternalCipher::Encryption ctr(_aes, iv);
+    ctr.Seek(offset);
+    ctr.ProcessData(out + offset, in + offset,
+                    std::min(CTR_SEGMENT, length - offset));
+  });
+}
+
 // Encrypter implementation
 
 AESEncrypter::AESEncrypter(const string &_key) {
@@ -18,21 +46,30 @@ AESEncrypter::AESEncrypter(const string &_key) {
   keygen.DeriveKey(key, 32, (byte *) _key.c_str(), _key.size(), salt, 32);
 
   // constrcut aes related object
-  CryptoPP::AES::Encryption _aes(key, 32);
-  aesEncryption = _aes;
-  CryptoPP::ECB_Mode_ExternalCipher::Encryption _ecb(aesEncryption, iv);
+  aesEncryption = std::make_shared<CryptoPP::AES::Encryption>(key, 32);
+  CryptoPP::ECB_Mode_ExternalCipher::Encryption _ecb(*aesEncryption, iv);
+  ecbEncryption = _ecb;
+}
+
+AESEncrypter::AESEncrypter(derived_t, const string &_derived) {
+  memset(key, 0, sizeof(key));
+  memcpy(key, _derived.data(), std::min<size_t>(_derived.size(), 32));
+
+  aesEncryption = std::make_shared<CryptoPP::AES::Encryption>(key, 32);
+  CryptoPP::ECB_Mode_ExternalCipher::Encryption _ecb(*aesEncryption, iv);
   ecbEncryption = _ecb;
 }
 
-AESEncrypter::AESEncrypter(AESEncrypter &a) {
+AESEncrypter::AESEncrypter(const AESEncrypter &a) {
   // copy the key
   memcpy(key, a.key, 33);
 
-  // make another aes related object
-  CryptoPP::AES::Encryption _aes(key, 32);
-  aesEncryption = _aes;
-  CryptoPP::ECB_Mode_ExternalCipher::Encryption _ecb(aesEncryption, iv);
+  // copy the key schedule, and make another mode object over it
+  aesEncryption = std::make_shared<CryptoPP::AES::Encryption>(
+      *a.aesEncryption);
+  CryptoPP::ECB_Mode_ExternalCipher::Encryption _ecb(*aesEncryption, iv);
   ecbEncryption = _ecb;
+  pool = a.pool;
 }
 
 void AESEncrypter::showkey() {
@@ -74,6 +111,17 @@ string AESEncrypter::encrypt(const string &plain) {
   return encrypted;
 }
 
+void AESEncrypter::parallelize(std::shared_ptr<parallel::Pool> _pool) {
+  pool = std::move(_pool);
+}
+
+string AESEncrypter::encrypt_piece(const byte *_iv, const string &plain) {
+  string encrypted(plain.size(), '\0');
+  _ctr(*aesEncryption, _iv, (const byte *) plain.data(),
+       (byte *) &encrypted[0], plain.size(), pool.get());
+  return encrypted;
+}
+
 // Decrypter implementation
 
 // Implementation is very likely to Encrypter
@@ -83,19 +131,31 @@ AESDecrypter::AESDecrypter(const string &_key) {
   CryptoPP::Scrypt keygen;
   keygen.DeriveKey(key, 32, (byte *) _key.c_str(), _key.size(), salt, 32);
 
-  CryptoPP::AES::Decryption _aes(key, 32);
-  aesDecryption = _aes;
-  CryptoPP::ECB_Mode_ExternalCipher::Decryption _ecb(aesDecryption, iv);
+  aesDecryption = std::make_shared<CryptoPP::AES::Decryption>(key, 32);
+  CryptoPP::ECB_Mode_ExternalCipher::Decryption _ecb(*aesDecryption, iv);
+  ecbDecryption = _ecb;
+  ctrEncryption = std::make_shared<CryptoPP::AES::Encryption>(key, 32);
+}
+
+AESDecrypter::AESDecrypter(derived_t, const string &_derived) {
+  memset(key, 0, sizeof(key));
+  memcpy(key, _derived.data(), std::min<size_t>(_derived.size(), 32));
+
+  aesDecryption = std::make_shared<CryptoPP::AES::Decryption>(key, 32);
+  CryptoPP::ECB_Mode_ExternalCipher::Decryption _ecb(*aesDecryption, iv);
   ecbDecryption = _ecb;
+  ctrEncryption = std::make_shared<CryptoPP::AES::Encryption>(key, 32);
 }
 
-AESDecrypter::AESDecrypter(AESDecrypter &a) {
+AESDecrypter::AESDecrypter(const AESDecrypter &a) {
   memcpy(key, a.key, 33);
 
-  CryptoPP::AES::Decryption _aes(key, 32);
-  aesDecryption = _aes;
-  CryptoPP::ECB_Mode_ExternalCipher::Decryption _ecb(aesDecryption, iv);
+  aesDecryption = std::make_shared<CryptoPP::AES::Decryption>(
+      *a.aesDecryption);
+  CryptoPP::ECB_Mode_ExternalCipher::Decryption _ecb(*aesDecryption, iv);
   ecbDecryption = _ecb;
+  ctrEncryption = a.ctrEncryption;
+  pool = a.pool;
 }
 
 void AESDecrypter::showkey() {
@@ -134,4 +194,17 @@ string AESDecrypter::decrypt(const string &cipher) {
 
   return decrypted;
 
-}
\ No newline at end of file
+}
+
+void AESDecrypter::parallelize(std::shared_ptr<parallel::Pool> _pool) {
+  pool = std::move(_pool);
+}
+
+string AESDecrypter::decrypt_piece(const byte *_iv,
+                                   const char *cipher,
+                                   size_t length) {
+  string decrypted(length, '\0');
+  _ctr(*ctrEncryption, _iv, (const byte *) cipher,
+       (byte *) &decrypted[0], length, pool.get());
+  return decrypted;
+}
@@ -9,6 +9,7 @@
 #include <string>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 
 #include <boost/io/ios_state.hpp>
 
@@ -21,14 +22,28 @@
 
 #include "./third_party/easyloggingpp/src/easylogging++.h"
 
+#include "parallel.h"
+
 /// \file encrypt.h
 /// \brief Header for encrypt related functions
 /// \note All things are in `encrypt` namespace
+/** PIECE CIPHER
+ * File pieces are encrypted with AES-256-CTR instead of ECB. Any part of
+ * the keystream can be computed without the part before it, so a large
+ * piece is split into segments of CTR_SEGMENT bytes which are encrypted
+ * (or decrypted) at the same time on a parallel::Pool. The result is the
+ * same however a piece is split, so both sides split pieces their own way.
+ * The IV must never be used for two different pieces under one key.
+ */
 
 namespace encrypt {
 
 const unsigned char salt[33] = "qwertyuiopasdfghjklzxcvbnm123456";
 
+/// \brief bytes of a piece encrypted as one part. pieces no larger than
+///        two of them are encrypted on the calling thread alone.
+const size_t CTR_SEGMENT = 256 * 1024;
+
 typedef unsigned char byte;
 
 using std::string;
@@ -70,6 +85,11 @@ inline string _cryptopp_Scrypt(const string &pass) {
   return string((char *) digest, 32);
 }
 
+/// \brief tag telling a constructor the key given is computed by
+///        _cryptopp_Scrypt already, so it's not derived again
+struct derived_t {};
+constexpr derived_t derived{};
+
 /// \class AESEncrypter
 /// \brief Class to perform data encrypt
 /// \detail This class mow uses AES-256-ECB as encrypt algorithm.
@@ -78,11 +98,16 @@ inline string _cryptopp_Scrypt(const string &pass) {
 /// \datamember byte iv[CryptoPP::AES::BLOCKSIZE]
 ///             Initialization Vector.
 ///             See <https://en.wikipedia.org/wiki/Initialization_vector>
-/// \datamember CryptoPP::AES::Encryption aesEncryption
-///             abstract aes encrypt instance
+/// \datamember std::shared_ptr<CryptoPP::AES::Encryption> aesEncryption
+///             abstract aes encrypt instance, holding the expanded key
+///             schedule. copies copy the expanded schedule rather than
+///             expand it again.
 /// \datamember CryptoPP::ECB_Mode_ExternalCipher::Encryption ecbEncryption
-///             abstract block cipher mode instance_
+///             abstract block cipher mode instance_, one of each copy
 ///             See <https://en.wikipedia.org/wiki/Block_cipher_mode_of_operation#Electronic_Codebook_(ECB)>
+/// \datamember std::shared_ptr<parallel::Pool> pool
+///             pool encrypting segments of large pieces, shared by copies.
+///             nullptr to encrypt them on the calling thread.
 /// \todo upgrade to more modern encrypt method like
 ///       AES-128-GCM or chacha20-poly1305
 class AESEncrypter {
@@ -92,19 +117,26 @@ class AESEncrypter {
   byte iv[CryptoPP::AES::BLOCKSIZE] =
       {0x45, 0x4e, 0x43, 0x52, 0x59, 0x50, 0x54, 0x44, 0x45, 0x43, 0x52, 0x59,
        0x50, 0x54};
-  CryptoPP::AES::Encryption aesEncryption;
+  std::shared_ptr<CryptoPP::AES::Encryption> aesEncryption;
   CryptoPP::ECB_Mode_ExternalCipher::Encryption ecbEncryption;
+  std::shared_ptr<parallel::Pool> pool;
 
  public:
   /// \brief constructor
   /// \param __key key plain key
   AESEncrypter(const string &_key);
 
+  /// \brief constructor
+  /// \param _derived 32 bytes computed key
+  AESEncrypter(derived_t, const string &_derived);
+
   /// \brief copy constructor
+  /// \detail the key schedule is copied rather than expanded again, so a
+  ///         copy for each thread or connection is cheap.
   /// \todo first 16 bytes encrypt/decrypt not working right.
   ///       now add 16bytes dummy data as head to bypass this problem.
   ///       further investigation required
-  AESEncrypter(AESEncrypter &a);
+  AESEncrypter(const AESEncrypter &a);
 
   /// \brief @debug show the using key
   void showkey();
@@ -116,6 +148,15 @@ class AESEncrypter {
   /// \param plain unencrypted data
   /// \return encrypted data
   string encrypt(const string &plain);
+
+  /// \brief encrypt segments of large pieces on the pool from now on
+  void parallelize(std::shared_ptr<parallel::Pool> _pool);
+
+  /// \brief perform piece encrypt, see PIECE CIPHER
+  /// \param iv CryptoPP::AES::BLOCKSIZE bytes, unique to the piece
+  /// \param plain unencrypted piece
+  /// \return encrypted piece, of the same length
+  string encrypt_piece(const byte *iv, const string &plain);
 };
 
 /// \class AESDecrypter
@@ -125,10 +166,18 @@ class AESEncrypter {
 ///             computed key to actually do encrypt
 /// \datamember byte iv[CryptoPP::AES::BLOCKSIZE]
 ///             Initialization Vector.
-/// \datamember CryptoPP::AES::Encryption aesEncryption
-///             abstract aes encrypt instance
-/// \datamember CryptoPP::ECB_Mode_ExternalCipher::Encryption ecbEncryption
-///             abstract block cipher mode instance
+/// \datamember std::shared_ptr<CryptoPP::AES::Decryption> aesDecryption
+///             abstract aes decrypt instance, holding the expanded key
+///             schedule. copies copy the expanded schedule, a cipher object
+///             isn't safe to use from two threads.
+/// \datamember CryptoPP::ECB_Mode_ExternalCipher::Decryption ecbDecryption
+///             abstract block cipher mode instance, one of each copy
+/// \datamember std::shared_ptr<CryptoPP::AES::Encryption> ctrEncryption
+///             aes encrypt instance of the same key, as counter mode runs
+///             the cipher forward to decrypt too. shared by copies, as it's
+///             only copied from: every piece runs on a copy of it.
+/// \datamember std::shared_ptr<parallel::Pool> pool
+///             pool decrypting segments of large pieces, shared by copies
 /// \todo upgrade to more modern encrypt method like
 ///       AES-128-GCM or chacha20-poly1305
 class AESDecrypter {
@@ -138,19 +187,26 @@ class AESDecrypter {
   byte iv[CryptoPP::AES::BLOCKSIZE] =
       {0x45, 0x4e, 0x43, 0x52, 0x59, 0x50, 0x54, 0x44, 0x45, 0x43, 0x52, 0x59,
        0x50, 0x54};
-  CryptoPP::AES::Decryption aesDecryption;
+  std::shared_ptr<CryptoPP::AES::Decryption> aesDecryption;
   CryptoPP::ECB_Mode_ExternalCipher::Decryption ecbDecryption;
+  std::shared_ptr<CryptoPP::AES::Encryption> ctrEncryption;
+  std::shared_ptr<parallel::Pool> pool;
 
  public:
   /// \brief constructor
   /// \param __key key plain key
   AESDecrypter(const string &_key);
 
+  /// \brief constructor
+  /// \param _derived 32 bytes computed key
+  AESDecrypter(derived_t, const string &_derived);
+
   /// \brief copy constructor
+  /// \detail the key schedule is copied rather than expanded again.
   /// \todo first 16 bytes encrypt/decrypt not working right.
   ///       now add 16bytes dummy data as head to bypass this problem.
   ///       further investigation required
-  AESDecrypter(AESDecrypter &a);
+  AESDecrypter(const AESDecrypter &a);
 
   /// \brief @debug show the using key
   void showkey();
@@ -162,6 +218,16 @@ class AESDecrypter {
   /// \param cipher encrypted data
   /// \return decrypted data
   string decrypt(const string &cipher);
+
+  /// \brief decrypt segments of large pieces on the pool from now on
+  void parallelize(std::shared_ptr<parallel::Pool> _pool);
+
+  /// \brief perform piece decrypt, see PIECE CIPHER
+  /// \param iv the iv the piece is encrypted with
+  /// \param cipher encrypted piece
+  /// \param length length of the encrypted piece
+  /// \return decrypted piece
+  string decrypt_piece(const byte *iv, const char *cipher, size_t length);
 };
 
 }
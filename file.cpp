@@ -4,6 +4,27 @@
 
 #include "file.h"
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/sysmacros.h>
+#endif
+#endif
+
 using namespace file;
 
 using std::string;
@@ -96,30 +117,379 @@ int file_reader::read(char *buffer, std::uintmax_t &offset_) {
   }
 }
 
+int file_reader::read_at(char *buffer, const std::uintmax_t &offset_) {
+
+  std::lock_guard<std::mutex> lock(_lock);
+
+  if (!_file.is_open()) {
+    return 0;
+  }
+
+  // remember where read stopped, including whether it hit the end
+  bool eof = _file.eof();
+  _file.clear();
+  auto pos = _file.tellg();
+
+  _file.seekg(offset_);
+  _file.read(buffer, buff_s);
+  int length = _file.gcount();
+
+  // go back to where read stopped
+  _file.clear();
+  _file.seekg(pos);
+  if (eof) {
+    _file.setstate(std::ios::eofbit);
+  }
+
+  return length;
+}
+
 int file_reader::read_all(char *buffer) {
   _file.read(buffer, file_size);
   return 0;
 }
 
-file_writer::file_writer(string _file_name, const std::uintmax_t &file_size) {
+stream_reader::stream_reader(const string &_file_name,
+                             const int &buff_size,
+                             const std::uintmax_t &_limit)
+    : in(&std::cin), buff_s(buff_size), limit(_limit) {
+  if (_file_name != "-") {
+    _file.open(_file_name, std::ios::in | std::ios::binary);
+    if (!_file.is_open()) {
+      LOG(ERROR) << "Failed in reading file: " << _file_name
+                 << " can't be opened.";
+      exit(1);
+    }
+    in = &_file;
+  }
+  LOG(INFO) << "Stream opened for reading: " << _file_name;
+}
 
-  // get remaining space of current directory
-  fs::space_info space = fs::space(fs::current_path());
+int stream_reader::read(char *buffer, std::uintmax_t &offset_) {
+  std::lock_guard<std::mutex> lock(_read_lock);
+  if (eof) {
+    return 0;
+  }
+  // blocks until the whole piece arrives, or the writer closed the pipe
+  in->read(buffer, buff_s);
+  int length = in->gcount();
+  if (length < (int) buff_s) {
+    eof = true;
+  }
+  if (length == 0) {
+    return 0;
+  }
+  offset_ = offset;
+  offset += length;
+  {
+    std::lock_guard<std::mutex> _l(_lock);
+    kept.emplace(offset_, string(buffer, length));
+    kept_bytes += length;
+  }
+  return length;
+}
 
-  // throw exception when no enough space.
-  if (space.available < file_size) {
-    LOG(ERROR) << "Failed in writing file: No enough space.";
-    throw NoEnoughSpace();
+int stream_reader::read_at(char *buffer, const std::uintmax_t &offset_) {
+  std::lock_guard<std::mutex> lock(_lock);
+  auto it = kept.find(offset_);
+  if (it == kept.end()) {
+    throw std::runtime_error("Piece at " + std::to_string(offset_)
+                                 + " of the stream is released.");
+  }
+  memcpy(buffer, it->second.data(), it->second.size());
+  return it->second.size();
+}
+
+std::uintmax_t stream_reader::get_size() {
+  std::lock_guard<std::mutex> lock(_read_lock);
+  return offset;
+}
+
+bool stream_reader::ready() {
+  std::lock_guard<std::mutex> lock(_lock);
+  return kept_bytes + buff_s <= limit;
+}
+
+void stream_reader::release(const std::uintmax_t &offset_) {
+  std::lock_guard<std::mutex> lock(_lock);
+  auto it = kept.find(offset_);
+  if (it != kept.end()) {
+    kept_bytes -= it->second.size();
+    kept.erase(it);
+  }
+}
+
+bool file::is_stream(const string &_file_name) {
+  if (_file_name == "-") {
+    return true;
+  }
+  std::error_code ec;
+  auto status = fs::status(_file_name, ec);
+  return !ec && fs::exists(status) && !fs::is_regular_file(status)
+      && !fs::is_directory(status);
+}
+
+write_options::prealloc_t write_options::parse_prealloc(const string &name) {
+  if (name == "none") {
+    return NONE;
+  } else if (name == "unwritten") {
+    return UNWRITTEN;
+  } else if (name == "full") {
+    return FULL;
+  }
+  throw std::invalid_argument("Unknown preallocation mode: " + name);
+}
+
+write_options::durability_t write_options::parse_durability(
+    const string &name) {
+  if (name == "none") {
+    return NO_SYNC;
+  } else if (name == "end") {
+    return AT_END;
+  } else if (name == "periodic") {
+    return PERIODIC;
+  } else if (name == "ack") {
+    return BEFORE_ACK;
+  }
+  throw std::invalid_argument("Unknown durability mode: " + name);
+}
+
+metrics::Histogram &file::sync_histogram() {
+  static metrics::Histogram h;
+  return h;
+}
+
+static std::atomic<uint64_t> _sync_count(0);
+static std::atomic<uint64_t> _sync_nanoseconds(0);
+
+uint64_t file::sync_count() {
+  return _sync_count.load(std::memory_order_relaxed);
+}
+
+uint64_t file::sync_nanoseconds() {
+  return _sync_nanoseconds.load(std::memory_order_relaxed);
+}
+
+/// \class sync_worker
+/// \brief Background thread running syncs one by one, in the order queued
+class sync_worker {
+ private:
+  std::deque<std::function<void()>> tasks;
+  std::mutex _lock;
+  std::condition_variable _cv;
+  bool stop = false;
+  std::thread th;
+
+  void _run() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(_lock);
+        _cv.wait(lock, [this]() { return stop || !tasks.empty(); });
+        if (tasks.empty()) {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop_front();
+      }
+      task();
+    }
+  }
+ public:
+  sync_worker() : th([this]() { _run(); }) {}
+
+  /// \note syncs still queued run before it returns
+  ~sync_worker() {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      stop = true;
+    }
+    _cv.notify_all();
+    th.join();
   }
 
+  void post(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      tasks.push_back(std::move(task));
+    }
+    _cv.notify_one();
+  }
+};
+
+static sync_worker &_syncer() {
+  static sync_worker w;
+  return w;
+}
+
+/// \brief fsync, or what the platform has for it
+static int _fsync(int fd) {
+  #ifdef WIN32
+  return _commit(fd);
+  #else
+  return fsync(fd);
+  #endif
+}
+
+/// \brief descriptor to sync a file through, and what syncing it cost
+/// \note the descriptor is closed, and the cost logged, after the last
+///       queued sync of the file.
+struct file_writer::sync_state {
+  int fd;
+  string name;
+  uint64_t syncs = 0;
+  std::chrono::nanoseconds spent{0};
+
+  sync_state(int _fd, string _name) : fd(_fd), name(std::move(_name)) {}
+
+  ~sync_state() {
+    #ifndef WIN32
+    ::close(fd);
+    #endif
+    if (syncs > 0) {
+      LOG(INFO) << "Synced " << name << " " << syncs << " times in "
+                << std::chrono::duration<double>(spent).count()
+                << " seconds.";
+    }
+  }
+
+  /// \brief run a sync call and count its cost
+  /// \return false if it failed
+  bool run(const std::function<int(int)> &call) {
+    auto start = std::chrono::steady_clock::now();
+    bool ok = call(fd) == 0;
+    auto used = std::chrono::steady_clock::now() - start;
+    sync_histogram().record(start);
+    spent += std::chrono::duration_cast<std::chrono::nanoseconds>(used);
+    ++syncs;
+    _sync_count.fetch_add(1, std::memory_order_relaxed);
+    _sync_nanoseconds.fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(used).count(),
+        std::memory_order_relaxed);
+    if (!ok) {
+      LOG(ERROR) << "Failed syncing " << name << ": " << strerror(errno);
+    }
+    return ok;
+  }
+};
+
+#ifndef WIN32
+/// \brief write zeros over the file and sync them, so its blocks are
+///        initialized and writing pieces later doesn't convert extents
+/// \return 0, or errno of what failed
+static int _zero_fill(int fd, const std::uintmax_t &file_size) {
+  std::vector<char> zeros(1 << 20, 0);
+  std::uintmax_t at = 0;
+  while (at < file_size) {
+    size_t len = (size_t) std::min<std::uintmax_t>(zeros.size(),
+                                                   file_size - at);
+    ssize_t n = ::pwrite(fd, zeros.data(), len, (off_t) at);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    at += n;
+  }
+  return _fsync(fd) == 0 ? 0 : errno;
+}
+
+/// \brief create the file and reserve its space
+/// \return false if the file can't be created, or there's no enough space
+static bool _preallocate(const string &_file_name,
+                         const std::uintmax_t &file_size,
+                         write_options::prealloc_t mode) {
+  int fd = ::open(_file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed in creating file: " << strerror(errno);
+    return false;
+  }
+  int err = 0;
+  if (file_size > 0) {
+    #ifdef __linux__
+    if (mode == write_options::UNWRITTEN) {
+      err = fallocate(fd, 0, 0, (off_t) file_size) == 0 ? 0 : errno;
+    } else {
+      err = posix_fallocate(fd, 0, (off_t) file_size);
+    }
+    #else
+    err = mode == write_options::UNWRITTEN
+          ? EOPNOTSUPP : posix_fallocate(fd, 0, (off_t) file_size);
+    #endif
+    if (mode == write_options::FULL && err == 0) {
+      // reserved first, so a file not fitting fails fast
+      err = _zero_fill(fd, file_size);
+    }
+  }
+  ::close(fd);
+  if (err == ENOSPC) {
+    ::unlink(_file_name.c_str());
+    return false;
+  }
+  if (err != 0) {
+    // the file system can't do it, the file just grows as before
+    LOG(WARNING) << "Can't preallocate " << _file_name << ": "
+                 << strerror(err);
+  }
+  return true;
+}
+#endif
+
+file_writer::file_writer(string _file_name,
+                         const std::uintmax_t &file_size,
+                         const write_options &options)
+    : durability(options.durability), sync_every(options.sync_every) {
+
   #ifdef WIN32
   std::replace(_file_name.begin(), _file_name.end(), '/', '\\');
   #else
   std::replace(_file_name.begin(), _file_name.end(), '\\', '/');
   #endif
 
-  // open file in binary write mode
+  // get remaining space of the file system the file is placed
+  fs::path dir = fs::absolute(_file_name).parent_path();
+  std::error_code ec;
+  fs::space_info space = fs::space(dir, ec);
+
+  // throw exception when no enough space.
+  if (ec || space.available < file_size) {
+    LOG(ERROR) << "Failed in writing file: No enough space.";
+    throw NoEnoughSpace();
+  }
+
+  #ifdef WIN32
   _file.open(_file_name, std::ios::out | std::ios::binary);
+  #else
+  if (options.prealloc == write_options::NONE) {
+    // open file in binary write mode
+    _file.open(_file_name, std::ios::out | std::ios::binary);
+  } else {
+    // reserve the space before another file takes it
+    if (!_preallocate(_file_name, file_size, options.prealloc)) {
+      LOG(ERROR) << "Failed in writing file: No enough space.";
+      throw NoEnoughSpace();
+    }
+    // the file is created, open without truncating the reserved space
+    _file.open(_file_name, std::ios::in | std::ios::out | std::ios::binary);
+  }
+
+  if (_file.is_open() && (options.direct
+      || (options.direct_threshold && file_size >= options.direct_threshold))) {
+    _open_direct(_file_name);
+  }
+
+  if (_file.is_open() && durability != write_options::NO_SYNC) {
+    int fd = ::open(_file_name.c_str(), O_WRONLY);
+    if (fd >= 0) {
+      _sync = std::make_shared<sync_state>(fd, _file_name);
+    } else {
+      LOG(WARNING) << "Can't open " << _file_name << " for syncing: "
+                   << strerror(errno);
+    }
+  }
+  #endif
+
   // put the pointer to the begin of the file
   _file.seekp(0);
 
@@ -132,20 +502,32 @@ file_writer::file_writer(string _file_name, const std::uintmax_t &file_size) {
 }
 
 file_writer::~file_writer() {
-  if (_file.is_open()) {
-    // flush to make everything write into disk
-    _file.flush();
-    _file.close();
-    LOG(INFO) << "File writing closed.";
-  }
+  close();
 }
 
 void file_writer::close() {
+  std::lock_guard<std::mutex> lock(_lock);
+  #ifndef WIN32
+  if (_direct >= 0) {
+    ::close(_direct);
+    _direct = -1;
+  }
+  #endif
   if (_file.is_open()) {
+    // flush to make everything write into disk
     _file.flush();
     _file.close();
     LOG(INFO) << "File writing closed.";
   }
+  if (_sync && _dirty) {
+    // the file is closed when the sync is done
+    auto st = std::move(_sync);
+    _syncer().post([st]() {
+      st->run(_fsync);
+    });
+  }
+  _sync.reset();
+  _dirty = false;
 }
 
 int file_writer::write(const char *buffer,
@@ -159,10 +541,40 @@ int file_writer::write(const char *buffer,
     LOG(DEBUG) << "File not open";
     return 0;
   } else {
-    // move pointer to piece offset
-    _file.seekp(offset);
-    _file.write(buffer, len);
+    // the aligned part may go with direct I/O, the rest is buffered
+    int done = _write_direct(buffer, len, offset);
+    if (done < len) {
+      // move pointer to piece offset
+      _file.seekp(offset + done);
+      _file.write(buffer + done, len - done);
 //    LOG(TRACE) << "File write: offset " << offset << " block_size " << len;
+      if (!_file) {
+        // reset the stream so later pieces can still be written
+        _file.clear();
+        LOG(WARNING) << "File write failed at offset " << offset;
+        return 0;
+      }
+    }
+    _dirty = true;
+    _unsynced += len;
+    if (_sync && durability >= write_options::PERIODIC
+        && _unsynced >= sync_every) {
+      // start writeback of what's written so far in the background
+      _unsynced = 0;
+      _file.flush();
+      auto st = _sync;
+      _syncer().post([st]() {
+        st->run([](int fd) {
+          #ifdef __linux__
+          // wait for the last writeback, so at most two periods are dirty
+          return sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE
+              | SYNC_FILE_RANGE_WRITE);
+          #else
+          return _fsync(fd);
+          #endif
+        });
+      });
+    }
     return len;
   }
 }
@@ -171,16 +583,429 @@ int file_writer::write(const char *buffer,
 int file_writer::write(const string &buffer,
                        const int &len,
                        const std::uintmax_t &offset) {
+  return write(buffer.c_str(), len, offset);
+}
 
+void file_writer::sync(std::function<void(bool)> done) {
   std::lock_guard<std::mutex> lock(_lock);
+  if (_file.is_open()) {
+    _file.flush();
+  }
+  if (!_sync) {
+    done(!_file.fail());
+    return;
+  }
+  _dirty = false;
+  auto st = _sync;
+  _syncer().post([st, done]() {
+    done(st->run(_fsync));
+  });
+}
 
-  if (!(_file.is_open())) {
-    LOG(DEBUG) << "File not open";
+#ifndef WIN32
+/// \brief aligned buffers for direct I/O, kept for later writes of any file
+/// \note the pool keeps at most MAX_FREE buffers, others are freed.
+class aligned_pool {
+ private:
+  static const size_t MAX_FREE = 8;
+  std::vector<std::pair<void *, size_t>> free_list;
+  std::mutex _lock;
+ public:
+  ~aligned_pool() {
+    for (auto &b : free_list) {
+      free(b.first);
+    }
+  }
+
+  /// \brief get a buffer of at least @size bytes aligned to @align
+  /// \return nullptr if allocation failed
+  std::pair<void *, size_t> get(size_t size, size_t align) {
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      for (auto it = free_list.begin(); it != free_list.end(); ++it) {
+        if (it->second >= size && (uintptr_t) it->first % align == 0) {
+          auto b = *it;
+          free_list.erase(it);
+          return b;
+        }
+      }
+    }
+    void *p = nullptr;
+    if (posix_memalign(&p, align, size) != 0) {
+      return {nullptr, 0};
+    }
+    return {p, size};
+  }
+
+  /// \brief give back a buffer from get()
+  void put(std::pair<void *, size_t> b) {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (free_list.size() < MAX_FREE) {
+      free_list.push_back(b);
+    } else {
+      free(b.first);
+    }
+  }
+};
+
+static aligned_pool &_pool() {
+  static aligned_pool p;
+  return p;
+}
+#endif
+
+#if !defined(WIN32) && defined(O_DIRECT)
+/// \brief alignment of offset, length and memory direct I/O of the file
+///        needs
+/// \detail told by statx, or the logical block size of the device the
+///         file is on. 4096 if neither is available.
+static size_t _direct_align(int fd) {
+  size_t align = 0;
+  #if defined(__linux__) && defined(STATX_DIOALIGN)
+  struct statx stx{};
+  if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+      && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0) {
+    align = std::max(stx.stx_dio_offset_align, stx.stx_dio_mem_align);
+  }
+  #endif
+  #if defined(__linux__) && defined(BLKSSZGET)
+  struct stat st{};
+  if (align == 0 && fstat(fd, &st) == 0) {
+    string dev = "/dev/block/" + std::to_string(major(st.st_dev)) + ":"
+        + std::to_string(minor(st.st_dev));
+    int bd = ::open(dev.c_str(), O_RDONLY);
+    if (bd >= 0) {
+      int size = 0;
+      if (ioctl(bd, BLKSSZGET, &size) == 0 && size > 0) {
+        align = size;
+      }
+      ::close(bd);
+    }
+  }
+  #endif
+  return align > 0 ? align : 4096;
+}
+#endif
+
+void file_writer::_open_direct(const string &_file_name) {
+  #if !defined(WIN32) && defined(O_DIRECT)
+  int fd = ::open(_file_name.c_str(), O_WRONLY | O_DIRECT);
+  if (fd < 0) {
+    LOG(WARNING) << "Direct I/O not available for " << _file_name << ": "
+                 << strerror(errno) << ", writing through page cache.";
+    return;
+  }
+  _block = _direct_align(fd);
+  _direct = fd;
+  LOG(INFO) << "Writing " << _file_name << " with direct I/O, block "
+            << _block << ".";
+  #endif
+}
+
+int file_writer::_write_direct(const char *buffer,
+                               const int &len,
+                               const std::uintmax_t &offset) {
+  #ifndef WIN32
+  if (_direct < 0 || offset % _block) {
     return 0;
-  } else {
-    _file.seekp(offset);
-    _file.write(buffer.c_str(), len);
-//    LOG(TRACE) << "File write: offset " << offset << " block_size " << len;
-    return len;
   }
+  int aligned = len - len % _block;
+  if (aligned <= 0) {
+    return 0;
+  }
+  auto b = _pool().get(aligned, _block);
+  if (!b.first) {
+    return 0;
+  }
+  memcpy(b.first, buffer, aligned);
+  ssize_t done = 0;
+  while (done < aligned) {
+    ssize_t n = pwrite(_direct, (char *) b.first + done, aligned - done,
+                       (off_t) (offset + done));
+    if (n <= 0 || n % _block) {
+      break;
+    }
+    done += n;
+  }
+  _pool().put(b);
+  if (done == aligned) {
+    return aligned;
+  }
+  if (errno == EINVAL) {
+    // the file system rejects it after all, stop trying
+    LOG(WARNING) << "Direct write rejected: " << strerror(errno)
+                 << ", writing through page cache.";
+    ::close(_direct);
+    _direct = -1;
+  }
+  #endif
+  return 0;
+}
+
+synthetic_reader::synthetic_reader(pattern_t _pattern,
+                                   const std::uintmax_t &_size,
+                                   const int &buff_size)
+    : pattern(_pattern), size(_size), buff_s(buff_size) {
+  LOG(INFO) << "Generating " << size << " bytes of data.";
+}
+
+synthetic_reader::pattern_t synthetic_reader::parse_pattern(
+    const string &name) {
+  if (name == "zero") {
+    return ZERO;
+  } else if (name == "random") {
+    return RANDOM;
+  } else if (name == "compressible") {
+    return COMPRESSIBLE;
+  }
+  throw std::invalid_argument("Unknown data pattern: " + name);
+}
+
+/// \brief splitmix64 step, a fast hash good enough for test data
+static inline uint64_t _mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+int synthetic_reader::_fill(char *buffer, const std::uintmax_t &offset_) {
+  if (offset_ >= size) {
+    return 0;
+  }
+  int length = (int) std::min<std::uintmax_t>(buff_s, size - offset_);
+  if (pattern == ZERO) {
+    memset(buffer, 0, length);
+    return length;
+  }
+  const char letters[] = "ACGT";
+  for (int i = 0; i < length; i += 8) {
+    uint64_t word = _mix(offset_ + i);
+    int n = std::min(8, length - i);
+    if (pattern == RANDOM) {
+      memcpy(buffer + i, &word, n);
+    } else {
+      for (int j = 0; j < n; ++j) {
+        buffer[i + j] = letters[(word >> (j * 2)) & 3];
+      }
+    }
+  }
+  return length;
+}
+
+int synthetic_reader::read(char *buffer, std::uintmax_t &offset_) {
+  std::lock_guard<std::mutex> lock(_lock);
+  offset_ = offset;
+  int length = _fill(buffer, offset_);
+  offset += length;
+  return length;
+}
+
+int synthetic_reader::read_at(char *buffer, const std::uintmax_t &offset_) {
+  return _fill(buffer, offset_);
+}
+
+std::uintmax_t synthetic_reader::get_size() {
+  std::lock_guard<std::mutex> lock(_lock);
+  return size - offset;
+}
+
+coalescing_writer::coalescing_writer(std::shared_ptr<writer> inner,
+                                     const std::uintmax_t &_window)
+    : _inner(std::move(inner)), window(_window) {
+  ok = _inner->ok;
+}
+
+coalescing_writer::~coalescing_writer() {
+  close();
+}
+
+void coalescing_writer::close() {
+  std::vector<std::function<void()>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    if (!_flush_all(callbacks)) {
+      LOG(ERROR) << "Failed writing pieces kept for coalescing.";
+    }
+    _inner->close();
+  }
+  for (auto &callback : callbacks) {
+    callback();
+  }
+}
+
+bool coalescing_writer::_flush(std::uintmax_t start,
+                               std::vector<std::function<void()>> &callbacks,
+                               std::uintmax_t except) {
+  auto run = runs.find(start);
+  std::uintmax_t end = run->second;
+  string data;
+  data.reserve(end - start);
+  auto first = pending.find(start);
+  auto last = first;
+  for (; last != pending.end() && last->first < end; ++last) {
+    data += last->second;
+  }
+  bool ok = _inner->write(data, (int) data.size(), start) != 0;
+  if (written) {
+    for (auto it = first; it != last; ++it) {
+      if (it->first != except) {
+        callbacks.emplace_back(
+            [report = written, offset = it->first, ok]() {
+              report(offset, ok);
+            });
+      }
+    }
+  }
+  pending.erase(first, last);
+  runs.erase(run);
+  pending_bytes -= data.size();
+  return ok;
+}
+
+bool coalescing_writer::_flush_all(
+    std::vector<std::function<void()>> &callbacks,
+    std::uintmax_t except) {
+  bool all = true;
+  for (auto it = runs.begin(); it != runs.end();) {
+    auto start = (it++)->first;
+    all = _flush(start, callbacks, except) && all;
+  }
+  return all;
+}
+
+int coalescing_writer::write(const char *buffer,
+                             const int &len,
+                             const std::uintmax_t &offset) {
+  std::vector<std::function<void()>> callbacks;
+  int result;
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    result = _write(buffer, len, offset, callbacks);
+  }
+  for (auto &callback : callbacks) {
+    callback();
+  }
+  return result;
+}
+
+int coalescing_writer::_write(const char *buffer,
+                              const int &len,
+                              const std::uintmax_t &offset,
+                              std::vector<std::function<void()>> &callbacks) {
+  if (len <= 0 || (std::uintmax_t) len >= window) {
+    // nothing to gain from keeping it
+    return _inner->write(buffer, len, offset);
+  }
+  if (!pending.emplace(offset, string(buffer, len)).second) {
+    // a duplicate of a piece kept, told written along with it
+    return written ? KEPT : len;
+  }
+  pending_bytes += len;
+
+  // merge with the runs just before and after the piece
+  std::uintmax_t start = offset;
+  std::uintmax_t end = offset + len;
+  auto next = runs.find(end);
+  if (next != runs.end()) {
+    end = next->second;
+    runs.erase(next);
+  }
+  auto prev = runs.lower_bound(offset);
+  if (prev != runs.begin() && (--prev)->second == offset) {
+    start = prev->first;
+  }
+  runs[start] = end;
+
+  if (end - start >= window || pending_bytes >= window) {
+    bool ok = _flush(start, callbacks, offset);
+    if (pending_bytes >= window) {
+      // window is full of scattered pieces, write them as they are
+      _flush_all(callbacks);
+    }
+    return ok ? len : 0;
+  }
+  return written ? KEPT : len;
+}
+
+int coalescing_writer::write(const string &buffer,
+                             const int &len,
+                             const std::uintmax_t &offset) {
+  return write(buffer.c_str(), len, offset);
+}
+
+void coalescing_writer::sync(std::function<void(bool)> done) {
+  std::vector<std::function<void()>> callbacks;
+  bool ok;
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    ok = _flush_all(callbacks);
+  }
+  for (auto &callback : callbacks) {
+    callback();
+  }
+  if (!ok) {
+    done(false);
+    return;
+  }
+  _inner->sync(std::move(done));
+}
+
+bool coalescing_writer::on_written(
+    std::function<void(std::uintmax_t, bool)> _written) {
+  std::lock_guard<std::mutex> lock(_lock);
+  written = std::move(_written);
+  return true;
+}
+
+void coalescing_writer::flush() {
+  std::vector<std::function<void()>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _flush_all(callbacks);
+  }
+  for (auto &callback : callbacks) {
+    callback();
+  }
+}
+
+std::shared_ptr<writer> file::open_writer(const string &_file_name,
+                                          const std::uintmax_t &file_size,
+                                          const write_options &options) {
+  if (options.null_sink) {
+    LOG(INFO) << "Discarding pieces of " << _file_name;
+    return std::make_shared<null_writer>();
+  }
+  std::shared_ptr<writer> w =
+      std::make_shared<file_writer>(_file_name, file_size, options);
+  if (options.coalesce > 0) {
+    w = std::make_shared<coalescing_writer>(w, options.coalesce);
+  }
+  return w;
+}
+
+std::uintmax_t file::parse_size(const string &size) {
+  size_t pos;
+  double value;
+  try {
+    value = std::stod(size, &pos);
+  }
+  catch (const std::logic_error &e) {
+    throw std::invalid_argument("Not a size: " + size);
+  }
+  string suffix = size.substr(pos);
+  const string units = "KMGT";
+  if (suffix.size() > 1 || value < 0) {
+    throw std::invalid_argument("Not a size: " + size);
+  }
+  if (!suffix.empty()) {
+    auto unit = units.find((char) toupper(suffix[0]));
+    if (unit == string::npos) {
+      throw std::invalid_argument("Not a size: " + size);
+    }
+    for (size_t i = 0; i <= unit; ++i) {
+      value *= 1024;
+    }
+  }
+  return (std::uintmax_t) value;
 }
@@ -11,9 +11,17 @@
 #include <mutex>
 #include <stdexcept>
 #include <exception>
+#include <memory>
+#include <cstdint>
+#include <map>
+#include <functional>
+#include <limits>
+#include <vector>
 
 #include "./third_party/easyloggingpp/src/easylogging++.h"
 
+#include "metrics.h"
+
 /// \file file.h
 /// \brief Header for file related works
 /// \note All things are in `file` namespace
@@ -28,6 +36,42 @@ class NoEnoughSpace : public std::runtime_error {
       : std::runtime_error("No enough space for file to write.") {}
 };
 
+/// \class reader
+/// \brief Interface of data source to be split into pieces
+/// \note implementations should be thread safe.
+class reader {
+ public:
+  virtual ~reader() = default;
+
+  /// \brief read the next piece
+  /// \param buffer space to save the read data in.
+  ///         should have a size of at least piece size.
+  /// \param offset_ store the start byte number of the read piece.
+  /// \return length of the read data, 0 at the end.
+  virtual int read(char *buffer, std::uintmax_t &offset_) = 0;
+
+  /// \brief read the piece at given offset again
+  /// \param buffer space to save the read data in.
+  /// \param offset_ the start byte number of the piece to read.
+  /// \return length of the read data.
+  virtual int read_at(char *buffer, const std::uintmax_t &offset_) = 0;
+
+  /// \brief size of data not read yet
+  virtual std::uintmax_t get_size() = 0;
+
+  /// \brief whether the size is known before reading
+  /// \detail if not, get_size tells bytes read so far, and the whole
+  ///         size once read returned 0.
+  virtual bool sized() { return true; }
+
+  /// \brief whether read can be called now
+  /// \detail false while too much data is kept for read_at.
+  virtual bool ready() { return true; }
+
+  /// \brief the piece at given offset will not be read again
+  virtual void release(const std::uintmax_t &offset_) {}
+};
+
 /// \class file_reader
 /// \brief Class to hold a file stream
 /// \detail This class is an encapsulation of the file std::ifstream which
@@ -47,7 +91,7 @@ class NoEnoughSpace : public std::runtime_error {
 ///             to determine if the file is opened and ready to read.
 /// \datamember std::uintmax_t offset @default_value: 0
 ///             file read offset to provide piece order information.
-class file_reader {
+class file_reader : public reader {
  private:
   std::ifstream _file;
   std::uintmax_t file_size;
@@ -69,7 +113,7 @@ class file_reader {
 
   /// \brief destructor
   /// \note close the file (if open) and destruct self.
-  ~file_reader();
+  ~file_reader() override;
 
   /// \brief read data from file
   /// \param buffer space to save the read data in.
@@ -78,7 +122,16 @@ class file_reader {
   /// \return length of the read data. Should be the same as @buff_s
   ///         unless reached the last piece or the end, at which will
   ///         return 0 for end, and real read bytes for last piece.
-  int read(char *buffer, std::uintmax_t &offset_);
+  int read(char *buffer, std::uintmax_t &offset_) override;
+
+  /// \brief read the piece at given offset again
+  /// \detail used to resend pieces. the position read continues from is
+  ///         kept unchanged.
+  /// \param buffer space to save the read data in.
+  ///         should have a size of at least @buff_s.
+  /// \param offset_ the start byte number of the piece to read.
+  /// \return length of the read data.
+  int read_at(char *buffer, const std::uintmax_t &offset_) override;
 
   /// \brief @debug read data from file
   /// \param buffer space to save the read data in.
@@ -88,7 +141,234 @@ class file_reader {
 
   /// \brief return size of the opened file.
   /// \return @file_size data member.
-  std::uintmax_t get_size() { return file_size; }
+  std::uintmax_t get_size() override { return file_size; }
+};
+
+/// \class synthetic_reader
+/// \brief Class to generate data instead of reading a file
+/// \detail used to measure network and crypto apart from disk. the data
+///         of a piece only depends on its offset, so pieces read again are
+///         the same.
+/// \datamember pattern_t pattern
+///             ZERO: all zero bytes.
+///             RANDOM: pseudo random bytes, not compressible.
+///             COMPRESSIBLE: random letters of ACGT, 2 bits of entropy
+///             per byte.
+/// \datamember std::uintmax_t size
+///             size of the data
+/// \datamember unsigned int buff_s
+///             piece size
+/// \datamember std::uintmax_t offset
+///             offset of the next piece
+/// \datamember std::mutex _lock
+///             lock of @offset
+class synthetic_reader : public reader {
+ public:
+  enum pattern_t { ZERO, RANDOM, COMPRESSIBLE };
+ private:
+  pattern_t pattern;
+  std::uintmax_t size;
+  unsigned int buff_s;
+  std::uintmax_t offset = 0;
+  std::mutex _lock;
+
+  /// \brief generate the piece at the offset
+  int _fill(char *buffer, const std::uintmax_t &offset_);
+ public:
+  /// \brief constructor
+  /// \param _pattern kind of data to generate
+  /// \param _size size of the data
+  /// \param buff_size piece size
+  synthetic_reader(pattern_t _pattern,
+                   const std::uintmax_t &_size,
+                   const int &buff_size);
+
+  /// \brief get pattern by name: zero, random or compressible
+  /// \throw std::invalid_argument for unknown name
+  static pattern_t parse_pattern(const std::string &name);
+
+  int read(char *buffer, std::uintmax_t &offset_) override;
+
+  int read_at(char *buffer, const std::uintmax_t &offset_) override;
+
+  std::uintmax_t get_size() override;
+};
+
+/// \class stream_reader
+/// \brief Class to read a pipe, whose size is unknown until its end
+/// \detail used for stdin or a FIFO. the data can't be read again, so
+///         every piece read is kept until it's released, to be read again
+///         by read_at. read blocks until a whole piece or the end arrives.
+/// \datamember std::ifstream _file
+///             the FIFO opened, unused for stdin
+/// \datamember std::istream *in
+///             stream read from
+/// \datamember unsigned int buff_s
+///             piece size
+/// \datamember std::uintmax_t limit
+///             bytes of pieces kept at most before ready returns false
+/// \datamember std::uintmax_t offset
+///             bytes read so far
+/// \datamember bool eof
+///             the end is read
+/// \datamember std::map<std::uintmax_t, std::string> kept
+///             pieces not released yet, by offset
+/// \datamember std::uintmax_t kept_bytes
+///             bytes of @kept
+/// \datamember std::mutex _read_lock
+///             lock of reading the stream, and @offset and @eof
+/// \datamember std::mutex _lock
+///             lock of @kept and @kept_bytes, so pieces are read again
+///             while read is blocked waiting for data
+class stream_reader : public reader {
+ private:
+  std::ifstream _file;
+  std::istream *in;
+  unsigned int buff_s;
+  std::uintmax_t limit;
+  std::uintmax_t offset = 0;
+  bool eof = false;
+  std::map<std::uintmax_t, std::string> kept;
+  std::uintmax_t kept_bytes = 0;
+  std::mutex _read_lock;
+  std::mutex _lock;
+ public:
+  /// \brief constructor
+  /// \param _file_name the FIFO, or "-" for stdin
+  /// \param buff_size piece size
+  /// \param _limit bytes of pieces kept at most
+  stream_reader(const std::string &_file_name,
+                const int &buff_size,
+                const std::uintmax_t &_limit);
+
+  stream_reader(stream_reader &_) = delete;
+
+  int read(char *buffer, std::uintmax_t &offset_) override;
+
+  /// \throw std::runtime_error if the piece is released already
+  int read_at(char *buffer, const std::uintmax_t &offset_) override;
+
+  std::uintmax_t get_size() override;
+
+  bool sized() override { return false; }
+
+  bool ready() override;
+
+  void release(const std::uintmax_t &offset_) override;
+};
+
+/// \brief tell if the name is one stream_reader should read: "-" for
+///        stdin, or anything but a regular file
+bool is_stream(const std::string &_file_name);
+
+/// \class writer
+/// \brief Interface of piece destination
+/// \note implementations should be thread safe.
+/// \datamember bool ok @default_value: false
+///             to determine if it's ready to write.
+class writer {
+ public:
+  bool ok = false;
+
+  virtual ~writer() = default;
+
+  /// \brief close before the object itself destruct
+  virtual void close() = 0;
+
+  /// \brief write returns it for a piece kept to be written later, which
+  ///        is told to the callback of on_written once it's written
+  static constexpr int KEPT = -1;
+
+  /// \brief write a piece
+  /// \param buffer overloaded to accept both char * and string as data source.
+  /// \param len length of the data to be write in.
+  /// \param offset offset of the piece to be write.
+  /// \return length of written data. 0 if the write failed. KEPT if it's
+  ///         kept, only after on_written is called.
+  virtual int write(const char *buffer,
+                    const int &len,
+                    const std::uintmax_t &offset) = 0;
+
+  virtual int write(const std::string &buffer,
+                    const int &len,
+                    const std::uintmax_t &offset) = 0;
+
+  /// \brief make what's written durable, without blocking the caller
+  /// \param done called with false if it failed. may be called from
+  ///        another thread.
+  virtual void sync(std::function<void(bool)> done) { done(true); }
+
+  /// \brief tell pieces kept by write once they're written, instead of
+  ///        having write report them written when they're kept
+  /// \param written called with the offset of a piece kept, and false if
+  ///        writing it failed. may be called from another thread.
+  /// \return false if pieces are never kept
+  virtual bool on_written(std::function<void(std::uintmax_t, bool)>) {
+    return false;
+  }
+
+  /// \brief write the pieces kept now
+  virtual void flush() {}
+};
+
+/// \brief latency of every fsync, fdatasync and sync_file_range call
+metrics::Histogram &sync_histogram();
+
+/// \brief count of those calls done
+uint64_t sync_count();
+
+/// \brief nanoseconds spent in those calls
+uint64_t sync_nanoseconds();
+
+/// \brief options of opening files to write
+/// \datamember bool null_sink
+///             discard pieces instead of writing files
+/// \datamember prealloc_t prealloc
+///             how space of the file is reserved when it's opened.
+///             NONE: not reserved, the file grows as pieces are written.
+///             UNWRITTEN: allocate unwritten extents with fallocate. it's
+///             fast, but skipped on file systems not supporting it.
+///             FULL: reserve with posix_fallocate, then write zeros over
+///             the file and sync them, so its blocks are initialized.
+///             takes as long as writing the file.
+/// \datamember bool direct
+///             write with O_DIRECT, bypassing the page cache
+/// \datamember std::uintmax_t direct_threshold
+///             write files of at least this size with O_DIRECT. 0 to
+///             disable.
+/// \datamember std::uintmax_t coalesce
+///             bytes of pieces kept to merge into sequential writes. 0 to
+///             write every piece at once.
+/// \datamember durability_t durability
+///             when written data is made durable. syncs run on a
+///             background thread.
+///             NO_SYNC: never, the kernel writes back when it likes.
+///             AT_END: fsync after the file is closed.
+///             PERIODIC: also start writeback every @sync_every bytes, so
+///             dirty pages don't pile up until the end.
+///             BEFORE_ACK: like PERIODIC, and the file is synced before
+///             the last piece is acknowledged.
+/// \datamember std::uintmax_t sync_every
+///             bytes written between writebacks of PERIODIC and BEFORE_ACK
+struct write_options {
+  enum prealloc_t { NONE, UNWRITTEN, FULL };
+  enum durability_t { NO_SYNC, AT_END, PERIODIC, BEFORE_ACK };
+
+  bool null_sink = false;
+  prealloc_t prealloc = UNWRITTEN;
+  bool direct = false;
+  std::uintmax_t direct_threshold = 0;
+  std::uintmax_t coalesce = 0;
+  durability_t durability = NO_SYNC;
+  std::uintmax_t sync_every = 64 * 1024 * 1024;
+
+  /// \brief get prealloc mode by name: none, unwritten or full
+  /// \throw std::invalid_argument for unknown name
+  static prealloc_t parse_prealloc(const std::string &name);
+
+  /// \brief get durability mode by name: none, end, periodic or ack
+  /// \throw std::invalid_argument for unknown name
+  static durability_t parse_durability(const std::string &name);
 };
 
 /// \class file_writer
@@ -100,23 +380,64 @@ class file_reader {
 /// \datamember std::mutex _lock
 ///             simple mutex lock to prevent multi read process happen in the
 ///             same time which will mess the piece order.
+/// \datamember int _direct @default_value: -1
+///             descriptor of the file opened with O_DIRECT, -1 if direct
+///             I/O is not used. pieces aligned to @_block are written
+///             through it, others (like the last piece) through @_file.
+/// \datamember size_t _block
+///             alignment of offset, length and memory of direct I/O
+/// \datamember durability_t durability
+///             when written data is made durable
+/// \datamember std::uintmax_t sync_every
+///             bytes written between writebacks
+/// \datamember std::uintmax_t _unsynced
+///             bytes written since the last writeback started
+/// \datamember bool _dirty
+///             something is written since the last sync
+/// \datamember std::shared_ptr<sync_state> _sync
+///             descriptor and cost of syncing, shared with the queued syncs
 /// \datamember bool ok @default_value: false
 ///             to determine if the file is opened and ready to read.
-class file_writer {
+class file_writer : public writer {
  private:
   std::ofstream _file;
   std::mutex _lock;
+  int _direct = -1;
+  size_t _block = 0;
+  write_options::durability_t durability;
+  std::uintmax_t sync_every;
+  std::uintmax_t _unsynced = 0;
+  bool _dirty = false;
+  struct sync_state;
+  std::shared_ptr<sync_state> _sync;
+
+  /// \brief open the file again with O_DIRECT
+  /// \note leave @_direct -1 if the file system rejects it
+  void _open_direct(const std::string &_file_name);
+
+  /// \brief write the aligned head of a piece with direct I/O
+  /// \return bytes written, the rest should be written buffered
+  int _write_direct(const char *buffer,
+                    const int &len,
+                    const std::uintmax_t &offset);
  public:
-  bool ok = false;
 
   /// \brief constructor
   /// \param _file_name name (and place) of the file to be write
   /// \param file_size size of the file to be open to write
+  /// \param options how the file is opened
   /// \detail this function will check if thre are enough space left on the
-  ///         file system. However it can't know if the space left become
-  ///         insufficient after it check due to other write perform to the
-  ///         file system.
-  file_writer(std::string _file_name, const std::uintmax_t &file_size);
+  ///         file system the file is placed. unless @options.prealloc is
+  ///         NONE, the space is reserved at once, so it can't become
+  ///         insufficient by other writes to the file system later, and
+  ///         the file is laid out in few extents.
+  ///         with @options.direct, or a @file_size over
+  ///         @options.direct_threshold, the file is written with direct I/O
+  ///         where the file system allows it.
+  /// \throw NoEnoughSpace when there's no enough space for the file
+  file_writer(std::string _file_name,
+              const std::uintmax_t &file_size,
+              const write_options &options = write_options());
 
   /// \brief constructor
   /// \note copy construct is not allowed as multi instance should never
@@ -126,25 +447,144 @@ class file_writer {
 
   /// \brief destructor
   /// \note close the file (if open) and destruct self.
-  ~file_writer();
+  ~file_writer() override;
 
   /// \brief close the file opened before the object itself destruct
-  void close();
+  void close() override;
 
   /// \brief write data to the opened file
   /// \param buffer overloaded to accept both char * and string as data source.
   /// \param len length of the data to be write in. Should be equal or less than
   ///         the buffer size.
   /// \param offset offset of the piece to be write.
+  /// \return length of written data. 0 if the file is not open or the
+  ///         write failed.
+  int write(const char *buffer,
+            const int &len,
+            const std::uintmax_t &offset) override;
+
+  int write(const std::string &buffer,
+            const int &len,
+            const std::uintmax_t &offset) override;
+
+  /// \brief fsync the file on the background thread
+  void sync(std::function<void(bool)> done) override;
+};
+
+/// \class null_writer
+/// \brief Class to discard pieces instead of writing a file
+/// \detail used to measure network and crypto apart from disk.
+class null_writer : public writer {
+ public:
+  null_writer() { ok = true; }
+
+  void close() override {}
+
+  int write(const char *buffer,
+            const int &len,
+            const std::uintmax_t &offset) override { return len; }
+
+  int write(const std::string &buffer,
+            const int &len,
+            const std::uintmax_t &offset) override { return len; }
+};
+
+/// \class coalescing_writer
+/// \brief Class to merge pieces arriving out of order into sequential writes
+/// \detail pieces are kept in memory until adjacent ones make up a run of
+///         @window bytes, which is written at once. when @window bytes are
+///         kept without such a run, every run is written, so the memory
+///         used is bounded. pieces of a run failed to write are dropped,
+///         the caller learns it from on_written and sends them again.
+/// \datamember std::shared_ptr<writer> _inner
+///             writer the runs are written to
+/// \datamember std::uintmax_t window
+///             size of a run to write, and bytes kept at most
+/// \datamember std::map<std::uintmax_t, std::string> pending
+///             pieces kept, by offset
+/// \datamember std::map<std::uintmax_t, std::uintmax_t> runs
+///             start and end offset of adjacent pieces in @pending
+/// \datamember std::uintmax_t pending_bytes
+///             bytes of @pending
+/// \datamember std::function<void(std::uintmax_t, bool)> written
+///             callback of on_written, empty if pieces are reported written
+///             when they're kept
+/// \datamember std::mutex _lock
+///             lock of the data members above. @written is called after
+///             it's released, so the callback may post or write again.
+class coalescing_writer : public writer {
+ private:
+  std::shared_ptr<writer> _inner;
+  std::uintmax_t window;
+  std::map<std::uintmax_t, std::string> pending;
+  std::map<std::uintmax_t, std::uintmax_t> runs;
+  std::uintmax_t pending_bytes = 0;
+  std::function<void(std::uintmax_t, bool)> written;
+  std::mutex _lock;
+
+  /// \brief write the run starting at @start and drop it
+  /// \param callbacks calls of @written for pieces of the run, to make
+  ///        once @_lock is released
+  /// \param except piece not told to @written, whose write is going on
+  /// \return false if it's failed
+  bool _flush(std::uintmax_t start,
+              std::vector<std::function<void()>> &callbacks,
+              std::uintmax_t except =
+                  std::numeric_limits<std::uintmax_t>::max());
+
+  /// \brief write all runs
+  bool _flush_all(std::vector<std::function<void()>> &callbacks,
+                  std::uintmax_t except =
+                      std::numeric_limits<std::uintmax_t>::max());
+
+  /// \brief write, with @_lock held
+  int _write(const char *buffer,
+             const int &len,
+             const std::uintmax_t &offset,
+             std::vector<std::function<void()>> &callbacks);
+ public:
+  /// \brief constructor
+  /// \param inner writer to write merged pieces to
+  /// \param _window bytes to merge into one write
+  coalescing_writer(std::shared_ptr<writer> inner,
+                    const std::uintmax_t &_window);
+
+  coalescing_writer(coalescing_writer &_) = delete;
+
+  ~coalescing_writer() override;
+
+  /// \brief write what's kept and close the inner writer
+  void close() override;
+
   int write(const char *buffer,
             const int &len,
-            const std::uintmax_t &offset);
+            const std::uintmax_t &offset) override;
 
   int write(const std::string &buffer,
             const int &len,
-            const std::uintmax_t &offset);
+            const std::uintmax_t &offset) override;
+
+  /// \brief write what's kept, then sync the inner writer
+  void sync(std::function<void(bool)> done) override;
+
+  bool on_written(std::function<void(std::uintmax_t, bool)> _written) override;
+
+  void flush() override;
 };
 
+/// \brief open a writer as the options tell
+/// \param _file_name name (and place) of the file to be write
+/// \param file_size size of the file to be write
+/// \throw NoEnoughSpace when there's no enough space for the file
+std::shared_ptr<writer> open_writer(const std::string &_file_name,
+                                    const std::uintmax_t &file_size,
+                                    const write_options &options);
+
+/// \brief parse size like 1G, 512M or 4096. suffix K, M, G and T are
+///         powers of 1024.
+/// \throw std::invalid_argument if it's not a size
+std::uintmax_t parse_size(const std::string &size);
+
 }
 
 #endif //FILE_TRANSFER_FILE_H
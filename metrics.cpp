@@ -0,0 +1,192 @@
+#include "metrics.h"
+
+#include <sstream>
+#include <iomanip>
+
+using namespace metrics;
+
+using std::string;
+
+int Registry::add_counter(const string &name, const string &help) {
+  std::lock_guard<std::mutex> lock(_lock);
+  if (counters.size() >= MAX_COUNTERS) {
+    throw std::length_error("Too many counters.");
+  }
+  counters.push_back({name, help});
+  return counters.size() - 1;
+}
+
+void Registry::add_gauge(const string &name,
+                         const string &help,
+                         gauge_t value) {
+  std::lock_guard<std::mutex> lock(_lock);
+  gauges.emplace_back(Desc{name, help}, std::move(value));
+}
+
+void Registry::add_counter(const string &name,
+                           const string &help,
+                           gauge_t value) {
+  std::lock_guard<std::mutex> lock(_lock);
+  gauges.emplace_back(Desc{name, help, true}, std::move(value));
+}
+
+uint64_t Registry::value(int id) {
+  std::lock_guard<std::mutex> lock(_lock);
+  uint64_t sum = 0;
+  for (auto &shard : shards) {
+    sum += shard->values[id].load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+string Registry::render() {
+  std::ostringstream s;
+  std::vector<Desc> _counters;
+  std::vector<std::pair<Desc, gauge_t>> _gauges;
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _counters = counters;
+    _gauges = gauges;
+  }
+  for (size_t i = 0; i < _counters.size(); ++i) {
+    s << "# HELP " << _counters[i].name << " " << _counters[i].help << "\n"
+      << "# TYPE " << _counters[i].name << " counter\n"
+      << _counters[i].name << " " << value(i) << "\n";
+  }
+  // gauge functions may take their own locks, call them unlocked
+  for (auto &g : _gauges) {
+    s << "# HELP " << g.first.name << " " << g.first.help << "\n"
+      << "# TYPE " << g.first.name
+      << (g.first.counter ? " counter\n" : " gauge\n")
+      << g.first.name << " " << std::setprecision(15) << g.second() << "\n";
+  }
+  return s.str();
+}
+
+Registry &metrics::registry() {
+  static Registry r;
+  return r;
+}
+
+unsigned metrics::thread_slot() {
+  static std::atomic<unsigned> next(0);
+  thread_local unsigned slot = next.fetch_add(1, std::memory_order_relaxed);
+  return slot;
+}
+
+Histogram::Histogram() {
+  for (auto &shard : shards) {
+    shard.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+Histogram::~Histogram() {
+  for (auto &shard : shards) {
+    delete shard.load(std::memory_order_relaxed);
+  }
+}
+
+Histogram::Shard &Histogram::_shard() {
+  auto &slot = shards[thread_slot() % SHARDS];
+  Shard *shard = slot.load(std::memory_order_acquire);
+  if (!shard) {
+    auto *_new = new Shard();
+    if (slot.compare_exchange_strong(shard, _new,
+                                     std::memory_order_acq_rel)) {
+      shard = _new;
+    } else {
+      // another thread allocated it first, shard is set to that one
+      delete _new;
+    }
+  }
+  return *shard;
+}
+
+uint64_t Histogram::_value(int index) {
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  int shift = index / SUB_BUCKETS - 1;
+  uint64_t low = ((uint64_t) (index % SUB_BUCKETS + SUB_BUCKETS)) << shift;
+  return low + (1ull << shift) / 2;
+}
+
+Histogram::Summary Histogram::summary() {
+  std::vector<uint64_t> counts(BUCKETS, 0);
+  Summary s;
+  uint64_t sum = 0;
+  for (auto &slot : shards) {
+    Shard *shard = slot.load(std::memory_order_acquire);
+    if (!shard) {
+      continue;
+    }
+    for (int i = 0; i < BUCKETS; ++i) {
+      counts[i] += shard->buckets[i].load(std::memory_order_relaxed);
+    }
+    sum += shard->sum.load(std::memory_order_relaxed);
+  }
+  for (auto c : counts) {
+    s.count += c;
+  }
+  if (s.count == 0) {
+    return s;
+  }
+  s.mean = (double) sum / s.count;
+
+  // walk buckets once, filling percentiles in increasing order
+  const double ranks[] = {0.5, 0.9, 0.99, 0.999};
+  uint64_t *targets[] = {&s.p50, &s.p90, &s.p99, &s.p999};
+  int next = 0;
+  uint64_t seen = 0;
+  bool first = true;
+  for (int i = 0; i < BUCKETS; ++i) {
+    if (counts[i] == 0) {
+      continue;
+    }
+    if (first) {
+      s.min = _value(i);
+      first = false;
+    }
+    seen += counts[i];
+    while (next < 4 && seen >= ranks[next] * s.count) {
+      *targets[next++] = _value(i);
+    }
+    s.max = _value(i);
+  }
+  return s;
+}
+
+/// \brief format nanoseconds with a fitting unit
+static string _duration(double ns) {
+  std::ostringstream s;
+  s << std::setprecision(3) << std::fixed;
+  if (ns < 1e3) {
+    s << ns << "ns";
+  } else if (ns < 1e6) {
+    s << ns / 1e3 << "us";
+  } else if (ns < 1e9) {
+    s << ns / 1e6 << "ms";
+  } else {
+    s << ns / 1e9 << "s";
+  }
+  return s.str();
+}
+
+string Histogram::Summary::str() const {
+  std::ostringstream s;
+  s << "count " << count << ", mean " << _duration(mean)
+    << ", min " << _duration(min) << ", p50 " << _duration(p50)
+    << ", p90 " << _duration(p90) << ", p99 " << _duration(p99)
+    << ", p99.9 " << _duration(p999) << ", max " << _duration(max);
+  return s.str();
+}
+
+string Histogram::Summary::json() const {
+  std::ostringstream s;
+  s << std::setprecision(15)
+    << "{\"count\":" << count << ",\"mean_ns\":" << mean
+    << ",\"min_ns\":" << min << ",\"p50_ns\":" << p50
+    << ",\"p90_ns\":" << p90 << ",\"p99_ns\":" << p99
+    << ",\"p999_ns\":" << p999 << ",\"max_ns\":" << max << "}";
+  return s.str();
+}
@@ -0,0 +1,223 @@
+#ifndef FILE_TRANSFER_METRICS_H_
+#define FILE_TRANSFER_METRICS_H_
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include <cstdint>
+#include <chrono>
+
+/// \file metrics.h
+/// \brief Header for metrics related works
+/// \note All things are in `metrics` namespace
+
+namespace metrics {
+
+const int MAX_COUNTERS = 64;
+
+/// \class Registry
+/// \brief Class to hold all counters and gauges of the program
+/// \detail counters are counted by each thread separately, without lock
+///         or atomic read-modify-write, and only summed up when rendered.
+///         gauges are functions called when rendered, and so are counters
+///         kept elsewhere.
+///         use the single instance returned by registry().
+/// \datamember std::vector<std::unique_ptr<Shard>> shards
+///             counter values of each thread ever counted. they are kept
+///             after the thread exits, so no count is lost.
+/// \datamember std::vector<Desc> counters
+///             name and help text of counters, by id
+/// \datamember std::vector<std::pair<Desc, gauge_t>> gauges
+///             name, help text and value function of gauges, and of
+///             counters with a value function
+/// \datamember std::mutex _lock
+///             lock of the data members above
+class Registry {
+ public:
+  typedef std::function<double()> gauge_t;
+ private:
+  /// \brief counter values of one thread. only that thread writes it.
+  struct Shard {
+    std::atomic<uint64_t> values[MAX_COUNTERS];
+    Shard() {
+      for (auto &v : values) {
+        v.store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+  struct Desc {
+    std::string name;
+    std::string help;
+    bool counter = false;
+  };
+  std::vector<std::unique_ptr<Shard>> shards;
+  std::vector<Desc> counters;
+  std::vector<std::pair<Desc, gauge_t>> gauges;
+  std::mutex _lock;
+
+  /// \brief get the Shard of calling thread
+  Shard &_local() {
+    thread_local Shard *shard = nullptr;
+    if (!shard) {
+      std::lock_guard<std::mutex> lock(_lock);
+      shards.push_back(std::make_unique<Shard>());
+      shard = shards.back().get();
+    }
+    return *shard;
+  }
+ public:
+  /// \brief register a counter
+  /// \return id of the counter
+  /// \throw std::length_error if there are too many counters
+  int add_counter(const std::string &name, const std::string &help);
+
+  /// \brief register a gauge
+  /// \param value function to get the value. it's called when rendering.
+  void add_gauge(const std::string &name,
+                 const std::string &help,
+                 gauge_t value);
+
+  /// \brief register a counter kept elsewhere
+  /// \param value function to get the value, which never decreases. it's
+  ///        called when rendering.
+  void add_counter(const std::string &name,
+                   const std::string &help,
+                   gauge_t value);
+
+  /// \brief count on the calling thread
+  void add(int id, uint64_t n) {
+    auto &v = _local().values[id];
+    // only this thread writes, a plain store is enough
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  /// \brief sum of a counter over all threads
+  uint64_t value(int id);
+
+  /// \brief render all metrics in Prometheus text format
+  std::string render();
+};
+
+/// \brief the Registry of the program
+Registry &registry();
+
+/// \class Counter
+/// \brief Handle of a counter in the Registry
+/// \datamember int id
+///             id of the counter
+class Counter {
+ private:
+  int id;
+ public:
+  /// \brief register a counter
+  /// \note name should follow Prometheus convention and end with _total.
+  Counter(const std::string &name, const std::string &help) :
+      id(registry().add_counter(name, help)) {}
+
+  void inc(uint64_t n = 1) { registry().add(id, n); }
+
+  uint64_t value() { return registry().value(id); }
+};
+
+/// \brief index of calling thread, to spread writes over shards
+unsigned thread_slot();
+
+/// \class Histogram
+/// \brief Class to record distribution of durations
+/// \detail values are nanoseconds counted in log-linear buckets: each power
+///         of two is split into @SUB_BUCKETS buckets, so percentiles are
+///         within about 3% of the real value (HDR histogram style). values
+///         over @MAX_VALUE count as @MAX_VALUE.
+///         recording is a relaxed atomic add on a bucket of one of the
+///         shards. threads are spread over shards so they seldom share a
+///         cache line. shards are allocated on first use, without lock.
+/// \datamember std::atomic<Shard *> shards[SHARDS]
+///             bucket counts, summed up when a Summary is taken
+class Histogram {
+ public:
+  static const int SUB_BITS = 5;
+  static const int SUB_BUCKETS = 1 << SUB_BITS;
+  // about 68 seconds
+  static const int MAX_BITS = 36;
+  static const uint64_t MAX_VALUE = (1ull << MAX_BITS) - 1;
+  static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+  static const int SHARDS = 8;
+
+  /// \brief percentiles of recorded values, in nanoseconds
+  struct Summary {
+    uint64_t count = 0;
+    double mean = 0;
+    uint64_t min = 0;
+    uint64_t p50 = 0;
+    uint64_t p90 = 0;
+    uint64_t p99 = 0;
+    uint64_t p999 = 0;
+    uint64_t max = 0;
+
+    /// \brief format for human reading
+    std::string str() const;
+
+    /// \brief format as a JSON object
+    std::string json() const;
+  };
+
+ private:
+  struct Shard {
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> sum;
+    Shard() {
+      for (auto &b : buckets) {
+        b.store(0, std::memory_order_relaxed);
+      }
+      sum.store(0, std::memory_order_relaxed);
+    }
+  };
+  std::atomic<Shard *> shards[SHARDS];
+
+  /// \brief get bucket index of a value
+  static int _index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+      return (int) value;
+    }
+    int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int) (value >> shift) - SUB_BUCKETS;
+  }
+
+  /// \brief get a value in the middle of a bucket
+  static uint64_t _value(int index);
+
+  Shard &_shard();
+ public:
+  Histogram();
+
+  Histogram(const Histogram &) = delete;
+
+  ~Histogram();
+
+  /// \brief record a value
+  void record(uint64_t value) {
+    if (value > MAX_VALUE) {
+      value = MAX_VALUE;
+    }
+    Shard &shard = _shard();
+    shard.buckets[_index(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  /// \brief record time since @start
+  void record(const std::chrono::steady_clock::time_point &start) {
+    record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+  }
+
+  /// \brief compute percentiles of values recorded so far
+  Summary summary();
+};
+
+}
+
+#endif //FILE_TRANSFER_METRICS_H_
@@ -0,0 +1,118 @@
+#include "parallel.h"
+
+#include <algorithm>
+
+using namespace parallel;
+
+/// \brief a job being run
+/// \datamember const std::function<void(size_t)> &part
+///             what to run, owned by the caller of run()
+/// \datamember size_t parts
+///             count of parts
+/// \datamember std::atomic<size_t> next
+///             the part to take next
+/// \datamember size_t done
+///             count of parts finished, guarded by @_lock
+struct Pool::Job {
+  const std::function<void(size_t)> &part;
+  size_t parts;
+  std::atomic<size_t> next;
+  size_t done = 0;
+  std::mutex _lock;
+  std::condition_variable _cv;
+
+  Job(const std::function<void(size_t)> &_part, size_t _parts)
+      : part(_part), parts(_parts), next(0) {}
+
+  /// \brief run parts until none is left to take
+  void work() {
+    size_t finished = 0;
+    for (size_t i; (i = next++) < parts; ++finished) {
+      part(i);
+    }
+    if (finished == 0) {
+      return;
+    }
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      done += finished;
+      last = done == parts;
+    }
+    if (last) {
+      _cv.notify_all();
+    }
+  }
+};
+
+Pool::Pool(int threads) {
+  for (int i = 0; i < threads; ++i) {
+    workers.emplace_back([this]() { _run(); });
+  }
+}
+
+Pool::~Pool() {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    stop = true;
+  }
+  _cv.notify_all();
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+void Pool::_run() {
+  for (;;) {
+    std::shared_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _cv.wait(lock, [this]() { return stop || !jobs.empty(); });
+      if (stop) {
+        return;
+      }
+      job = jobs.front();
+      // all parts are taken by others already
+      if (job->next >= job->parts) {
+        jobs.pop_front();
+        continue;
+      }
+    }
+    job->work();
+  }
+}
+
+void Pool::run(size_t parts, const std::function<void(size_t)> &part) {
+  if (parts == 0) {
+    return;
+  }
+  if (parts == 1 || workers.empty()) {
+    for (size_t i = 0; i < parts; ++i) {
+      part(i);
+    }
+    return;
+  }
+
+  auto job = std::make_shared<Job>(part, parts);
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    jobs.push_back(job);
+  }
+  // the caller takes a part too
+  size_t helpers = std::min(parts - 1, workers.size());
+  for (size_t i = 0; i < helpers; ++i) {
+    _cv.notify_one();
+  }
+  job->work();
+  {
+    // all parts are taken, workers needn't look at it any more
+    std::lock_guard<std::mutex> lock(_lock);
+    auto it = std::find(jobs.begin(), jobs.end(), job);
+    if (it != jobs.end()) {
+      jobs.erase(it);
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(job->_lock);
+  job->_cv.wait(lock, [&job]() { return job->done == job->parts; });
+}
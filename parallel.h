@@ -0,0 +1,65 @@
+#ifndef FILE_TRANSFER_PARALLEL_H_
+#define FILE_TRANSFER_PARALLEL_H_
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <cstddef>
+
+/// \file parallel.h
+/// \brief Header for splitting a job over several cores
+/// \note All things are in `parallel` namespace
+
+namespace parallel {
+
+/// \class Pool
+/// \brief Class to run the parts of a job on worker threads
+/// \detail the thread running a job takes parts of it as well, so a job
+///         never waits for a busy worker to start, and a Pool with no
+///         worker runs jobs on the calling thread alone. any number of
+///         threads may run jobs at the same time; workers take the parts
+///         of the oldest job first.
+/// \datamember std::vector<std::thread> workers
+///             worker threads
+/// \datamember std::deque<std::shared_ptr<Job>> jobs
+///             jobs having parts not taken yet
+/// \datamember bool stop
+///             workers should exit
+/// \datamember std::mutex _lock
+///             lock of @jobs and @stop
+class Pool {
+ private:
+  struct Job;
+
+  std::vector<std::thread> workers;
+  std::deque<std::shared_ptr<Job>> jobs;
+  bool stop = false;
+  std::mutex _lock;
+  std::condition_variable _cv;
+
+  void _run();
+ public:
+  /// \brief constructor
+  /// \param threads worker threads, besides the ones running jobs
+  explicit Pool(int threads);
+
+  Pool(const Pool &) = delete;
+
+  ~Pool();
+
+  /// \brief run part(0) ... part(parts - 1), and return when all are done
+  /// \note parts run in no particular order, and must not throw
+  void run(size_t parts, const std::function<void(size_t)> &part);
+
+  /// \brief threads a job can run on at most
+  size_t width() const { return workers.size() + 1; }
+};
+
+}
+
+#endif //FILE_TRANSFER_PARALLEL_H_
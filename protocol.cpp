@@ -5,6 +5,8 @@
 #include "protocol.h"
 #include "./third_party/cryptopp/crc.h"
 
+#include <chrono>
+
 namespace protocol {
 
 void _debug_value(const string &str) {
@@ -42,9 +44,13 @@ string _crc32(const string &input) {
 string Randomsession::session(int length) {
   string m;
   m.reserve(length);
-  // generate one byte for once
-  for (int i = 0; i < length; ++i) {
-    m += (char) index_dist(rng);
+  // take every byte of each word drawn
+  while (m.size() < (size_t) length) {
+    auto word = rng();
+    for (int i = 0; i < 4 && m.size() < (size_t) length; ++i) {
+      m += (char) (word & 0xFF);
+      word >>= 8;
+    }
   }
   return m;
 }
@@ -63,21 +69,27 @@ string Randomsession::session(int length) {
  * | MAGIC_HEADER 2 | 0 1 | [ Encrypted SESSION 32 ]
  * Where SESSION is a random 32 bytes data for further file transfer
  *
- * Client: File Negotiation
- * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | PIECE_SIZE 4 | FILE_LENGTH 8 | FILE_PATH 256 ] ]
+ * Client: File Negotiation (once for each file)
+ * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | STREAM 8 | PIECE_SIZE 8 | FILE_LENGTH 16 | FILE_PATH 256 ] ]
  * File with too long path can not be upload.
+ * STREAM is chosen by the client and is non-zero and unique in the session.
  *
  * Server: File Negotiation
  * Can't open file for write
- * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | 1 1 ]
+ * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | STREAM 8 | 1 1 ]
  * OK. Wait for data
- * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | 0 1 ]
+ * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | STREAM 8 | 0 1 ]
  *
  * Client: Start Transfering file
  *  TCP Mode:
  *      Start forking threads
  *
- *  | MAGIC_HEADER_TRANSFER 2 | [ Encrypted [ SESSION 32 | FILE_PIECE_ORDER 8 | FILE_PIECE PIECE_SIZE ] ]
+ *  | MAGIC_HEADER_TRANSFER 2 | STREAM 8 | [ Encrypted [ SESSION 32 | FILE_PIECE_ORDER 8 | FILE_PIECE PIECE_SIZE ] ]
+ *  Pieces of every file share the connections. STREAM 0 with an empty
+ *  piece closes the connection.
+ *
+ * Server: Acknowledge pieces
+ *  | MAGIC_HEADER_TRANSFER 2 | STREAM 8 | [ Encrypted [ SESSION 32 | STATUS 1 | CUMULATIVE 8 | BASE 8 | BITMAP_LENGTH 8 | BITMAP ] ]
  *
  */
 
@@ -121,12 +133,13 @@ string read_msg(std::function<string(int)> &read) {
   }
 }
 
-string read_msg_transfer(std::function<string(int)> &read) {
+string read_msg_transfer(std::function<string(int)> &read, uint64_t &stream) {
   try {
     if (read(2) != MAGIC_HEADER_TRANSFER) {
       throw NotOurMsg("read_msg_transfer - head");
     }
     uint32_t sz = stoul(read(8), 0, 16);
+    stream = stoull(read(8), 0, 16);
     return read(sz);
   }
   catch (const std::exception &e) {
@@ -149,12 +162,14 @@ uint32_t read_msg_len(std::function<string(int)> &read) {
   }
 }
 
-uint32_t read_msg_transfer_len(std::function<string(int)> &read) {
+uint32_t read_msg_transfer_len(std::function<string(int)> &read,
+                               uint64_t &stream) {
   try {
     if (read(2) != MAGIC_HEADER_TRANSFER) {
       throw NotOurMsg("read_msg_transfer_len - head");
     }
     uint32_t sz = stoul(read(8), 0, 16);
+    stream = stoull(read(8), 0, 16);
     return sz;
   }
   catch (const std::exception &e) {
@@ -175,6 +190,10 @@ string read_msg_guess(std::function<string(int)> &read, int &type) {
       return "";
     }
     uint32_t sz = stoul(read(8), 0, 16);
+    if (type == 1) {
+      // stream of the transfer message
+      read(8);
+    }
     auto a = read(sz);
     return a;
   }
@@ -192,42 +211,74 @@ string build_msg(const string &raw_msg) {
   return msg;
 }
 
-string build_msg_transfer(const string &raw_msg) {
+string build_msg_transfer(const string &raw_msg, const uint64_t &stream) {
   string msg = MAGIC_HEADER_TRANSFER;
   msg += fixedLength(raw_msg.size(), 8);
+  msg += fixedLength(stream, 8);
   msg += raw_msg;
   return msg;
 }
 
 /* Data packet struct
  * Client: Server Hello
- * | MAGIC_HEADER 2 | [ Encrypted [ MAGIC_HEADER 2 | VERSION 4] ]
+ * | MAGIC_HEADER 2 | KEY_ID 16 | [ Encrypted [ MAGIC_HEADER 2 | VERSION 4 | TIME 16 | SESSION 32 | TICKET ] ]
  */
 
-string server_hello_build(AESEncrypter &enc) {
+/// \brief key id padded to its field
+static string _key_id_field(const string &key_id) {
+  string field = key_id.substr(0, KEY_ID_LENGTH);
+  field.resize(KEY_ID_LENGTH, '\0');
+  return field;
+}
+
+string read_key_id(const string &msg) {
+  string key_id = msg.substr(0, KEY_ID_LENGTH);
+  return key_id.substr(0, key_id.find('\0'));
+}
+
+string server_hello_build(AESEncrypter &enc,
+                          const string &session,
+                          const string &ticket,
+                          const string &key_id) {
   LOG(DEBUG) << "server_hello_build";
   string enc_str = MAGIC_HEADER;
   enc_str += VERSION;
-  return enc.encrypt(enc_str);
+  uint64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  enc_str += fixedLength(now, 16);
+  enc_str += session;
+  enc_str += ticket;
+  return _key_id_field(key_id) + enc.encrypt(enc_str);
 }
 
-int server_hello_verify(AESDecrypter &dec, const string &msg) {
+int server_hello_verify(AESDecrypter &dec,
+                        const string &msg,
+                        string &session,
+                        uint64_t &sent,
+                        string &ticket) {
   LOG(DEBUG) << "server_hello_verify";
   try {
-    string dec_str = dec.decrypt(msg);
-    string b = dec_str.substr(0, 2);
+    string dec_str = dec.decrypt(msg.substr(KEY_ID_LENGTH));
     if (dec_str.substr(0, 2) != MAGIC_HEADER) {
       LOG(DEBUG) << "Received unknown hello msg.";
       return 1;
     } else if (dec_str.substr(2, 4) != VERSION) {
       LOG(DEBUG) << "Client version unequal.";
       return 2;
+    } else if (dec_str.size() < 55) {
+      // time, proposed session and the trailing NUL
+      LOG(DEBUG) << "Received hello msg without session.";
+      return 1;
     } else {
       LOG(DEBUG) << "Received hello msg.";
+      sent = stoull(dec_str.substr(6, 16), 0, 16);
+      session = dec_str.substr(22, 32);
+      ticket = dec_str.substr(54, dec_str.size() - 55);
       return 0;
     }
   }
-  catch (const std::out_of_range &e) {
+  catch (const std::exception &e) {
+    // cut message, or one encrypted with another key
     LOG(DEBUG) << "Received unknown hello msg.";
     return 1;
   }
@@ -239,19 +290,23 @@ int server_hello_verify(AESDecrypter &dec, const string &msg) {
  * | MAGIC_HEADER 2 | 1 1
  * - Check version compability ->
  * | MAGIC_HEADER 2 | 2 1 | [ Encrypted VERSION 4 ]
+ * - Check the session is not taken ->
+ * | MAGIC_HEADER 2 | 3 1
  * ( If all passed )
- * | MAGIC_HEADER 2 | 0 1 | [ Encrypted SESSION 32 ]
- * Where SESSION is a random 32 bytes data for further file transfer
+ * | MAGIC_HEADER 2 | 0 1 | [ Encrypted [ SESSION 32 | LIFETIME 16 | TICKET ] ]
+ * Where SESSION is the one the client proposed
  */
 
 string client_hello_build(AESEncrypter &enc,
                           const int &status,
-                          const string &session) {
+                          const string &session,
+                          uint64_t lifetime,
+                          const string &ticket) {
   LOG(DEBUG) << "client_hello_build";
   if (status == 0) {
     string msg;
     msg += (char) 0x00;
-    msg += enc.encrypt(session);
+    msg += enc.encrypt(session + fixedLength(lifetime, 16) + ticket);
     return msg;
   } else if (status == 1) {
     string msg;
@@ -261,18 +316,28 @@ string client_hello_build(AESEncrypter &enc,
     string msg;
     msg += enc.encrypt(VERSION);
     return msg;
+  } else if (status == 3) {
+    string msg;
+    msg += (char) 0x03;
+    return msg;
   } else {
     throw std::invalid_argument("Wrong status.");
   }
 }
 
-int client_hello_verify(AESDecrypter &dec, const string &msg, string &session) {
+int client_hello_verify(AESDecrypter &dec,
+                        const string &msg,
+                        string &session,
+                        uint64_t &lifetime,
+                        string &ticket) {
   LOG(DEBUG) << "client_hello_verify";
   try {
     if (msg[0] == 0x00) {
       LOG(DEBUG) << "Got server reply.";
       string dec_str = dec.decrypt(msg.substr(1, msg.size() - 1));
       session = dec_str.substr(0, 32);
+      lifetime = stoull(dec_str.substr(32, 16), 0, 16);
+      ticket = dec_str.substr(48, dec_str.size() - 49);
       return 0;
     } else if (msg[0] == 0x01) {
       LOG(DEBUG) << "Server using another key.";
@@ -280,6 +345,9 @@ int client_hello_verify(AESDecrypter &dec, const string &msg, string &session) {
     } else if (msg[0] == 0x02) {
       LOG(DEBUG) << "Server is another version.";
       return 2;
+    } else if (msg[0] == 0x03) {
+      LOG(DEBUG) << "Session taken by another client.";
+      return 3;
     } else {
       throw std::invalid_argument("Wrong status.");
     }
@@ -290,21 +358,48 @@ int client_hello_verify(AESDecrypter &dec, const string &msg, string &session) {
   }
 }
 
+/* Resumption ticket
+ * [ Encrypted with ticket key [ MAGIC_HEADER_TICKET 2 | EXPIRY 16 ] ]
+ */
+
+string ticket_build(AESEncrypter &enc, uint64_t expiry) {
+  LOG(DEBUG) << "ticket_build";
+  return enc.encrypt(MAGIC_HEADER_TICKET + fixedLength(expiry, 16));
+}
+
+bool ticket_verify(AESDecrypter &dec, const string &ticket, uint64_t now) {
+  LOG(DEBUG) << "ticket_verify";
+  try {
+    string dec_str = dec.decrypt(ticket);
+    if (dec_str.size() != 19 || dec_str.substr(0, 2) != MAGIC_HEADER_TICKET) {
+      return false;
+    }
+    return stoull(dec_str.substr(2, 16), 0, 16) > now;
+  }
+  catch (const std::exception &e) {
+    return false;
+  }
+}
+
 /* Client: File Negotiation
- * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | PIECE_SIZE 8 | FILE_LENGTH 16 | FILE_PATH VARY ] ]
+ * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | STREAM 8 | PIECE_SIZE 8 | FILE_LENGTH 16 | FLAGS 8 | FILE_PATH VARY ] ]
  * File with too long path can not be upload.
  */
 
 string
 file_negotiation_build(AESEncrypter &enc,
                        const string &session,
+                       const uint64_t &stream,
                        const uint32_t &piece_size,
                        const uint64_t &file_length,
+                       const uint32_t &flags,
                        const string &file_path) {
   LOG(DEBUG) << "file_negotiation_build";
   string enc_str = session;
+  enc_str += fixedLength(stream, 8);
   enc_str += fixedLength(piece_size, 8);
   enc_str += fixedLength(file_length, 16);
+  enc_str += fixedLength(flags, 8);
   enc_str += file_path;
   return enc.encrypt(enc_str);
 }
@@ -312,8 +407,10 @@ file_negotiation_build(AESEncrypter &enc,
 int file_negotiation_verify(AESDecrypter &dec,
                             const string &msg,
                             const string &session,
+                            uint64_t &stream,
                             uint32_t &piece_size,
                             uint64_t &file_length,
+                            uint32_t &flags,
                             string &file_path) {
   LOG(DEBUG) << "file_negotiation_verify";
   string dec_str = dec.decrypt(msg);
@@ -321,9 +418,11 @@ int file_negotiation_verify(AESDecrypter &dec,
     if (dec_str.substr(0, 32) != session) {
       return 1;
     }
-    piece_size = stoul(dec_str.substr(32, 8), 0, 16);
-    file_length = stoull(dec_str.substr(40, 16), 0, 16);
-    file_path = dec_str.substr(56, dec_str.size() - 56);
+    stream = stoull(dec_str.substr(32, 8), 0, 16);
+    piece_size = stoul(dec_str.substr(40, 8), 0, 16);
+    file_length = stoull(dec_str.substr(48, 16), 0, 16);
+    flags = stoul(dec_str.substr(64, 8), 0, 16);
+    file_path = dec_str.substr(72, dec_str.size() - 72);
     return 0;
   }
   catch (const std::out_of_range &e) {
@@ -333,31 +432,49 @@ int file_negotiation_verify(AESDecrypter &dec,
 
 /* Server: File Negotiation
  * Can't open file for write
- * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | 1 1 ]
+ * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | STREAM 8 | 1 1 | FILE_LENGTH 16 ]
  * OK. Wait for data
- * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | 0 1 ]
+ * | MAGIC_HEADER 2 | [ Encrypted [ SESSION 32 | STREAM 8 | 0 1 | FILE_LENGTH 16 ]
  */
 
 string file_negotiation_reply(AESEncrypter &enc,
                               const string &session,
-                              const int &status) {
+                              const uint64_t &stream,
+                              const int &status,
+                              const uint64_t &file_length) {
   LOG(DEBUG) << "file_negotiation_reply";
   string enc_str = session;
+  enc_str += fixedLength(stream, 8);
   enc_str += (char) status;
+  enc_str += fixedLength(file_length, 16);
   return enc.encrypt(enc_str);
 }
 
 int file_negotiation_finish(AESDecrypter &dec,
                             const string &msg,
-                            const string &session) {
+                            const string &session,
+                            const uint64_t &stream) {
+  uint64_t file_length;
+  return file_negotiation_finish(dec, msg, session, stream, file_length);
+}
+
+int file_negotiation_finish(AESDecrypter &dec,
+                            const string &msg,
+                            const string &session,
+                            const uint64_t &stream,
+                            uint64_t &file_length) {
   LOG(DEBUG) << "file_negotiation_finish";
   try {
     string dec_str = dec.decrypt(msg);
     if (dec_str.substr(0, 32) != session) {
       throw std::runtime_error(
           "file_negotiation_finish - Server session conflict.");
+    } else if (stoull(dec_str.substr(32, 8), 0, 16) != stream) {
+      throw std::runtime_error(
+          "file_negotiation_finish - Server stream conflict.");
     } else {
-      return (int) *dec_str.substr(32, 1).c_str();
+      file_length = stoull(dec_str.substr(41, 16), 0, 16);
+      return (int) *dec_str.substr(40, 1).c_str();
     }
   }
   catch (const std::out_of_range &e) {
@@ -367,20 +484,27 @@ int file_negotiation_finish(AESDecrypter &dec,
 }
 
 /* Client: Start Transfering file
- *  | MAGIC_HEADER_TRANSFER 2 | [ Encrypted [ SESSION 32 | FILE_PIECE_ORDER 32 | FILE_PIECE PIECE_SIZE ] ]
+ *  | MAGIC_HEADER_TRANSFER 2 | STREAM 8 | [ Encrypted [ SESSION 32 | FILE_PIECE_ORDER 32 | FILE_PIECE PIECE_SIZE ] ]
  */
 
-string file_transfer_init(AESEncrypter &enc, const string &session) {
+string file_transfer_init(AESEncrypter &enc,
+                          const string &session,
+                          const string &key_id) {
   LOG(DEBUG) << "file_transfer_init";
 //  string enc_str(16, char(0xFE));
 //  enc_str += session;
-  return enc.encrypt(session);
+  return _key_id_field(key_id) + enc.encrypt(session);
 }
 
 string file_transfer_init_read(AESDecrypter &dec, const string &msg) {
   LOG(DEBUG) << "file_transfer_init_read";
   try {
-    auto dec_str = dec.decrypt(msg);
+    auto dec_str = dec.decrypt(msg.substr(KEY_ID_LENGTH));
+    // other STREAM 0 messages begin with the session too.
+    // encrypt keeps the terminating null
+    if (dec_str.size() != 33) {
+      return "";
+    }
     return dec_str.substr(0, 32);
   }
   catch (const std::exception &e) {
@@ -397,11 +521,28 @@ string file_transfer_init_reply(AESEncrypter &enc, const int &status) {
 
 int file_transfer_init_confirm(AESDecrypter &dec, const string &msg) {
   LOG(DEBUG) << "file_transfer_init_confirm";
-  return int(dec.decrypt(msg)[16]);
+  auto dec_str = dec.decrypt(msg);
+  if (dec_str.size() != 18) {
+    return -1;
+  }
+  return int(dec_str[16]);
+}
+
+/// \brief iv of a piece, unique as a session never negotiates a stream
+///        twice and a piece is always sent with the same data
+static string _piece_iv(const string &session,
+                        const uint64_t &stream,
+                        const uint32_t &order) {
+  string data = session + fixedLength(stream, 8) + fixedLength(order, 8);
+  byte digest[CryptoPP::SHA256::DIGESTSIZE];
+  CryptoPP::SHA256().CalculateDigest(
+      digest, (const byte *) data.data(), data.size());
+  return string((char *) digest, CryptoPP::AES::BLOCKSIZE);
 }
 
 string file_transfer_build(AESEncrypter &enc,
                            const string &session,
+                           const uint64_t &stream,
                            const uint32_t &order,
                            const uint32_t &size,
                            const
@@ -416,25 +557,33 @@ string file_transfer_build(AESEncrypter &enc,
   enc_str += session;
   enc_str += fixedLength(order, 8);
   enc_str += fixedLength(size, 8);
-  enc_str += piece;
-  return enc.encrypt(enc_str);
+  string iv = _piece_iv(session, stream, order);
+  return enc.encrypt(enc_str)
+      + enc.encrypt_piece((const byte *) iv.data(), piece);
 }
 
 int file_transfer_read(AESDecrypter &dec,
                        const string &msg,
                        const string &session,
+                       const uint64_t &stream,
                        uint32_t &order,
                        uint32_t &size,
                        string &piece) {
 //  LOG(DEBUG) << "file_transfer_read";
   try {
-    string dec_str = dec.decrypt(msg);
+    if (msg.size() < PIECE_HEADER_LENGTH) {
+      throw std::out_of_range("file_transfer_read");
+    }
+    string dec_str = dec.decrypt(msg.substr(0, PIECE_HEADER_LENGTH));
     if (dec_str.substr(0, 32) != session) {
       throw std::runtime_error("file_transfer_read - Server session conflict.");
     }
     order = stoul(dec_str.substr(32, 8), 0, 16);
     size = stoul(dec_str.substr(40, 8), 0, 16);
-    piece = dec_str.substr(48, dec_str.size() - 48);
+    string iv = _piece_iv(session, stream, order);
+    piece = dec.decrypt_piece((const byte *) iv.data(),
+                              msg.data() + PIECE_HEADER_LENGTH,
+                              msg.size() - PIECE_HEADER_LENGTH);
     string _t;
     std::ostringstream a(_t);
     a << "order-" << order << " size-" << size
@@ -448,31 +597,84 @@ int file_transfer_read(AESDecrypter &dec,
   }
 }
 
+/* Server: Acknowledge pieces
+ *  | MAGIC_HEADER_TRANSFER 2 | STREAM 8 | [ Encrypted [ SESSION 32 | STATUS 1 | CUMULATIVE 8 | BASE 8 | BITMAP_LENGTH 8 | BITMAP ] ]
+ */
+
 string file_transfer_receive(AESEncrypter &enc,
                              const string &session,
-                             const int &status) {
-  LOG(DEBUG) << "file_transfer_receive";
-  string enc_str(16, char(0xFF));
-  enc_str += session;
+                             const int &status,
+                             const uint32_t &cumulative,
+                             const uint32_t &base,
+                             const string &bitmap) {
+  string enc_str = session;
   enc_str += (char) status;
+  enc_str += fixedLength(cumulative, 8);
+  enc_str += fixedLength(base, 8);
+  enc_str += fixedLength(bitmap.size(), 8);
+  enc_str += bitmap;
   return enc.encrypt(enc_str);
 }
 
 int file_transfer_confirm(AESDecrypter &dec,
                           const string &msg,
-                          const string &session) {
-  LOG(DEBUG) << "file_transfer_confirm";
+                          const string &session,
+                          uint32_t &cumulative,
+                          uint32_t &base,
+                          string &bitmap) {
   try {
     string dec_str = dec.decrypt(msg);
-    if (dec_str.substr(16, 32) != session) {
-      throw std::runtime_error("Server session conflict.");
-    } else {
-      return (int) dec_str[48];
+    if (dec_str.substr(0, 32) != session) {
+      throw std::runtime_error(
+          "file_transfer_confirm - Server session conflict.");
     }
+    int status = (int) dec_str.at(32);
+    cumulative = stoul(dec_str.substr(33, 8), 0, 16);
+    base = stoul(dec_str.substr(41, 8), 0, 16);
+    uint32_t length = stoul(dec_str.substr(49, 8), 0, 16);
+    if (dec_str.size() < 57 + length) {
+      throw std::out_of_range("bitmap");
+    }
+    bitmap = dec_str.substr(57, length);
+    return status;
   }
   catch (const std::out_of_range &e) {
-    throw std::runtime_error("Client sent bad file transfered info.");
+    throw std::runtime_error(
+        "file_transfer_confirm - Server sent bad file transfered info.");
   }
 }
 
-}
\ No newline at end of file
+string sack_bitmap_build(std::vector<uint32_t> &orders, uint32_t &base) {
+  string bitmap;
+  if (orders.empty()) {
+    return bitmap;
+  }
+  base = orders.front();
+  auto it = orders.begin();
+  for (; it != orders.end(); ++it) {
+    uint32_t bit = *it - base;
+    // the rest is left for the next bitmap
+    if (bit >= SACK_BITMAP_SIZE * 8) {
+      break;
+    }
+    if (bitmap.size() <= bit / 8) {
+      bitmap.resize(bit / 8 + 1, (char) 0);
+    }
+    bitmap[bit / 8] |= (char) (1u << (bit % 8));
+  }
+  orders.erase(orders.begin(), it);
+  return bitmap;
+}
+
+std::vector<uint32_t> sack_bitmap_read(const uint32_t &base,
+                                       const string &bitmap) {
+  std::vector<uint32_t> orders;
+  for (uint32_t i = 0; i < bitmap.size() * 8; ++i) {
+    if (static_cast<byte>(bitmap[i / 8]) & (1u << (i % 8))) {
+      orders.push_back(base + i);
+    }
+  }
+  return orders;
+}
+
+}
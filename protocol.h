@@ -16,6 +16,7 @@
 #include <exception>
 #include <charconv>
 #include <iomanip>
+#include <vector>
 
 #include <boost/random/random_device.hpp>
 #include <boost/random/uniform_int_distribution.hpp>
@@ -26,7 +27,24 @@
 
 #define MAGIC_HEADER "TY"
 #define MAGIC_HEADER_TRANSFER "YT"
-#define VERSION "\x01\x01\x01\x01"
+#define MAGIC_HEADER_TICKET "TK"
+// bytes of the key id in clear before the Server Hello and transfer init
+#define KEY_ID_LENGTH 16
+#define VERSION "\x01\x01\x01\x09"
+// seconds a Server Hello is accepted for, before or after the server's clock
+#define HELLO_FRESHNESS 300
+// bytes of the encrypted header of a piece: SESSION 32 | ORDER 8 | SIZE 8
+// and the NUL encrypt() adds, padded to AES blocks
+#define PIECE_HEADER_LENGTH 64
+// max bytes of bitmap in one ack message
+#define SACK_BITMAP_SIZE 1024
+// file negotiation flags
+// write the file with direct I/O, bypassing the server's page cache
+#define FLAG_DIRECT_IO 0x1
+// the file length is unknown until the end piece, see below
+#define FLAG_STREAMING 0x2
+// the server sends the file at FILE_PATH to the client, see below
+#define FLAG_FETCH 0x4
 
 /// \file protocol.h
 /// \brief Header for the implement of the nultithread file transfer protocol
@@ -35,7 +53,20 @@
 /** PACKET STRUCT OF THE PROTOCOL
  * Data packet struct
  * Client: Server Hello
- * | MAGIC_HEADER 2 | LENGTH 8 | [ Encrypted [ MAGIC_HEADER 2 | VERSION 4] ]
+ * | MAGIC_HEADER 2 | LENGTH 8 | KEY_ID 16 |
+ * [ Encrypted [ MAGIC_HEADER 2 | VERSION 4 | TIME 16 | SESSION 32 | TICKET ] ]
+ * KEY_ID names the key (tenant) the message is encrypted with, padded
+ * with NUL. Empty for the server's default key.
+ * Where SESSION is a random 32 bytes data for further file transfer,
+ * proposed by the client so it doesn't need to wait for the reply before
+ * negotiating files and opening transfer connections.
+ * TIME is when the message is sent, in seconds since epoch of the
+ * client's clock. The server refuses a Server Hello sent more than
+ * HELLO_FRESHNESS seconds away from its clock, or proposing a session it
+ * accepted within that time, so a recorded session can't be replayed.
+ * TICKET is empty, or a resumption ticket the server issued before. With
+ * a valid ticket the server sends no Client Hello and goes on to File
+ * Negotiation; with an invalid one it closes the connection.
  *
  * Server: Client Hello
  * - Check is our header -> Close Connection
@@ -43,25 +74,82 @@
  * | MAGIC_HEADER 2 | LENGTH 8 | 1 1
  * - Check version compability ->
  * | MAGIC_HEADER 2 | LENGTH 8 | 2 1 | [ Encrypted VERSION 4 ]
+ * - Check the session is not taken by another client ->
+ * | MAGIC_HEADER 2 | LENGTH 8 | 3 1
  * ( If all passed )
- * | MAGIC_HEADER 2 | LENGTH 8 | 0 1 | [ Encrypted SESSION 32 ]
- * Where SESSION is a random 32 bytes data for further file transfer
+ * | MAGIC_HEADER 2 | LENGTH 8 | 0 1 |
+ * [ Encrypted [ SESSION 32 | LIFETIME 16 | TICKET ] ]
+ * Where TICKET is a resumption ticket valid for LIFETIME seconds, empty
+ * if the server doesn't issue them:
+ * [ Encrypted with ticket key [ MAGIC_HEADER_TICKET 2 | EXPIRY 16 ] ]
+ * EXPIRY is in seconds since epoch of the server's clock.
+ *
+ * The client sends the first File Negotiation right after the Server Hello,
+ * and reads both replies later. Transfer connections are opened at the
+ * same time; the server holds them (and pieces of streams being
+ * negotiated) until the session (and the stream) is known.
  *
  * Client: File Negotiation
  * | MAGIC_HEADER 2 | LENGTH 8 |
- * [ Encrypted [ SESSION 32 | PIECE_SIZE 4 | FILE_LENGTH 8 | FILE_PATH 256 ] ]
+ * [ Encrypted [ SESSION 32 | STREAM 8 | PIECE_SIZE 4 | FILE_LENGTH 8 |
+ *               FLAGS 8 | FILE_PATH 256 ] ]
  * File with too long path can not be upload.
+ * FLAGS are FLAG_* bits asking how the server stores the file.
+ * STREAM is chosen by the client and identifies the file in this session.
+ * A session can negotiate any number of files, one after another, on the
+ * same connection.
  *
  * Server: File Negotiation
  * Can't open file for write
- * | MAGIC_HEADER 2 | LENGTH 8 | [ Encrypted [ SESSION 32 | 1 1 ]
+ * | MAGIC_HEADER 2 | LENGTH 8 |
+ * [ Encrypted [ SESSION 32 | STREAM 8 | 1 1 | FILE_LENGTH 16 ] ]
  * OK. Wait for data
- * | MAGIC_HEADER 2 | LENGTH 8 | [ Encrypted [ SESSION 32 | 0 1 ]
+ * | MAGIC_HEADER 2 | LENGTH 8 |
+ * [ Encrypted [ SESSION 32 | STREAM 8 | 0 1 | FILE_LENGTH 16 ] ]
+ * FILE_LENGTH is the length of the file fetched, 0 for an upload.
  *
  * Client: Start Transfering file
- *      Start forking threads:
- *      | MAGIC_HEADER_TRANSFER 2 | LENGTH 8 |
- *      [ Encrypted [ SESSION 32 | FILE_PIECE_ORDER 8 | FILE_PIECE PIECE_SIZE ] ]
+ *      Transfer connections belong to the session rather than to one file,
+ *      and carry pieces of every file (stream) of it:
+ *      | MAGIC_HEADER_TRANSFER 2 | LENGTH 8 | STREAM 8 |
+ *      [ Encrypted [ SESSION 32 | FILE_PIECE_ORDER 8 | SIZE 8 ] ] |
+ *      [ Encrypted in counter mode FILE_PIECE PIECE_SIZE ]
+ *      The header takes PIECE_HEADER_LENGTH bytes. The piece is encrypted
+ *      as told in PIECE CIPHER of encrypt.h, with the first 16 bytes of
+ *      SHA-256 [ SESSION 32 | STREAM 8 | FILE_PIECE_ORDER 8 ] as its iv.
+ *      Connection init and finish messages use STREAM 0. The init is
+ *      | MAGIC_HEADER_TRANSFER 2 | LENGTH 8 | 0 8 | KEY_ID 16 |
+ *      [ Encrypted SESSION 32 ]
+ *
+ * Server: Acknowledge pieces (on the same transfer connection)
+ *      | MAGIC_HEADER_TRANSFER 2 | LENGTH 8 | STREAM 8 |
+ *      [ Encrypted [ SESSION 32 | STATUS 1 | CUMULATIVE 8 | BASE 8 |
+ *                    BITMAP_LENGTH 8 | BITMAP ] ]
+ *      STATUS 0 means pieces in BITMAP are written into file, 1 means
+ *      writing them failed and they should be sent again, 2 means the
+ *      whole file is written and no more piece of it should be sent, 3
+ *      means the server has no room for the pieces yet (it delivers the
+ *      file in order, and they're too far ahead) and they should be sent
+ *      again a little later.
+ *      Every piece with order lower than CUMULATIVE is written.
+ *      Bit i (LSB first) of BITMAP byte i / 8 stands for piece BASE + i.
+ *
+ *      A file negotiated with FLAG_STREAMING has FILE_LENGTH 0, as it's
+ *      read from a pipe. After its last piece the client sends an end
+ *      piece, numbered after it, with SIZE 0 and FILE_PIECE beginning with
+ *      FILE_LENGTH 16. It's resent and acknowledged like any other piece,
+ *      and the file is finished once every piece up to it is written.
+ *
+ *      A file negotiated with FLAG_FETCH goes the other way: FILE_PATH
+ *      names a file on the server, FILE_LENGTH is 0 and the reply tells
+ *      its length. The server sends its pieces through the transfer
+ *      connections of the session, just as the client sends pieces, and
+ *      the client acknowledges them with the same ack message. Every
+ *      message of the stream from the server is a piece, and every one
+ *      from the client an ack. Pieces on a connection that broke are sent
+ *      again through another. A piece with SIZE 0 tells the file can't be
+ *      read anymore, and the client gives it up. The client acks pieces
+ *      of a file it has finished or given up with STATUS 2.
  *
  */
 
@@ -103,23 +191,17 @@ struct OtherSideError : public std::runtime_error {
 };
 
 /// \brief class to generate session id.
-/// \detail session is a 32 bytes long string generated by server
-///         randomly during negotiation. It is used to identify which
+/// \detail session is a 32 bytes long string generated by the client
+///         randomly before handshake. It is used to identify which
 ///         file the new connected file transfer thread belongs to,
 ///          and attach the right file pointer to the thread handle object.
 /// \datamember boost::random::random_device rng
-///             random generator
-/// \datamember boost::random::uniform_int_distribution<> index_dist
+///             random generator. each call reads 4 bytes from the system.
 ///             generator distribution
 class Randomsession {
  private:
   boost::random::random_device rng;
-  boost::random::uniform_int_distribution<> index_dist;
  public:
-  /// \brief constructor
-  Randomsession() {
-    index_dist = boost::random::uniform_int_distribution<>(0, 255);
-  }
   /// \brief session generator
   /// \param length length of the session to generate
   string session(int length);
@@ -154,9 +236,11 @@ bool is_ourmsg_tansfer(const string &msg);
 ///     header to identify each other, so there are another function
 ///     with transfer variant to handle transfer message.
 ///     all function with _transfer is of this reason.
+/// \param stream the stream the message belongs to.
+///         transfer message only.
 string read_msg(std::function<string(int)> &read);
 
-string read_msg_transfer(std::function<string(int)> &read);
+string read_msg_transfer(std::function<string(int)> &read, uint64_t &stream);
 
 /// \brief read the message length
 /// \param read the function to call to get message read from socket.
@@ -170,7 +254,8 @@ string read_msg_transfer(std::function<string(int)> &read);
 ///     to determine how many bytes the body have and read it.
 uint32_t read_msg_len(std::function<string(int)> &read);
 
-uint32_t read_msg_transfer_len(std::function<string(int)> &read);
+uint32_t read_msg_transfer_len(std::function<string(int)> &read,
+                               uint64_t &stream);
 
 /// \brief read the message without knowing the connection type
 /// \param read the function to call to get message read from socket.
@@ -183,18 +268,23 @@ uint32_t read_msg_transfer_len(std::function<string(int)> &read);
 /// \return the body data of the message (without unencrypted header
 ///         and length info)
 /// \note transfer connection and handshake connection uses different
-///     header to identify each other.
+///     header to identify each other. stream of transfer message is
+///     dropped as the first message of a connection is always stream 0.
 string read_msg_guess(std::function<string(int)> &read, int &type);
 
 /// \brief build raw message with header and length info
 /// \param raw_msg encrypted headless message.
 /// \return message with header and length info which can be send
 ///         to the other side.
+/// \param stream the stream the message belongs to. transfer message only.
 /// \note this function will get the length info from the raw_msg
 ///         using .size() member function.
 string build_msg(const string &raw_msg);
 
-string build_msg_transfer(const string &raw_msg);
+string build_msg_transfer(const string &raw_msg, const uint64_t &stream);
+
+/// \brief length of transfer message head
+const int TRANSFER_HEAD_LENGTH = 18;
 
 /// \brief @template convert number into fixed length string
 /// \param value the number to be convert
@@ -216,14 +306,23 @@ using encrypt::AESDecrypter;
 
 /// \brief @client build server-hello message
 /// \param enc encrypter object
-/// \return built encrypted raw server-hello message
-string server_hello_build(
-                          AESEncrypter &enc
+/// \param session session proposed by the client
+/// \param ticket resumption ticket to skip Client Hello, or empty
+/// \param key_id id of the key @enc uses, empty for the default key
+/// \return built encrypted raw server-hello message, stamped with the
+///         current time
+string server_hello_build(AESEncrypter &enc,
+                          const string &session,
+                          const string &ticket = "",
+                          const string &key_id = ""
 );
 
 /// \brief @server verify server-hello message
 /// \param dec decrypter object
 /// \param msg encrypted raw message received
+/// \param session session proposed by the client
+/// \param sent when the client sent the message, in seconds since epoch
+/// \param ticket resumption ticket sent by the client, or empty
 /// \return status code
 ///         0: good server-hello data
 ///         1: server-hello with wrong header. This often indicate the
@@ -231,18 +330,26 @@ string server_hello_build(
 ///         2: clitent version is not the same as server. This will cause
 ///             some problem
 int server_hello_verify(AESDecrypter &dec,
-                        const string &msg
+                        const string &msg,
+                        string &session,
+                        uint64_t &sent,
+                        string &ticket
 );
 
 /// \brief @server build client-hello message
 /// \param enc encrypter object
-/// \param status status code from server_hello_verify
-/// \param session generated session string
+/// \param status status code from server_hello_verify, or 3 if the
+///        session proposed is taken
+/// \param session session string accepted
+/// \param lifetime seconds the ticket is valid for
+/// \param ticket resumption ticket issued, or empty
 /// \return built encrypted raw server-hello message
 /// \throw std::invalid_argument when undefined status given
 string client_hello_build(AESEncrypter &enc,
                           const int &status,
-                          const string &session
+                          const string &session,
+                          uint64_t lifetime = 0,
+                          const string &ticket = ""
 );
 
 /// \brief @client verify client-hello message
@@ -254,24 +361,51 @@ string client_hello_build(AESEncrypter &enc,
 ///             client using another key
 ///         2: clitent version is not the same as server. This will cause
 ///             some problem
+///         3: the session proposed is taken by another client
+/// \param lifetime seconds the ticket is valid for
+/// \param ticket resumption ticket issued, empty if none
 /// \throw std::invalid_argument when undefined status received
 /// \throw std::runtime_error when message received is too short
 int client_hello_verify(AESDecrypter &dec,
                         const string &msg,
-                        string &session
+                        string &session,
+                        uint64_t &lifetime,
+                        string &ticket
+);
+
+/// \brief @server build a resumption ticket
+/// \param enc encrypter object with the ticket key
+/// \param expiry seconds since epoch the ticket is valid until
+/// \return built encrypted ticket
+string ticket_build(AESEncrypter &enc,
+                    uint64_t expiry
+);
+
+/// \brief @server verify a resumption ticket
+/// \param dec decrypter object with the ticket key
+/// \param ticket ticket received
+/// \param now seconds since epoch
+/// \return false if the ticket is not issued with the key or expired
+bool ticket_verify(AESDecrypter &dec,
+                   const string &ticket,
+                   uint64_t now
 );
 
 /// \brief @client build negotiate file info
 /// \param enc encrypter object
 /// \param session generated session string
+/// \param stream stream id chosen for the file, never 0
 /// \param piece_size divided piece size which will be send each time
 /// \param file_length length of the file to be transfered
+/// \param flags FLAG_* bits of the file
 /// \param file_path name (and place) of the file to be transfered
 /// \return built encrypted raw file negotiation message
 string file_negotiation_build(AESEncrypter &enc,
                               const string &session,
+                              const uint64_t &stream,
                               const uint32_t &piece_size,
                               const uint64_t &file_length,
+                              const uint32_t &flags,
                               const string &file_path
 );
 
@@ -279,8 +413,10 @@ string file_negotiation_build(AESEncrypter &enc,
 /// \param dec decrypter object
 /// \param msg encrypted raw message received
 /// \param session generated session string
+/// \param stream stream id chosen for the file
 /// \param piece_size divided piece size which will be send each time
 /// \param file_length length of the file to be transfered
+/// \param flags FLAG_* bits of the file
 /// \param file_path name (and place) of the file to be transfered
 /// \return verify status
 ///         0: ok
@@ -289,42 +425,69 @@ string file_negotiation_build(AESEncrypter &enc,
 int file_negotiation_verify(AESDecrypter &dec,
                             const string &msg,
                             const string &session,
+                            uint64_t &stream,
                             uint32_t &piece_size,
                             uint64_t &file_length,
+                            uint32_t &flags,
                             string &file_path
 );
 
 /// \brief @server reply file open result
 /// \param enc encrypter object
 /// \param session generated session string
+/// \param stream stream id of the file
 /// \param status file open status
 ///        0: no error
 ///        1: file open failed
+/// \param file_length length of the file fetched, 0 for an upload
 /// \return built encrypted raw file negotiation message
 string file_negotiation_reply(AESEncrypter &enc,
                               const string &session,
-                              const int &status
+                              const uint64_t &stream,
+                              const int &status,
+                              const uint64_t &file_length = 0
 );
 
 /// \brief @client finish file negotiation
 /// \param dec decrypter object
 /// \param msg encrypted raw message received
 /// \param session generated session string
+/// \param stream stream id of the file
 /// \return status code from server
-/// \throw std::runtime_error if session conflict or message too short
+/// \throw std::runtime_error if session or stream conflict or message
+///        too short
+int file_negotiation_finish(AESDecrypter &dec,
+                            const string &msg,
+                            const string &session,
+                            const uint64_t &stream
+);
+
+/// \brief @client finish file negotiation of a file fetched
+/// \param file_length length of the file told by the server
+/// \note for other parameters, see file_negotiation_finish above
 int file_negotiation_finish(AESDecrypter &dec,
                             const string &msg,
-                            const string &session
+                            const string &session,
+                            const uint64_t &stream,
+                            uint64_t &file_length
 );
 
 /// \brief @client transfer connection init
 /// \param enc encrypter object
 /// \param session generated session string
+/// \param key_id id of the key @enc uses, empty for the default key
 /// \return built encrypted raw file transfer message
 string file_transfer_init(AESEncrypter &enc,
-                          const string &session
+                          const string &session,
+                          const string &key_id = ""
 );
 
+/// \brief @server read the key id of a Server Hello or transfer init
+/// \detail it's in clear, to choose the key to decrypt the rest with
+/// \param msg raw message received
+/// \return key id, empty for the default key
+string read_key_id(const string &msg);
+
 
 /// \brief @server read transfer connection init
 /// \param dec decrypter object
@@ -335,25 +498,35 @@ string file_transfer_init_read(AESDecrypter &dec,
 );
 
 
-/// \brief @server @unused reply the transfer info
+/// \brief @server reply the transfer connection init
+/// \detail only used by UDP transfer connections, whose init may be lost
+/// \param enc encrypter object
+/// \param status 0 if attached to the session, 1 if the session is unknown
+/// \return built encrypted raw file transfer message
 string file_transfer_init_reply(AESEncrypter &enc,
                                 const int &status
 );
 
-/// \brief @client @unused confirm the transfer info
+/// \brief @client confirm the transfer connection init
+/// \param dec decrypter object
+/// \param msg encrypted raw message received
+/// \return status from server, see file_transfer_init_reply
 int file_transfer_init_confirm(AESDecrypter &dec,
                                const string &msg
 );
 
 /// \brief @client build transfer message with payload
+/// \detail the server builds pieces of files fetched with it too
 /// \param enc encrypter object
 /// \param session generated session string
+/// \param stream stream id of the file, 0 for the finish message
 /// \param order order of the sending piece
 /// \param size size of the sending piece
 /// \param piece file piece data
 /// \return built encrypted raw file transfer message
 string file_transfer_build(AESEncrypter &enc,
                            const string &session,
+                           const uint64_t &stream,
                            const uint32_t &order,
                            const uint32_t &size,
                            const string &piece
@@ -363,6 +536,7 @@ string file_transfer_build(AESEncrypter &enc,
 /// \param dec decrypter object
 /// \param msg encrypted raw message received
 /// \param session of connected transfer thread
+/// \param stream stream id the message is sent with
 /// \param order order of the sending piece
 /// \param size size of the sending piece
 /// \param piece file piece data
@@ -371,20 +545,62 @@ string file_transfer_build(AESEncrypter &enc,
 int file_transfer_read(AESDecrypter &dec,
                        const string &msg,
                        const string &session,
+                       const uint64_t &stream,
                        uint32_t &order,
                        uint32_t &size,
                        string &piece
 );
 
-/// \brief @server @unused reply client the data has received
+/// \brief @server acknowledge pieces to the client
+/// \detail the client acknowledges pieces of files fetched with it too
+/// \param enc encrypter object
+/// \param session generated session string
+/// \param status status of the pieces in bitmap
+///        0: pieces are written into file
+///        1: pieces failed to write and should be sent again
+///        2: all pieces are written, stop sending (duplicated) pieces
+///        3: no room for the pieces yet, send them again later
+/// \param cumulative every piece with lower order is written into file
+/// \param base order of the first piece the bitmap stands for
+/// \param bitmap SACK-style bitmap built by sack_bitmap_build
+/// \return built encrypted raw file transfer ack message
 string file_transfer_receive(AESEncrypter &enc,
                              const string &session,
-                             const int &status);
+                             const int &status,
+                             const uint32_t &cumulative,
+                             const uint32_t &base,
+                             const string &bitmap);
 
-/// \brief @client @unused check the data has received
+/// \brief @client read the acknowledge of sent pieces
+/// \param dec decrypter object
+/// \param msg encrypted raw message received
+/// \param session generated session string
+/// \param cumulative every piece with lower order is written into file
+/// \param base order of the first piece the bitmap stands for
+/// \param bitmap SACK-style bitmap, read with sack_bitmap_read
+/// \return status code from server, see file_transfer_receive
+/// \throw std::runtime_error if session conflict or message too short
 int file_transfer_confirm(AESDecrypter &dec,
                           const string &msg,
-                          const string &session);
+                          const string &session,
+                          uint32_t &cumulative,
+                          uint32_t &base,
+                          string &bitmap);
+
+/// \brief pack piece orders into a SACK-style bitmap
+/// \param orders sorted piece orders to pack. orders too far from the
+///        first one to fit in one bitmap are left in the vector, packed
+///        ones are removed.
+/// \param base order of the first piece the bitmap stands for
+/// \return the bitmap
+string sack_bitmap_build(std::vector<uint32_t> &orders, uint32_t &base);
+
+/// \brief unpack a SACK-style bitmap into piece orders
+/// \param base order of the first piece the bitmap stands for
+/// \param bitmap the bitmap
+/// \return orders of pieces marked in the bitmap
+std::vector<uint32_t> sack_bitmap_read(const uint32_t &base,
+                                       const string &bitmap);
 
 }
 #endif //FILE_TRANSFER_PROTOCOL_H
@@ -0,0 +1,100 @@
+#include "ratelimit.h"
+
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+
+using namespace ratelimit;
+
+using std::string;
+
+TokenBucket::TokenBucket(uint64_t _rate, uint64_t _burst) {
+  last = std::chrono::steady_clock::now();
+  set(_rate, _burst);
+  // start full
+  tokens = burst;
+}
+
+void TokenBucket::_refill(const std::chrono::steady_clock::time_point &now) {
+  std::chrono::duration<double> elapsed = now - last;
+  last = now;
+  tokens = std::min((double) burst, tokens + rate * elapsed.count());
+}
+
+void TokenBucket::set(uint64_t _rate, uint64_t _burst) {
+  std::lock_guard<std::mutex> lock(_lock);
+  // tokens filled so far count with the old rate
+  _refill(std::chrono::steady_clock::now());
+  rate = _rate;
+  burst = _burst ? _burst : std::max<uint64_t>(rate / 10, 1);
+  tokens = std::min((double) burst, tokens);
+}
+
+std::chrono::nanoseconds TokenBucket::consume(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(_lock);
+  if (rate == 0) {
+    return std::chrono::nanoseconds(0);
+  }
+  _refill(std::chrono::steady_clock::now());
+  tokens -= bytes;
+  if (tokens >= 0) {
+    return std::chrono::nanoseconds(0);
+  }
+  // time to pay off the debt
+  return std::chrono::nanoseconds((int64_t) (-tokens * 1e9 / rate));
+}
+
+uint64_t TokenBucket::get_rate() {
+  std::lock_guard<std::mutex> lock(_lock);
+  return rate;
+}
+
+uint64_t TokenBucket::get_burst() {
+  std::lock_guard<std::mutex> lock(_lock);
+  return burst;
+}
+
+uint64_t ratelimit::parse_rate(const string &rate) {
+  size_t pos;
+  double value;
+  try {
+    value = std::stod(rate, &pos);
+  }
+  catch (const std::logic_error &e) {
+    throw std::invalid_argument("Not a rate: " + rate);
+  }
+  string suffix = rate.substr(pos);
+  const string units = "KMGT";
+  double scale = 1;
+  if (suffix.size() == 1) {
+    auto unit = units.find((char) toupper(suffix[0]));
+    if (unit == string::npos) {
+      throw std::invalid_argument("Not a rate: " + rate);
+    }
+    for (size_t i = 0; i <= unit; ++i) {
+      scale *= 1000;
+    }
+  } else if (!suffix.empty()) {
+    throw std::invalid_argument("Not a rate: " + rate);
+  }
+  if (value < 0) {
+    throw std::invalid_argument("Not a rate: " + rate);
+  }
+  return (uint64_t) (value * scale);
+}
+
+string ratelimit::format_rate(uint64_t rate) {
+  if (rate == 0) {
+    return "unlimited";
+  }
+  const char *units[] = {"B/s", "KB/s", "MB/s", "GB/s", "TB/s"};
+  double value = rate;
+  int unit = 0;
+  while (value >= 1000 && unit < 4) {
+    value /= 1000;
+    ++unit;
+  }
+  std::ostringstream s;
+  s << std::setprecision(4) << value << units[unit];
+  return s.str();
+}
@@ -0,0 +1,75 @@
+#ifndef FILE_TRANSFER_RATELIMIT_H_
+#define FILE_TRANSFER_RATELIMIT_H_
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+
+/// \file ratelimit.h
+/// \brief Header for rate limit related works
+/// \note All things are in `ratelimit` namespace
+
+namespace ratelimit {
+
+/// \class TokenBucket
+/// \brief Class to limit the rate of sending or receiving data
+/// \detail tokens are bytes. they fill up at @rate per second up to @burst.
+///         a piece always takes its length of tokens even if less are left,
+///         and the debt tells how long to wait before the next piece. tokens
+///         are only computed when a piece is taken, from the steady clock
+///         which is read without a syscall on common platforms, so the
+///         limit stays accurate at any rate. this class is thread safe.
+/// \datamember uint64_t rate
+///             bytes per second. 0 means unlimited.
+/// \datamember uint64_t burst
+///             max tokens saved up when idle
+/// \datamember double tokens
+///             tokens available, negative for debt
+/// \datamember std::chrono::steady_clock::time_point last
+///             last time tokens are computed
+/// \datamember std::mutex _lock
+///             lock of the data members above
+class TokenBucket {
+ private:
+  uint64_t rate = 0;
+  uint64_t burst = 0;
+  double tokens = 0;
+  std::chrono::steady_clock::time_point last;
+  std::mutex _lock;
+
+  /// \brief add tokens filled since last time
+  void _refill(const std::chrono::steady_clock::time_point &now);
+ public:
+  /// \brief constructor
+  /// \param _rate bytes per second. 0 means unlimited.
+  /// \param _burst max tokens. 0 to use a tenth of a second of @_rate.
+  explicit TokenBucket(uint64_t _rate = 0, uint64_t _burst = 0);
+
+  /// \brief change the limit
+  /// \note tokens saved are kept, up to the new burst.
+  void set(uint64_t _rate, uint64_t _burst = 0);
+
+  /// \brief take tokens for a piece
+  /// \param bytes length of the piece
+  /// \return time to wait before the next piece. 0 if no need to wait.
+  std::chrono::nanoseconds consume(uint64_t bytes);
+
+  uint64_t get_rate();
+
+  uint64_t get_burst();
+};
+
+/// \brief parse a rate like 100M, 1.5G or 65536
+/// \detail suffix K, M, G and T are powers of 1000.
+/// \return bytes per second
+/// \throw std::invalid_argument if it's not a rate
+uint64_t parse_rate(const std::string &rate);
+
+/// \brief format bytes per second for human reading
+std::string format_rate(uint64_t rate);
+
+}
+
+#endif //FILE_TRANSFER_RATELIMIT_H_
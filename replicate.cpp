@@ -0,0 +1,417 @@
+#include "replicate.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/asio.hpp>
+
+#include "./third_party/easyloggingpp/src/easylogging++.h"
+
+using namespace replicate;
+using boost::asio::ip::tcp;
+using boost::asio::buffer;
+
+Target Target::parse(const std::string &spec) {
+  auto pos = spec.rfind(':');
+  if (pos == std::string::npos || pos == 0 || pos + 1 == spec.size()) {
+    throw std::invalid_argument("Incorrect server " + spec);
+  }
+  Target target;
+  target.host = spec.substr(0, pos);
+  try {
+    size_t used;
+    target.port = std::stoi(spec.substr(pos + 1), &used);
+    if (used != spec.size() - pos - 1) {
+      throw std::invalid_argument(spec);
+    }
+  }
+  catch (const std::logic_error &e) {
+    throw std::invalid_argument("Incorrect port of server " + spec);
+  }
+  if (target.port <= 0 || target.port > 65535) {
+    throw std::invalid_argument("Incorrect port of server " + spec);
+  }
+  boost::system::error_code ec;
+  boost::asio::ip::address::from_string(target.host, ec);
+  if (ec) {
+    throw std::invalid_argument("Incorrect address of server " + spec);
+  }
+  return target;
+}
+
+Link::Link(const Target &_target,
+           const protocol::AESEncrypter &_enc,
+           const protocol::AESDecrypter &_dec,
+           const std::string &_key_id,
+           const std::string &_session)
+    : target(_target),
+      enc(_enc),
+      dec(_dec),
+      key_id(_key_id),
+      session(_session) {}
+
+void Link::start() {
+  auto self(shared_from_this());
+  std::thread([this, self]() { _negotiate(); }).detach();
+}
+
+void Link::negotiate(uint64_t stream,
+                     uint32_t piece_size,
+                     uint64_t file_length,
+                     uint32_t flags,
+                     const std::string &path) {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    negotiations.push_back({stream, piece_size, file_length, flags, path});
+  }
+  _cv.notify_all();
+}
+
+void Link::forward(uint64_t stream,
+                   uint32_t order,
+                   const std::string &frame,
+                   sent_t sent,
+                   acked_t acked) {
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    if (!broken && refused.find(stream) == refused.end()) {
+      auto &piece = pending[{stream, order}];
+      piece.on_acked.push_back(std::move(acked));
+      if (piece.sent) {
+        // a copy of it is on the way already
+        sent();
+      } else {
+        piece.on_sent.push_back(std::move(sent));
+      }
+      if (!piece.frame) {
+        piece.frame = std::make_shared<const std::string>(
+            protocol::build_msg_transfer(frame, stream));
+        queue.emplace_back(stream, order);
+      }
+      lock.unlock();
+      _cv.notify_all();
+      return;
+    }
+  }
+  sent();
+  acked(false);
+}
+
+void Link::close() {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    closing = true;
+  }
+  _cv.notify_all();
+}
+
+void Link::_complete(std::map<key_t, Piece>::iterator it,
+                     bool ok,
+                     std::vector<std::function<void()>> &callbacks) {
+  for (auto &sent : it->second.on_sent) {
+    callbacks.emplace_back(std::move(sent));
+  }
+  for (auto &acked : it->second.on_acked) {
+    callbacks.emplace_back([acked, ok]() { acked(ok); });
+  }
+  pending.erase(it);
+}
+
+std::vector<std::function<void()>> Link::_break() {
+  std::vector<std::function<void()>> callbacks;
+  broken = true;
+  while (!pending.empty()) {
+    _complete(pending.begin(), false, callbacks);
+  }
+  queue.clear();
+  _cv.notify_all();
+  return callbacks;
+}
+
+void Link::_negotiate() {
+  boost::asio::io_context io_context;
+  tcp::socket sock(io_context);
+  // ciphers are not thread safe, each thread has its copy
+  protocol::AESEncrypter _enc(enc);
+  protocol::AESDecrypter _dec(dec);
+  std::function<std::string(int)> _t = [&sock](int length) {
+    std::string _tmp;
+    _tmp.resize(length);
+    read(sock, buffer(_tmp), boost::asio::transfer_exactly(length));
+    return _tmp;
+  };
+
+  try {
+    sock.connect(tcp::endpoint(
+        boost::asio::ip::address::from_string(target.host), target.port));
+    sock.set_option(tcp::no_delay(true));
+    boost::asio::write(sock, buffer(protocol::build_msg(
+        protocol::server_hello_build(_enc, session, "", key_id))));
+    std::string _sess;
+    std::string ticket;
+    uint64_t lifetime;
+    int status = protocol::client_hello_verify(
+        _dec, protocol::read_msg(_t), _sess, lifetime, ticket);
+    if (status != 0 || _sess != session) {
+      throw std::runtime_error("handshake refused.");
+    }
+  }
+  catch (const std::exception &e) {
+    LOG(ERROR) << "Can't replicate to " << target.str() << ": " << e.what();
+    std::vector<std::function<void()>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      callbacks = _break();
+    }
+    for (auto &callback : callbacks) {
+      callback();
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    alive = target.threads;
+  }
+  auto self(shared_from_this());
+  for (int i = 0; i < target.threads; ++i) {
+    std::thread([this, self, i]() { _transfer(i); }).detach();
+  }
+
+  for (;;) {
+    negotiation_t next;
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _cv.wait(lock, [this]() {
+        return !negotiations.empty() || broken || (closing && alive == 0);
+      });
+      if (negotiations.empty() || broken) {
+        // closing the connection, after the transfer connections, tells
+        // the next server the Session is over
+        return;
+      }
+      next = std::move(negotiations.front());
+      negotiations.pop_front();
+    }
+    int status;
+    try {
+      boost::asio::write(sock, buffer(protocol::build_msg(
+          protocol::file_negotiation_build(_enc,
+                                           session,
+                                           next.stream,
+                                           next.piece_size,
+                                           next.file_length,
+                                           next.flags,
+                                           next.path))));
+      status = protocol::file_negotiation_finish(
+          _dec, protocol::read_msg(_t), session, next.stream);
+    }
+    catch (const std::exception &e) {
+      LOG(ERROR) << "Negotiation with " << target.str() << " broke: "
+                 << e.what();
+      std::vector<std::function<void()>> callbacks;
+      {
+        std::lock_guard<std::mutex> lock(_lock);
+        callbacks = _break();
+      }
+      for (auto &callback : callbacks) {
+        callback();
+      }
+      return;
+    }
+    if (status != 0) {
+      LOG(ERROR) << "Next server " << target.str()
+                 << " can't receive stream " << next.stream << ".";
+    }
+    std::vector<std::function<void()>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      if (status == 0) {
+        accepted.insert(next.stream);
+      } else {
+        refused.insert(next.stream);
+      }
+      if (status != 0 || finished.count(next.stream) > 0) {
+        auto it = pending.lower_bound({next.stream, 0});
+        while (it != pending.end() && it->first.first == next.stream) {
+          _complete(it++, status == 0, callbacks);
+        }
+      }
+    }
+    for (auto &callback : callbacks) {
+      callback();
+    }
+  }
+}
+
+void Link::_transfer(int number) {
+  boost::asio::io_context io_context;
+  tcp::socket sock(io_context);
+  protocol::AESEncrypter _enc(enc);
+  protocol::AESDecrypter _dec(dec);
+  std::function<std::string(int)> _t = [&sock](int length) {
+    std::string _tmp;
+    _tmp.resize(length);
+    read(sock, buffer(_tmp), boost::asio::transfer_exactly(length));
+    return _tmp;
+  };
+  // pieces sent through this connection but not acknowledged
+  std::deque<key_t> in_flight;
+
+  // drop pieces acknowledged, here or through another connection, or
+  // failed. call with @_lock held
+  auto prune = [this, &in_flight]() {
+    in_flight.erase(std::remove_if(
+        in_flight.begin(), in_flight.end(),
+        [this](const key_t &k) { return pending.find(k) == pending.end(); }),
+                    in_flight.end());
+  };
+
+  // receive one ack message and complete the pieces it tells
+  auto read_ack = [&]() {
+    uint64_t stream;
+    uint32_t cumulative;
+    uint32_t base;
+    std::string bitmap;
+    std::string msg = protocol::read_msg_transfer(_t, stream);
+    int status = protocol::file_transfer_confirm(
+        _dec, msg, session, cumulative, base, bitmap);
+    auto orders = protocol::sack_bitmap_read(base, bitmap);
+    std::vector<std::function<void()>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      if (status == 3) {
+        // no room for them yet, send them again a little later
+        for (auto order : orders) {
+          if (pending.find({stream, order}) != pending.end()) {
+            queue.emplace_back(stream, order);
+          }
+          in_flight.erase(std::remove(in_flight.begin(), in_flight.end(),
+                                      std::make_pair(stream, order)),
+                          in_flight.end());
+        }
+        deferred_until = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds(20);
+      } else if (status == 2 && accepted.count(stream) == 0) {
+        // a refused stream is told finished too. which one it is, the
+        // negotiation tells
+        finished.insert(stream);
+      } else {
+        for (auto order : orders) {
+          auto it = pending.find({stream, order});
+          if (it != pending.end()) {
+            _complete(it, status != 1, callbacks);
+          }
+        }
+        if (status != 1) {
+          // lower pieces, or all of a finished stream, are written
+          auto it = pending.lower_bound({stream, 0});
+          while (it != pending.end() && it->first.first == stream
+              && (status == 2 || it->first.second < cumulative)) {
+            _complete(it++, true, callbacks);
+          }
+        }
+      }
+      prune();
+      if (pending.empty()) {
+        _cv.notify_all();
+      }
+    }
+    for (auto &callback : callbacks) {
+      callback();
+    }
+  };
+
+  try {
+    sock.connect(tcp::endpoint(
+        boost::asio::ip::address::from_string(target.host), target.port));
+    boost::asio::write(sock, buffer(protocol::build_msg_transfer(
+        protocol::file_transfer_init(_enc, session, key_id), 0)));
+
+    for (;;) {
+      // take acks already arrived, and wait for them if window is full
+      while ((!in_flight.empty() && in_flight.size() >= window)
+          || sock.available() > 0) {
+        read_ack();
+      }
+
+      key_t next;
+      std::shared_ptr<const std::string> frame;
+      std::vector<sent_t> on_sent;
+      {
+        std::unique_lock<std::mutex> lock(_lock);
+        if (broken) {
+          break;
+        }
+        prune();
+        if (std::chrono::steady_clock::now() >= deferred_until) {
+          while (!queue.empty() && !frame) {
+            next = queue.front();
+            queue.pop_front();
+            auto it = pending.find(next);
+            if (it == pending.end()) {
+              continue;
+            }
+            frame = it->second.frame;
+            if (!it->second.sent) {
+              it->second.sent = true;
+              on_sent.swap(it->second.on_sent);
+            }
+          }
+        }
+        if (!frame && in_flight.empty()) {
+          if (closing && pending.empty()) {
+            break;
+          }
+          if (queue.empty()) {
+            _cv.wait(lock);
+          } else {
+            _cv.wait_until(lock, deferred_until);
+          }
+          continue;
+        }
+      }
+      if (!frame) {
+        // nothing to send, wait until our pieces are acknowledged
+        read_ack();
+        continue;
+      }
+      boost::asio::write(sock, buffer(*frame));
+      in_flight.push_back(next);
+      for (auto &sent : on_sent) {
+        sent();
+      }
+    }
+
+    // send finish packet
+    boost::asio::write(sock, buffer(protocol::build_msg_transfer(
+        protocol::file_transfer_build(_enc, session, 0, 0, 0, " "), 0)));
+  }
+  catch (const std::exception &e) {
+    LOG(ERROR) << "Connection " << number << " to " << target.str()
+               << " broke: " << e.what();
+    std::vector<std::function<void()>> callbacks;
+    {
+      std::lock_guard<std::mutex> lock(_lock);
+      // let other connections send what we didn't get acknowledged
+      for (auto &k : in_flight) {
+        if (pending.find(k) != pending.end()) {
+          queue.push_back(k);
+        }
+      }
+      if (--alive == 0) {
+        callbacks = _break();
+      }
+    }
+    _cv.notify_all();
+    for (auto &callback : callbacks) {
+      callback();
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    --alive;
+  }
+  _cv.notify_all();
+}
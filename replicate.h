@@ -0,0 +1,207 @@
+#ifndef FILE_TRANSFER_REPLICATE_H_
+#define FILE_TRANSFER_REPLICATE_H_
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+#include "protocol.h"
+
+/// \file replicate.h
+/// \brief Header for forwarding uploaded pieces to the next server
+/// \note All things are in `replicate` namespace
+/** CHAIN REPLICATION
+ * A server given the next server of a chain opens a Link to it for each
+ * Session, acting as the client of it: the Link proposes the session id
+ * the client proposed, uses the key the client uses, and negotiates each
+ * file with the stream id the client chose. So a piece is the same
+ * message for both, and once decrypted (the piece verified) it's
+ * forwarded as received, while it's written locally, without being
+ * encrypted again. The next server may forward it further the same way.
+ * The client is acknowledged a piece once it's written locally and the
+ * next server acknowledged it, that is once every server down the chain
+ * has it. A piece the next server refuses, or every connection to it
+ * broken, is reported to the client as failed to write.
+ * All servers of a chain should have the keys clients use.
+ */
+
+namespace replicate {
+
+/// \brief the next server of the chain
+/// \datamember std::string host
+///             ip of the server
+/// \datamember int port
+///             port of the server
+/// \datamember int threads
+///             transfer connections of each Link
+struct Target {
+  std::string host;
+  int port = 0;
+  int threads = 2;
+
+  /// \brief get the server by HOST:PORT
+  /// \throw std::invalid_argument if it's not one
+  static Target parse(const std::string &spec);
+
+  std::string str() const { return host + ":" + std::to_string(port); }
+};
+
+/// \class Link
+/// \brief Class to forward pieces of one Session to the next server
+/// \detail like the client, a thread of its own negotiates files and a
+///         thread for each transfer connection sends pieces and reads
+///         acks, blocking. forward and negotiate are called on the io
+///         thread, and never block it; callbacks are called on the
+///         threads of the Link.
+/// \datamember Target target
+///             the next server
+/// \datamember protocol::AESEncrypter enc
+/// \datamember protocol::AESDecrypter dec
+///             ciphers of the key the client uses, copied by each thread
+/// \datamember std::string key_id
+///             id of the key the client uses
+/// \datamember std::string session
+///             session id the client proposed
+/// \datamember std::deque<negotiation_t> negotiations
+///             files to negotiate
+/// \datamember std::set<uint64_t> accepted
+///             streams the next server accepted
+/// \datamember std::set<uint64_t> refused
+///             streams the next server can't receive
+/// \datamember std::set<uint64_t> finished
+///             streams the next server told finished before it's known
+///             whether it accepted them. acks of different connections
+///             come in any order.
+/// \datamember std::map<key_t, Piece> pending
+///             pieces forwarded and not acknowledged yet, by stream and
+///             order
+/// \datamember std::deque<key_t> queue
+///             pieces to be sent by any connection
+/// \datamember std::chrono::steady_clock::time_point deferred_until
+///             nothing is sent until then, as the next server had no room
+///             for pieces
+/// \datamember int alive
+///             transfer connections not broken
+/// \datamember bool broken
+///             the next server can't be reached, every piece fails
+/// \datamember bool closing
+///             the Session is over, threads exit once nothing is pending
+/// \datamember std::mutex _lock
+///             lock of the data members above
+class Link : public std::enable_shared_from_this<Link> {
+ public:
+  typedef std::function<void()> sent_t;
+  typedef std::function<void(bool)> acked_t;
+ private:
+  typedef std::pair<uint64_t, uint32_t> key_t;
+
+  /// \brief a piece forwarded
+  /// \datamember std::shared_ptr<const std::string> frame
+  ///             the message, kept to send it again
+  /// \datamember bool sent
+  ///             it's been sent once
+  /// \datamember std::vector<sent_t> on_sent
+  ///             called once it's sent
+  /// \datamember std::vector<acked_t> on_acked
+  ///             called once it's acknowledged, or failed
+  struct Piece {
+    std::shared_ptr<const std::string> frame;
+    bool sent = false;
+    std::vector<sent_t> on_sent;
+    std::vector<acked_t> on_acked;
+  };
+
+  /// \brief a file to negotiate
+  struct negotiation_t {
+    uint64_t stream;
+    uint32_t piece_size;
+    uint64_t file_length;
+    uint32_t flags;
+    std::string path;
+  };
+
+  Target target;
+  protocol::AESEncrypter enc;
+  protocol::AESDecrypter dec;
+  std::string key_id;
+  std::string session;
+  std::deque<negotiation_t> negotiations;
+  std::set<uint64_t> accepted;
+  std::set<uint64_t> refused;
+  std::set<uint64_t> finished;
+  std::map<key_t, Piece> pending;
+  std::deque<key_t> queue;
+  std::chrono::steady_clock::time_point deferred_until;
+  int alive = 0;
+  bool broken = false;
+  bool closing = false;
+  std::mutex _lock;
+  std::condition_variable _cv;
+
+  // pieces a connection can have in flight
+  static const int window = 16;
+
+  /// \brief handshake, then negotiate files until closed
+  void _negotiate();
+
+  /// \brief send pieces and read acks through one connection
+  void _transfer(int number);
+
+  /// \brief the next server can't be reached, fail every piece
+  /// \note call with @_lock held, and the returned callbacks without
+  std::vector<std::function<void()>> _break();
+
+  /// \brief a piece is acknowledged or failed
+  /// \note call with @_lock held, and the returned callbacks without
+  void _complete(std::map<key_t, Piece>::iterator it,
+                 bool ok,
+                 std::vector<std::function<void()>> &callbacks);
+ public:
+  /// \brief constructor
+  /// \note call start() to connect
+  Link(const Target &_target,
+       const protocol::AESEncrypter &_enc,
+       const protocol::AESDecrypter &_dec,
+       const std::string &_key_id,
+       const std::string &_session);
+
+  Link(const Link &) = delete;
+
+  /// \brief start the threads connecting to the next server
+  void start();
+
+  /// \brief negotiate a file with the next server
+  /// \detail pieces of it can be forwarded at once.
+  void negotiate(uint64_t stream,
+                 uint32_t piece_size,
+                 uint64_t file_length,
+                 uint32_t flags,
+                 const std::string &path);
+
+  /// \brief forward a piece
+  /// \param frame body of the transfer message the client sent
+  /// \param sent called once it's handed to a connection, or failed
+  /// \param acked called with true once the next server acknowledged it,
+  ///        with false if it failed
+  void forward(uint64_t stream,
+               uint32_t order,
+               const std::string &frame,
+               sent_t sent,
+               acked_t acked);
+
+  /// \brief no more file or piece comes, close once all are acknowledged
+  void close();
+};
+
+}
+
+#endif //FILE_TRANSFER_REPLICATE_H_
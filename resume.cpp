@@ -0,0 +1,222 @@
+#include "resume.h"
+#include "encrypt.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <filesystem>
+
+#include <boost/random/random_device.hpp>
+
+using namespace resume;
+
+namespace fs = std::filesystem;
+
+static std::string _hex(const std::string &data) {
+  static const char *digits = "0123456789abcdef";
+  std::string out;
+  out.reserve(data.size() * 2);
+  for (unsigned char c : data) {
+    out += digits[c >> 4];
+    out += digits[c & 0xF];
+  }
+  return out;
+}
+
+/// \throw std::invalid_argument if not hex
+static std::string _unhex(const std::string &text) {
+  if (text.size() % 2) {
+    throw std::invalid_argument("Odd length of hex.");
+  }
+  std::string out;
+  out.reserve(text.size() / 2);
+  for (size_t i = 0; i < text.size(); i += 2) {
+    out += (char) std::stoul(text.substr(i, 2), nullptr, 16);
+  }
+  return out;
+}
+
+static std::string _sha256(const std::string &data) {
+  unsigned char digest[CryptoPP::SHA256::DIGESTSIZE];
+  CryptoPP::SHA256().CalculateDigest(
+      digest, (const unsigned char *) data.data(), data.size());
+  return std::string((char *) digest, sizeof(digest));
+}
+
+/// \brief HMAC-SHA256 of the data
+static std::string _hmac(const std::string &key, const std::string &data) {
+  // keys longer than a block are hashed first
+  std::string block = key.size() > 64 ? _sha256(key) : key;
+  block.resize(64, '\0');
+  std::string inner(block), outer(block);
+  for (size_t i = 0; i < 64; ++i) {
+    inner[i] ^= 0x36;
+    outer[i] ^= 0x5c;
+  }
+  return _sha256(outer + _sha256(inner + data));
+}
+
+/// \brief key the derived key of the server is sealed with in the cache
+static std::string _seal(const std::string &pass, const std::string &server) {
+  return _hmac(_hmac(pass, "resumption cache seal"), server);
+}
+
+/// \brief xor of two strings, as long as the shorter
+static std::string _xor(const std::string &a, const std::string &b) {
+  std::string out(std::min(a.size(), b.size()), '\0');
+  for (size_t i = 0; i < out.size(); ++i) {
+    out[i] = a[i] ^ b[i];
+  }
+  return out;
+}
+
+/// \brief write the cache again with the entry of the server replaced
+/// \param entry new entry, nullptr to remove it
+static void _rewrite(const std::string &path,
+                     const std::string &server,
+                     const std::string &pass,
+                     const Entry *entry) {
+  std::string fp = fingerprint(pass);
+  std::vector<std::string> lines;
+  {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      std::string _server, _fp;
+      fields >> _server >> _fp;
+      if (_server != server || _fp != fp) {
+        lines.push_back(line);
+      }
+    }
+  }
+  if (entry) {
+    lines.push_back(server + " " + fp + " " + std::to_string(entry->expiry)
+                        + " " + _hex(entry->ticket) + " "
+                        + _hex(_xor(entry->derived, _seal(pass, server))));
+  }
+
+  // replaced at once, so another run reading it meanwhile sees either
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    if (!out) {
+      LOG(WARNING) << "Can't write resumption cache " << path << ".";
+      return;
+    }
+    std::error_code ec;
+    fs::permissions(tmp, fs::perms::owner_read | fs::perms::owner_write,
+                    fs::perm_options::replace, ec);
+    for (auto &l : lines) {
+      out << l << "\n";
+    }
+  }
+  std::error_code ec;
+  fs::rename(tmp, path, ec);
+  if (ec) {
+    LOG(WARNING) << "Can't write resumption cache " << path << ": "
+                 << ec.message();
+  }
+}
+
+uint64_t resume::now() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string resume::fingerprint(const std::string &pass) {
+  return _hex(_hmac(pass, "resumption cache")).substr(0, 16);
+}
+
+std::string resume::ticket_secret(const std::string &path) {
+  std::string secret;
+  if (!path.empty()) {
+    std::ifstream in(path);
+    if (in) {
+      std::string text;
+      in >> text;
+      try {
+        secret = _unhex(text);
+      }
+      catch (const std::logic_error &e) {}
+      if (secret.size() != 32) {
+        throw std::invalid_argument("Incorrect ticket key file " + path);
+      }
+      return secret;
+    }
+  }
+
+  boost::random::random_device rng;
+  while (secret.size() < 32) {
+    unsigned int r = rng();
+    secret.append((const char *) &r, sizeof(r));
+  }
+  if (path.empty()) {
+    return secret;
+  }
+  {
+    std::ofstream out(path, std::ios::trunc);
+    std::error_code ec;
+    fs::permissions(path, fs::perms::owner_read | fs::perms::owner_write,
+                    fs::perm_options::replace, ec);
+    out << _hex(secret) << "\n";
+    if (!out) {
+      throw std::invalid_argument("Can't write ticket key file " + path);
+    }
+  }
+  LOG(INFO) << "New ticket key saved in " << path << ".";
+  return secret;
+}
+
+std::string resume::ticket_key(const std::string &secret,
+                               const std::string &derived) {
+  return _hmac(secret, derived);
+}
+
+bool resume::load(const std::string &path,
+                  const std::string &server,
+                  const std::string &pass,
+                  Entry &entry,
+                  uint64_t margin) {
+  std::string fp = fingerprint(pass);
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string _server, _fp, _ticket, _sealed;
+    uint64_t _expiry = 0;
+    fields >> _server >> _fp >> _expiry >> _ticket >> _sealed;
+    if (_server != server || _fp != fp) {
+      continue;
+    }
+    std::string derived;
+    try {
+      entry.ticket = _unhex(_ticket);
+      derived = _xor(_unhex(_sealed), _seal(pass, server));
+    }
+    catch (const std::logic_error &e) {
+      return false;
+    }
+    if (derived.size() == 32) {
+      entry.derived = derived;
+    }
+    entry.expiry = _expiry;
+    return !entry.ticket.empty() && entry.expiry > now() + margin;
+  }
+  return false;
+}
+
+void resume::save(const std::string &path,
+                  const std::string &server,
+                  const std::string &pass,
+                  const Entry &entry) {
+  _rewrite(path, server, pass, &entry);
+}
+
+void resume::forget(const std::string &path,
+                    const std::string &server,
+                    const std::string &pass) {
+  _rewrite(path, server, pass, nullptr);
+}
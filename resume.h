@@ -0,0 +1,89 @@
+#ifndef FILE_TRANSFER_RESUME_H_
+#define FILE_TRANSFER_RESUME_H_
+
+#include <string>
+#include <cstdint>
+
+/// \file resume.h
+/// \brief Header for session resumption
+/// \note All things are in `resume` namespace
+/** RESUMPTION
+ * The server issues a ticket in the Client Hello, encrypted with a key
+ * made from a secret only the server knows and the client's key. The
+ * secret is kept in a file, so tickets outlive a restart. A client
+ * caches the ticket on disk, and a later run within the ticket lifetime
+ * skips waiting for the Client Hello: it sends the ticket in the Server
+ * Hello, and the server goes on to File Negotiation without replying.
+ * The key derived from the passphrase is cached along, so a later run
+ * doesn't derive it again.
+ * Cache file lines:
+ * SERVER FINGERPRINT EXPIRY TICKET KEY
+ * where SERVER is host:port, followed by #KEY_ID if the key has an id,
+ * FINGERPRINT is an HMAC of the passphrase, EXPIRY is in seconds since
+ * epoch of the client's clock, KEY is the derived key sealed with a key
+ * made from the passphrase, and binary fields are in hex. Guessing the
+ * passphrase from the file costs a hash a guess, not a key derivation
+ * like guessing it from the handshake, so the file is only readable by
+ * its owner.
+ */
+
+namespace resume {
+
+/// \brief a cached resumption of a server
+/// \datamember std::string ticket
+///             ticket issued by the server, empty if none
+/// \datamember uint64_t expiry
+///             seconds since epoch the ticket is valid until
+/// \datamember std::string derived
+///             key derived from the passphrase, empty if none
+struct Entry {
+  std::string ticket;
+  uint64_t expiry = 0;
+  std::string derived;
+};
+
+/// \brief seconds since epoch
+uint64_t now();
+
+/// \brief tell which key an entry is for
+/// \param pass passphrase of the key
+std::string fingerprint(const std::string &pass);
+
+/// \brief read the secret the server issues tickets with
+/// \detail made at random and saved, readable by its owner only, if the
+///         file doesn't exist
+/// \param path file of the secret, empty for a secret of this run only
+/// \throw std::invalid_argument if it can't be read or saved
+std::string ticket_secret(const std::string &path);
+
+/// \brief key the server issues tickets of a client key with
+/// \param secret the server's ticket secret, never sent to clients
+/// \param derived key derived from the passphrase of the client key
+std::string ticket_key(const std::string &secret, const std::string &derived);
+
+/// \brief find the entry of the server and key
+/// \detail the derived key is filled in even if the ticket is expiring
+/// \param pass passphrase of the key
+/// \param margin seconds the ticket should still be valid for
+/// \return false if none, or the ticket is expiring
+bool load(const std::string &path,
+          const std::string &server,
+          const std::string &pass,
+          Entry &entry,
+          uint64_t margin = 60);
+
+/// \brief replace the entry of the server and key
+/// \param pass passphrase of the key, @entry.derived is sealed with
+void save(const std::string &path,
+          const std::string &server,
+          const std::string &pass,
+          const Entry &entry);
+
+/// \brief remove the entry of the server and key
+void forget(const std::string &path,
+            const std::string &server,
+            const std::string &pass);
+
+}
+
+#endif //FILE_TRANSFER_RESUME_H_
@@ -9,11 +9,27 @@
 #include <utility>
 #include <string>
 #include <functional>
+#include <algorithm>
+#include <map>
+#include <deque>
+#include <list>
+#include <chrono>
+#include <sstream>
+#include <fstream>
 
 #include "./third_party/cxxopts/include/cxxopts.hpp"
 
 #include "file.h"
 #include "protocol.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "storage.h"
+#include "udp.h"
+#include "sockopt.h"
+#include "resume.h"
+#include "tenant.h"
+#include "deliver.h"
+#include "replicate.h"
 
 INITIALIZE_EASYLOGGINGPP
 
@@ -35,43 +51,1047 @@ using boost::asio::buffer;
 
 protocol::Randomsession sess_gen;
 
+metrics::Counter m_accepted(
+    "fileuploader_connections_accepted_total", "Connections accepted.");
+metrics::Counter m_handshake_failed(
+    "fileuploader_handshakes_failed_total",
+    "Connections closed as not our client or not connected session.");
+metrics::Counter m_frames(
+    "fileuploader_frames_received_total", "Transfer frames received.");
+metrics::Counter m_bytes_received(
+    "fileuploader_bytes_received_total", "Bytes of transfer frames received.");
+metrics::Counter m_bytes_decrypted(
+    "fileuploader_bytes_decrypted_total",
+    "Bytes of transfer frames decrypted.");
+metrics::Counter m_bytes_written(
+    "fileuploader_bytes_written_total", "Bytes of pieces written into files.");
+metrics::Counter m_write_failed(
+    "fileuploader_write_failures_total", "Pieces failed to write.");
+metrics::Counter m_bytes_fetched(
+    "fileuploader_bytes_fetched_total",
+    "Bytes of pieces read from files clients fetch.");
+metrics::Counter m_bytes_replicated(
+    "fileuploader_bytes_replicated_total",
+    "Bytes of pieces the next server of the chain acknowledged.");
+
+// file to append latency percentiles of each finished Session to
+std::string latency_json;
+
+// how files received are stored
+file::write_options storage_options;
+
+// directories files are spread over, empty to store as the client names them
+storage::Layout layout;
+
+// settings of transfer sockets
+sockopt::options socket_options;
+
+// seconds a resumption ticket is valid for
+uint64_t ticket_lifetime;
+
+// where files are delivered in order as they arrive, nullptr if not
+std::shared_ptr<deliver::Output> delivery;
+
+// bytes of pieces ahead of what's delivered kept of each file
+uint64_t reorder_buffer;
+
+// next server of the chain uploads are replicated to, nullptr if not
+std::shared_ptr<replicate::Target> replica_target;
+
+// clients can fetch files stored
+bool allow_fetch = false;
+
 class Session;
 
 
+/// \class Scheduler
+/// \brief Class to share decrypting and writing work between Sessions
+/// \detail a Thread hands every received piece to the Scheduler and doesn't
+///         read the next one until the piece is handled, so a Session can't
+///         get more than its share by opening more connections. pieces are
+///         picked by deficit round-robin over the Sessions, each Session
+///         getting quantum * weight bytes per round. pieces of small files
+///         are queued in a separate lane served first, so small uploads
+///         don't wait behind large ones. no work is held back while
+///         anything is queued, so total throughput is unchanged.
+/// \datamember boost::asio::io_context &io_context_
+///             io_context to run the work on
+/// \datamember boost::asio::steady_timer timer_
+///             timer to report stats
+/// \datamember uint32_t quantum
+///             bytes a Session of weight 1 can handle per round
+/// \datamember uint64_t small
+///             files not larger than this go to the small lane
+/// \datamember int interval
+///             seconds between stats reports. 0 to disable.
+/// \datamember std::unordered_map<std::string, uint32_t> weights
+///             weight of client addresses. others have weight 1.
+/// \datamember std::deque<std::shared_ptr<Flow>> active[2]
+///             Flows with queued pieces in each lane, in round-robin order
+/// \datamember std::list<std::shared_ptr<Flow>> flows
+///             Flows of all Sessions not finished
+/// \datamember uint64_t total
+///             bytes handled since started
+/// \datamember uint64_t _reported
+///             value of total at last stats report
+/// \datamember bool _posted
+///             whether a run is posted to the io_context already
+/// \datamember uint64_t queued_pieces
+///             pieces queued in all lanes
+/// \datamember uint64_t queued_bytes
+///             bytes queued in all lanes
+class Scheduler {
+ public:
+  enum lane_t { SMALL = 0, BULK = 1 };
+  typedef std::function<void()> job_t;
+
+  /// \brief a piece waiting to be handled
+  struct Job {
+    job_t run;
+    uint32_t cost;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  /// \brief queued work and stats of one Session
+  struct Flow {
+    std::string name;
+    uint32_t weight;
+    // stats
+    uint64_t bytes = 0;
+    uint64_t jobs = 0;
+    uint64_t wait_us = 0;
+    uint64_t _total_at_open = 0;
+    uint64_t _reported = 0;
+    // scheduling state of each lane
+    std::deque<Job> queue[2];
+    int64_t deficit[2] = {0, 0};
+    bool active[2] = {false, false};
+    bool fresh[2] = {true, true};
+  };
+
+ private:
+  boost::asio::io_context &io_context_;
+  boost::asio::steady_timer timer_;
+  uint32_t quantum;
+  uint64_t small;
+  int interval;
+  std::unordered_map<std::string, uint32_t> weights;
+  std::deque<std::shared_ptr<Flow>> active[2];
+  std::list<std::shared_ptr<Flow>> flows;
+  uint64_t total = 0;
+  uint64_t _reported = 0;
+  bool _posted = false;
+  uint64_t queued_pieces = 0;
+  uint64_t queued_bytes = 0;
+
+  // bytes handled before letting pending reads complete
+  static const uint64_t batch = 1048576;
+
+ public:
+  /// \brief constructor
+  /// \note this constructor simply initialize its members. for detailed
+  ///       infomation, see class's datamenber explanation.
+  Scheduler(
+      boost::asio::io_context &io_context,
+      const uint32_t &_quantum,
+      const uint64_t &_small,
+      const int &_interval,
+      std::unordered_map<std::string, uint32_t> _weights
+  ) :
+      io_context_(io_context),
+      timer_(io_context),
+      quantum(_quantum),
+      small(_small),
+      interval(_interval),
+      weights(std::move(_weights)) {
+    if (interval > 0) {
+      _report();
+    }
+  }
+
+  /// \brief get the lane for pieces of a file
+  lane_t lane_of(uint64_t file_size) {
+    return file_size <= small ? SMALL : BULK;
+  }
+
+  uint64_t get_queued_pieces() { return queued_pieces; }
+
+  uint64_t get_queued_bytes() { return queued_bytes; }
+
+  /// \brief register a Session
+  /// \param name client address of the Session
+  std::shared_ptr<Flow> open(const std::string &name) {
+    auto flow = std::make_shared<Flow>();
+    flow->name = name;
+    auto it = weights.find(name);
+    flow->weight = it == weights.end() ? 1 : it->second;
+    flow->_total_at_open = total;
+    flows.push_back(flow);
+    return flow;
+  }
+
+  /// \brief unregister a finished Session and log its stats
+  void close(const std::shared_ptr<Flow> &flow) {
+    auto it = std::find(flows.begin(), flows.end(), flow);
+    if (it == flows.end()) {
+      return;
+    }
+    flows.erase(it);
+    uint64_t during = total - flow->_total_at_open;
+    LOG(INFO) << "Session from " << flow->name << " (weight " << flow->weight
+              << ") handled " << flow->bytes << " bytes in " << flow->jobs
+              << " pieces, "
+              << (during ? flow->bytes * 100.0 / during : 100.0)
+              << "% of server share, average wait "
+              << (flow->jobs ? flow->wait_us / flow->jobs : 0) << "us.";
+  }
+
+  /// \brief queue a piece of a Session
+  /// \param cost bytes of the piece
+  /// \param run work to handle the piece
+  void submit(const std::shared_ptr<Flow> &flow,
+              lane_t lane,
+              uint32_t cost,
+              job_t run) {
+    flow->queue[lane].push_back(
+        {std::move(run), cost, std::chrono::steady_clock::now()});
+    ++queued_pieces;
+    queued_bytes += cost;
+    if (!flow->active[lane]) {
+      flow->active[lane] = true;
+      active[lane].push_back(flow);
+    }
+    _post();
+  }
+
+ private:
+  void _post() {
+    if (_posted) {
+      return;
+    }
+    _posted = true;
+    boost::asio::post(io_context_, [this]() { _run(); });
+  }
+
+  /// \brief handle queued pieces
+  /// \detail at most a batch is handled at once, then reads completed
+  ///         meanwhile get in the queues before the next batch.
+  void _run() {
+    _posted = false;
+    uint64_t done = 0;
+    while (done < batch) {
+      int lane = active[SMALL].empty() ? BULK : SMALL;
+      if (active[lane].empty()) {
+        return;
+      }
+      std::shared_ptr<Flow> flow = active[lane].front();
+      if (flow->fresh[lane]) {
+        // new round for this Flow
+        flow->deficit[lane] += (int64_t) quantum * flow->weight;
+        flow->fresh[lane] = false;
+      }
+      auto &queue = flow->queue[lane];
+      if (queue.front().cost > flow->deficit[lane]) {
+        // used up its quantum, next Flow's turn
+        active[lane].pop_front();
+        active[lane].push_back(flow);
+        flow->fresh[lane] = true;
+        continue;
+      }
+      Job job = std::move(queue.front());
+      queue.pop_front();
+      flow->deficit[lane] -= job.cost;
+      if (queue.empty()) {
+        // idle Flows don't save up deficit
+        flow->deficit[lane] = 0;
+        flow->fresh[lane] = true;
+        flow->active[lane] = false;
+        active[lane].pop_front();
+      }
+
+      flow->bytes += job.cost;
+      ++flow->jobs;
+      flow->wait_us += std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - job.queued).count();
+      total += job.cost;
+      done += job.cost;
+      --queued_pieces;
+      queued_bytes -= job.cost;
+
+      job.run();
+    }
+    if (!active[SMALL].empty() || !active[BULK].empty()) {
+      _post();
+    }
+  }
+
+  /// \brief log share of each Session every interval
+  void _report() {
+    timer_.expires_after(std::chrono::seconds(interval));
+    timer_.async_wait([this](boost::system::error_code ec) {
+      if (ec) {
+        return;
+      }
+      uint64_t during = total - _reported;
+      for (auto &flow : flows) {
+        uint64_t bytes = flow->bytes - flow->_reported;
+        flow->_reported = flow->bytes;
+        if (bytes == 0) {
+          continue;
+        }
+        LOG(INFO) << "Session from " << flow->name << " (weight "
+                  << flow->weight << "): " << bytes << " bytes, "
+                  << bytes * 100.0 / during << "% of server share, "
+                  << flow->queue[SMALL].size() + flow->queue[BULK].size()
+                  << " pieces queued.";
+      }
+      _reported = total;
+      _report();
+    });
+  }
+};
+
+
+/// \class Limiter
+/// \brief Class to hold rate limits of the server
+/// \detail every received piece takes tokens from the global bucket and
+///         the bucket of its Session. the Thread waits for the longer of
+///         them before reading the next piece, so the client is slowed
+///         down by TCP flow control.
+/// \datamember ratelimit::TokenBucket global
+///             limit of all Sessions together
+/// \datamember uint64_t session_rate
+///             limit of each Session. 0 means unlimited.
+/// \datamember uint64_t session_burst
+///             burst of each Session. 0 to use a tenth of a second.
+/// \datamember std::list<std::weak_ptr<ratelimit::TokenBucket>> sessions
+///             buckets of Sessions, to apply changed limits
+class Limiter {
+ public:
+  ratelimit::TokenBucket global;
+ private:
+  uint64_t session_rate;
+  uint64_t session_burst;
+  std::list<std::weak_ptr<ratelimit::TokenBucket>> sessions;
+ public:
+  /// \brief constructor
+  /// \note this constructor simply initialize its members. for detailed
+  ///       infomation, see class's datamenber explanation.
+  Limiter(
+      const uint64_t &rate,
+      const uint64_t &burst,
+      const uint64_t &_session_rate,
+      const uint64_t &_session_burst
+  ) :
+      global(rate, burst),
+      session_rate(_session_rate),
+      session_burst(_session_burst) {}
+
+  /// \brief create the bucket of a new Session
+  std::shared_ptr<ratelimit::TokenBucket> open() {
+    auto bucket =
+        std::make_shared<ratelimit::TokenBucket>(session_rate, session_burst);
+    sessions.push_back(bucket);
+    return bucket;
+  }
+
+  /// \brief change the limit of every Session
+  void set_session(uint64_t rate, uint64_t burst) {
+    session_rate = rate;
+    session_burst = burst;
+    for (auto it = sessions.begin(); it != sessions.end();) {
+      auto bucket = it->lock();
+      if (bucket) {
+        bucket->set(rate, burst);
+        ++it;
+      } else {
+        it = sessions.erase(it);
+      }
+    }
+  }
+
+  uint64_t get_session_rate() { return session_rate; }
+
+  uint64_t get_session_burst() { return session_burst; }
+
+  /// \brief take tokens for a received piece
+  /// \return time to wait before reading the next piece
+  std::chrono::nanoseconds consume(ratelimit::TokenBucket &session,
+                                   uint64_t bytes) {
+    return std::max(global.consume(bytes), session.consume(bytes));
+  }
+};
+
+
+/// \class Replay
+/// \brief Class to refuse Server Hellos recorded and sent again
+/// \detail a hello sent more than HELLO_FRESHNESS seconds away from now is
+///         refused. sessions accepted are kept until hellos of their time
+///         are refused anyway, and a hello proposing one of them is
+///         refused too.
+/// \datamember std::unordered_map<std::string, uint64_t> seen
+///             session - time its hello was sent pair of sessions accepted
+/// \datamember std::multimap<uint64_t, std::string> by_time
+///             the same pairs by time, to forget them
+class Replay {
+ private:
+  std::unordered_map<std::string, uint64_t> seen;
+  std::multimap<uint64_t, std::string> by_time;
+
+  /// \brief forget sessions whose hello would be refused as stale now
+  void _forget(uint64_t now) {
+    while (!by_time.empty()
+        && by_time.begin()->first + HELLO_FRESHNESS < now) {
+      seen.erase(by_time.begin()->second);
+      by_time.erase(by_time.begin());
+    }
+  }
+
+ public:
+  /// \brief tell if a hello may be accepted
+  /// \param session session it proposes
+  /// \param sent when it was sent
+  bool fresh(const std::string &session, uint64_t sent) {
+    uint64_t now = resume::now();
+    _forget(now);
+    return sent + HELLO_FRESHNESS >= now && sent <= now + HELLO_FRESHNESS
+        && seen.find(session) == seen.end();
+  }
+
+  /// \brief remember the session of a hello accepted
+  void accept(const std::string &session, uint64_t sent) {
+    if (seen.emplace(session, sent).second) {
+      by_time.emplace(sent, session);
+    }
+  }
+};
+
+
+/// \class Stream
+/// \brief Class to hold one file uploaded in a Session
+/// \detail a Session can upload many files one after another or at the same
+///         time. each of them is a Stream, and pieces of all Streams share
+///         the transfer connections of the Session.
+/// \datamember enum s_code { TRANSFERRING, SYNCING, FINISHED }
+///             indicate Stream status
+///             SYNCING: every piece is written, and the file is being
+///             synced before the last piece is acknowledged.
+/// \datamember uint32_t max_ahead
+///             pieces of a streamed file taken past the cumulative ack.
+///             more would grow @received, and the file, as far as an
+///             order a client sends.
+/// \datamember s_code status
+///             store status
+/// \datamember uint64_t id
+///             stream id chosen by the client
+/// \datamember uint32_t piece_size
+///             transfer file piece size
+/// \datamember uint64_t file_size
+///             size of the file
+/// \datamember bool open
+///             the file is streamed and its end piece is not received
+///             yet, so its size is unknown and pieces of any order are
+///             taken
+/// \datamember std::shared_ptr<file::writer> _f
+///             a shared pointer of writer object
+/// \datamember storage::Root *root
+///             Root the file is placed under, whose I/O threads write it.
+///             nullptr to write on the io thread.
+/// \datamember std::shared_ptr<deliver::Reorder> reorder
+///             delivering the file in order, nullptr if not delivered
+/// \datamember std::vector<bool> received
+///             whether each piece has been written into file. of a
+///             streamed file, it grows as pieces come, and the end piece
+///             counts as a piece written.
+/// \datamember uint32_t cumulative
+///             every piece with lower order has been written into file
+/// \datamember uint32_t written
+///             count of pieces written into file
+/// \datamember bool keeps
+///             the writer may keep pieces to write later, and tells once
+///             they're written
+/// \datamember std::map<uint32_t, std::vector<std::shared_ptr<std::function<void(bool)>>>> kept
+///             what to do once each piece passed to the writer is written,
+///             if @keeps
+/// \datamember std::chrono::steady_clock::time_point kept_at
+///             time a piece was kept last
+/// \datamember bool flushing
+///             pieces kept are to be written once no piece is kept for a
+///             while
+class Stream {
+ public:
+  enum s_code { TRANSFERRING, SYNCING, FINISHED };
+  static const uint32_t max_ahead = 65536;
+  s_code status = TRANSFERRING;
+  uint64_t id;
+  uint32_t piece_size;
+  uint64_t file_size;
+  bool open;
+  std::shared_ptr<file::writer> _f;
+  storage::Root *root = nullptr;
+  std::shared_ptr<deliver::Reorder> reorder;
+  bool keeps = false;
+  std::chrono::steady_clock::time_point kept_at;
+  bool flushing = false;
+ private:
+  std::vector<bool> received;
+  uint32_t cumulative = 0;
+  uint32_t written = 0;
+  std::map<uint32_t, std::vector<std::shared_ptr<std::function<void(bool)>>>>
+      kept;
+ public:
+  /// \brief constructor
+  /// \note this constructor simply initialize its members. for detailed
+  ///       infomation, see class's datamenber explanation.
+  Stream(
+      const uint64_t &_id,
+      const uint32_t &_piece_size,
+      const uint64_t &_file_size,
+      std::shared_ptr<file::writer> f,
+      bool streaming = false
+  ) :
+      id(_id),
+      piece_size(_piece_size),
+      file_size(_file_size),
+      open(streaming),
+      _f(std::move(f)) {
+    received.assign((file_size + piece_size - 1) / piece_size, false);
+  }
+
+  /// \brief check if the order stands for a piece of the file
+  bool in_file(uint32_t order) { return open || order < received.size(); }
+
+  /// \brief check if a piece of a streamed file is too far ahead to take
+  ///        yet. its size is unknown, so pieces are only taken up to
+  ///        @max_ahead orders past the cumulative ack.
+  bool too_far(uint32_t order) {
+    return open && order >= cumulative && order - cumulative >= max_ahead;
+  }
+
+  /// \brief check if the piece has been written already
+  /// \detail during end-game the client sends duplicates of outstanding
+  ///         pieces, only the first copy is written.
+  bool is_received(uint32_t order) {
+    return order < received.size() && received[order];
+  }
+
+  /// \brief check if the piece is the only one not written yet
+  bool is_last(uint32_t order) {
+    return !open && !is_received(order) && written + 1 == received.size();
+  }
+
+  /// \brief end piece of a streamed file received notify
+  /// \param order order of the end piece
+  /// \param length file length it tells
+  /// \return false if it doesn't agree with pieces received
+  bool end(uint32_t order, uint64_t length) {
+    uint64_t pieces = (length + piece_size - 1) / piece_size;
+    if (!open || pieces != order || received.size() > order + 1) {
+      return false;
+    }
+    open = false;
+    file_size = length;
+    received.resize(order + 1, false);
+    return true;
+  }
+
+  /// \brief piece written notify
+  /// \param order order of the written piece
+  /// \return true if this was the last piece of the file
+  bool piece_written(uint32_t order) {
+    if (order >= received.size()) {
+      received.resize(order + 1, false);
+    }
+    if (!received[order]) {
+      received[order] = true;
+      ++written;
+    }
+    while (cumulative < received.size() && received[cumulative]) {
+      ++cumulative;
+    }
+    return !open && cumulative == received.size();
+  }
+
+  /// \brief get cumulative ack of the file
+  uint32_t get_cumulative() { return cumulative; }
+
+  /// \brief wait for the piece passed to the writer to be written. it's
+  ///        done before writing, the writer may tell it written from
+  ///        another thread before its write returns
+  void keep(uint32_t order,
+            const std::shared_ptr<std::function<void(bool)>> &done) {
+    kept[order].push_back(done);
+  }
+
+  /// \brief stop waiting, the write of the piece returned that it's done
+  /// \return false if the writer told it written already
+  bool unkeep(uint32_t order,
+              const std::shared_ptr<std::function<void(bool)>> &done) {
+    auto it = kept.find(order);
+    if (it == kept.end()) {
+      return false;
+    }
+    auto &waiting = it->second;
+    auto found = std::find(waiting.begin(), waiting.end(), done);
+    if (found == waiting.end()) {
+      return false;
+    }
+    waiting.erase(found);
+    if (waiting.empty()) {
+      kept.erase(it);
+    }
+    return true;
+  }
+
+  /// \brief the writer wrote a piece it kept, or failed to
+  void kept_written(uint32_t order, bool ok) {
+    auto it = kept.find(order);
+    if (it == kept.end()) {
+      return;
+    }
+    auto waiting = std::move(it->second);
+    kept.erase(it);
+    for (auto &done : waiting) {
+      (*done)(ok);
+    }
+  }
+
+  /// \brief check if pieces are waiting for the writer
+  bool has_kept() { return !kept.empty(); }
+
+  /// \brief close the file
+  /// \return false if it was finished already
+  bool finish() {
+    if (status == FINISHED) {
+      return false;
+    }
+    status = FINISHED;
+    _f->close();
+    if (root) {
+      root->release();
+    }
+    if (reorder) {
+      if (!open && cumulative == received.size()) {
+        reorder->end();
+      } else {
+        reorder->abort();
+      }
+    }
+    return true;
+  }
+};
+
+/// \class Fetch
+/// \brief Class to hold one file a client fetches in a Session
+/// \detail the other way of a Stream: pieces are read from the file and
+///         sent through the Threads of the Session, each taking the next
+///         piece while it has room for more. pieces sent through a
+///         connection that broke, or the client failed writing, are sent
+///         again by any Thread.
+/// \datamember enum s_code { TRANSFERRING, FINISHED }
+///             indicate Fetch status
+/// \datamember s_code status
+///             store status
+/// \datamember uint64_t id
+///             stream id chosen by the client
+/// \datamember uint32_t piece_size
+///             transfer file piece size
+/// \datamember uint64_t file_size
+///             size of the file
+/// \datamember std::shared_ptr<file::reader> _f
+///             a shared pointer of reader object, reset once finished
+/// \datamember storage::Root *root
+///             Root the file is under, whose I/O threads read it.
+///             nullptr to read on the io thread.
+/// \datamember std::vector<bool> acked
+///             whether each piece is acknowledged by the client
+/// \datamember uint32_t cumulative
+///             every piece with lower order is acknowledged
+/// \datamember uint32_t next
+///             the piece never sent to take next
+/// \datamember std::deque<uint32_t> resend_queue
+///             pieces to be sent again
+class Fetch {
+ public:
+  enum s_code { TRANSFERRING, FINISHED };
+  s_code status = TRANSFERRING;
+  uint64_t id;
+  uint32_t piece_size;
+  uint64_t file_size;
+  std::shared_ptr<file::reader> _f;
+  storage::Root *root = nullptr;
+ private:
+  std::vector<bool> acked;
+  uint32_t cumulative = 0;
+  uint32_t next = 0;
+  std::deque<uint32_t> resend_queue;
+ public:
+  /// \brief constructor
+  /// \note this constructor simply initialize its members. for detailed
+  ///       infomation, see class's datamenber explanation.
+  Fetch(
+      const uint64_t &_id,
+      const uint32_t &_piece_size,
+      const uint64_t &_file_size,
+      std::shared_ptr<file::reader> f
+  ) :
+      id(_id),
+      piece_size(_piece_size),
+      file_size(_file_size),
+      _f(std::move(f)) {
+    acked.assign((file_size + piece_size - 1) / piece_size, false);
+  }
+
+  /// \brief count of pieces of the file
+  uint32_t pieces() { return acked.size(); }
+
+  /// \brief size of the piece
+  uint32_t size_of(uint32_t order) {
+    return std::min<uint64_t>(piece_size,
+                              file_size - (uint64_t) order * piece_size);
+  }
+
+  /// \brief take the next piece to send, pieces to send again first
+  /// \return false if there's none
+  bool next_piece(uint32_t &order) {
+    while (!resend_queue.empty()) {
+      order = resend_queue.front();
+      resend_queue.pop_front();
+      if (!acked[order]) {
+        return true;
+      }
+    }
+    if (status == FINISHED || next >= acked.size()) {
+      return false;
+    }
+    order = next++;
+    return true;
+  }
+
+  /// \brief send the piece again
+  void resend(uint32_t order) {
+    if (status != FINISHED && order < acked.size() && !acked[order]) {
+      resend_queue.push_back(order);
+    }
+  }
+
+  /// \brief check if the piece needn't be sent anymore
+  bool is_acked(uint32_t order) {
+    return status == FINISHED || order >= acked.size() || acked[order];
+  }
+
+  /// \brief acknowledge received notify
+  /// \param _cumulative every piece with lower order is written by the
+  ///        client
+  /// \param orders other pieces written
+  /// \return true if every piece is acknowledged
+  bool ack(uint32_t _cumulative, const std::vector<uint32_t> &orders) {
+    for (uint32_t i = cumulative;
+         i < std::min<size_t>(_cumulative, acked.size()); ++i) {
+      acked[i] = true;
+    }
+    for (auto order : orders) {
+      if (order < acked.size()) {
+        acked[order] = true;
+      }
+    }
+    while (cumulative < acked.size() && acked[cumulative]) {
+      ++cumulative;
+    }
+    return cumulative == acked.size();
+  }
+
+  /// \brief close the file
+  /// \return false if it was finished already
+  bool finish() {
+    if (status == FINISHED) {
+      return false;
+    }
+    status = FINISHED;
+    resend_queue.clear();
+    // pieces being read hold the reader till they're done
+    _f.reset();
+    if (root) {
+      root->release();
+    }
+    return true;
+  }
+};
+
 /// \class Thread
 /// \brief Class to handle a transfer thread
 /// \detail this class will interact with a incoming thread and receive data
-///         from it. It should be instanced only by Session
+///         from it. It should be instanced only by Session. pieces of any
+///         Stream of the Session can come from it. how messages are received
+///         and acks are sent depends on the transport, see TcpThread and
+///         UdpThread.
 /// \datamember int number
 ///             thread number
-/// \datamember tcp::socket socket_
-///             transfer thread socket
+/// \datamember executor_t executor_
+///             executor of the transport, where everything of it runs
 /// \datamember protocol::AESEncrypter enc
 ///             encrypter object
 /// \datamember protocol::AESDecrypter dec
 ///             decrypter object
-/// \datamember std::shared_ptr<file::file_writer> _f
-///             a shared pointer of file writer object
 /// \datamember std::weak_ptr<Session> _sess
 ///             a weak pointer to the Session launched this Thread
 ///             use to inform finish
-/// \datamember std::string _tmp
-///             temp for storing data received in asynchorous operation
 /// \datamember std::string session;
 ///             session id of this connection
-/// \datamember uint32_t piece_size;
-///             transfer file piece size
+/// \datamember std::map<uint64_t, std::vector<uint32_t>> _acked
+///             orders of pieces written but not acknowledged yet, by stream
+/// \datamember std::map<uint64_t, std::vector<uint32_t>> _failed
+///             orders of pieces failed to write and not reported yet,
+///             by stream
+/// \datamember std::map<uint64_t, std::vector<uint32_t>> _busy
+///             orders of pieces too far ahead of what's delivered, or
+///             written of a streamed file, and not reported yet, by stream
+/// \datamember std::vector<uint64_t> _cancelled
+///             finished streams the client should be told to stop sending
+/// \datamember std::deque<std::pair<std::shared_ptr<Fetch>, uint32_t>> _sending
+///             pieces of files fetched taken by this connection, being
+///             read or sent but not acknowledged yet
+/// \datamember std::string _pieces
+///             pieces of files fetched read and not sent yet
+/// \datamember std::string _ack_buf
+///             ack messages (and pieces) being sent in asynchorous operation
+/// \datamember bool _ack_writing
+///             whether an ack write is in progress. acks produced meanwhile
+///             are merged and sent after it finished.
+/// \datamember bool _finished
+///             the connection is finished or broken and the Session has
+///             been informed
+/// \datamember int _queued
+///             pieces of this connection queued in the Scheduler
+/// \datamember bool _paused
+///             reading is paused as too many pieces are queued
+/// \datamember bool _closed
+///             the client closed the connection or it broke. the Session
+///             is informed after queued pieces are handled.
+/// \datamember std::chrono::steady_clock::time_point _resume_at
+///             time the next message can be read under the rate limits
 class Thread : public std::enable_shared_from_this<Thread> {
+ public:
+  typedef tcp::socket::executor_type executor_t;
  private:
   int number;
-  tcp::socket socket_;
+  std::map<uint64_t, std::vector<uint32_t>> _acked;
+  std::map<uint64_t, std::vector<uint32_t>> _failed;
+  std::map<uint64_t, std::vector<uint32_t>> _busy;
+  std::vector<uint64_t> _cancelled;
+  std::deque<std::pair<std::shared_ptr<Fetch>, uint32_t>> _sending;
+  std::string _pieces;
+  std::string _ack_buf;
+  bool _ack_writing = false;
+  bool _paused = false;
+ protected:
+  executor_t executor_;
   protocol::AESEncrypter enc;
   protocol::AESDecrypter dec;
-  std::shared_ptr<file::file_writer> _f;
   std::weak_ptr<Session> _sess;
-  std::string _tmp;
   std::string session;
-  uint32_t piece_size;
+  bool _finished = false;
+  int _queued = 0;
+  bool _closed = false;
+  std::chrono::steady_clock::time_point _resume_at;
+
+  // pieces a connection can have queued in the Scheduler
+  static const int read_ahead = 4;
+
+  // pieces of files fetched a connection can have taken
+  static const int send_ahead = 16;
+
+  /// \brief read the next message once the rate limits allow
+  virtual void _read_next() = 0;
+
+  /// \brief whether pieces of files fetched can be sent through it
+  virtual bool _can_send() { return false; }
+
+  /// \brief send ack messages to the client
+  /// \param data ack messages, kept unchanged until @done is called
+  /// \param done called once sent, with false if the connection broke
+  virtual void _write(const std::string &data,
+                      std::function<void(bool)> done) = 0;
+
+  /// \brief queue the received piece to the Scheduler
+  /// \detail next message is read at once if not too many pieces of this
+  ///         connection are queued, otherwise after one is handled.
+  /// \param _stream stream of the message
+  /// \param msg received message body
+  /// \param head_at time the head of the message arrived
+  void _schedule(uint64_t _stream,
+                 std::string msg,
+                 std::chrono::steady_clock::time_point head_at);
+
+  /// \brief write the received data into file
+  /// \note to add finishing logic the code need to reference to Session
+  ///         class, so its definition is placed out the class below.
+  /// \param msg received message body
+  /// \param _stream stream of the message
+  /// \param done called on the io thread after the piece is handled
+  void _write_file(const std::string &msg,
+                   uint64_t _stream,
+                   std::function<void()> done);
+
+  /// \brief write a piece into the file of the Stream
+  /// \detail on an I/O thread of the Root of the Stream if it has one.
+  /// \param taken called on the io thread once the writer has the piece,
+  ///        written or kept to write later
+  /// \param done called on the io thread once it's written, with false if
+  ///        failed
+  void _write_piece(const std::shared_ptr<Session> &_s,
+                    const std::shared_ptr<Stream> &_st,
+                    uint32_t order,
+                    std::string piece,
+                    uint32_t size,
+                    std::function<void()> taken,
+                    std::function<void(bool)> done);
+
+  /// \brief forward a piece to the next server of the chain
+  /// \param msg received message body, forwarded as it is
+  /// \param sent called on the io thread once it's on the way
+  /// \param acked called on the io thread with false if the next server
+  ///        didn't take it
+  void _forward(const std::shared_ptr<replicate::Link> &replica,
+                const std::string &msg,
+                uint64_t _stream,
+                uint32_t order,
+                uint32_t size,
+                std::function<void()> sent,
+                std::function<void(bool)> acked);
+
+  /// \brief acknowledge or ask again for a piece after writing it
+  /// \param replicated false if the next server of the chain didn't take
+  ///        it, though it's written
+  void _piece_written(const std::shared_ptr<Stream> &_st,
+                      uint32_t order,
+                      uint32_t size,
+                      bool ok,
+                      bool replicated = true);
+
+  /// \brief take pieces of files fetched while there's room for more
+  void _fill_pieces();
+
+  /// \brief read and encrypt a piece of a file fetched into @_pieces
+  /// \detail on an I/O thread of the Root of the Fetch if it has one.
+  void _read_piece(const std::shared_ptr<Fetch> &_ft, uint32_t order);
+
+  /// \brief a piece of a file fetched is read
+  /// \param ok false if the file can't be read
+  void _piece_read(const std::shared_ptr<Fetch> &_ft,
+                   uint32_t order,
+                   const std::string &msg,
+                   bool ok);
+
+  /// \brief handle an ack of pieces of a file fetched
+  void _fetch_acked(const std::shared_ptr<Fetch> &_ft,
+                    const std::string &msg);
+
+  /// \brief the connection can't be read anymore
+  void _close() {
+    _closed = true;
+    if (_queued == 0) {
+      _finish();
+    }
+  }
+
+  /// \brief send pending acks to the client
+  /// \detail acks are sent pipelined with reading: reading the next piece
+  ///         never waits for them. if an ack is already being sent, pending
+  ///         acks will be merged and sent once it finished. pieces of files
+  ///         fetched are sent along with them.
+  void _send_ack();
+
+  /// \brief inform the Session this connection is over
+  virtual void _finish();
+
+ public:
+  /// \brief start receiving messages
+  virtual void start() = 0;
+
+  /// \brief tell the client the Stream is finished
+  /// \detail stops the client from sending end-game duplicates (or a piece
+  ///         still on the way) of the Stream through this connection.
+  void cancel(uint64_t _stream) {
+    _cancelled.push_back(_stream);
+    _send_ack();
+  }
+
+  /// \brief ask the client to send a piece again
+  void fail(uint64_t _stream, uint32_t order) {
+    _failed[_stream].push_back(order);
+    _send_ack();
+  }
+
+  /// \brief send pieces of files fetched, if there's room for more
+  void wake() {
+    _send_ack();
+  }
+
+  /// \brief constructor
+  /// \note this constructor simply initialize its members. for detailed
+  ///       infomation, see class's datamenber explanation.
+  Thread(
+      executor_t _executor,
+      protocol::AESEncrypter _enc,
+      protocol::AESDecrypter _dec,
+      std::string &_session,
+      const int &_number,
+      std::weak_ptr<Session> _s
+  ) :
+      number(_number),
+      executor_(std::move(_executor)),
+      enc(_enc),
+      dec(_dec),
+      _sess(std::move(_s)),
+      session(_session) {}
+
+  virtual ~Thread() = default;
+};
+
+/// \class TcpThread
+/// \brief Class to handle a transfer thread connected by TCP
+/// \datamember tcp::socket socket_
+///             transfer thread socket
+/// \datamember std::string _tmp
+///             temp for storing data received in asynchorous operation
+/// \datamember uint64_t stream;
+///             stream of the message being received
+/// \datamember boost::asio::steady_timer _timer
+///             timer to wait until @_resume_at
+/// \datamember std::chrono::steady_clock::time_point _head_at
+///             time the head of the message being received arrived
+/// \datamember sockopt::applied tuning
+///             settings of the socket in effect
+/// \datamember uint64_t _tuned_bytes
+///             bytes received since buffers are last sized
+/// \datamember std::chrono::steady_clock::time_point _tuned_at
+///             time buffers are last sized
+class TcpThread : public Thread {
+ private:
+  tcp::socket socket_;
+  std::string _tmp;
+  uint64_t stream = 0;
+  boost::asio::steady_timer _timer;
+  std::chrono::steady_clock::time_point _head_at;
+  sockopt::applied tuning;
+  uint64_t _tuned_bytes = 0;
+  std::chrono::steady_clock::time_point _tuned_at;
+
+  /// \brief size buffers by the bandwidth-delay product measured lately
+  void _autosize(uint32_t bytes) {
+    _tuned_bytes += bytes;
+    std::chrono::duration<double> tuned = _head_at - _tuned_at;
+    if (tuned.count() < 1) {
+      return;
+    }
+    if (sockopt::autosize(socket_.native_handle(),
+                          _tuned_bytes / tuned.count(), tuning)) {
+      LOG(INFO) << "Transfer thread buffers resized: " << tuning.str() << ".";
+    }
+    _tuned_bytes = 0;
+    _tuned_at = _head_at;
+  }
  public:
   /// \brief emulator to the boost::asio read function
   /// \detail due to the limitation of asynchorous function, we can't simply
@@ -93,28 +1113,47 @@ class Thread : public std::enable_shared_from_this<Thread> {
   }
   /// \brief read the head info of the message
   /// \detail all packet has a fixed length head with header to mark our data
-  ///         packet and a number to mark how long the packet is. We first read
-  ///         the header, get the body length, and read the body then.
+  ///         packet, a number to mark how long the packet is and the stream
+  ///         it belongs to. We first read the header, get the body length,
+  ///         and read the body then.
   void _read_head() {
     // reset temp
     _tmp.clear();
-    _tmp.resize(10);
+    _tmp.resize(protocol::TRANSFER_HEAD_LENGTH);
 
     auto self(shared_from_this());
-    async_read(socket_, buffer(_tmp), boost::asio::transfer_exactly(10),
+    async_read(socket_, buffer(_tmp),
+               boost::asio::transfer_exactly(protocol::TRANSFER_HEAD_LENGTH),
                [this, self](boost::system::error_code ec, std::size_t) {
       // this function is called after the task finished (here after head read)
                  if (!ec) {
+                   _head_at = std::chrono::steady_clock::now();
                    _read_body();
+                 } else {
+                   _close();
                  }
                });
   }
-  /// \brief read the body of the message
+  /// \brief read the next message once the rate limits allow
+  void _read_next() override {
+    if (std::chrono::steady_clock::now() >= _resume_at) {
+      _read_head();
+      return;
+    }
+    _timer.expires_at(_resume_at);
+    auto self(shared_from_this());
+    _timer.async_wait([this, self](boost::system::error_code ec) {
+      if (!ec) {
+        _read_head();
+      }
+    });
+  }
+  /// \brief read the body of the message
   void _read_body() {
     // get length info from received head data
     std::function<std::string(int)> _t =
-        std::bind(&Thread::_read, shared_from_this(), std::placeholders::_1);
-    uint32_t length = protocol::read_msg_transfer_len(_t);
+        std::bind(&TcpThread::_read, this, std::placeholders::_1);
+    uint32_t length = protocol::read_msg_transfer_len(_t, stream);
     _tmp.clear();
     _tmp.resize(length);
 
@@ -122,36 +1161,48 @@ class Thread : public std::enable_shared_from_this<Thread> {
     async_read(socket_, buffer(_tmp), boost::asio::transfer_exactly(length),
                [this, self](boost::system::error_code ec, std::size_t) {
                  if (!ec) {
-                   _write_file();
+                   _autosize(protocol::TRANSFER_HEAD_LENGTH + _tmp.size());
+                   _schedule(stream, std::move(_tmp), _head_at);
+                 } else {
+                   _close();
                  }
                });
   }
-  /// \brief write the received data into file
-  /// \note to add finishing logic the code need to reference to Session
-  ///         class, so its definition is placed out the class below.
-  void _write_file();
+
+  bool _can_send() override { return true; }
+
+  void _write(const std::string &data,
+              std::function<void(bool)> done) override {
+    auto self(shared_from_this());
+    async_write(socket_, buffer(data),
+                [self, done](boost::system::error_code ec, std::size_t) {
+                  done(!ec);
+                });
+  }
+
+  void start() override {
+    _read_head();
+  }
 
   /// \brief constructor
   /// \note this constructor simply initialize its members. for detailed
   ///       infomation, see class's datamenber explanation.
-  Thread(
+  TcpThread(
       tcp::socket _socket,
       protocol::AESEncrypter _enc,
       protocol::AESDecrypter _dec,
-      std::shared_ptr<file::file_writer> f,
       std::string &_session,
-      uint32_t &_piece_size,
       const int &_number,
       std::weak_ptr<Session> _s
   ) :
+      Thread(_socket.get_executor(), _enc, _dec, _session, _number,
+             std::move(_s)),
       socket_(std::move(_socket)),
-      enc(_enc),
-      dec(_dec),
-      session(_session),
-      piece_size(_piece_size),
-      _f(std::move(f)),
-      number(_number),
-      _sess(std::move(_s)) {
+      _timer(socket_.get_executor()),
+      _tuned_at(std::chrono::steady_clock::now()) {
+    tuning = sockopt::apply(socket_.native_handle(), socket_options);
+    LOG(INFO) << "Transfer thread " << _number << ": " << tuning.str()
+              << ".";
 
 //    async_write(socket_, buffer(protocol::build_msg(
 //        protocol::file_transfer_init_reply(enc, 0))),
@@ -166,12 +1217,149 @@ class Thread : public std::enable_shared_from_this<Thread> {
   }
 };
 
+/// \class UdpThread
+/// \brief Class to handle a transfer thread sending UDP datagrams
+/// \detail datagrams from the client's address are delivered by the
+///         Acceptor. pieces are handled as they come: a UDP client
+///         paces itself with its own congestion control, and a datagram
+///         not read would be dropped anyway. so the rate limits of the
+///         server don't apply, and pieces coming while too many are queued
+///         are dropped for the client to send again. acks are packed into
+///         datagrams. the connection is closed after the finish message, or
+///         after nothing comes for a while. files fetched are not sent
+///         through it, as nothing paces datagrams of the server.
+/// \datamember udp::Link &link
+///             link to send datagrams through, shared by all UdpThreads
+/// \datamember udp::endpoint remote
+///             address of the client
+/// \datamember boost::asio::steady_timer _timer
+///             timer to check if the client is gone
+/// \datamember std::chrono::steady_clock::time_point _last_at
+///             time the last datagram came
+class UdpThread : public Thread {
+ private:
+  udp::Link &link;
+  udp::endpoint remote;
+  boost::asio::steady_timer _timer;
+  std::chrono::steady_clock::time_point _last_at;
+
+  // the client is gone if nothing comes for this long
+  static constexpr std::chrono::seconds idle_timeout{30};
+  // pieces queued in the Scheduler before dropping more
+  static const int queue_limit = 256;
+
+  /// \brief tell the client it's attached
+  void _reply_init() {
+    link.send(std::make_shared<std::string>(protocol::build_msg_transfer(
+        protocol::file_transfer_init_reply(enc, 0), 0)), remote);
+  }
+
+  /// \brief close the connection if nothing comes for too long
+  void _wait_idle() {
+    _timer.expires_at(_last_at + idle_timeout);
+    auto self(shared_from_this());
+    _timer.async_wait([this, self](boost::system::error_code ec) {
+      if (ec || _finished) {
+        return;
+      }
+      if (std::chrono::steady_clock::now() - _last_at >= idle_timeout) {
+        LOG(WARNING) << "UDP transfer thread timed out.";
+        _close();
+        return;
+      }
+      _wait_idle();
+    });
+  }
+ protected:
+  void _read_next() override {}
+
+  void _write(const std::string &data,
+              std::function<void(bool)> done) override {
+    for (auto &d : udp::pack(data)) {
+      link.send(std::make_shared<std::string>(std::move(d)), remote);
+    }
+    done(true);
+  }
+
+  void _finish() override {
+    Thread::_finish();
+    _timer.cancel();
+  }
+ public:
+  /// \brief handle a datagram from the client
+  void deliver(const std::string &datagram) {
+    if (_finished || _closed) {
+      return;
+    }
+    _last_at = std::chrono::steady_clock::now();
+    std::vector<std::string> frames;
+    try {
+      frames = udp::unpack(datagram);
+    }
+    catch (const std::exception &e) {
+      LOG(WARNING) << e.what();
+      return;
+    }
+    for (auto &frame : frames) {
+      uint64_t _stream;
+      std::function<std::string(int)> _t = [&frame](int length) {
+        std::string _data = frame.substr(0, length);
+        frame.erase(0, length);
+        return _data;
+      };
+      std::string msg = protocol::read_msg_transfer(_t, _stream);
+      if (_stream == 0
+          && !protocol::file_transfer_init_read(dec, msg).empty()) {
+        // our reply is lost or still on the way
+        _reply_init();
+        continue;
+      }
+      if (_stream != 0 && _queued >= queue_limit) {
+        continue;
+      }
+      _schedule(_stream, std::move(msg), _last_at);
+      if (_stream == 0) {
+        // nothing follows the finish message
+        return;
+      }
+    }
+  }
+
+  void start() override {
+    _reply_init();
+    _last_at = std::chrono::steady_clock::now();
+    _wait_idle();
+  }
+
+  /// \brief constructor
+  /// \note this constructor simply initialize its members. for detailed
+  ///       infomation, see class's datamenber explanation.
+  UdpThread(
+      udp::Link &_link,
+      udp::endpoint _remote,
+      protocol::AESEncrypter _enc,
+      protocol::AESDecrypter _dec,
+      std::string &_session,
+      const int &_number,
+      std::weak_ptr<Session> _s
+  ) :
+      Thread(_link.get_executor(), _enc, _dec, _session, _number,
+             std::move(_s)),
+      link(_link),
+      remote(std::move(_remote)),
+      _timer(_link.get_executor()) {}
+};
+
+constexpr std::chrono::seconds UdpThread::idle_timeout;
+
 
 /// \class Session
 /// \brief Class to handle a client
 /// \detail this class will interact with a incoming client and
 ///         negotiate with it. after that, transfer will be handled by
-///         Thread instance.
+///         Thread instance. after one file is negotiated the client can
+///         negotiate more files through the same connection, and their
+///         pieces are sent through the Threads already connected.
 /// \datamember enum s_code { NOTSET, NEGOTIATED, FINISHED }
 ///             indicate Session status
 ///             NOT_SET: this Session hasn't finish negotiation with client.
@@ -183,23 +1371,57 @@ class Thread : public std::enable_shared_from_this<Thread> {
 ///             session id of this connection
 /// \datamember tcp::socket socket_
 ///             transfer thread socket
+/// \datamember const tenant::Key &key
+///             key the client uses
 /// \datamember protocol::AESEncrypter enc
 ///             encrypter object
 /// \datamember protocol::AESDecrypter dec
 ///             decrypter object
-/// \datamember std::shared_ptr<file::file_writer> _f
-///             a shared pointer of file writer object
+/// \datamember std::unordered_map<uint64_t, std::shared_ptr<Stream>> streams
+///             negotiated files by stream id
+/// \datamember std::unordered_map<uint64_t, std::shared_ptr<Fetch>> fetches
+///             files the client fetches by stream id, kept after finished
+///             like @streams
+/// \datamember std::vector<std::shared_ptr<Fetch>> sending
+///             files fetched not finished yet
+/// \datamember size_t cursor
+///             the Fetch to take the next piece from. Fetches take turns
+///             like Uploads of the client.
+/// \datamember std::shared_ptr<replicate::Link> replica
+///             forwards pieces to the next server of the chain, nullptr
+///             if not replicating
 /// \datamember std::unordered_map<int, std::shared_ptr<Thread>> children
 ///             store and control the Threads
 /// \datamember std::string _tmp
 ///             temp for storing data received in asynchorous operation
-/// \datamember uint32_t piece_size;
-///             transfer file piece size
 /// \datamember std::atomic_int number = 0;
 ///             counter to compute thread id
 ///             use atomic object to ensure no duplicate count
+/// \datamember int alive
+///             count of Threads not finished yet
+/// \datamember bool closed
+///             the client closed the negotiation connection
+/// \datamember uint64_t last_stream
+///             highest stream id the client negotiated
+/// \datamember std::unordered_map<uint64_t, std::vector<std::function<void()>>> held
+///             work on pieces of streams not negotiated yet. the client
+///             sends pieces right after the negotiation without waiting for
+///             the reply, so they may come first through another connection.
 /// \datamember int result
 ///             store the result of verify function
+/// \datamember Scheduler &scheduler
+///             Scheduler to queue received pieces
+/// \datamember std::shared_ptr<Scheduler::Flow> flow
+///             queued pieces and stats of this Session in the Scheduler
+/// \datamember Limiter &limiter
+///             rate limits of the server
+/// \datamember std::shared_ptr<ratelimit::TokenBucket> bucket
+///             rate limit of this Session
+/// \datamember std::chrono::milliseconds flush_delay
+///             time without pieces kept after which the pieces kept by a
+///             writer are written
+/// \datamember metrics::Histogram h_receive, h_decrypt, h_write
+///             latency of each stage of handling a piece
 class Session : public std::enable_shared_from_this<Session> {
  public:
   enum s_code { NOTSET, NEGOTIATED, FINISHED };
@@ -207,15 +1429,31 @@ class Session : public std::enable_shared_from_this<Session> {
   std::string session;
  private:
   tcp::socket socket_;
+  const tenant::Key &key;
   protocol::AESEncrypter enc;
   protocol::AESDecrypter dec;
-  std::shared_ptr<file::file_writer> _f;
+  std::unordered_map<uint64_t, std::shared_ptr<Stream>> streams;
+  std::unordered_map<uint64_t, std::shared_ptr<Fetch>> fetches;
+  std::vector<std::shared_ptr<Fetch>> sending;
+  size_t cursor = 0;
+  std::shared_ptr<replicate::Link> replica;
   std::unordered_map<int, std::shared_ptr<Thread>> children;
   std::string _tmp;
-  uint32_t piece_size;
   std::atomic_int number = 0;
+  int alive = 0;
+  bool closed = false;
+  uint64_t last_stream = 0;
+  std::unordered_map<uint64_t, std::vector<std::function<void()>>> held;
   int result;
+  Scheduler &scheduler;
+  std::shared_ptr<Scheduler::Flow> flow;
+  Limiter &limiter;
+  std::shared_ptr<ratelimit::TokenBucket> bucket;
+  static constexpr std::chrono::milliseconds flush_delay{2};
  public:
+  metrics::Histogram h_receive;
+  metrics::Histogram h_decrypt;
+  metrics::Histogram h_write;
   /// \brief emulator to the boost::asio read function
   /// \note for detailed info, see Thread::_read
   std::string _read(int length) {
@@ -228,16 +1466,28 @@ class Session : public std::enable_shared_from_this<Session> {
   ///       infomation, see class's datamenber explanation.
   Session(
       tcp::socket _socket,
-      protocol::AESEncrypter _enc,
-      protocol::AESDecrypter _dec,
-      std::string &msg
+      const tenant::Key &_key,
+      std::string &msg,
+      Scheduler &_scheduler,
+      Limiter &_limiter
   ) :
       socket_(std::move(_socket)),
-      enc(_enc),
-      dec(_dec),
-      _tmp(msg) {
+      key(_key),
+      enc(_key.enc),
+      dec(_key.dec),
+      _tmp(msg),
+      scheduler(_scheduler),
+      limiter(_limiter) {
     status = NOTSET;
-    session = sess_gen.session(32);
+    bucket = limiter.open();
+
+    // Sessions are weighted by client address
+    boost::system::error_code ec;
+    auto address = socket_.remote_endpoint(ec).address();
+    if (address.is_v6() && address.to_v6().is_v4_mapped()) {
+      address = address.to_v6().to_v4();
+    }
+    flow = scheduler.open(address.to_string());
 
     // force send small tcp packet to make protocol negotiation
     // works properly
@@ -250,23 +1500,96 @@ class Session : public std::enable_shared_from_this<Session> {
 
   /// read data: Server Hello
   /// send data: Cilent Hello
-  void step1() {
+  /// \param taken tell if a session id is used by another client
+  /// \param replay hellos accepted before, to refuse them sent again
+  void step1(const std::function<bool(const std::string &)> &taken,
+             Replay &replay) {
     /// read Server Hello part
-    result = protocol::server_hello_verify(dec, _tmp);
+    std::string proposed;
+    uint64_t sent = 0;
+    std::string ticket;
+    result = protocol::server_hello_verify(dec, _tmp, proposed, sent, ticket);
+    if (result == 0 && !replay.fresh(proposed, sent)) {
+      // recorded and sent again, or the client's clock is far off
+      LOG(WARNING) << "Client hello is stale or replayed.";
+      result = 1;
+    } else if (result == 0 && taken(proposed)) {
+      LOG(WARNING) << "Client proposed a session taken.";
+      result = 3;
+    } else if (result == 0) {
+      session = proposed;
+    }
     if (result != 0) {
+      // still unique among Sessions till Acceptor deletes it
+      session = sess_gen.session(32);
+    }
+    if (result == 0 && !ticket.empty()) {
+      std::unique_ptr<protocol::AESDecrypter> _td;
+      if (key.ticket_dec) {
+        _td = std::make_unique<protocol::AESDecrypter>(*key.ticket_dec);
+      }
+      if (_td && protocol::ticket_verify(*_td, ticket, resume::now())) {
+        // resumed. the client doesn't wait for Client Hello
+        LOG(INFO) << "Client resumed with a ticket.";
+        replay.accept(session, sent);
+        status = NEGOTIATED;
+        _replicate();
+        step2();
+        return;
+      }
+      LOG(INFO) << "Client sent an invalid or expired ticket.";
+      result = 1;
+    }
+    if (result == 1 || result == 2) {
       status = FINISHED;
+      m_handshake_failed.inc();
+      scheduler.close(flow);
+      // the client learns from the connection closed
+      boost::system::error_code ec;
+      socket_.close(ec);
       // call Acceptor to delete self
       return;
     }
 
     /// send Cilent Hello part
+    auto self(shared_from_this());
+    if (result != 0) {
+      // tell the client why before leaving
+      status = FINISHED;
+      m_handshake_failed.inc();
+      scheduler.close(flow);
+      async_write(socket_, buffer(protocol::build_msg(
+          protocol::client_hello_build(enc, result, session))),
+                  [self](boost::system::error_code, std::size_t) {});
+      return;
+    }
+    // the client negotiates without waiting for this reply, so the first
+    // File Negotiation is read meanwhile
+    replay.accept(session, sent);
+    status = NEGOTIATED;
+    _replicate();
+    std::string issued;
+    if (key.ticket_enc) {
+      protocol::AESEncrypter _te(*key.ticket_enc);
+      issued = protocol::ticket_build(_te, resume::now() + ticket_lifetime);
+    }
     async_write(socket_, buffer(protocol::build_msg(
-        protocol::client_hello_build(enc, result, session))),
-                [this](boost::system::error_code ec, std::size_t) {
-                  if (!ec) {
-                    step2();
-                  }
-                });
+        protocol::client_hello_build(enc, result, session,
+                                     ticket_lifetime, issued))),
+                [self](boost::system::error_code, std::size_t) {});
+    step2();
+  }
+
+  /// \brief connect to the next server of the chain, if replicating
+  /// \detail as the client of it, with the session id and key the client
+  ///         uses. see CHAIN REPLICATION.
+  void _replicate() {
+    if (!replica_target) {
+      return;
+    }
+    replica = std::make_shared<replicate::Link>(*replica_target, key.enc,
+                                                key.dec, key.id, session);
+    replica->start();
   }
 
   /// receive data: File Negotiation head
@@ -279,6 +1602,11 @@ class Session : public std::enable_shared_from_this<Session> {
                [this, self](boost::system::error_code ec, std::size_t) {
                  if (!ec) {
                    step3();
+                 } else {
+                   // the client has negotiated all its files
+                   closed = true;
+                   _release_all();
+                   check_finished();
                  }
                });
   }
@@ -299,44 +1627,188 @@ class Session : public std::enable_shared_from_this<Session> {
                [this, self](boost::system::error_code ec, std::size_t) {
                  if (!ec) {
                    step4();
+                 } else {
+                   closed = true;
+                   _release_all();
+                   check_finished();
                  }
                });
   }
 
   /// read data: File Negotiation body
   /// send data: File Negotiation result
+  /// then wait for the next File Negotiation
   void step4() {
     /// read File Negotiation body part
+    uint64_t stream;
+    uint32_t piece_size;
     uint64_t file_s;
+    uint32_t flags;
     std::string path;
     protocol::file_negotiation_verify(dec,
                                       _tmp,
                                       session,
+                                      stream,
                                       piece_size,
                                       file_s,
+                                      flags,
                                       path);
     // move shared_ptr to class member to control life cycle
-    try {
+    std::shared_ptr<file::writer> _f;
+    storage::Root *root = nullptr;
+    bool fetch = flags & FLAG_FETCH;
+    if (stream == 0 || streams.find(stream) != streams.end()
+        || fetches.find(stream) != fetches.end() || piece_size == 0) {
+      LOG(WARNING) << "Bad stream " << stream << " negotiated.";
+      result = 1;
+    } else if (fetch) {
+      // the path ends with the NUL encrypt() adds
+      result = (int) !_fetch(stream, piece_size, std::string(path.c_str()),
+                             file_s);
+    } else {
+      try {
 //      std::shared_ptr<file::file_writer>
 //          _tf(new file::file_writer(path.c_str(), file_s));
-      _f = std::make_shared<file::file_writer>(path, file_s);
-      result = (int) !(_f->ok);
+        auto options = storage_options;
+        options.direct = options.direct || (flags & FLAG_DIRECT_IO);
+        std::string place = path;
+        if (!layout.empty() && !options.null_sink) {
+          root = layout.choose(file_s);
+          if (!root) {
+            LOG(ERROR) << "No storage root has space for " << path << ".";
+            throw file::NoEnoughSpace();
+          }
+          auto _p = root->place(path);
+          std::error_code ec;
+          std::filesystem::create_directories(_p.parent_path(), ec);
+          place = _p.string();
+          LOG(INFO) << "Stream " << stream << " stored under "
+                    << root->get_path() << ".";
+        }
+        _f = file::open_writer(place, file_s, options);
+        result = (int) !(_f->ok);
+      }
+      catch (file::NoEnoughSpace &e) {
+        result = 1;
+      }
     }
-    catch (file::NoEnoughSpace &e) {
-      result = 1;
+
+    if (result == 0 && !fetch) {
+      auto _s = std::make_shared<Stream>(stream, piece_size, file_s, _f,
+                                         flags & FLAG_STREAMING);
+      if (root) {
+        root->acquire();
+        _s->root = root;
+      }
+      std::weak_ptr<Stream> weak = _s;
+      auto executor = socket_.get_executor();
+      _s->keeps = _f->on_written(
+          [weak, executor, piece_size](std::uintmax_t offset, bool ok) {
+            uint32_t order = offset / piece_size;
+            boost::asio::post(executor, [weak, order, ok]() {
+              auto _st = weak.lock();
+              if (_st) {
+                _st->kept_written(order, ok);
+              }
+            });
+          });
+      streams[stream] = _s;
+      if (replica) {
+        replica->negotiate(stream, piece_size, file_s, flags,
+                           std::string(path.c_str()));
+      }
+      if (delivery) {
+        // the path ends with the NUL encrypt() adds
+        _s->reorder = std::make_shared<deliver::Reorder>(
+            delivery, std::string(path.c_str()), piece_size, reorder_buffer);
+        _s->reorder->start();
+      }
+      if (!_s->in_file(0)) {
+        // nothing to wait for
+        _s->finish();
+      }
     }
+    last_stream = std::max(last_stream, stream);
+    _release(stream);
 
     /// send File Negotiation result part
+    auto self(shared_from_this());
     async_write(socket_, buffer(protocol::build_msg(
-        protocol::file_negotiation_reply(enc, session, result))),
-                [this](boost::system::error_code ec, std::size_t) {
+        protocol::file_negotiation_reply(enc, session, stream, result,
+                                         fetch ? file_s : 0))),
+                [this, self](boost::system::error_code ec, std::size_t) {
                   if (!ec) {
-                    status = NEGOTIATED;
+                    step2();
                   }
                 });
-    if (result != 0) {
-      status = FINISHED;
+  }
+
+  /// \brief open a file the client fetches and start sending it
+  /// \param path file name the client told, looked for under the storage
+  ///        roots if there are, or else under the working directory
+  /// \param file_s set to the size of the file
+  /// \return false if it can't be read
+  bool _fetch(uint64_t stream,
+              uint32_t piece_size,
+              const std::string &path,
+              uint64_t &file_s) {
+    if (!allow_fetch) {
+      LOG(WARNING) << "Refused fetching " << path << ", not allowed.";
+      return false;
+    }
+    std::string place = path;
+    storage::Root *root = nullptr;
+    if (layout.empty()) {
+      // like Root::place, but refused instead of dropping what escapes
+      std::filesystem::path _p(path);
+      bool inside = !_p.empty() && !_p.has_root_path();
+      for (auto &part : _p) {
+        inside = inside && part != "..";
+      }
+      if (!inside) {
+        LOG(WARNING) << "Refused fetching " << path
+                     << ", outside the working directory.";
+        return false;
+      }
+    } else {
+      std::filesystem::path _p;
+      root = layout.find(path, _p);
+      if (!root) {
+        LOG(WARNING) << "No storage root holds " << path << ".";
+        return false;
+      }
+      place = _p.string();
+    }
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(place, ec)) {
+      LOG(WARNING) << "Can't fetch " << place << ", not a file.";
+      return false;
+    }
+    file_s = std::filesystem::file_size(place, ec);
+    if (ec) {
+      LOG(WARNING) << "Can't fetch " << place << ": " << ec.message();
+      return false;
+    }
+    auto _ft = std::make_shared<Fetch>(
+        stream, piece_size, file_s,
+        std::make_shared<file::file_reader>(place, piece_size));
+    if (root) {
+      root->acquire();
+      _ft->root = root;
     }
+    fetches[stream] = _ft;
+    LOG(INFO) << "Stream " << stream << " fetches " << place << ", "
+              << file_s << " bytes.";
+    if (_ft->pieces() == 0) {
+      // nothing to send
+      _ft->finish();
+      return true;
+    }
+    sending.push_back(_ft);
+    for (auto &_t : children) {
+      _t.second->wake();
+    }
+    return true;
   }
 
   /// \brief Thread creator
@@ -345,47 +1817,835 @@ class Session : public std::enable_shared_from_this<Session> {
   ///         let Session create a new Thread to handle the client
   void attach_thread(tcp::socket _socket) {
     std::shared_ptr<Thread> _t(
-        new Thread(std::move(_socket),
-                   enc,
-                   dec,
-                   _f,
-                   session,
-                   piece_size,
-                   number,
-                   shared_from_this()));
-    _t->_read_head();
+        new TcpThread(std::move(_socket),
+                      enc,
+                      dec,
+                      session,
+                      number,
+                      shared_from_this()));
+    _attach(std::move(_t));
+  }
+
+  /// \brief Thread creator of a client sending UDP datagrams
+  /// \param link link to reply through
+  /// \param remote address of the client
+  /// \return the Thread, to deliver the datagrams of the client to
+  std::shared_ptr<UdpThread> attach_udp_thread(udp::Link &link,
+                                               const udp::endpoint &remote) {
+    auto _t = std::make_shared<UdpThread>(link,
+                                          remote,
+                                          enc,
+                                          dec,
+                                          session,
+                                          number,
+                                          shared_from_this());
+    _attach(_t);
+    return _t;
+  }
+
+  /// \brief start the Thread and keep it as a child
+  void _attach(std::shared_ptr<Thread> _t) {
+    _t->start();
+    _t->wake();
     // store the children
     children[number] = std::move(_t);
     // increase count
     ++number;
+    ++alive;
+  }
+
+  int get_alive() { return alive; }
+
+  /// \brief id of the key the client uses
+  const std::string &key_id() const { return key.id; }
+
+  /// \brief Link to the next server of the chain, nullptr if not
+  ///         replicating
+  const std::shared_ptr<replicate::Link> &get_replica() const {
+    return replica;
+  }
+
+  /// \brief tell if pieces of the stream should wait for its negotiation
+  bool awaits(uint64_t stream) {
+    return !closed && status == NEGOTIATED && stream > last_stream;
+  }
+
+  /// \brief hold work on a piece until its stream is negotiated
+  void hold(uint64_t stream, std::function<void()> job) {
+    held[stream].push_back(std::move(job));
+  }
+
+  /// \brief run the work held for the stream
+  void _release(uint64_t stream) {
+    auto it = held.find(stream);
+    if (it == held.end()) {
+      return;
+    }
+    auto jobs = std::move(it->second);
+    held.erase(it);
+    for (auto &job : jobs) {
+      job();
+    }
+  }
+
+  /// \brief run all work held, as no more stream will be negotiated
+  void _release_all() {
+    auto _held = std::move(held);
+    held.clear();
+    for (auto &_h : _held) {
+      for (auto &job : _h.second) {
+        job();
+      }
+    }
+  }
+
+  /// \brief get a negotiated Stream
+  /// \return nullptr if the stream is unknown
+  std::shared_ptr<Stream> get_stream(uint64_t stream) {
+    auto it = streams.find(stream);
+    if (it == streams.end()) {
+      return nullptr;
+    }
+    return it->second;
+  }
+
+  /// \brief get a file the client fetches
+  /// \return nullptr if the stream is not one
+  std::shared_ptr<Fetch> get_fetch(uint64_t stream) {
+    auto it = fetches.find(stream);
+    if (it == fetches.end()) {
+      return nullptr;
+    }
+    return it->second;
+  }
+
+  /// \brief take the next piece of files fetched to send, taking them in
+  ///        turn
+  /// \return false if there's none
+  bool next_fetch_piece(std::shared_ptr<Fetch> &_ft, uint32_t &order) {
+    for (size_t i = 0; i < sending.size(); ++i) {
+      auto &_f = sending[(cursor + i) % sending.size()];
+      if (_f->next_piece(order)) {
+        _ft = _f;
+        cursor += i + 1;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// \brief send a piece of a file fetched again, through any Thread
+  void fetch_resend(const std::shared_ptr<Fetch> &_ft, uint32_t order) {
+    _ft->resend(order);
+    for (auto &_t : children) {
+      _t.second->wake();
+    }
+  }
+
+  /// \brief pieces of a file fetched acknowledged notify
+  void fetch_acked(const std::shared_ptr<Fetch> &_ft,
+                   uint32_t cumulative,
+                   const std::vector<uint32_t> &orders) {
+    if (_ft->ack(cumulative, orders)) {
+      fetch_finished(_ft, true);
+    }
+  }
+
+  /// \brief stop sending a file fetched
+  /// \param ok false if the file can't be read
+  void fetch_finished(const std::shared_ptr<Fetch> &_ft, bool ok) {
+    if (!_ft->finish()) {
+      return;
+    }
+    sending.erase(std::remove(sending.begin(), sending.end(), _ft),
+                  sending.end());
+    if (ok) {
+      LOG(INFO) << "Stream " << _ft->id << " fetched.";
+    } else {
+      LOG(ERROR) << "Stream " << _ft->id << " can't be read anymore.";
+    }
+  }
+
+  /// \brief queue a received piece to the Scheduler
+  /// \param stream stream of the piece
+  /// \param cost bytes of the piece
+  /// \param job work to handle the piece
+  void schedule(uint64_t stream, uint32_t cost, Scheduler::job_t job) {
+    auto _st = get_stream(stream);
+    // finish message and pieces of small files take the small lane
+    Scheduler::lane_t lane = Scheduler::SMALL;
+    if (_st) {
+      // the size of a file being streamed is unknown, likely large
+      lane = _st->open ? Scheduler::BULK : scheduler.lane_of(_st->file_size);
+    } else if (stream != 0) {
+      lane = Scheduler::BULK;
+    }
+    scheduler.submit(flow, lane, cost, std::move(job));
+  }
+
+  /// \brief take rate limit tokens for a received piece
+  /// \return time to wait before reading the next piece
+  std::chrono::nanoseconds throttle(uint32_t bytes) {
+    return limiter.consume(*bucket, bytes);
+  }
+
+  /// \brief write the pieces the writer of the Stream keeps once no more
+  ///        come for @flush_delay. they're only acknowledged once written,
+  ///        so the client may wait for them before sending the rest of a
+  ///        run
+  void flush_later(const std::shared_ptr<Stream> &_st) {
+    _st->kept_at = std::chrono::steady_clock::now();
+    if (_st->flushing) {
+      return;
+    }
+    _st->flushing = true;
+    _flush_at(_st, _st->kept_at + flush_delay);
+  }
+
+  /// \brief write the pieces kept once @flush_delay passed since the last
+  void _flush_at(const std::shared_ptr<Stream> &_st,
+                 std::chrono::steady_clock::time_point at) {
+    auto self(shared_from_this());
+    auto timer = std::make_shared<boost::asio::steady_timer>(
+        socket_.get_executor(), at);
+    timer->async_wait([this, self, _st, timer](boost::system::error_code) {
+      auto idle_at = _st->kept_at + flush_delay;
+      if (_st->status != Stream::FINISHED
+          && std::chrono::steady_clock::now() < idle_at) {
+        _flush_at(_st, idle_at);
+        return;
+      }
+      _st->flushing = false;
+      if (_st->status == Stream::FINISHED || !_st->has_kept()) {
+        return;
+      }
+      auto _f = _st->_f;
+      if (_st->root) {
+        _st->root->post([_f]() { _f->flush(); });
+      } else {
+        _f->flush();
+      }
+    });
+  }
+
+  /// \brief piece written notify
+  /// \detail when the last piece of a Stream is written the file is closed at
+  ///         once, and every Thread tells the client to stop sending pieces
+  ///         of it. with durability BEFORE_ACK, the last piece is held
+  ///         until the file is synced.
+  /// \return false if the piece should not be acknowledged yet
+  bool piece_written(const std::shared_ptr<Stream> &_s, uint32_t order) {
+    if (storage_options.durability == file::write_options::BEFORE_ACK
+        && _s->status == Stream::TRANSFERRING && _s->is_last(order)) {
+      _s->status = Stream::SYNCING;
+      auto self(shared_from_this());
+      auto executor = socket_.get_executor();
+      _s->_f->sync([this, self, executor, _s, order](bool ok) {
+        boost::asio::post(executor, [this, self, _s, order, ok]() {
+          synced(_s, order, ok);
+        });
+      });
+      return false;
+    }
+    _written(_s, order);
+    return true;
+  }
+
+  /// \brief mark the piece written, and close the file after the last one
+  void _written(const std::shared_ptr<Stream> &_s, uint32_t order) {
+    if (_s->piece_written(order) && _s->finish()) {
+      LOG(INFO) << "Stream " << _s->id << " finished.";
+      for (auto &_t : children) {
+        _t.second->cancel(_s->id);
+      }
+    }
+  }
+
+  /// \brief sync before the last ack done notify
+  /// \param order the last piece, not acknowledged yet
+  void synced(const std::shared_ptr<Stream> &_s, uint32_t order, bool ok) {
+    if (_s->status != Stream::SYNCING) {
+      // the session is closed meanwhile
+      return;
+    }
+    _s->status = Stream::TRANSFERRING;
+    if (ok) {
+      // the client learns every piece is written from the cancel
+      _written(_s, order);
+      return;
+    }
+    // what's written may be lost, let the client send the piece again
+    for (auto &_t : children) {
+      _t.second->fail(_s->id, order);
+      break;
+    }
   }
+
   /// \brief thread finish notify
   /// \detail after each thread finished, this function will be called once to
-  ///         infrom the Session. when count go back to zero, file will be
-  ///         closed and Session will be marked FINISHED.
+  ///         infrom the Session. when count go back to zero and the client
+  ///         closed the negotiation connection, files will be closed and
+  ///         Session will be marked FINISHED.
   void finish_thread(int _number) {
-    --number;
-    if (number == 0) {
-      status = FINISHED;
-      _f->close();
+    children.erase(_number);
+    --alive;
+    check_finished();
+  }
+
+  /// \brief mark FINISHED if the client has left
+  void check_finished() {
+    if (!closed || alive > 0 || status == FINISHED) {
+      return;
+    }
+    status = FINISHED;
+    scheduler.close(flow);
+    for (auto &_s : streams) {
+      if (_s.second->finish()) {
+        LOG(WARNING) << "Stream " << _s.first << " closed before finished.";
+      }
+    }
+    for (auto &_ft : sending) {
+      _ft->finish();
+      LOG(WARNING) << "Stream " << _ft->id << " closed before fetched.";
+    }
+    sending.clear();
+    if (replica) {
+      replica->close();
+    }
+    report_latency();
+  }
+
+  /// \brief log latency percentiles of each stage
+  /// \detail also appended to @latency_json as one JSON object per line
+  ///         if set.
+  void report_latency() {
+    auto s_receive = h_receive.summary();
+    if (s_receive.count == 0) {
+      return;
+    }
+    auto s_decrypt = h_decrypt.summary();
+    auto s_write = h_write.summary();
+    LOG(INFO) << "Piece receive: " << s_receive.str();
+    LOG(INFO) << "Piece decrypt: " << s_decrypt.str();
+    LOG(INFO) << "Piece write: " << s_write.str();
+    if (latency_json.empty()) {
+      return;
+    }
+    std::ofstream out(latency_json, std::ios::app);
+    out << "{\"client\":\"" << flow->name << "\""
+        << ",\"receive\":" << s_receive.json()
+        << ",\"decrypt\":" << s_decrypt.json()
+        << ",\"write\":" << s_write.json() << "}\n";
+    if (!out) {
+      LOG(WARNING) << "Failed writing " << latency_json << ".";
     }
   }
 };
 
+/// \brief queue the received piece to the Scheduler
+void Thread::_schedule(uint64_t _stream,
+                       std::string body,
+                       std::chrono::steady_clock::time_point head_at) {
+  std::shared_ptr<Session> _s = _sess.lock();
+  if (!_s) {
+    return;
+  }
+  auto self(shared_from_this());
+  uint32_t cost = body.size();
+  m_frames.inc();
+  m_bytes_received.inc(protocol::TRANSFER_HEAD_LENGTH + cost);
+  auto _ft = _s->get_fetch(_stream);
+  if (_ft) {
+    // an ack of a file fetched, small and handled at once
+    _fetch_acked(_ft, body);
+    _read_next();
+    return;
+  }
+  _s->h_receive.record(head_at);
+  // the piece owns its buffer so the next one can be read meanwhile
+  auto msg = std::make_shared<std::string>(std::move(body));
+  ++_queued;
+  _s->schedule(_stream, cost, [this, self, msg, _stream]() {
+    _write_file(*msg, _stream, [this, self, _stream]() {
+      --_queued;
+      if (_stream == 0 || _finished) {
+        return;
+      }
+      if (_closed) {
+        _close();
+      } else if (_paused) {
+        _paused = false;
+        _read_next();
+      }
+    });
+  });
+  if (_stream == 0) {
+    // nothing follows the finish message
+    return;
+  }
+  _resume_at = std::chrono::steady_clock::now() + _s->throttle(cost);
+  if (_queued < read_ahead) {
+    _read_next();
+  } else {
+    _paused = true;
+  }
+}
+
 /// \brief write the received data into file
-void Thread::_write_file() {
+void Thread::_write_file(const std::string &msg,
+                         uint64_t _stream,
+                         std::function<void()> done) {
   uint32_t order;
   uint32_t size;
   std::string piece;
-  protocol::file_transfer_read(dec, _tmp, session, order, size, piece);
-  if (order == 0 && size == 0) {
+  std::shared_ptr<Session> _s = _sess.lock();
+  if (!_s) {
+    done();
+    return;
+  }
+  if (_stream != 0 && !_s->get_stream(_stream) && _s->awaits(_stream)) {
+    // negotiation of the stream is on the way. reading is paused until
+    // it's done, as @done is held too.
+    auto self(shared_from_this());
+    _s->hold(_stream, [this, self, msg, _stream, done]() {
+      _write_file(msg, _stream, done);
+    });
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  protocol::file_transfer_read(dec, msg, session, _stream, order, size,
+                               piece);
+  _s->h_decrypt.record(start);
+  m_bytes_decrypted.inc(msg.size());
+  if (_stream == 0) {
     // transfer finished. inform Session.
-    std::shared_ptr<Session> _s(_sess);
+    _finish();
+    done();
+    return;
+  }
+  auto _st = _s->get_stream(_stream);
+  if (_st && _st->status == Stream::SYNCING) {
+    // the last ack is held until the file is synced
+    done();
+    return;
+  }
+  if (!_st || _st->status == Stream::FINISHED
+      || _st->is_received(order)) {
+    // stream finished already, or an end-game duplicate. keep the first
+    // copy and drop this one
+    if (_st) {
+      _acked[_stream].push_back(order);
+    } else {
+      // the server refused the stream, tell the client to stop
+      _cancelled.push_back(_stream);
+    }
+    _send_ack();
+    done();
+    return;
+  }
+  if (size > piece.size() || size > _st->piece_size) {
+    // the header claims more than the frame carries, or a piece holds
+    LOG(WARNING) << "Bad size of piece " << order << " of stream "
+                 << _st->id << ".";
+    _failed[_stream].push_back(order);
+    _send_ack();
+    done();
+    return;
+  }
+  if (_st->too_far(order)) {
+    // the client sends it again once lower pieces are written
+    _busy[_stream].push_back(order);
+    _send_ack();
+    done();
+    return;
+  }
+  if (size == 0 && _st->open) {
+    // the end piece of a streamed file, telling its length
+    uint64_t length = 0;
+    bool ok;
+    try {
+      length = std::stoull(piece.substr(0, 16), nullptr, 16);
+      ok = _st->end(order, length);
+    }
+    catch (const std::logic_error &e) {
+      ok = false;
+    }
+    if (!ok) {
+      LOG(WARNING) << "Bad end piece " << order << " of stream " << _st->id
+                   << ".";
+      done();
+      return;
+    }
+    LOG(INFO) << "Stream " << _st->id << " ends at " << length << " bytes.";
+    auto replica = _s->get_replica();
+    if (replica) {
+      auto self(shared_from_this());
+      _forward(replica, msg, _stream, order, 0, []() {},
+               [this, self, _st, order](bool replicated) {
+                 _piece_written(_st, order, 0, true, replicated);
+               });
+    } else {
+      _piece_written(_st, order, 0, true);
+    }
+    done();
+    return;
+  }
+  if (!_st->in_file(order)) {
+    _piece_written(_st, order, size, false);
+    done();
+    return;
+  }
+  if (_st->reorder && !_st->reorder->accept(order, piece, size)) {
+    // the client sends it again once the consumer has caught up
+    _busy[_stream].push_back(order);
+    _send_ack();
+    done();
+    return;
+  }
+  auto self(shared_from_this());
+  auto replica = _s->get_replica();
+  if (!replica) {
+    _write_piece(_s, _st, order, std::move(piece), size, done,
+                 [this, self, _st, order, size](bool ok) {
+                   _piece_written(_st, order, size, ok);
+                 });
+    return;
+  }
+  // forwarded while it's written. the next piece is read once both are
+  // on their way, and this one acknowledged once both are done
+  auto reading = std::make_shared<int>(2);
+  auto release = [reading, done]() {
+    if (--*reading == 0) {
+      done();
+    }
+  };
+  auto acking = std::make_shared<int>(2);
+  auto written = std::make_shared<bool>(false);
+  auto replicated = std::make_shared<bool>(false);
+  auto join = [this, self, _st, order, size, acking, written, replicated]() {
+    if (--*acking == 0) {
+      _piece_written(_st, order, size, *written, *replicated);
+    }
+  };
+  _forward(replica, msg, _stream, order, size, release,
+           [join, replicated](bool ok) {
+             *replicated = ok;
+             join();
+           });
+  _write_piece(_s, _st, order, std::move(piece), size, release,
+               [join, written](bool ok) {
+                 *written = ok;
+                 join();
+               });
+}
+
+/// \brief forward a piece to the next server of the chain
+void Thread::_forward(const std::shared_ptr<replicate::Link> &replica,
+                      const std::string &msg,
+                      uint64_t _stream,
+                      uint32_t order,
+                      uint32_t size,
+                      std::function<void()> sent,
+                      std::function<void(bool)> acked) {
+  auto executor = executor_;
+  replica->forward(
+      _stream, order, msg,
+      [executor, sent]() { boost::asio::post(executor, sent); },
+      [executor, size, acked](bool ok) {
+        if (ok) {
+          m_bytes_replicated.inc(size);
+        }
+        boost::asio::post(executor, [acked, ok]() { acked(ok); });
+      });
+}
+
+/// \brief write a piece into the file of the Stream
+void Thread::_write_piece(const std::shared_ptr<Session> &_s,
+                          const std::shared_ptr<Stream> &_st,
+                          uint32_t order,
+                          std::string piece,
+                          uint32_t size,
+                          std::function<void()> taken,
+                          std::function<void(bool)> done) {
+  auto write = [_s, _st, order, size](const std::string &data) {
+    auto start = std::chrono::steady_clock::now();
+    int written = _st->_f->write(data, size,
+                                 ((std::uintmax_t) order) * _st->piece_size);
+    _s->h_write.record(start);
+    return written;
+  };
+  std::shared_ptr<std::function<void(bool)>> waiting;
+  if (_st->keeps) {
+    waiting = std::make_shared<std::function<void(bool)>>(std::move(done));
+    _st->keep(order, waiting);
+  }
+  auto complete = [_s, _st, order, size, taken, done, waiting](int written) {
+    taken();
+    if (!waiting) {
+      done(written == (int) size);
+    } else if (written == file::writer::KEPT) {
+      // acknowledged once it's written, the Stream is told by the writer
+      _s->flush_later(_st);
+    } else if (_st->unkeep(order, waiting)) {
+      (*waiting)(written == (int) size);
+    }
+  };
+  if (!_st->root) {
+    complete(write(piece));
+    return;
+  }
+  auto data = std::make_shared<std::string>(std::move(piece));
+  auto executor = executor_;
+  _st->root->post([write, data, executor, complete]() {
+    int written = write(*data);
+    boost::asio::post(executor, [complete, written]() { complete(written); });
+  });
+}
+
+void Thread::_piece_written(const std::shared_ptr<Stream> &_st,
+                            uint32_t order,
+                            uint32_t size,
+                            bool ok,
+                            bool replicated) {
+  std::shared_ptr<Session> _s = _sess.lock();
+  if (!_s) {
+    return;
+  }
+  if (_st->status == Stream::SYNCING) {
+    // the last ack is held until the file is synced
+  } else if (_st->status == Stream::FINISHED || _st->is_received(order)) {
+    // another copy made it meanwhile
+    _acked[_st->id].push_back(order);
+  } else if (ok && replicated) {
+    m_bytes_written.inc(size);
+    if (_s->piece_written(_st, order)) {
+      _acked[_st->id].push_back(order);
+    }
+  } else if (ok) {
+    // written here, the client sends it again for the rest of the chain
+    LOG(WARNING) << "Piece " << order << " of stream " << _st->id
+                 << " not replicated.";
+    _failed[_st->id].push_back(order);
+  } else {
+    LOG(WARNING) << "Failed writing piece " << order << " of stream "
+                 << _st->id << ".";
+    m_write_failed.inc();
+    _failed[_st->id].push_back(order);
+  }
+  _send_ack();
+}
+
+/// \brief inform the Session this connection is over
+void Thread::_finish() {
+  if (_finished) {
+    return;
+  }
+  _finished = true;
+  std::shared_ptr<Session> _s = _sess.lock();
+  if (_s) {
+    // let other connections send what the client didn't acknowledge
+    auto _taken = std::move(_sending);
+    _sending.clear();
+    for (auto &_p : _taken) {
+      _s->fetch_resend(_p.first, _p.second);
+    }
     _s->finish_thread(number);
+  }
+}
+
+/// \brief take pieces of files fetched while there's room for more
+void Thread::_fill_pieces() {
+  if (!_can_send()) {
+    return;
+  }
+  std::shared_ptr<Session> _s = _sess.lock();
+  if (!_s) {
+    return;
+  }
+  // forget pieces acknowledged, through this connection or another
+  _sending.erase(std::remove_if(
+      _sending.begin(), _sending.end(),
+      [](const std::pair<std::shared_ptr<Fetch>, uint32_t> &p) {
+        return p.first->is_acked(p.second);
+      }), _sending.end());
+  std::shared_ptr<Fetch> _ft;
+  uint32_t order;
+  while (_sending.size() < send_ahead && _s->next_fetch_piece(_ft, order)) {
+    _sending.emplace_back(_ft, order);
+    _read_piece(_ft, order);
+  }
+}
+
+/// \brief read and encrypt a piece of a file fetched
+void Thread::_read_piece(const std::shared_ptr<Fetch> &_ft, uint32_t order) {
+  auto f = _ft->_f;
+  uint64_t id = _ft->id;
+  uint32_t piece_size = _ft->piece_size;
+  uint32_t expected = _ft->size_of(order);
+  std::string _session = session;
+  auto read = [f, id, piece_size, expected, order, _session](
+      protocol::AESEncrypter &_enc, bool &ok) {
+    std::string piece(piece_size, '\0');
+    int size = f->read_at(&piece[0], (std::uintmax_t) order * piece_size);
+    // negative if the read failed
+    ok = size >= 0 && (uint32_t) size == expected;
+    // a piece of size 0 tells the client it can't be read
+    piece.resize(ok ? size : 0);
+    return protocol::build_msg_transfer(protocol::file_transfer_build(
+        _enc, _session, id, order, piece.size(), piece), id);
+  };
+  if (!_ft->root) {
+    bool ok;
+    std::string msg = read(enc, ok);
+    _piece_read(_ft, order, msg, ok);
+    return;
+  }
+  // the encrypter of the connection is used on the io thread
+  auto _enc = std::make_shared<protocol::AESEncrypter>(enc);
+  auto executor = executor_;
+  auto self(shared_from_this());
+  _ft->root->post([this, self, _ft, order, read, _enc, executor]() {
+    bool ok;
+    auto msg = std::make_shared<std::string>(read(*_enc, ok));
+    boost::asio::post(executor, [this, self, _ft, order, msg, ok]() {
+      _piece_read(_ft, order, *msg, ok);
+      _send_ack();
+    });
+  });
+}
+
+/// \brief a piece of a file fetched is read
+void Thread::_piece_read(const std::shared_ptr<Fetch> &_ft,
+                         uint32_t order,
+                         const std::string &msg,
+                         bool ok) {
+  if (_finished) {
+    return;
+  }
+  if (ok) {
+    m_bytes_fetched.inc(_ft->size_of(order));
+  } else if (_ft->status != Fetch::FINISHED) {
+    LOG(ERROR) << "Failed reading piece " << order << " of stream "
+               << _ft->id << ".";
+    std::shared_ptr<Session> _s = _sess.lock();
+    if (_s) {
+      _s->fetch_finished(_ft, false);
+    }
+  }
+  _pieces += msg;
+}
+
+/// \brief handle an ack of pieces of a file fetched
+void Thread::_fetch_acked(const std::shared_ptr<Fetch> &_ft,
+                          const std::string &msg) {
+  std::shared_ptr<Session> _s = _sess.lock();
+  if (!_s) {
     return;
   }
-  _f->write(piece, size, ((std::uintmax_t) order) * piece_size);
-  _read_head();
+  uint32_t cumulative;
+  uint32_t base;
+  std::string bitmap;
+  int status = protocol::file_transfer_confirm(dec, msg, session,
+                                               cumulative, base, bitmap);
+  auto orders = protocol::sack_bitmap_read(base, bitmap);
+  if (status == 2) {
+    // the client has got the whole file, or given it up
+    _s->fetch_finished(_ft, true);
+  } else if (status == 1) {
+    for (auto order : orders) {
+      LOG(WARNING) << "Client failed writing piece " << order
+                   << " of stream " << _ft->id << ".";
+      _sending.erase(std::remove(_sending.begin(), _sending.end(),
+                                 std::make_pair(_ft, order)),
+                     _sending.end());
+      _s->fetch_resend(_ft, order);
+    }
+    _s->fetch_acked(_ft, cumulative, {});
+  } else {
+    _s->fetch_acked(_ft, cumulative, orders);
+  }
+  _send_ack();
+}
+
+/// \brief send pending acks to the client
+void Thread::_send_ack() {
+  if (_finished) {
+    return;
+  }
+  // pieces are read while acks are being sent
+  _fill_pieces();
+  if (_ack_writing
+      || (_acked.empty() && _failed.empty() && _busy.empty()
+          && _cancelled.empty() && _pieces.empty())) {
+    return;
+  }
+  std::shared_ptr<Session> _s = _sess.lock();
+  if (!_s) {
+    return;
+  }
+
+  _ack_buf.clear();
+  // failed pieces are reported with status 1
+  for (auto &_p : _failed) {
+    auto _st = _s->get_stream(_p.first);
+    auto &orders = _p.second;
+    std::sort(orders.begin(), orders.end());
+    while (!orders.empty()) {
+      uint32_t base;
+      std::string bitmap = protocol::sack_bitmap_build(orders, base);
+      _ack_buf += protocol::build_msg_transfer(protocol::file_transfer_receive(
+          enc, session, 1, _st->get_cumulative(), base, bitmap), _p.first);
+    }
+  }
+  _failed.clear();
+  // pieces refused for now with status 3
+  for (auto &_p : _busy) {
+    auto _st = _s->get_stream(_p.first);
+    auto &orders = _p.second;
+    std::sort(orders.begin(), orders.end());
+    while (!orders.empty()) {
+      uint32_t base;
+      std::string bitmap = protocol::sack_bitmap_build(orders, base);
+      _ack_buf += protocol::build_msg_transfer(protocol::file_transfer_receive(
+          enc, session, 3, _st->get_cumulative(), base, bitmap), _p.first);
+    }
+  }
+  _busy.clear();
+  for (auto &_p : _acked) {
+    uint32_t cumulative = _s->get_stream(_p.first)->get_cumulative();
+    auto &orders = _p.second;
+    // pieces below cumulative are already covered by it
+    std::sort(orders.begin(), orders.end());
+    orders.erase(orders.begin(), std::lower_bound(
+        orders.begin(), orders.end(), cumulative));
+    do {
+      uint32_t base = cumulative;
+      std::string bitmap = protocol::sack_bitmap_build(orders, base);
+      _ack_buf += protocol::build_msg_transfer(protocol::file_transfer_receive(
+          enc, session, 0, cumulative, base, bitmap), _p.first);
+    } while (!orders.empty());
+  }
+  _acked.clear();
+  // cancel goes last so the client has got every ack before it
+  for (auto _id : _cancelled) {
+    auto _st = _s->get_stream(_id);
+    uint32_t cumulative = _st ? _st->get_cumulative() : 0;
+    _ack_buf += protocol::build_msg_transfer(protocol::file_transfer_receive(
+        enc, session, 2, cumulative, cumulative, ""), _id);
+  }
+  _cancelled.clear();
+  _ack_buf += _pieces;
+  _pieces.clear();
+
+  _ack_writing = true;
+  auto self(shared_from_this());
+  _write(_ack_buf, [this, self](bool ok) {
+    _ack_writing = false;
+    if (ok) {
+      // send acks produced during this write
+      _send_ack();
+    }
+  });
 }
 
 
@@ -393,23 +2653,215 @@ void Thread::_write_file() {
 /// \brief Class to accept incoming connection
 /// \detail this class will accept new incoming connection and send to
 ///         related object to handle
-/// \datamember protocol::AESEncrypter enc
-///             encrypter object
-/// \datamember protocol::AESDecrypter dec
-///             decrypter object
+/// \datamember const tenant::Table &keys
+///             keys clients may use
 /// \datamember tcp::acceptor acceptor_
 ///             accept connection to the specific port.
 /// \datamember std::unordered_map<std::string, std::shared_ptr<Session>> children
 ///             store session - Session pointer pair to get
 /// \datamember std::vector<std::string> s_list
 ///             session list to walk through to clean FINISHED Sessions.
+/// \datamember Scheduler &scheduler
+///             Scheduler shared by all Sessions
+/// \datamember Limiter &limiter
+///             rate limits shared by all Sessions
+/// \datamember std::unique_ptr<udp::socket> udp_socket_
+///             socket receiving UDP transfer threads on the same port.
+///             nullptr if UDP is not enabled.
+/// \datamember std::unique_ptr<udp::Link> link
+///             link to send datagrams through
+/// \datamember std::map<udp::endpoint, std::weak_ptr<UdpThread>> flows
+///             UdpThread of each client address
+/// \datamember std::string _datagram
+///             datagram being received
+/// \datamember udp::endpoint _from
+///             address of the datagram being received
+/// \datamember std::unordered_map<std::string, std::vector<parked_t>> parked
+///             transfer connections whose session is not known yet. the
+///             client opens them while its handshake is on the way, so they
+///             are attached once the session is, or dropped after
+///             @park_timeout.
+/// \datamember size_t parked_count
+///             count of connections in @parked
+/// \datamember boost::asio::steady_timer _park_timer
+///             timer to drop connections parked too long
+/// \datamember Replay replay
+///             hellos accepted, to refuse them sent again
 class Acceptor : public std::enable_shared_from_this<Acceptor> {
  private:
-  protocol::AESEncrypter enc;
-  protocol::AESDecrypter dec;
+  /// \brief a parked transfer connection
+  /// \datamember std::chrono::steady_clock::time_point at
+  ///             when it came
+  /// \datamember std::function<void()> attach
+  ///             attach it to its Session, known by then
+  /// \datamember udp::endpoint from
+  ///             address of a UDP thread
+  struct parked_t {
+    std::chrono::steady_clock::time_point at;
+    std::function<void()> attach;
+    udp::endpoint from;
+  };
+  static constexpr std::chrono::seconds park_timeout{10};
+  static const size_t max_parked = 1024;
+
+  const tenant::Table &keys;
   tcp::acceptor acceptor_;
   std::unordered_map<std::string, std::shared_ptr<Session>> children;
   std::vector<std::string> s_list;
+  Scheduler &scheduler;
+  Limiter &limiter;
+  std::unique_ptr<udp::socket> udp_socket_;
+  std::unique_ptr<udp::Link> link;
+  std::map<udp::endpoint, std::weak_ptr<UdpThread>> flows;
+  std::string _datagram;
+  udp::endpoint _from;
+  std::unordered_map<std::string, std::vector<parked_t>> parked;
+  size_t parked_count = 0;
+  boost::asio::steady_timer _park_timer;
+  Replay replay;
+
+  /// \brief keep a transfer connection of an unknown session for a while
+  /// \return false if too many are parked already
+  bool _park(const std::string &_sess,
+             std::function<void()> attach,
+             const udp::endpoint &from = udp::endpoint()) {
+    if (parked_count >= max_parked) {
+      return false;
+    }
+    if (parked_count == 0) {
+      _sweep_later();
+    }
+    parked[_sess].push_back({std::chrono::steady_clock::now(),
+                             std::move(attach), from});
+    ++parked_count;
+    return true;
+  }
+
+  /// \brief attach connections parked for the session just known
+  void _unpark(const std::string &_sess) {
+    auto it = parked.find(_sess);
+    if (it == parked.end()) {
+      return;
+    }
+    auto _parked = std::move(it->second);
+    parked.erase(it);
+    parked_count -= _parked.size();
+    for (auto &_p : _parked) {
+      _p.attach();
+    }
+  }
+
+  /// \brief drop connections parked too long, until none is parked
+  void _sweep_later() {
+    _park_timer.expires_after(park_timeout);
+    _park_timer.async_wait([this](boost::system::error_code ec) {
+      if (ec) {
+        return;
+      }
+      auto expired = std::chrono::steady_clock::now() - park_timeout;
+      for (auto it = parked.begin(); it != parked.end();) {
+        auto &_list = it->second;
+        auto _end = std::remove_if(_list.begin(), _list.end(),
+                                   [&expired](const parked_t &_p) {
+                                     return _p.at <= expired;
+                                   });
+        if (_end != _list.end()) {
+          LOG(INFO) << "Drop " << (_list.end() - _end)
+                    << " thread(s) of not connected client.";
+          m_handshake_failed.inc(_list.end() - _end);
+          parked_count -= _list.end() - _end;
+          _list.erase(_end, _list.end());
+        }
+        it = _list.empty() ? parked.erase(it) : std::next(it);
+      }
+      if (parked_count > 0) {
+        _sweep_later();
+      }
+    });
+  }
+
+  /// \brief read the session of a transfer init with the key it names
+  /// \param key_id the key named
+  /// \return empty if not our client
+  std::string _init_session(const std::string &msg, std::string &key_id) {
+    key_id = protocol::read_key_id(msg);
+    auto _key = keys.find(key_id);
+    if (!_key) {
+      return "";
+    }
+    protocol::AESDecrypter _dec(_key->dec);
+    return protocol::file_transfer_init_read(_dec, msg);
+  }
+
+  /// \brief tell if the session is known and uses the key
+  bool _known(const std::string &_sess, const std::string &key_id) {
+    auto it = children.find(_sess);
+    return it != children.end() && it->second->key_id() == key_id;
+  }
+
+  /// \brief hand a datagram to the UdpThread of its address
+  /// \detail the first datagram from an address should be a transfer init
+  ///         of a known session, which attaches a new UdpThread to it.
+  void _dispatch(const udp::endpoint &from, const std::string &datagram) {
+    auto it = flows.find(from);
+    if (it != flows.end()) {
+      auto _t = it->second.lock();
+      if (_t) {
+        _t->deliver(datagram);
+        return;
+      }
+      flows.erase(it);
+    }
+
+    uint64_t _stream;
+    std::string _sess;
+    std::string _key_id;
+    try {
+      std::string frame = udp::unpack(datagram).at(0);
+      std::function<std::string(int)> _t = [&frame](int length) {
+        std::string _data = frame.substr(0, length);
+        frame.erase(0, length);
+        return _data;
+      };
+      std::string msg = protocol::read_msg_transfer(_t, _stream);
+      if (_stream == 0) {
+        _sess = _init_session(msg, _key_id);
+      }
+    }
+    catch (const std::exception &e) {}
+    if (_sess.empty()) {
+      // not our client, or a late datagram of a finished thread
+      LOG(DEBUG) << "Drop datagram from " << from << ".";
+      return;
+    }
+    m_accepted.inc();
+    if (children.find(_sess) == children.end()) {
+      // the handshake may be on the way. the client sends the init again
+      // until answered, so one copy of it is kept.
+      auto it = parked.find(_sess);
+      if (it == parked.end() || std::none_of(
+          it->second.begin(), it->second.end(),
+          [&from](const parked_t &_p) { return _p.from == from; })) {
+        LOG(DEBUG) << "Park UDP thread of not connected client.";
+        _park(_sess, [this, from, datagram]() {
+          _dispatch(from, datagram);
+        }, from);
+      }
+      return;
+    }
+    if (!_known(_sess, _key_id)
+        || children[_sess]->status == Session::FINISHED) {
+      LOG(INFO) << "Receive UDP thread but not connected client.";
+      m_handshake_failed.inc();
+      return;
+    }
+    LOG(INFO) << "Receive new client UDP thread.";
+    // forget addresses whose thread is over
+    for (auto f = flows.begin(); f != flows.end();) {
+      f = f->second.expired() ? flows.erase(f) : std::next(f);
+    }
+    flows[from] = children[_sess]->attach_udp_thread(*link, from);
+  }
  public:
   /// \brief constructor
   /// \note this constructor simply initialize its members. for detailed
@@ -417,12 +2869,15 @@ class Acceptor : public std::enable_shared_from_this<Acceptor> {
   explicit Acceptor(
       boost::asio::io_context &io_context,
       int port,
-      protocol::AESEncrypter &_enc,
-      protocol::AESDecrypter &_dec) :
+      const tenant::Table &_keys,
+      Scheduler &_scheduler,
+      Limiter &_limiter) :
       // listen to 0.0.0.0 (Any address) with specific port
+      keys(_keys),
       acceptor_(io_context, tcp::endpoint(tcp::v6(), port)),
-      enc(_enc),
-      dec(_dec) {}
+      scheduler(_scheduler),
+      limiter(_limiter),
+      _park_timer(io_context) {}
   /// \brief @static encapsulate boost::asio read function
   /// \detail encapsulate the boost::asio's read function and reduce parameter
   ///         count to make the function signature the same as read_msg series
@@ -436,6 +2891,54 @@ class Acceptor : public std::enable_shared_from_this<Acceptor> {
     read(*socket_, buffer(_tmp), boost::asio::transfer_exactly(length));
     return _tmp;
   };
+  /// \brief count Sessions not finished
+  int active_sessions() {
+    int count = 0;
+    for (auto const &_s : children) {
+      count += _s.second->status != Session::FINISHED;
+    }
+    return count;
+  }
+
+  /// \brief count Threads not finished
+  int active_threads() {
+    int count = 0;
+    for (auto const &_s : children) {
+      count += _s.second->get_alive();
+    }
+    return count;
+  }
+
+  /// \brief receive UDP transfer threads on the same port too
+  /// \param conditions simulated path of datagrams sent, for testing
+  void listen_udp(int port, const udp::Conditions &conditions) {
+    udp_socket_ = std::make_unique<udp::socket>(
+        acceptor_.get_executor(),
+        udp::endpoint(boost::asio::ip::udp::v6(), port));
+    boost::system::error_code ec;
+    // datagrams of all clients queue in the one socket
+    udp_socket_->set_option(
+        boost::asio::socket_base::receive_buffer_size(8 << 20), ec);
+    link = std::make_unique<udp::Link>(*udp_socket_, conditions);
+    do_receive();
+  }
+
+  /// \brief this function recursive infinitely to keep receiving datagrams
+  void do_receive() {
+    _datagram.resize(udp::MAX_DATAGRAM);
+    udp_socket_->async_receive_from(
+        buffer(_datagram), _from,
+        [this](boost::system::error_code ec, std::size_t length) {
+          if (!ec) {
+            _datagram.resize(length);
+            _dispatch(_from, _datagram);
+          } else if (ec == boost::asio::error::operation_aborted) {
+            return;
+          }
+          do_receive();
+        });
+  }
+
   /// \brief this function recursive infinitely to keep accepting connection.
   void do_accept() {
     // first clean up finished Sessions
@@ -454,6 +2957,7 @@ class Acceptor : public std::enable_shared_from_this<Acceptor> {
           // this lambda function will be called
           // when a new connection established
           if (!ec) {
+            m_accepted.inc();
             int type_;
             // bind _read to satisfy function signature request
             std::function<std::string(int)> _t =
@@ -461,33 +2965,74 @@ class Acceptor : public std::enable_shared_from_this<Acceptor> {
             std::string _msg = protocol::read_msg_guess(_t, type_);
             if (type_ == -1) {
               LOG(INFO) << "Receive connection but not our client.";
+              m_handshake_failed.inc();
+              do_accept();
+            } else if (type_ == 0 && !keys.find(protocol::read_key_id(_msg))) {
+              LOG(INFO) << "Receive connection with unknown key.";
+              m_handshake_failed.inc();
               do_accept();
             } else if (type_ == 0) {
-              LOG(INFO) << "Receive new client connection.";
+              auto _key = keys.find(protocol::read_key_id(_msg));
+              if (_key->id.empty()) {
+                LOG(INFO) << "Receive new client connection.";
+              } else {
+                LOG(INFO) << "Receive new client connection of key "
+                          << _key->id << ".";
+              }
               // session handler
               std::shared_ptr<Session>
-                  _s(new Session(std::move(socket), enc, dec, _msg));
-              s_list.push_back(_s->session);
-              _s->step1();
-              children[_s->session] = std::move(_s);
+                  _s(new Session(std::move(socket), *_key, _msg,
+                                 scheduler, limiter));
+              _s->step1([this](const std::string &_sess) {
+                return children.find(_sess) != children.end();
+              }, replay);
+              std::string _sess = _s->session;
+              s_list.push_back(_sess);
+              children[_sess] = std::move(_s);
+              if (children[_sess]->status != Session::FINISHED) {
+                // transfer connections opened during the handshake
+                _unpark(_sess);
+              }
               do_accept();
             } else if (type_ == 1) {
               // determine if session is known
-              std::string _sess = protocol::file_transfer_init_read(dec, _msg);
+              std::string _key_id;
+              std::string _sess = _init_session(_msg, _key_id);
               if (_sess.empty()) {
                 LOG(INFO) << "Receive connection but not our client.";
+                m_handshake_failed.inc();
                 socket.close();
-              } else if (children.find(_sess) != children.end()) {
+              } else if (_known(_sess, _key_id)) {
                 // thread handler (attach to session)
                 LOG(INFO) << "Receive new client thread.";
                 children[_sess]->attach_thread(std::move(socket));
-              } else {
-                LOG(INFO) << "Receive thread but not connected client.";
+              } else if (children.find(_sess) != children.end()) {
+                LOG(INFO) << "Receive thread with another key of the session.";
+                m_handshake_failed.inc();
                 socket.close();
+              } else {
+                // the handshake may be on the way
+                auto _socket = std::make_shared<tcp::socket>(
+                    std::move(socket));
+                if (!_park(_sess, [this, _sess, _key_id, _socket]() {
+                  if (!_known(_sess, _key_id)) {
+                    LOG(INFO) << "Receive thread with another key of the "
+                                 "session.";
+                    m_handshake_failed.inc();
+                    return;
+                  }
+                  LOG(INFO) << "Receive new client thread.";
+                  children[_sess]->attach_thread(std::move(*_socket));
+                })) {
+                  LOG(INFO) << "Receive thread but not connected client.";
+                  m_handshake_failed.inc();
+                  _socket->close();
+                }
               }
               do_accept();
             } else {
               LOG(WARNING) << "Not defined connection type.";
+              m_handshake_failed.inc();
               do_accept();
             }
 //            std::make_shared<session>(std::move(socket))->start();
@@ -500,6 +3045,242 @@ class Acceptor : public std::enable_shared_from_this<Acceptor> {
   }
 };
 
+constexpr std::chrono::seconds Acceptor::park_timeout;
+
+/// \class Control
+/// \brief Class to change rate limits while running
+/// \detail listens on localhost only. each line received is a command:
+///         `rate RATE [BURST]` sets the limit of the whole server,
+///         `session-rate RATE [BURST]` sets the limit of every Session,
+///         `show` prints current limits.
+///         RATE 0 removes the limit. reply is a line beginning with
+///         OK or ERR.
+/// \datamember tcp::acceptor acceptor_
+///             accept connection to the control port
+/// \datamember Limiter &limiter
+///             rate limits to change
+class Control {
+ private:
+  tcp::acceptor acceptor_;
+  Limiter &limiter;
+
+  /// \brief a connected control client
+  struct Client : public std::enable_shared_from_this<Client> {
+    tcp::socket socket_;
+    boost::asio::streambuf _buf;
+    std::string _reply;
+    Control *control;
+
+    Client(tcp::socket _socket, Control *_control) :
+        socket_(std::move(_socket)),
+        control(_control) {}
+
+    void read() {
+      auto self(shared_from_this());
+      async_read_until(socket_, _buf, '\n',
+                       [this, self](boost::system::error_code ec,
+                                    std::size_t) {
+                         if (ec) {
+                           return;
+                         }
+                         std::istream is(&_buf);
+                         std::string line;
+                         std::getline(is, line);
+                         _reply = control->execute(line) + "\n";
+                         async_write(socket_, buffer(_reply),
+                                     [this, self](boost::system::error_code ec,
+                                                  std::size_t) {
+                                       if (!ec) {
+                                         read();
+                                       }
+                                     });
+                       });
+    }
+  };
+
+ public:
+  /// \brief constructor
+  /// \note this constructor simply initialize its members. for detailed
+  ///       infomation, see class's datamenber explanation.
+  Control(
+      boost::asio::io_context &io_context,
+      int port,
+      Limiter &_limiter) :
+      acceptor_(io_context,
+                tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)),
+      limiter(_limiter) {}
+
+  /// \brief this function recursive infinitely to keep accepting connection.
+  void do_accept() {
+    acceptor_.async_accept(
+        [this](boost::system::error_code ec, tcp::socket socket) {
+          if (!ec) {
+            std::make_shared<Client>(std::move(socket), this)->read();
+          }
+          do_accept();
+        });
+  }
+
+  /// \brief run a command
+  /// \return reply to the command
+  std::string execute(const std::string &line) {
+    std::istringstream is(line);
+    std::string command, rate, burst;
+    is >> command >> rate >> burst;
+    try {
+      if (command == "show") {
+        auto show = [](uint64_t _rate, uint64_t _burst) {
+          if (_rate == 0) {
+            return ratelimit::format_rate(_rate);
+          }
+          return ratelimit::format_rate(_rate) + " burst "
+              + (_burst ? std::to_string(_burst) + "B" : "default");
+        };
+        return "OK rate " + show(limiter.global.get_rate(),
+                                 limiter.global.get_burst())
+            + ", session-rate " + show(limiter.get_session_rate(),
+                                       limiter.get_session_burst());
+      } else if (command == "rate" && !rate.empty()) {
+        limiter.global.set(ratelimit::parse_rate(rate),
+                           burst.empty() ? 0 : ratelimit::parse_rate(burst));
+      } else if (command == "session-rate" && !rate.empty()) {
+        limiter.set_session(ratelimit::parse_rate(rate),
+                            burst.empty() ? 0 : ratelimit::parse_rate(burst));
+      } else {
+        return "ERR unknown command";
+      }
+    }
+    catch (const std::invalid_argument &e) {
+      return std::string("ERR ") + e.what();
+    }
+    LOG(INFO) << "Control: " << line;
+    return "OK";
+  }
+};
+
+/// \class Metrics
+/// \brief Class to serve metrics over HTTP
+/// \detail listens on localhost only and replies to `GET /metrics` with
+///         all metrics in Prometheus text format. runs on the same
+///         io_context as the Sessions so reading gauges needs no lock.
+/// \datamember tcp::acceptor acceptor_
+///             accept connection to the metrics port
+/// \datamember uint64_t _last_frames
+///             frames received at last scrape
+/// \datamember std::chrono::steady_clock::time_point _last_scrape
+///             time of last scrape
+class Metrics {
+ private:
+  tcp::acceptor acceptor_;
+  uint64_t _last_frames = 0;
+  std::chrono::steady_clock::time_point _last_scrape;
+
+  /// \brief a connected HTTP client
+  struct Client : public std::enable_shared_from_this<Client> {
+    tcp::socket socket_;
+    boost::asio::streambuf _buf;
+    std::string _reply;
+
+    explicit Client(tcp::socket _socket) : socket_(std::move(_socket)) {}
+
+    void read() {
+      auto self(shared_from_this());
+      async_read_until(socket_, _buf, "\r\n\r\n",
+                       [this, self](boost::system::error_code ec,
+                                    std::size_t) {
+                         if (ec) {
+                           return;
+                         }
+                         std::istream is(&_buf);
+                         std::string method, path;
+                         is >> method >> path;
+                         std::string body, code;
+                         if (method == "GET" && path == "/metrics") {
+                           code = "200 OK";
+                           body = metrics::registry().render();
+                         } else {
+                           code = "404 Not Found";
+                           body = "Not Found\n";
+                         }
+                         _reply = "HTTP/1.1 " + code + "\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: " + std::to_string(body.size())
+                             + "\r\nConnection: close\r\n\r\n" + body;
+                         async_write(socket_, buffer(_reply),
+                                     [this, self](boost::system::error_code,
+                                                  std::size_t) {
+                                       boost::system::error_code ec;
+                                       socket_.shutdown(
+                                           tcp::socket::shutdown_both, ec);
+                                     });
+                       });
+    }
+  };
+
+ public:
+  /// \brief constructor
+  /// \detail registers gauges of the server objects.
+  Metrics(
+      boost::asio::io_context &io_context,
+      int port,
+      Acceptor &acceptor,
+      Scheduler &scheduler) :
+      acceptor_(io_context,
+                tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)),
+      _last_scrape(std::chrono::steady_clock::now()) {
+    auto &r = metrics::registry();
+    r.add_gauge("fileuploader_sessions_active", "Sessions not finished.",
+                [&acceptor]() { return acceptor.active_sessions(); });
+    r.add_gauge("fileuploader_threads_active",
+                "Transfer connections not finished.",
+                [&acceptor]() { return acceptor.active_threads(); });
+    r.add_gauge("fileuploader_queued_pieces",
+                "Pieces waiting in the scheduler.",
+                [&scheduler]() { return scheduler.get_queued_pieces(); });
+    r.add_gauge("fileuploader_queued_bytes",
+                "Bytes waiting in the scheduler.",
+                [&scheduler]() { return scheduler.get_queued_bytes(); });
+    r.add_gauge("fileuploader_frames_per_second",
+                "Transfer frames received per second since last scrape.",
+                [this]() { return frames_per_second(); });
+    r.add_gauge("fileuploader_io_queued_jobs",
+                "Writes waiting for I/O threads of storage roots.",
+                []() { return layout.get_queued(); });
+    r.add_counter("fileuploader_syncs_total",
+                  "Syncs of received files done.",
+                  []() { return file::sync_count(); });
+    r.add_counter("fileuploader_sync_seconds_total",
+                  "Seconds spent syncing received files.",
+                  []() { return file::sync_nanoseconds() / 1e9; });
+    r.add_gauge("fileuploader_sync_p99_seconds",
+                "99th percentile of seconds a sync takes.",
+                []() { return file::sync_histogram().summary().p99 / 1e9; });
+  }
+
+  /// \brief this function recursive infinitely to keep accepting connection.
+  void do_accept() {
+    acceptor_.async_accept(
+        [this](boost::system::error_code ec, tcp::socket socket) {
+          if (!ec) {
+            std::make_shared<Client>(std::move(socket))->read();
+          }
+          do_accept();
+        });
+  }
+
+  /// \brief frames received per second since last scrape
+  double frames_per_second() {
+    auto now = std::chrono::steady_clock::now();
+    uint64_t frames = m_frames.value();
+    std::chrono::duration<double> elapsed = now - _last_scrape;
+    double rate = elapsed.count() > 0
+                  ? (frames - _last_frames) / elapsed.count() : 0;
+    _last_frames = frames;
+    _last_scrape = now;
+    return rate;
+  }
+};
+
 int main(int argc, char *argv[]) {
 
   // arguments reader
@@ -507,16 +3288,125 @@ int main(int argc, char *argv[]) {
 
   options.add_options()
       ("p,port", "Port number to bind", cxxopts::value<int>())
-      ("k,key", "Encrypt key to communicate", cxxopts::value<std::string>());
+      ("k,key", "Encrypt key to communicate", cxxopts::value<std::string>())
+      ("keys", "File of more keys, one \"KEY_ID KEY\" a line. clients name "
+               "theirs by --key-id",
+       cxxopts::value<std::string>())
+      ("q,quantum", "Bytes a session handles per scheduling round",
+       cxxopts::value<uint32_t>())
+      ("small", "Files up to this size(byte) are scheduled first",
+       cxxopts::value<uint64_t>())
+      ("weight", "Scheduling weight of client, as address=weight",
+       cxxopts::value<std::vector<std::string>>())
+      ("stats", "Seconds between scheduler stats logs, 0 to disable",
+       cxxopts::value<int>())
+      ("r,rate", "Receive rate limit(byte/s) of the server, like 1G",
+       cxxopts::value<std::string>())
+      ("burst", "Bytes the server can receive at once after idle",
+       cxxopts::value<std::string>())
+      ("session-rate", "Receive rate limit(byte/s) of each session",
+       cxxopts::value<std::string>())
+      ("session-burst", "Bytes a session can send at once after idle",
+       cxxopts::value<std::string>())
+      ("control", "Localhost port to change rate limits while running",
+       cxxopts::value<int>())
+      ("metrics", "Localhost port to serve Prometheus metrics on",
+       cxxopts::value<int>())
+      ("latency-json", "File to append piece latency percentiles to",
+       cxxopts::value<std::string>())
+      ("null-sink", "Discard received pieces instead of writing files")
+      ("prealloc", "Reserve space of files when negotiated: none, "
+                   "unwritten(default) or full, which also writes zeros "
+                   "over them",
+       cxxopts::value<std::string>())
+      ("direct", "Write all files with direct I/O, bypassing page cache")
+      ("direct-threshold", "Write files of at least this size, like 1G, "
+                           "with direct I/O",
+       cxxopts::value<std::string>())
+      ("coalesce", "Merge pieces into sequential writes of this size, "
+                   "like 8M. 4M to 32M suits most disks. pieces are "
+                   "acknowledged once written",
+       cxxopts::value<std::string>())
+      ("durability", "When files are synced: none(default), end, periodic, "
+                     "or ack which syncs before the last ack",
+       cxxopts::value<std::string>())
+      ("sync-every", "Bytes written between background writebacks of "
+                     "periodic and ack durability, default 64M",
+       cxxopts::value<std::string>())
+      ("allow-fetch", "Let clients fetch files stored, under the roots "
+                      "or else the working directory")
+      ("root", "Directories to spread files over, comma separated or "
+               "repeated. one per disk",
+       cxxopts::value<std::vector<std::string>>())
+      ("io-threads", "I/O threads of each root, default 2",
+       cxxopts::value<int>())
+      ("rcvbuf", "Receive buffer of transfer connections, like 4M. sized "
+                 "by the measured bandwidth-delay product if not given",
+       cxxopts::value<std::string>())
+      ("udp", "Accept transfer threads over UDP on the same port")
+      ("udp-sim", "Simulate a path for datagrams sent, for testing, like "
+                  "loss=0.01,delay=50ms,jitter=5ms",
+       cxxopts::value<std::string>())
+      ("ticket-lifetime", "Seconds a resumption ticket issued is valid for, "
+                          "default 3600. 0 to issue none",
+       cxxopts::value<int>())
+      ("ticket-key", "File of the secret resumption tickets are issued "
+                     "with, made if missing. without it tickets don't "
+                     "outlive a restart",
+       cxxopts::value<std::string>())
+      ("crypto-threads", "Threads decrypting segments of large pieces "
+                         "at the same time, default the count of cores",
+       cxxopts::value<int>())
+      ("deliver", "Also pass every file on in order while it's uploaded: "
+                  "- for stdout (logs then go to the log file only), a "
+                  "named pipe, or |COMMAND run for each file with its name "
+                  "in UPLOAD_NAME. add --null-sink to skip writing files",
+       cxxopts::value<std::string>())
+      ("reorder-buffer", "Bytes of pieces ahead of what's delivered kept "
+                         "of each file, like 256M, default 64M",
+       cxxopts::value<std::string>())
+      ("replicate-to", "Next server of the chain to replicate uploads to, "
+                       "HOST:PORT. it should have the keys clients use",
+       cxxopts::value<std::string>())
+      ("replicate-threads", "Connections to the next server of the chain "
+                            "for each client, default 2",
+       cxxopts::value<int>());
 
   int port;
   std::string key;
+  uint32_t quantum;
+  uint64_t small;
+  std::unordered_map<std::string, uint32_t> weights;
+  int interval;
+  // rate, burst, session-rate, session-burst
+  uint64_t limits[4];
+  int control_port;
+  int metrics_port;
+  int io_threads;
+  bool udp_enabled;
+  udp::Conditions conditions;
+  std::string keys_file;
+  std::string ticket_key_file;
+  int crypto_threads;
 
   auto result = options.parse(argc, argv);
 
+  try {
+    keys_file = result["keys"].as<std::string>();
+  }
+  catch (const std::domain_error &e) {}
+
+  try {
+    ticket_key_file = result["ticket-key"].as<std::string>();
+  }
+  catch (const std::domain_error &e) {}
+
   try {
     port = result["p"].as<int>();
-    key = result["k"].as<std::string>();
+    // not required if keys are given in a file
+    if (keys_file.empty() || result.count("k") > 0) {
+      key = result["k"].as<std::string>();
+    }
   }
   catch (const cxxopts::OptionException &e) {
     std::cerr << "Incorrect parameters" << std::endl;
@@ -527,25 +3417,326 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
+  try {
+    quantum = result["q"].as<uint32_t>();
+  }
+  catch (const std::domain_error &e) {
+    quantum = 65536;
+  }
+
+  try {
+    small = result["small"].as<uint64_t>();
+  }
+  catch (const std::domain_error &e) {
+    small = 1048576;
+  }
+
+  try {
+    for (auto &w : result["weight"].as<std::vector<std::string>>()) {
+      auto pos = w.rfind('=');
+      if (pos == std::string::npos || std::stoi(w.substr(pos + 1)) <= 0) {
+        std::cerr << "Incorrect weight " << w << std::endl;
+        exit(1);
+      }
+      weights[w.substr(0, pos)] = std::stoi(w.substr(pos + 1));
+    }
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::logic_error &e) {
+    std::cerr << "Incorrect weight given" << std::endl;
+    exit(1);
+  }
+
+  try {
+    interval = result["stats"].as<int>();
+  }
+  catch (const std::domain_error &e) {
+    interval = 0;
+  }
+
+  const char *limit_options[] = {"rate", "burst",
+                                 "session-rate", "session-burst"};
+  for (int i = 0; i < 4; ++i) {
+    try {
+      limits[i] = ratelimit::parse_rate(
+          result[limit_options[i]].as<std::string>());
+    }
+    catch (const std::domain_error &e) {
+      limits[i] = 0;
+    }
+    catch (const std::invalid_argument &e) {
+      std::cerr << e.what() << std::endl;
+      exit(1);
+    }
+  }
+
+  try {
+    control_port = result["control"].as<int>();
+  }
+  catch (const std::domain_error &e) {
+    control_port = 0;
+  }
+
+  try {
+    metrics_port = result["metrics"].as<int>();
+  }
+  catch (const std::domain_error &e) {
+    metrics_port = 0;
+  }
+
+  try {
+    latency_json = result["latency-json"].as<std::string>();
+  }
+  catch (const std::domain_error &e) {}
+
+  storage_options.null_sink = result.count("null-sink") > 0;
+  allow_fetch = result.count("allow-fetch") > 0;
+
+  try {
+    storage_options.prealloc = file::write_options::parse_prealloc(
+        result["prealloc"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  storage_options.direct = result.count("direct") > 0;
+
+  try {
+    storage_options.direct_threshold = file::parse_size(
+        result["direct-threshold"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    storage_options.coalesce = file::parse_size(
+        result["coalesce"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    storage_options.durability = file::write_options::parse_durability(
+        result["durability"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    storage_options.sync_every = file::parse_size(
+        result["sync-every"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  if (storage_options.sync_every == 0) {
+    std::cerr << "Sync interval should be positive" << std::endl;
+    exit(1);
+  }
+
+  try {
+    crypto_threads = result["crypto-threads"].as<int>();
+  }
+  catch (const std::domain_error &e) {
+    crypto_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  if (crypto_threads < 1) {
+    std::cerr << "Crypto threads should be positive" << std::endl;
+    exit(1);
+  }
+
+  try {
+    io_threads = result["io-threads"].as<int>();
+  }
+  catch (const std::domain_error &e) {
+    io_threads = 2;
+  }
+
+  if (io_threads < 0) {
+    std::cerr << "I/O threads should not be negative" << std::endl;
+    exit(1);
+  }
+
+  try {
+    for (auto &r : result["root"].as<std::vector<std::string>>()) {
+      layout.add(r, io_threads);
+    }
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::filesystem::filesystem_error &e) {
+    std::cerr << "Can't use storage root: " << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    socket_options.receive_buffer = file::parse_size(
+        result["rcvbuf"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  udp_enabled = result.count("udp") > 0;
+
+  try {
+    delivery = std::make_shared<deliver::Output>(
+        result["deliver"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    reorder_buffer =
+        file::parse_size(result["reorder-buffer"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {
+    reorder_buffer = 64 * 1024 * 1024;
+  }
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    replica_target = std::make_shared<replicate::Target>(
+        replicate::Target::parse(result["replicate-to"].as<std::string>()));
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  try {
+    int threads = result["replicate-threads"].as<int>();
+    if (threads <= 0) {
+      std::cerr << "Replicate threads should be positive" << std::endl;
+      exit(1);
+    }
+    if (replica_target) {
+      replica_target->threads = threads;
+    }
+  }
+  catch (const std::domain_error &e) {}
+
+  try {
+    int lifetime = result["ticket-lifetime"].as<int>();
+    if (lifetime < 0) {
+      std::cerr << "Ticket lifetime should not be negative" << std::endl;
+      exit(1);
+    }
+    ticket_lifetime = lifetime;
+  }
+  catch (const std::domain_error &e) {
+    ticket_lifetime = 3600;
+  }
+
+  try {
+    conditions = udp::Conditions::parse(result["udp-sim"].as<std::string>());
+  }
+  catch (const std::domain_error &e) {}
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+
+  if (storage_options.coalesce > (1u << 30)) {
+    std::cerr << "Coalesce window should be at most 1G" << std::endl;
+    exit(1);
+  }
+
+  if (quantum == 0) {
+    std::cerr << "Quantum should be positive" << std::endl;
+    exit(1);
+  }
+
   el::Configurations defaultConf;
   defaultConf.setToDefault();
   defaultConf.setGlobally(
       el::ConfigurationType::Format, "[%datetime - %level]: %msg");
+  if (delivery && delivery->get_kind() == deliver::Output::STDOUT) {
+    // stdout carries the files
+    defaultConf.setGlobally(el::ConfigurationType::ToStandardOutput, "false");
+  }
   el::Loggers::reconfigureLogger("default", defaultConf);
 
   #ifdef WIN32
   protocol::init_environment();
   #endif
 
-  protocol::AESEncrypter enc(key);
-  protocol::AESDecrypter dec(key);
+  // every key is derived and expanded here once
+  tenant::Table keys;
+  try {
+    std::string ticket_secret;
+    if (ticket_lifetime > 0) {
+      ticket_secret = resume::ticket_secret(ticket_key_file);
+    }
+    if (result.count("k") > 0) {
+      keys.add("", key, ticket_secret);
+    }
+    if (!keys_file.empty()) {
+      keys.load(keys_file, ticket_secret);
+    }
+  }
+  catch (const std::invalid_argument &e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+  LOG(INFO) << keys.size() << " key(s) loaded.";
+  if (replica_target) {
+    LOG(INFO) << "Replicating uploads to " << replica_target->str() << ".";
+  }
+  // the caller decrypting a piece takes a segment too
+  keys.parallelize(std::make_shared<parallel::Pool>(crypto_threads - 1));
 
   boost::asio::io_context io_context;
 
-  Acceptor a(io_context, port, enc, dec);
+  Scheduler scheduler(io_context, quantum, small, interval, weights);
+
+  Limiter limiter(limits[0], limits[1], limits[2], limits[3]);
+
+  Acceptor a(io_context, port, keys, scheduler, limiter);
 
   a.do_accept();
 
+  if (udp_enabled) {
+    a.listen_udp(port, conditions);
+  }
+
+  std::unique_ptr<Control> control;
+  if (control_port != 0) {
+    control = std::make_unique<Control>(io_context, control_port, limiter);
+    control->do_accept();
+  }
+
+  std::unique_ptr<Metrics> metrics;
+  if (metrics_port != 0) {
+    metrics = std::make_unique<Metrics>(io_context, metrics_port, a,
+                                        scheduler);
+    metrics->do_accept();
+  }
+
   io_context.run();
 
   #ifdef WIN32
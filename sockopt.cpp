@@ -0,0 +1,243 @@
+#include "sockopt.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <poll.h>
+#include <cerrno>
+#endif
+
+#ifdef WIN32
+typedef int socklen_t;
+#endif
+
+using namespace sockopt;
+
+/// \brief set an option of the socket
+/// \return false if failed
+template<typename T>
+static bool _set(handle_t fd, int level, int name, T value) {
+  return setsockopt(fd, level, name, (const char *) &value, sizeof(value))
+      == 0;
+}
+
+/// \brief get an option of the socket
+/// \return -1 if failed
+template<typename T>
+static int64_t _get(handle_t fd, int level, int name) {
+  T value = 0;
+  socklen_t length = sizeof(value);
+  if (getsockopt(fd, level, name, (char *) &value, &length) != 0) {
+    return -1;
+  }
+  return (int64_t) value;
+}
+
+#ifdef __linux__
+/// \brief max size of a buffer the kernel allows to set
+static uint64_t _max(const char *name) {
+  std::ifstream f(std::string("/proc/sys/net/core/") + name);
+  uint64_t value = 0;
+  f >> value;
+  return value;
+}
+#endif
+
+std::string applied::str() const {
+  std::ostringstream s;
+  auto size = [&s](int64_t value, bool automatic) {
+    if (value < 0) {
+      s << "unsupported";
+    } else {
+      s << value << (automatic ? "(auto)" : "");
+    }
+  };
+  s << "send buffer ";
+  size(send_buffer, send_auto);
+  s << ", receive buffer ";
+  size(receive_buffer, receive_auto);
+  s << ", pacing ";
+  if (pacing_rate < 0) {
+    s << "unsupported";
+  } else if ((uint64_t) pacing_rate >= UINT32_MAX) {
+    s << "unlimited";
+  } else {
+    s << pacing_rate << "byte/s";
+  }
+  s << ", notsent lowat ";
+  if (notsent_lowat < 0) {
+    s << "unsupported";
+  } else if (notsent_lowat == 0 || notsent_lowat >= INT32_MAX) {
+    s << "unlimited";
+  } else {
+    s << notsent_lowat;
+  }
+  s << ", zerocopy " << (zerocopy ? "on" : "off");
+  return s.str();
+}
+
+applied sockopt::apply(handle_t fd, const options &o) {
+  applied a;
+  if (o.send_buffer > 0) {
+    _set<int>(fd, SOL_SOCKET, SO_SNDBUF, (int) std::min<uint64_t>(
+        o.send_buffer, INT32_MAX / 2));
+    a.send_auto = false;
+  }
+  if (o.receive_buffer > 0) {
+    _set<int>(fd, SOL_SOCKET, SO_RCVBUF, (int) std::min<uint64_t>(
+        o.receive_buffer, INT32_MAX / 2));
+    a.receive_auto = false;
+  }
+  a.send_buffer = _get<int>(fd, SOL_SOCKET, SO_SNDBUF);
+  a.receive_buffer = _get<int>(fd, SOL_SOCKET, SO_RCVBUF);
+#ifdef __linux__
+#ifdef SO_MAX_PACING_RATE
+  if (o.pacing_rate > 0) {
+    // older kernels only take 32 bits
+    if (!_set<uint64_t>(fd, SOL_SOCKET, SO_MAX_PACING_RATE, o.pacing_rate)) {
+      _set<uint32_t>(fd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                     (uint32_t) std::min<uint64_t>(o.pacing_rate,
+                                                   UINT32_MAX - 1));
+    }
+  }
+  a.pacing_rate = _get<uint32_t>(fd, SOL_SOCKET, SO_MAX_PACING_RATE);
+#endif
+  if (o.notsent_lowat > 0) {
+    _set<int>(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+              (int) std::min<uint64_t>(o.notsent_lowat, INT32_MAX));
+  }
+  a.notsent_lowat = _get<int>(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT);
+#ifdef SO_ZEROCOPY
+  if (o.zerocopy > 0) {
+    a.zerocopy = _set<int>(fd, SOL_SOCKET, SO_ZEROCOPY, 1);
+  }
+#endif
+#endif
+  return a;
+}
+
+double sockopt::rtt(handle_t fd) {
+#ifdef __linux__
+  tcp_info info{};
+  socklen_t length = sizeof(info);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) != 0) {
+    return 0;
+  }
+  // a receiver measures it from the data coming in
+  return (info.tcpi_rtt ? info.tcpi_rtt : info.tcpi_rcv_rtt) / 1e6;
+#else
+  return 0;
+#endif
+}
+
+bool sockopt::autosize(handle_t fd, double bandwidth, applied &a) {
+#ifdef __linux__
+  double _rtt = rtt(fd);
+  if (_rtt <= 0 || bandwidth <= 0) {
+    return false;
+  }
+  auto target = (uint64_t) (2 * bandwidth * _rtt);
+  bool grown = false;
+  auto grow = [&](int name, const char *max, int64_t &current) {
+    // the kernel doubles the size set for its bookkeeping
+    uint64_t size = std::min<uint64_t>(target, _max(max));
+    if (current < 0 || size * 2 <= (uint64_t) current) {
+      return;
+    }
+    _set<int>(fd, SOL_SOCKET, name, (int) std::min<uint64_t>(
+        size, INT32_MAX / 2));
+    current = _get<int>(fd, SOL_SOCKET, name);
+    grown = true;
+  };
+  if (a.send_auto) {
+    a.send_buffer = _get<int>(fd, SOL_SOCKET, SO_SNDBUF);
+    grow(SO_SNDBUF, "wmem_max", a.send_buffer);
+  }
+  if (a.receive_auto) {
+    a.receive_buffer = _get<int>(fd, SOL_SOCKET, SO_RCVBUF);
+    grow(SO_RCVBUF, "rmem_max", a.receive_buffer);
+  }
+  return grown;
+#else
+  return false;
+#endif
+}
+
+void zerocopy_sender::send(std::shared_ptr<std::string> data) {
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+  size_t sent = 0;
+  while (sent < data->size()) {
+    auto n = ::send(fd, data->data() + sent, data->size() - sent,
+                    MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == ENOBUFS && !pending.empty()) {
+        // too many sends not completed
+        reap(pending_bytes / 2);
+        continue;
+      }
+      throw boost::system::system_error(
+          boost::system::error_code(errno, boost::system::system_category()));
+    }
+    sent += n;
+    ++calls;
+  }
+  pending_bytes += data->size();
+  pending.emplace_back(calls - 1, std::move(data));
+#else
+  throw std::logic_error("MSG_ZEROCOPY is not supported.");
+#endif
+}
+
+void zerocopy_sender::reap(uint64_t limit) {
+#if defined(__linux__) && defined(MSG_ZEROCOPY)
+  while (!pending.empty()) {
+    char control[128];
+    msghdr msg{};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (pending_bytes <= limit) {
+        return;
+      }
+      // the error queue being readable is told as POLLERR
+      pollfd p{fd, 0, 0};
+      poll(&p, 1, 100);
+      continue;
+    }
+    for (auto c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if (!((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR)
+          || (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      auto err = (sock_extended_err *) CMSG_DATA(c);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      // send calls from ee_info to ee_data are completed. TCP completes
+      // them in order.
+      uint32_t count = err->ee_data - err->ee_info + 1;
+      completed += count;
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        copied += count;
+      }
+      while (!pending.empty()
+          && (int32_t) (pending.front().first - err->ee_data) <= 0) {
+        pending_bytes -= pending.front().second->size();
+        pending.pop_front();
+      }
+    }
+  }
+#endif
+}
@@ -0,0 +1,111 @@
+#ifndef FILE_TRANSFER_SOCKOPT_H_
+#define FILE_TRANSFER_SOCKOPT_H_
+
+#include <boost/asio.hpp>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+/// \file sockopt.h
+/// \brief Header for tuning transfer sockets
+/// \note All things are in `sockopt` namespace. most options only work on
+///       Linux, and are reported as not applied elsewhere.
+
+namespace sockopt {
+
+typedef boost::asio::ip::tcp::socket::native_handle_type handle_t;
+
+/// \brief settings asked for a transfer socket
+/// \datamember uint64_t send_buffer, receive_buffer
+///             bytes of socket buffers. 0 to size them by the measured
+///             bandwidth-delay product.
+/// \datamember uint64_t pacing_rate
+///             bytes per second the kernel paces the connection at.
+///             0 for unlimited.
+/// \datamember uint64_t notsent_lowat
+///             unsent bytes the send buffer keeps at most. 0 for no limit.
+/// \datamember uint64_t zerocopy
+///             messages of at least this size are sent without copying
+///             into the kernel. 0 to always copy.
+struct options {
+  uint64_t send_buffer = 0;
+  uint64_t receive_buffer = 0;
+  uint64_t pacing_rate = 0;
+  uint64_t notsent_lowat = 0;
+  uint64_t zerocopy = 0;
+};
+
+/// \brief settings in effect on a socket, read back after applied
+/// \detail the kernel may double or cap the buffer sizes asked. -1 for
+///         settings not supported here.
+struct applied {
+  int64_t send_buffer = -1;
+  int64_t receive_buffer = -1;
+  bool send_auto = true;
+  bool receive_auto = true;
+  int64_t pacing_rate = -1;
+  int64_t notsent_lowat = -1;
+  bool zerocopy = false;
+
+  std::string str() const;
+};
+
+/// \brief apply the settings to a connected socket
+applied apply(handle_t fd, const options &o);
+
+/// \brief round trip time measured by the kernel, in seconds
+/// \return 0 if not known
+double rtt(handle_t fd);
+
+/// \brief grow auto sized buffers to twice the bandwidth-delay product
+/// \detail the kernel sizes buffers by itself until one is set, and won't
+///         set it larger than its max (net.core.wmem_max/rmem_max). a
+///         buffer is only set when that makes it larger.
+/// \param bandwidth bytes per second measured by the caller
+/// \param a settings in effect, updated
+/// \return true if some buffer is grown
+bool autosize(handle_t fd, double bandwidth, applied &a);
+
+/// \class zerocopy_sender
+/// \brief Class to send messages with MSG_ZEROCOPY on a blocking socket
+/// \detail the kernel reads a message sent from its buffer until it
+///         tells it's done through the error queue of the socket, so every
+///         message is kept until then.
+/// \datamember handle_t fd
+///             the socket
+/// \datamember std::deque<std::pair<uint32_t, std::shared_ptr<std::string>>> pending
+///             messages not completed, with the number of the last send
+///             call of them
+/// \datamember uint32_t calls
+///             send calls done. the kernel numbers them from 0.
+/// \datamember uint64_t pending_bytes
+///             bytes of @pending
+/// \datamember uint64_t completed, copied
+///             send calls completed, and of them what the kernel copied
+///             anyway (always so on loopback)
+class zerocopy_sender {
+ private:
+  handle_t fd;
+  std::deque<std::pair<uint32_t, std::shared_ptr<std::string>>> pending;
+  uint32_t calls = 0;
+  uint64_t pending_bytes = 0;
+ public:
+  uint64_t completed = 0;
+  uint64_t copied = 0;
+
+  explicit zerocopy_sender(handle_t _fd) : fd(_fd) {}
+
+  /// \brief send the whole message
+  /// \throw boost::system::system_error if failed
+  void send(std::shared_ptr<std::string> data);
+
+  /// \brief release messages completed
+  /// \param limit block until pending bytes are not more than this
+  void reap(uint64_t limit = UINT64_MAX);
+};
+
+}
+
+#endif //FILE_TRANSFER_SOCKOPT_H_
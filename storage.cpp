@@ -0,0 +1,110 @@
+#include "storage.h"
+
+using namespace storage;
+
+Root::Root(const fs::path &_path, int threads)
+    : path(fs::absolute(_path)), queued(0), files(0) {
+  fs::create_directories(path);
+  for (int i = 0; i < threads; ++i) {
+    workers.emplace_back([this]() { _run(); });
+  }
+}
+
+Root::~Root() {
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    stop = true;
+  }
+  _cv.notify_all();
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+void Root::_run() {
+  for (;;) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _cv.wait(lock, [this]() { return stop || !jobs.empty(); });
+      if (jobs.empty()) {
+        return;
+      }
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    job();
+    --queued;
+  }
+}
+
+void Root::post(std::function<void()> job) {
+  if (workers.empty()) {
+    job();
+    return;
+  }
+  ++queued;
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    jobs.push_back(std::move(job));
+  }
+  _cv.notify_one();
+}
+
+fs::path Root::place(const std::string &file_name) const {
+  fs::path result = path;
+  for (auto &part : fs::path(file_name).relative_path()) {
+    if (part == ".." || part == ".") {
+      continue;
+    }
+    result /= part;
+  }
+  return result;
+}
+
+uint64_t Root::available() const {
+  std::error_code ec;
+  auto space = fs::space(path, ec);
+  return ec ? 0 : space.available;
+}
+
+void Layout::add(const fs::path &path, int threads) {
+  roots.push_back(std::make_unique<Root>(path, threads));
+}
+
+Root *Layout::choose(uint64_t file_size) {
+  Root *best = nullptr;
+  uint64_t best_space = 0;
+  for (auto &r : roots) {
+    uint64_t space = r->available();
+    if (space < file_size) {
+      continue;
+    }
+    if (!best || r->depth() < best->depth()
+        || (r->depth() == best->depth() && space > best_space)) {
+      best = r.get();
+      best_space = space;
+    }
+  }
+  return best;
+}
+
+Root *Layout::find(const std::string &file_name, fs::path &place) {
+  for (auto &root : roots) {
+    auto _p = root->place(file_name);
+    std::error_code ec;
+    if (fs::is_regular_file(_p, ec)) {
+      place = _p;
+      return root.get();
+    }
+  }
+  return nullptr;
+}
+
+uint64_t Layout::get_queued() const {
+  uint64_t sum = 0;
+  for (auto &r : roots) {
+    sum += r->get_queued();
+  }
+  return sum;
+}
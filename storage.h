@@ -0,0 +1,123 @@
+#ifndef FILE_TRANSFER_STORAGE_H_
+#define FILE_TRANSFER_STORAGE_H_
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <filesystem>
+#include <cstdint>
+
+/// \file storage.h
+/// \brief Header for placing received files on several disks
+/// \note All things are in `storage` namespace
+
+namespace storage {
+
+namespace fs = std::filesystem;
+
+/// \class Root
+/// \brief Class to hold a directory files are stored under
+/// \detail usually a mount point of its own disk. every Root has its own
+///         I/O threads, so writes to different disks go in parallel and a
+///         slow disk only holds back files placed on it. a Root with no
+///         thread runs jobs on the calling thread.
+/// \datamember fs::path path
+///             the directory
+/// \datamember std::vector<std::thread> workers
+///             I/O threads running jobs posted
+/// \datamember std::deque<std::function<void()>> jobs
+///             jobs waiting for a thread
+/// \datamember std::atomic<uint64_t> queued
+///             jobs posted and not finished
+/// \datamember std::atomic<uint64_t> files
+///             files open under the directory
+/// \datamember bool stop
+///             workers should exit when no job is left
+/// \datamember std::mutex _lock
+///             lock of @jobs and @stop
+class Root {
+ private:
+  fs::path path;
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> jobs;
+  std::atomic<uint64_t> queued;
+  std::atomic<uint64_t> files;
+  bool stop = false;
+  std::mutex _lock;
+  std::condition_variable _cv;
+
+  void _run();
+ public:
+  /// \brief constructor
+  /// \param _path the directory, created if not existing
+  /// \param threads I/O threads. 0 to run jobs on the calling thread.
+  /// \throw std::filesystem::filesystem_error if it can't be created
+  Root(const fs::path &_path, int threads);
+
+  Root(const Root &) = delete;
+
+  /// \note jobs still queued run before it returns
+  ~Root();
+
+  /// \brief run a job on one of the I/O threads
+  void post(std::function<void()> job);
+
+  /// \brief place of a file under this Root
+  /// \note absolute paths and `..` given by the client are kept inside.
+  fs::path place(const std::string &file_name) const;
+
+  /// \brief bytes available on the file system of the directory
+  uint64_t available() const;
+
+  /// \brief jobs queued and files open, what choosing a Root goes by
+  uint64_t depth() const { return queued + files; }
+
+  uint64_t get_queued() const { return queued; }
+
+  const fs::path &get_path() const { return path; }
+
+  /// \brief count a file placed under this Root until it's released
+  void acquire() { ++files; }
+
+  void release() { --files; }
+};
+
+/// \class Layout
+/// \brief Class to spread files over Roots
+/// \datamember std::vector<std::unique_ptr<Root>> roots
+///             the Roots. empty to store files as the client names them.
+class Layout {
+ private:
+  std::vector<std::unique_ptr<Root>> roots;
+ public:
+  /// \brief add a Root
+  /// \throw std::filesystem::filesystem_error if it can't be created
+  void add(const fs::path &path, int threads);
+
+  bool empty() const { return roots.empty(); }
+
+  /// \brief choose a Root for a file
+  /// \detail among Roots having space for the file, the one with fewest
+  ///         jobs queued and files open, then the one with most space.
+  /// \return nullptr if no Root has enough space
+  Root *choose(uint64_t file_size);
+
+  /// \brief find the Root holding a file
+  /// \param file_name file name the client told
+  /// \param place set to the place of the file under the Root found
+  /// \return nullptr if no Root holds it
+  Root *find(const std::string &file_name, fs::path &place);
+
+  /// \brief jobs queued on all Roots
+  uint64_t get_queued() const;
+};
+
+}
+
+#endif //FILE_TRANSFER_STORAGE_H_
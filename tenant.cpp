@@ -0,0 +1,78 @@
+#include "tenant.h"
+#include "resume.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cctype>
+
+using namespace tenant;
+
+Key::Key(const std::string &_id,
+         const std::string &derived,
+         const std::string &ticket_secret)
+    : id(_id),
+      enc(encrypt::derived, derived),
+      dec(encrypt::derived, derived) {
+  if (!ticket_secret.empty()) {
+    // clients know the key, so tickets take the server's secret too
+    ticket_enc = std::make_unique<encrypt::AESEncrypter>(
+        encrypt::derived, resume::ticket_key(ticket_secret, derived));
+    ticket_dec = std::make_unique<encrypt::AESDecrypter>(
+        encrypt::derived, resume::ticket_key(ticket_secret, derived));
+  }
+}
+
+void Table::add(const std::string &id,
+                const std::string &pass,
+                const std::string &ticket_secret) {
+  if (id.size() > MAX_ID_LENGTH
+      || std::any_of(id.begin(), id.end(),
+                     [](char c) { return std::isspace((unsigned char) c)
+                         || c == '\0'; })) {
+    throw std::invalid_argument("Incorrect key id " + id);
+  }
+  if (keys.find(id) != keys.end()) {
+    throw std::invalid_argument("Duplicate key id " + id);
+  }
+  if (pass.length() < 7) {
+    LOG(WARNING) << "You are using a short key which is weak to attack.";
+  }
+  keys[id] = std::make_unique<Key>(id, encrypt::_cryptopp_Scrypt(pass),
+                                   ticket_secret);
+}
+
+void Table::load(const std::string &path, const std::string &ticket_secret) {
+  std::ifstream in(path);
+  if (!in) {
+    throw std::invalid_argument("Can't read key file " + path);
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    auto pos = line.find(' ');
+    if (pos == 0 || pos == std::string::npos || pos + 1 == line.size()) {
+      throw std::invalid_argument("Incorrect key line " + line.substr(0, pos));
+    }
+    add(line.substr(0, pos), line.substr(pos + 1), ticket_secret);
+  }
+}
+
+void Table::parallelize(const std::shared_ptr<parallel::Pool> &pool) {
+  for (auto &k : keys) {
+    k.second->enc.parallelize(pool);
+    k.second->dec.parallelize(pool);
+  }
+}
+
+const Key *Table::find(const std::string &id) const {
+  auto it = keys.find(id);
+  if (it == keys.end()) {
+    return nullptr;
+  }
+  return it->second.get();
+}
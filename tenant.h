@@ -0,0 +1,85 @@
+#ifndef FILE_TRANSFER_TENANT_H_
+#define FILE_TRANSFER_TENANT_H_
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "encrypt.h"
+
+/// \file tenant.h
+/// \brief Header for the keys a server accepts
+/// \note All things are in `tenant` namespace
+/** KEY TABLE
+ * Each client names its key by an id sent in clear before the Server Hello
+ * and the transfer init. Keys are derived and their AES key schedules are
+ * expanded once when the table is loaded, and only read afterwards, so a
+ * handshake costs the same however many keys there are.
+ * Key file lines:
+ * KEY_ID PASSPHRASE
+ * Blank lines and lines beginning with # are skipped. The passphrase is
+ * the rest of the line.
+ */
+
+namespace tenant {
+
+/// \brief longest key id
+const size_t MAX_ID_LENGTH = 16;
+
+/// \brief ciphers of a key, built once
+/// \datamember std::string id
+///             key id, empty for the default key
+/// \datamember encrypt::AESEncrypter enc
+/// \datamember encrypt::AESDecrypter dec
+///             ciphers of the key. copy them to use, each thread its own.
+///             copies copy the expanded key schedule, so it's never
+///             expanded again nor shared between threads.
+/// \datamember std::unique_ptr<encrypt::AESEncrypter> ticket_enc
+/// \datamember std::unique_ptr<encrypt::AESDecrypter> ticket_dec
+///             ciphers of resumption tickets, nullptr if none are issued
+struct Key {
+  std::string id;
+  encrypt::AESEncrypter enc;
+  encrypt::AESDecrypter dec;
+  std::unique_ptr<encrypt::AESEncrypter> ticket_enc;
+  std::unique_ptr<encrypt::AESDecrypter> ticket_dec;
+
+  /// \param derived key derived from the passphrase
+  /// \param ticket_secret secret resumption tickets are issued with, empty
+  ///        if none are issued
+  Key(const std::string &_id,
+      const std::string &derived,
+      const std::string &ticket_secret);
+};
+
+/// \class Table
+/// \brief Class to find the key of a client
+/// \datamember std::unordered_map<std::string, std::unique_ptr<Key>> keys
+///             keys by id
+class Table {
+ private:
+  std::unordered_map<std::string, std::unique_ptr<Key>> keys;
+ public:
+  /// \brief derive and add a key
+  /// \throw std::invalid_argument if the id is too long, has spaces, or
+  ///        is added already
+  void add(const std::string &id,
+           const std::string &pass,
+           const std::string &ticket_secret);
+
+  /// \brief add the keys of a key file
+  /// \throw std::invalid_argument if the file can't be read or malformed
+  void load(const std::string &path, const std::string &ticket_secret);
+
+  /// \return nullptr if unknown
+  const Key *find(const std::string &id) const;
+
+  size_t size() const { return keys.size(); }
+
+  /// \brief share a pool to encrypt and decrypt pieces with every key
+  void parallelize(const std::shared_ptr<parallel::Pool> &pool);
+};
+
+}
+
+#endif //FILE_TRANSFER_TENANT_H_
@@ -0,0 +1,289 @@
+#include "udp.h"
+
+#include <algorithm>
+
+using namespace udp;
+
+// head of a transfer frame: magic, length and stream
+static const size_t HEAD_LENGTH = 18;
+
+// gains of PROBE_BW, one round trip each
+static const double GAIN_CYCLE[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+// gain of STARTUP, 2/ln2, doubling the rate every round
+static const double HIGH_GAIN = 2.885;
+
+constexpr std::chrono::seconds RateControl::RTT_WINDOW;
+
+/// \brief length of the frame starting at @pos, 0 if it's cut
+static size_t frame_length(const std::string &frames, size_t pos) {
+  if (frames.size() - pos < HEAD_LENGTH) {
+    return 0;
+  }
+  size_t length;
+  try {
+    length = std::stoul(frames.substr(pos + 2, 8), nullptr, 16);
+  }
+  catch (const std::logic_error &e) {
+    return 0;
+  }
+  if (frames.size() - pos - HEAD_LENGTH < length) {
+    return 0;
+  }
+  return HEAD_LENGTH + length;
+}
+
+std::vector<std::string> udp::pack(const std::string &frames, size_t max) {
+  std::vector<std::string> datagrams;
+  std::string current;
+  size_t pos = 0;
+  while (pos < frames.size()) {
+    size_t length = frame_length(frames, pos);
+    if (length == 0) {
+      throw std::runtime_error("udp::pack - cut frame.");
+    }
+    if (!current.empty() && current.size() + length > max) {
+      datagrams.push_back(std::move(current));
+      current.clear();
+    }
+    current.append(frames, pos, length);
+    pos += length;
+  }
+  if (!current.empty()) {
+    datagrams.push_back(std::move(current));
+  }
+  return datagrams;
+}
+
+std::vector<std::string> udp::unpack(const std::string &datagram) {
+  std::vector<std::string> frames;
+  size_t pos = 0;
+  while (pos < datagram.size()) {
+    size_t length = frame_length(datagram, pos);
+    if (length == 0) {
+      throw std::runtime_error("udp::unpack - cut frame.");
+    }
+    frames.push_back(datagram.substr(pos, length));
+    pos += length;
+  }
+  return frames;
+}
+
+Conditions Conditions::parse(const std::string &spec) {
+  Conditions c;
+  size_t pos = 0;
+  while (pos < spec.size()) {
+    auto end = spec.find(',', pos);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+    auto item = spec.substr(pos, end - pos);
+    pos = end + 1;
+    auto eq = item.find('=');
+    if (eq == std::string::npos) {
+      throw std::invalid_argument("Incorrect link condition " + item);
+    }
+    auto name = item.substr(0, eq);
+    auto value = item.substr(eq + 1);
+    try {
+      size_t used;
+      double number = std::stod(value, &used);
+      auto unit = value.substr(used);
+      if (number < 0) {
+        throw std::invalid_argument(value);
+      }
+      if (name == "loss") {
+        if (!unit.empty() || number >= 1) {
+          throw std::invalid_argument(value);
+        }
+        c.loss = number;
+        continue;
+      }
+      double scale;
+      if (unit == "us") {
+        scale = 1;
+      } else if (unit == "ms" || unit.empty()) {
+        scale = 1e3;
+      } else if (unit == "s") {
+        scale = 1e6;
+      } else {
+        throw std::invalid_argument(value);
+      }
+      std::chrono::microseconds time((int64_t) (number * scale));
+      if (name == "delay") {
+        c.delay = time;
+      } else if (name == "jitter") {
+        c.jitter = time;
+      } else {
+        throw std::invalid_argument(value);
+      }
+    }
+    catch (const std::logic_error &e) {
+      throw std::invalid_argument("Incorrect link condition " + item);
+    }
+  }
+  return c;
+}
+
+void Link::send(std::shared_ptr<std::string> data, const endpoint &to) {
+  ++sent;
+  auto &socket = socket_;
+  auto transmit = [&socket, data, to]() {
+    socket.async_send_to(boost::asio::buffer(*data), to,
+                         [data](boost::system::error_code, std::size_t) {});
+  };
+  if (conditions.empty()) {
+    transmit();
+    return;
+  }
+  if (std::uniform_real_distribution<double>(0, 1)(rng) < conditions.loss) {
+    ++dropped;
+    return;
+  }
+  auto delay = conditions.delay;
+  if (conditions.jitter.count() > 0) {
+    delay += std::chrono::microseconds(
+        std::uniform_int_distribution<int64_t>(
+            0, conditions.jitter.count())(rng));
+  }
+  if (delay.count() == 0) {
+    transmit();
+    return;
+  }
+  auto timer = std::make_shared<boost::asio::steady_timer>(
+      socket_.get_executor(), delay);
+  timer->async_wait([timer, transmit](boost::system::error_code ec) {
+    if (!ec) {
+      transmit();
+    }
+  });
+}
+
+RateControl::RateControl(uint32_t _mss, std::chrono::nanoseconds rtt)
+    : mss(_mss) {
+  auto now = std::chrono::steady_clock::now();
+  if (rtt < std::chrono::microseconds(10)) {
+    rtt = std::chrono::microseconds(10);
+  }
+  min_rtt = rtt;
+  min_rtt_at = now;
+  srtt = rtt;
+  rttvar = rtt / 2;
+  delivered_at = now;
+  cycle_at = now;
+  // start as if a window of 10 datagrams is delivered every round trip
+  btl_bw = 10.0 * mss / std::chrono::duration<double>(rtt).count();
+  bw_max[0] = btl_bw;
+}
+
+RateControl::Sample RateControl::on_send(uint32_t bytes,
+                                         const time_point &now) {
+  if (in_flight == 0) {
+    // nothing was on the way, so the idle time is not a delivery interval
+    delivered_at = now;
+  }
+  in_flight += bytes;
+  Sample s;
+  s.sent_at = now;
+  s.delivered = delivered;
+  s.delivered_at = delivered_at;
+  return s;
+}
+
+void RateControl::on_ack(const Sample &s,
+                         uint32_t bytes,
+                         const time_point &now,
+                         bool measure) {
+  in_flight -= std::min<uint64_t>(in_flight, bytes);
+  delivered += bytes;
+  delivered_at = now;
+  if (!measure) {
+    return;
+  }
+
+  auto rtt = now - s.sent_at;
+  if (rtt <= min_rtt || now - min_rtt_at > RTT_WINDOW) {
+    min_rtt = std::max<std::chrono::nanoseconds>(
+        rtt, std::chrono::microseconds(10));
+    min_rtt_at = now;
+  }
+  auto diff = rtt > srtt ? rtt - srtt : srtt - rtt;
+  rttvar = (rttvar * 3 + diff) / 4;
+  srtt = (srtt * 7 + rtt) / 8;
+
+  // a round ends when a datagram sent after the last round ended is acked
+  bool round_start = false;
+  if (s.delivered >= round_end) {
+    round_end = delivered;
+    ++round;
+    bw_max[round % BW_ROUNDS] = 0;
+    round_start = true;
+  }
+
+  // delivered bytes over the time they took, which is never shorter than
+  // a round trip, so bursts on the way don't inflate it
+  double interval = std::chrono::duration<double>(
+      std::max(now - s.delivered_at, now - s.sent_at)).count();
+  if (interval > 0) {
+    _update_bw((delivered - s.delivered) / interval);
+  }
+
+  if (round_start && state == STARTUP) {
+    // the pipe is full when bandwidth stops growing by a quarter
+    if (btl_bw >= full_bw * 1.25) {
+      full_bw = btl_bw;
+      full_rounds = 0;
+    } else if (++full_rounds >= 3) {
+      state = DRAIN;
+    }
+  }
+  _update_state(now);
+}
+
+void RateControl::on_loss(uint32_t bytes) {
+  in_flight -= std::min<uint64_t>(in_flight, bytes);
+  lost += bytes;
+}
+
+void RateControl::_update_bw(double rate) {
+  auto &slot = bw_max[round % BW_ROUNDS];
+  slot = std::max(slot, rate);
+  btl_bw = *std::max_element(std::begin(bw_max), std::end(bw_max));
+}
+
+void RateControl::_update_state(const time_point &now) {
+  if (state == DRAIN && in_flight <= window() / 2) {
+    state = PROBE_BW;
+    cycle = 2;
+    cycle_at = now;
+  }
+  if (state == PROBE_BW && now - cycle_at > min_rtt) {
+    cycle = (cycle + 1) % 8;
+    cycle_at = now;
+  }
+}
+
+double RateControl::pacing_rate() const {
+  double gain;
+  switch (state) {
+    case STARTUP:
+      gain = HIGH_GAIN;
+      break;
+    case DRAIN:
+      gain = 1 / HIGH_GAIN;
+      break;
+    default:
+      gain = GAIN_CYCLE[cycle];
+  }
+  return std::max(gain * btl_bw, (double) mss);
+}
+
+uint64_t RateControl::window() const {
+  double bdp = btl_bw * std::chrono::duration<double>(min_rtt).count();
+  return std::max<uint64_t>(2 * bdp, 4 * mss);
+}
+
+std::chrono::nanoseconds RateControl::timeout() const {
+  return std::max<std::chrono::nanoseconds>(
+      srtt + 4 * rttvar, std::chrono::milliseconds(50));
+}
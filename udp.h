@@ -0,0 +1,200 @@
+#ifndef FILE_TRANSFER_UDP_H_
+#define FILE_TRANSFER_UDP_H_
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+/// \file udp.h
+/// \brief Header for the UDP transport of transfer connections
+/// \note All things are in `udp` namespace
+/** UDP TRANSPORT
+ * A transfer connection can be a UDP flow to the server's port instead of
+ * a TCP connection. Datagrams carry the same transfer frames:
+ * | MAGIC_HEADER_TRANSFER 2 | LENGTH 8 | STREAM 8 | [ Encrypted [ ... ] ]
+ * Client: one piece frame per datagram. The first datagram is the
+ *         transfer init frame (STREAM 0), sent again until answered.
+ * Server: answers the init frame with the init reply frame (STREAM 0), and
+ *         sends acks as usual. A datagram may hold several ack frames.
+ * Lost pieces are found by the client from the acks (a piece sent well
+ * before an acknowledged one, or nothing acknowledged for a timeout) and
+ * sent again. Lost acks are covered by the cumulative ack of later ones.
+ * The client paces pieces at the rate RateControl estimates the path can
+ * carry, rather than slowing down on every loss like TCP.
+ */
+
+namespace udp {
+
+typedef boost::asio::ip::udp::socket socket;
+typedef boost::asio::ip::udp::endpoint endpoint;
+typedef std::chrono::steady_clock::time_point time_point;
+
+// largest payload of a UDP datagram
+const size_t MAX_DATAGRAM = 65507;
+
+/// \brief group frames into datagrams
+/// \param frames transfer frames one after another
+/// \param max bytes of a datagram at most. a larger frame takes one alone.
+/// \return payloads of the datagrams
+std::vector<std::string> pack(const std::string &frames,
+                              size_t max = MAX_DATAGRAM);
+
+/// \brief split a datagram into the frames it holds
+/// \throw std::runtime_error if a frame is cut
+std::vector<std::string> unpack(const std::string &datagram);
+
+/// \brief conditions of the simulated path
+/// \datamember double loss
+///             probability a datagram is dropped
+/// \datamember std::chrono::microseconds delay
+///             one way delay added to every datagram
+/// \datamember std::chrono::microseconds jitter
+///             random delay up to this added on top of @delay
+struct Conditions {
+  double loss = 0;
+  std::chrono::microseconds delay{0};
+  std::chrono::microseconds jitter{0};
+
+  bool empty() const { return loss <= 0 && delay.count() <= 0
+        && jitter.count() <= 0; }
+
+  /// \brief parse conditions like loss=0.01,delay=75ms,jitter=5ms
+  /// \throw std::invalid_argument if malformed
+  static Conditions parse(const std::string &spec);
+};
+
+/// \class Link
+/// \brief Class to send datagrams, optionally through a simulated path
+/// \detail the simulator drops and delays datagrams on the sending side,
+///         inside the process, so loss and long round trips can be tested
+///         on loopback. a simulator on both sides affects pieces and acks.
+///         the socket is used from its own executor only, so it's safe with
+///         asynchronous receiving on the same socket.
+/// \datamember socket &socket_
+///             socket to send through
+/// \datamember Conditions conditions
+///             simulated path, empty to send at once
+/// \datamember std::mt19937_64 rng
+///             random source of the simulator
+/// \datamember uint64_t sent, dropped
+///             datagrams sent and dropped by the simulator
+class Link {
+ private:
+  socket &socket_;
+  Conditions conditions;
+  std::mt19937_64 rng;
+ public:
+  uint64_t sent = 0;
+  uint64_t dropped = 0;
+
+  Link(socket &_socket, const Conditions &_conditions)
+      : socket_(_socket), conditions(_conditions),
+        rng(std::random_device()()) {}
+
+  /// \brief send a datagram
+  /// \note send errors are ignored, as a lost datagram would be.
+  void send(std::shared_ptr<std::string> data, const endpoint &to);
+
+  socket::executor_type get_executor() { return socket_.get_executor(); }
+};
+
+/// \class RateControl
+/// \brief Class to estimate the rate a path can carry
+/// \detail a simplified BBR. the bottleneck bandwidth is the max delivery
+///         rate measured over the last rounds, and the round trip time is
+///         the min measured lately. the sender paces at a gain of the
+///         bandwidth and keeps about two bandwidth-delay products in
+///         flight. random loss doesn't lower the rate, only what's
+///         delivered does.
+///         STARTUP: gain 2.89 until bandwidth stops growing for 3 rounds.
+///         DRAIN: gain 1/2.89 until the queue built up is drained.
+///         PROBE_BW: gains cycle 1.25, 0.75, 1 x6, one round trip each.
+///         this class is not thread safe.
+class RateControl {
+ public:
+  /// \brief what's known when a datagram is sent, to measure delivery rate
+  ///        when it's acknowledged
+  struct Sample {
+    time_point sent_at;
+    uint64_t delivered = 0;
+    time_point delivered_at;
+  };
+
+  enum state_t { STARTUP, DRAIN, PROBE_BW };
+ private:
+  static const int BW_ROUNDS = 10;
+  // min rtt older than this is replaced by the next sample
+  static constexpr std::chrono::seconds RTT_WINDOW{10};
+
+  uint32_t mss;
+  state_t state = STARTUP;
+  uint64_t delivered = 0;
+  time_point delivered_at;
+  uint64_t in_flight = 0;
+  uint64_t round = 0;
+  uint64_t round_end = 0;
+  double bw_max[BW_ROUNDS] = {};
+  double btl_bw = 0;
+  double full_bw = 0;
+  int full_rounds = 0;
+  std::chrono::nanoseconds min_rtt{0};
+  time_point min_rtt_at;
+  std::chrono::nanoseconds srtt{0};
+  std::chrono::nanoseconds rttvar{0};
+  int cycle = 0;
+  time_point cycle_at;
+  uint64_t lost = 0;
+
+  void _update_bw(double rate);
+  void _update_state(const time_point &now);
+ public:
+  /// \param _mss bytes of a datagram, for the min window
+  /// \param rtt round trip time measured by the handshake, to start with
+  RateControl(uint32_t _mss, std::chrono::nanoseconds rtt);
+
+  /// \brief a datagram is sent
+  Sample on_send(uint32_t bytes, const time_point &now);
+
+  /// \brief a datagram is acknowledged
+  /// \param measure the ack tells when the datagram arrived. false if
+  ///        another copy may have arrived instead, so RTT and rate are
+  ///        not measured from it.
+  void on_ack(const Sample &s, uint32_t bytes, const time_point &now,
+              bool measure = true);
+
+  /// \brief a datagram is found lost
+  void on_loss(uint32_t bytes);
+
+  /// \brief bytes per second to pace datagrams at
+  double pacing_rate() const;
+
+  /// \brief bytes allowed in flight
+  uint64_t window() const;
+
+  uint64_t get_in_flight() const { return in_flight; }
+
+  /// \brief time without ack after which every datagram in flight is lost
+  std::chrono::nanoseconds timeout() const;
+
+  /// \brief how much later than an acknowledged datagram one can be sent
+  ///        and still be waited for
+  std::chrono::nanoseconds reorder_window() const { return min_rtt / 4; }
+
+  std::chrono::nanoseconds get_min_rtt() const { return min_rtt; }
+
+  double get_bandwidth() const { return btl_bw; }
+
+  uint64_t get_lost() const { return lost; }
+
+  state_t get_state() const { return state; }
+};
+
+}
+
+#endif //FILE_TRANSFER_UDP_H_